@@ -27,9 +27,76 @@ extern "C" {
 void Print(const char* format , ...);
 void Fatal(const char* format , ...);
 unsigned int LoadTexBMP(const char* file);
+unsigned char* ReadBMP(const char* file,int* width,int* height);
+unsigned int UploadTexBMP(unsigned int texture,const unsigned char* image,int dx,int dy,const char* file);
+void TexCompression(int on);
 void Project(double fov,double asp,double dim);
 void ErrCheck(const char* where);
 int  LoadOBJ(const char* file);
+void DrawOBJ(int obj);
+void OBJBounds(int obj,float lo[3],float hi[3]);
+int  MaterialSwitches(void);
+unsigned int LoadTexBMPAsync(const char* file);
+void LoadOBJAsync(const char* file,int* obj);
+int  PollAssets(void);
+void DrawTorus(double a,double c);
+void DrawPole(double height,double r);
+int  NewCubes(void);
+void AddCube(int list,double x,double y,double z,double dx,double dy,double dz,double th);
+void ClearCubes(int list);
+void DrawCubes(int list);
+void OverlayPoint(float size,const float rgba[4],double x,double y,double z);
+void OverlayLine(float width,const float rgba[4],double x0,double y0,double z0,double x1,double y1,double z1);
+void DrawOverlay(void);
+void ClearOverlay(void);
+void* MapFile(const char* file,size_t* size);
+void UnmapFile(void* buf,size_t size);
+unsigned long long HashBytes(const void* buf,size_t n);
+unsigned long long HashFile(const char* file);
+void FileStamp(const char* file,long long* mtime,long long* size);
+int  ArrayCapacity(int max,int n);
+void* ResizeArray(void* x,int n,size_t size);
+void* GrowArray(void* x,int n,int* max,size_t size);
+int  Processors(void);
+void RunThreads(void* (*func)(void*),void* chunk,size_t size,int n);
+int  DrawCalls(void);
+void Headless(int width,int height);
+int  Offscreen(void);
+void ProfileStart(const char* file);
+void ProfileStop(void);
+void ZoneBegin(const char* name);
+void ZoneEnd(void);
+void ProfileFrame(void);
+void ProfileHUD(void);
+int  NewOctree(void);
+void ClearOctree(int tree);
+void OctreeAdd(int tree,int id,const float lo[3],const float hi[3]);
+int* CullOctree(int tree,int* n);
+int  BakeBegin(void);
+void BakeEnd(void);
+int  BakeDraw(void);
+int  CaptureTriangles(void (*draw)(void),double size,float** tri);
+int  NewBVH(void);
+void BuildBVH(int bvh,const float* tri,int n);
+int  BVHInfo(int bvh,int* depth,double* cost);
+int  RayBVH(int bvh,const float o[3],const float d[3],float tmax,int any,float* t);
+void RaysBVH(int bvh,int n,const float* o,const float* d,const float* tmax,int any,float* t,int* hit);
+int  ClosestBVH(int bvh,const float p[3],float maxd,float q[3]);
+void OcclusionBegin(int width,int height);
+void OcclusionDraw(const float* tri,int n);
+int  OcclusionVisible(const float lo[3],const float hi[3],double pad);
+
+//  Count draw calls for DrawCalls()
+extern int Ndraw;
+#define glBegin(mode)                  (Ndraw++,glBegin(mode))
+#define glDrawArrays(mode,first,count) (Ndraw++,glDrawArrays(mode,first,count))
+#define glDrawElements(mode,count,type,indices) (Ndraw++,glDrawElements(mode,count,type,indices))
+
+//  Profile zones only test a flag while the profiler is off
+extern int Profiling;
+#define ZoneBegin(name) (Profiling ? ZoneBegin(name) : (void)0)
+#define ZoneEnd()       (Profiling ? ZoneEnd() : (void)0)
+#define ProfileFrame()  (Profiling ? ProfileFrame() : (void)0)
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,44 @@
+/*
+ *  Growable arrays
+ *
+ *  Capacities double from ARRAY_MIN so appending n elements one at a time
+ *  copies O(n) elements in all.  Arrays of the same length can share one
+ *  capacity by calling ArrayCapacity() once and ResizeArray() on each.
+ */
+#include "CSCIx229.h"
+
+#define ARRAY_MIN 1024  //  Smallest capacity
+
+/*
+ *  Capacity of at least n elements (doubling from capacity max)
+ */
+int ArrayCapacity(int max,int n)
+{
+   if (max<ARRAY_MIN) max = ARRAY_MIN;
+   while (max<n)
+   {
+      if (max>(1<<30)) Fatal("Array too large (%d elements)\n",n);
+      max *= 2;
+   }
+   return max;
+}
+
+/*
+ *  Resize array x to n elements of size bytes
+ */
+void* ResizeArray(void* x,int n,size_t size)
+{
+   x = realloc(x,(n>0?n:1)*size);
+   if (!x) Fatal("Cannot allocate memory for %d elements of %lu bytes\n",n,(unsigned long)size);
+   return x;
+}
+
+/*
+ *  Grow array x of capacity *max to hold at least n elements of size bytes
+ */
+void* GrowArray(void* x,int n,int* max,size_t size)
+{
+   if (n<=*max) return x;
+   *max = ArrayCapacity(*max,n);
+   return ResizeArray(x,*max,size);
+}
@@ -0,0 +1,1103 @@
+/*
+ *  Sparse bundle adjustment
+ *
+ *  BundleAdjust() refines keyframe poses and landmark positions to minimize
+ *  the reprojection error of the measured observations, with the measured
+ *  odometry between consecutive keyframes as extra terms so keyframes that
+ *  see nothing stay attached to the trajectory.  Poses have four parameters
+ *  (position and heading) to match pose_t.
+ *
+ *  Each Levenberg-Marquardt iteration linearizes every observation,
+ *  eliminates the landmarks with the Schur complement and solves the
+ *  reduced camera system.  Keyframes ordered along a trajectory give that
+ *  system a narrow profile, so it is factored with an envelope Cholesky
+ *  decomposition unless the profile is too large, in which case block
+ *  Jacobi preconditioned conjugate gradients is used instead.  Residuals,
+ *  Jacobians, normal equations, the Schur complement and trial costs are
+ *  computed in parallel.
+ */
+#include "CSCIx229.h"
+#include "slam.h"
+#include <time.h>
+
+#define BA_ENVELOPE (1<<22)  //  Largest envelope factored with Cholesky (doubles)
+#define BA_CHUNK    256      //  Smallest share of work given to a thread
+#define BA_TRIES    10       //  Damping increases before giving up on an iteration
+
+//  Observation term (residual and Jacobian weighted for the robust loss)
+typedef struct
+{
+   int cam;         //  Keyframe
+   int lm;          //  Landmark (index of optimized landmarks)
+   int obs;         //  Observation
+   double r[2];     //  Residual
+   double J[2][4];  //  Derivatives by keyframe x,y,z,heading (by landmark x,y,z they are minus the first three)
+   double W[4][3];  //  Jc' Jl
+} term_t;
+
+//  Odometry term between keyframes k-1 and k
+typedef struct
+{
+   int valid;        //  Odometry measured
+   double r[4];      //  Residual
+   double Ji[4][4];  //  Derivatives by keyframe k-1
+   double Jj[4][4];  //  Derivatives by keyframe k
+} odo_t;
+
+struct ba_s;
+
+//  Share of parallel work
+typedef struct
+{
+   struct ba_s* ba;  //  Problem
+   int k0,k1;        //  Range of work
+   double sum;       //  Partial cost
+} chunk_t;
+
+//  Problem
+typedef struct ba_s
+{
+   slammap_t* map;       //  Map
+   const baopt_t* opt;   //  Options
+   int threads;          //  Number of threads
+   chunk_t* chunk;       //  Work shares
+   int Ncam,fixed,Nf;    //  Keyframes, fixed keyframes and free keyframes
+   int Nl;               //  Optimized landmarks
+   int* lmidx;           //  Optimized index of each map landmark (-1 for none)
+   int* lmid;            //  Map index of each optimized landmark
+   double *P,*L;         //  Keyframe (x,y,z,heading in radians) and landmark parameters
+   double *Pt,*Lt;       //  Trial parameters
+   int Nt;               //  Observation terms
+   term_t* term;         //  Observation terms
+   int* tfirst;          //  Terms of keyframe k are term[tfirst[k]] .. term[tfirst[k+1]-1]
+   int *lfirst,*lterm;   //  Terms of landmark l are term[lterm[lfirst[l]]] .. term[lterm[lfirst[l+1]-1]]
+   int No;               //  Odometry terms
+   odo_t* odo;           //  Odometry term of each keyframe
+   double *U,*gc;        //  Free keyframe diagonal blocks (4x4) and gradients
+   double *V,*gl,*Vinv;  //  Landmark diagonal blocks (3x3), gradients and damped inverses
+   int *sfirst,*scol;    //  Blocks of reduced row i are in columns scol[sfirst[i]] .. scol[sfirst[i+1]-1]
+   double *S,*rhs;       //  Reduced camera system (4x4 blocks) and right hand side
+   double *dc,*dl;       //  Keyframe and landmark steps
+   int cholesky;         //  Solve with envelope Cholesky (otherwise conjugate gradients)
+   int* fs;              //  First column in the envelope of each row
+   size_t* off;          //  Offset of each row in the envelope
+   double* env;          //  Envelope Cholesky factor
+   double *Mi,*pr,*pz,*pp,*pq;  //  Preconditioner factors and conjugate gradient vectors
+   int cg;               //  Conjugate gradient iterations of the last solve
+   double lambda;        //  Damping
+   double f,h,st,sr;     //  Focal length, Huber threshold and odometry deviations
+} ba_t;
+
+//
+//  Wall clock time in seconds
+//
+static double now()
+{
+#ifdef _WIN32
+   return (double)clock()/CLOCKS_PER_SEC;
+#else
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC,&t);
+   return t.tv_sec + 1e-9*t.tv_nsec;
+#endif
+}
+
+//
+//  Allocate n zeroed elements of size bytes
+//
+static void* alloc(size_t n,size_t size)
+{
+   void* x = calloc(n>0?n:1,size);
+   if (!x) Fatal("Cannot allocate memory for bundle adjustment (%lu elements)\n",(unsigned long)n);
+   return x;
+}
+
+//
+//  Run func over 0 .. n-1 split between threads
+//    Chunk 0 runs on the calling thread
+//    Returns the sum of the partial costs
+//
+static double parallel(ba_t* ba,void* (*func)(void*),int n)
+{
+   int k;
+   double sum=0;
+   int m = (n+BA_CHUNK-1)/BA_CHUNK;
+   if (m>ba->threads) m = ba->threads;
+   if (m<1) m = 1;
+   for (k=0;k<m;k++)
+   {
+      ba->chunk[k].ba  = ba;
+      ba->chunk[k].k0  = (int)((long long)n*k/m);
+      ba->chunk[k].k1  = (int)((long long)n*(k+1)/m);
+      ba->chunk[k].sum = 0;
+   }
+   RunThreads(func,ba->chunk,sizeof(ba->chunk[0]),m);
+   //  Sum in chunk order so the result does not depend on timing
+   for (k=0;k<m;k++)
+      sum += ba->chunk[k].sum;
+   return sum;
+}
+
+//
+//  Cholesky factorization of an n x n matrix in place (lower triangle)
+//    Returns 0 if the matrix is not positive definite
+//
+static int chol(double* A,int n)
+{
+   int i,j,k;
+   for (j=0;j<n;j++)
+   {
+      double d = A[j*n+j];
+      for (k=0;k<j;k++)
+         d -= A[j*n+k]*A[j*n+k];
+      if (!(d>0)) return 0;
+      d = sqrt(d);
+      A[j*n+j] = d;
+      for (i=j+1;i<n;i++)
+      {
+         double s = A[i*n+j];
+         for (k=0;k<j;k++)
+            s -= A[i*n+k]*A[j*n+k];
+         A[i*n+j] = s/d;
+      }
+   }
+   return 1;
+}
+
+//
+//  Solve L L' x = b in place given the Cholesky factor L
+//
+static void cholsolve(const double* L,int n,double* x)
+{
+   int i,k;
+   for (i=0;i<n;i++)
+   {
+      for (k=0;k<i;k++)
+         x[i] -= L[i*n+k]*x[k];
+      x[i] /= L[i*n+i];
+   }
+   for (i=n-1;i>=0;i--)
+   {
+      for (k=i+1;k<n;k++)
+         x[i] -= L[k*n+i]*x[k];
+      x[i] /= L[i*n+i];
+   }
+}
+
+//
+//  Huber loss of squared error e2
+//
+static double rho(const ba_t* ba,double e2)
+{
+   double e = sqrt(e2);
+   return (ba->h<=0 || e<=ba->h) ? e2 : 2*ba->h*e - ba->h*ba->h;
+}
+
+//
+//  Wrap angle to -pi .. pi
+//
+static double wrap(double a)
+{
+   return a - 2*M_PI*floor((a+M_PI)/(2*M_PI));
+}
+
+//
+//  Project landmark L into keyframe P
+//    Returns 0 if the landmark is not in front of the keyframe
+//
+static int project(const double* P,const double* L,double* u,double* v,double* py)
+{
+   double c = cos(P[3]);
+   double s = sin(P[3]);
+   double dx = L[0]-P[0];
+   double dy = L[1]-P[1];
+   double px =  c*dx + s*dy;
+   *py       = -s*dx + c*dy;
+   if (*py<1e-6) return 0;
+   *u = px/(*py);
+   *v = (L[2]-P[2])/(*py);
+   return 1;
+}
+
+//
+//  Cost of observation term T with parameters P and L
+//    Landmarks behind the keyframe cost as much as a large error so steps
+//    that move them there are rejected
+//
+static double obscost(const ba_t* ba,const term_t* T,const double* P,const double* L)
+{
+   double u,v,py;
+   if (!project(P+4*T->cam,L+3*T->lm,&u,&v,&py)) return rho(ba,100*ba->f*ba->f);
+   u = ba->f*(u-ba->map->u[T->obs]);
+   v = ba->f*(v-ba->map->v[T->obs]);
+   return rho(ba,u*u+v*v);
+}
+
+//
+//  Odometry residual of keyframe k with parameters P
+//    Fills the derivatives when Ji and Jj are not NULL
+//
+static void odometry(const ba_t* ba,int k,const double* P,double r[4],double Ji[4][4],double Jj[4][4])
+{
+   const pose_t* m = ba->map->odom+k;
+   const double* A = P+4*(k-1);
+   const double* B = P+4*k;
+   double c = cos(A[3]);
+   double s = sin(A[3]);
+   double dx = B[0]-A[0];
+   double dy = B[1]-A[1];
+   double rx =  c*dx + s*dy;
+   double ry = -s*dx + c*dy;
+   r[0] = (rx-m->x)/ba->st;
+   r[1] = (ry-m->y)/ba->st;
+   r[2] = (B[2]-A[2]-m->z)/ba->st;
+   r[3] = wrap(B[3]-A[3]-m->d*M_PI/180)/ba->sr;
+   if (Ji && Jj)
+   {
+      int i,j;
+      const double R[3][3] = {{c,s,0},{-s,c,0},{0,0,1}};
+      memset(Ji,0,16*sizeof(double));
+      memset(Jj,0,16*sizeof(double));
+      for (i=0;i<3;i++)
+         for (j=0;j<3;j++)
+         {
+            Ji[i][j] = -R[i][j]/ba->st;
+            Jj[i][j] =  R[i][j]/ba->st;
+         }
+      Ji[0][3] =  ry/ba->st;
+      Ji[1][3] = -rx/ba->st;
+      Ji[3][3] = -1/ba->sr;
+      Jj[3][3] =  1/ba->sr;
+   }
+}
+
+//
+//  Odometry cost with parameters P (linearized when lin is set)
+//
+static double odocost(ba_t* ba,const double* P,int lin)
+{
+   int k,i;
+   double sum=0;
+   for (k=1;k<ba->Ncam;k++)
+   {
+      odo_t* O = ba->odo+k;
+      double r[4];
+      if (!O->valid) continue;
+      if (lin)
+         odometry(ba,k,P,O->r,O->Ji,O->Jj);
+      else
+         odometry(ba,k,P,r,NULL,NULL);
+      for (i=0;i<4;i++)
+         sum += lin ? O->r[i]*O->r[i] : r[i]*r[i];
+   }
+   return sum;
+}
+
+//
+//  Residuals and Jacobians of observation terms k0 .. k1-1
+//    Huber weights are applied by scaling both with the square root of
+//    the weight
+//
+static void* linearize(void* arg)
+{
+   chunk_t* c = (chunk_t*)arg;
+   ba_t* ba = c->ba;
+   int t,a,b;
+   for (t=c->k0;t<c->k1;t++)
+   {
+      term_t* T = ba->term+t;
+      double u,v,py,e2,w;
+      if (!project(ba->P+4*T->cam,ba->L+3*T->lm,&u,&v,&py))
+      {
+         memset(T->r,0,sizeof(T->r));
+         memset(T->J,0,sizeof(T->J));
+         memset(T->W,0,sizeof(T->W));
+         c->sum += rho(ba,100*ba->f*ba->f);
+      }
+      else
+      {
+         double s = sin(ba->P[4*T->cam+3]);
+         double C = cos(ba->P[4*T->cam+3]);
+         T->r[0] = ba->f*(u-ba->map->u[T->obs]);
+         T->r[1] = ba->f*(v-ba->map->v[T->obs]);
+         e2 = T->r[0]*T->r[0] + T->r[1]*T->r[1];
+         c->sum += rho(ba,e2);
+         w = (ba->h<=0 || e2<=ba->h*ba->h) ? 1 : sqrt(ba->h/sqrt(e2));
+         T->J[0][0] = (-C-u*s)/py;  T->J[1][0] = -v*s/py;
+         T->J[0][1] = (-s+u*C)/py;  T->J[1][1] =  v*C/py;
+         T->J[0][2] = 0;            T->J[1][2] = -1/py;
+         T->J[0][3] = 1+u*u;        T->J[1][3] =  u*v;
+         for (a=0;a<4;a++)
+         {
+            T->J[0][a] *= w*ba->f;
+            T->J[1][a] *= w*ba->f;
+         }
+         T->r[0] *= w;
+         T->r[1] *= w;
+         for (a=0;a<4;a++)
+            for (b=0;b<3;b++)
+               T->W[a][b] = -T->J[0][a]*T->J[0][b] - T->J[1][a]*T->J[1][b];
+      }
+   }
+   return NULL;
+}
+
+//
+//  Normal equation blocks of free keyframes k0 .. k1-1
+//
+static void* camblocks(void* arg)
+{
+   chunk_t* c = (chunk_t*)arg;
+   ba_t* ba = c->ba;
+   int i,t,a,b,m;
+   for (i=c->k0;i<c->k1;i++)
+   {
+      int k = i+ba->fixed;
+      double* U = ba->U+16*i;
+      double* g = ba->gc+4*i;
+      memset(U,0,16*sizeof(double));
+      memset(g,0,4*sizeof(double));
+      for (t=ba->tfirst[k];t<ba->tfirst[k+1];t++)
+      {
+         const term_t* T = ba->term+t;
+         for (a=0;a<4;a++)
+         {
+            g[a] -= T->J[0][a]*T->r[0] + T->J[1][a]*T->r[1];
+            for (b=0;b<4;b++)
+               U[4*a+b] += T->J[0][a]*T->J[0][b] + T->J[1][a]*T->J[1][b];
+         }
+      }
+      //  Odometry from the previous keyframe and to the next
+      if (ba->odo[k].valid)
+      {
+         const odo_t* O = ba->odo+k;
+         for (a=0;a<4;a++)
+            for (m=0;m<4;m++)
+            {
+               g[a] -= O->Jj[m][a]*O->r[m];
+               for (b=0;b<4;b++)
+                  U[4*a+b] += O->Jj[m][a]*O->Jj[m][b];
+            }
+      }
+      if (k+1<ba->Ncam && ba->odo[k+1].valid)
+      {
+         const odo_t* O = ba->odo+k+1;
+         for (a=0;a<4;a++)
+            for (m=0;m<4;m++)
+            {
+               g[a] -= O->Ji[m][a]*O->r[m];
+               for (b=0;b<4;b++)
+                  U[4*a+b] += O->Ji[m][a]*O->Ji[m][b];
+            }
+      }
+   }
+   return NULL;
+}
+
+//
+//  Normal equation blocks of landmarks k0 .. k1-1
+//
+static void* lmblocks(void* arg)
+{
+   chunk_t* c = (chunk_t*)arg;
+   ba_t* ba = c->ba;
+   int l,n,a,b;
+   for (l=c->k0;l<c->k1;l++)
+   {
+      double* V = ba->V+9*l;
+      double* g = ba->gl+3*l;
+      memset(V,0,9*sizeof(double));
+      memset(g,0,3*sizeof(double));
+      for (n=ba->lfirst[l];n<ba->lfirst[l+1];n++)
+      {
+         const term_t* T = ba->term+ba->lterm[n];
+         for (a=0;a<3;a++)
+         {
+            g[a] += T->J[0][a]*T->r[0] + T->J[1][a]*T->r[1];
+            for (b=0;b<3;b++)
+               V[3*a+b] += T->J[0][a]*T->J[0][b] + T->J[1][a]*T->J[1][b];
+         }
+      }
+   }
+   return NULL;
+}
+
+//
+//  Damped inverse of landmark blocks k0 .. k1-1
+//    A landmark whose block cannot be inverted is not moved
+//
+static void* invert(void* arg)
+{
+   chunk_t* c = (chunk_t*)arg;
+   ba_t* ba = c->ba;
+   int l,a;
+   for (l=c->k0;l<c->k1;l++)
+   {
+      double A[9];
+      double* Vi = ba->Vinv+9*l;
+      memcpy(A,ba->V+9*l,sizeof(A));
+      for (a=0;a<3;a++)
+         A[4*a] += ba->lambda*fmax(A[4*a],1e-6);
+      memset(Vi,0,9*sizeof(double));
+      if (!chol(A,3)) continue;
+      for (a=0;a<3;a++)
+      {
+         double x[3] = {0,0,0};
+         x[a] = 1;
+         cholsolve(A,3,x);
+         Vi[a] = x[0];
+         Vi[3+a] = x[1];
+         Vi[6+a] = x[2];
+      }
+   }
+   return NULL;
+}
+
+//
+//  Block (i,j) of the reduced camera system
+//
+static double* block(const ba_t* ba,int i,int j)
+{
+   int lo = ba->sfirst[i];
+   int hi = ba->sfirst[i+1]-1;
+   while (lo<=hi)
+   {
+      int mid = (lo+hi)/2;
+      if (ba->scol[mid]==j)
+         return ba->S+16*mid;
+      else if (ba->scol[mid]<j)
+         lo = mid+1;
+      else
+         hi = mid-1;
+   }
+   Fatal("Bundle adjustment block %d,%d missing\n",i,j);
+   return NULL;
+}
+
+//
+//  Add J1' J2 (4x4) to block B
+//
+static void addjtj(double* B,double J1[4][4],double J2[4][4])
+{
+   int a,b,m;
+   for (a=0;a<4;a++)
+      for (b=0;b<4;b++)
+         for (m=0;m<4;m++)
+            B[4*a+b] += J1[m][a]*J2[m][b];
+}
+
+//
+//  Rows k0 .. k1-1 of the reduced camera system on and above the diagonal
+//    S = U - W V^-1 W'  and  rhs = gc - W V^-1 gl
+//    Each row is written only by the thread that owns it.  Terms of a
+//    landmark and the blocks of a row are both in keyframe order, so the
+//    blocks are found by walking the row.
+//
+static void* schur(void* arg)
+{
+   chunk_t* c = (chunk_t*)arg;
+   ba_t* ba = c->ba;
+   int i,t,n,p,a,b;
+   for (i=c->k0;i<c->k1;i++)
+   {
+      int k = i+ba->fixed;
+      int p0 = ba->sfirst[i];
+      double* r = ba->rhs+4*i;
+      double* D;
+      //  Find the diagonal
+      while (ba->scol[p0]<i) p0++;
+      D = ba->S+16*p0;
+      memset(D,0,16*(ba->sfirst[i+1]-p0)*sizeof(double));
+      memcpy(r,ba->gc+4*i,4*sizeof(double));
+      //  Damped diagonal and odometry to the next keyframe
+      for (a=0;a<16;a++)
+         D[a] = ba->U[16*i+a];
+      for (a=0;a<4;a++)
+         D[5*a] += ba->lambda*fmax(D[5*a],1e-6);
+      if (k+1<ba->Ncam && ba->odo[k+1].valid)
+         addjtj(ba->S+16*(p0+1),ba->odo[k+1].Ji,ba->odo[k+1].Jj);
+      //  Landmarks
+      for (t=ba->tfirst[k];t<ba->tfirst[k+1];t++)
+      {
+         const term_t* T = ba->term+t;
+         const double* Vi = ba->Vinv+9*T->lm;
+         const double* g = ba->gl+3*T->lm;
+         double Y[4][3];
+         for (a=0;a<4;a++)
+            for (b=0;b<3;b++)
+               Y[a][b] = T->W[a][0]*Vi[b] + T->W[a][1]*Vi[3+b] + T->W[a][2]*Vi[6+b];
+         for (a=0;a<4;a++)
+            r[a] -= Y[a][0]*g[0] + Y[a][1]*g[1] + Y[a][2]*g[2];
+         p = p0;
+         for (n=ba->lfirst[T->lm];n<ba->lfirst[T->lm+1];n++)
+         {
+            const term_t* T2 = ba->term+ba->lterm[n];
+            double* B;
+            if (T2->cam<k) continue;
+            while (ba->scol[p]<T2->cam-ba->fixed) p++;
+            B = ba->S+16*p;
+            for (a=0;a<4;a++)
+               for (b=0;b<4;b++)
+                  B[4*a+b] -= Y[a][0]*T2->W[b][0] + Y[a][1]*T2->W[b][1] + Y[a][2]*T2->W[b][2];
+         }
+      }
+   }
+   return NULL;
+}
+
+//
+//  Blocks below the diagonal of rows k0 .. k1-1 from those above
+//
+static void* mirror(void* arg)
+{
+   chunk_t* c = (chunk_t*)arg;
+   ba_t* ba = c->ba;
+   int i,p,a,b;
+   for (i=c->k0;i<c->k1;i++)
+      for (p=ba->sfirst[i];ba->scol[p]<i;p++)
+      {
+         const double* B = block(ba,ba->scol[p],i);
+         for (a=0;a<4;a++)
+            for (b=0;b<4;b++)
+               ba->S[16*p+4*a+b] = B[4*b+a];
+      }
+   return NULL;
+}
+
+//
+//  Landmark steps of landmarks k0 .. k1-1 and their trial positions
+//    dl = V^-1 (gl - W' dc)
+//
+static void* backsub(void* arg)
+{
+   chunk_t* c = (chunk_t*)arg;
+   ba_t* ba = c->ba;
+   int l,n,a;
+   for (l=c->k0;l<c->k1;l++)
+   {
+      const double* Vi = ba->Vinv+9*l;
+      double x[3];
+      memcpy(x,ba->gl+3*l,sizeof(x));
+      for (n=ba->lfirst[l];n<ba->lfirst[l+1];n++)
+      {
+         const term_t* T = ba->term+ba->lterm[n];
+         const double* dc;
+         if (T->cam<ba->fixed) continue;
+         dc = ba->dc+4*(T->cam-ba->fixed);
+         for (a=0;a<3;a++)
+            x[a] -= T->W[0][a]*dc[0] + T->W[1][a]*dc[1] + T->W[2][a]*dc[2] + T->W[3][a]*dc[3];
+      }
+      for (a=0;a<3;a++)
+      {
+         ba->dl[3*l+a] = Vi[3*a]*x[0] + Vi[3*a+1]*x[1] + Vi[3*a+2]*x[2];
+         ba->Lt[3*l+a] = ba->L[3*l+a] + ba->dl[3*l+a];
+      }
+   }
+   return NULL;
+}
+
+//
+//  Cost of observation terms k0 .. k1-1 at the trial parameters
+//
+static void* evaluate(void* arg)
+{
+   chunk_t* c = (chunk_t*)arg;
+   ba_t* ba = c->ba;
+   int t;
+   for (t=c->k0;t<c->k1;t++)
+      c->sum += obscost(ba,ba->term+t,ba->Pt,ba->Lt);
+   return NULL;
+}
+
+//
+//  Sort integers
+//
+static int cmpint(const void* p,const void* q)
+{
+   return *(const int*)p - *(const int*)q;
+}
+
+//
+//  Add column j to reduced row i unless already there
+//
+static void addcol(ba_t* ba,int* mark,int i,int j,int* N,int* max)
+{
+   if (mark[j]==i+1) return;
+   mark[j] = i+1;
+   if (*N==*max)
+   {
+      *max *= 2;
+      ba->scol = (int*)realloc(ba->scol,*max*sizeof(int));
+      if (!ba->scol) Fatal("Cannot allocate memory for bundle adjustment\n");
+   }
+   ba->scol[(*N)++] = j;
+}
+
+//
+//  Block structure of the reduced camera system and its envelope
+//    Free keyframes i and j are coupled when they see a common landmark or
+//    are joined by odometry
+//
+static void structure(ba_t* ba)
+{
+   int i,t,n,max=1024,N=0;
+   size_t size=0;
+   int* mark = (int*)alloc(ba->Nf,sizeof(int));
+   ba->sfirst = (int*)alloc(ba->Nf+1,sizeof(int));
+   ba->scol = (int*)alloc(max,sizeof(int));
+   for (i=0;i<ba->Nf;i++)
+   {
+      int k = i+ba->fixed;
+      ba->sfirst[i] = N;
+      addcol(ba,mark,i,i,&N,&max);
+      if (ba->odo[k].valid && i>0) addcol(ba,mark,i,i-1,&N,&max);
+      if (k+1<ba->Ncam && ba->odo[k+1].valid) addcol(ba,mark,i,i+1,&N,&max);
+      for (t=ba->tfirst[k];t<ba->tfirst[k+1];t++)
+      {
+         int l = ba->term[t].lm;
+         for (n=ba->lfirst[l];n<ba->lfirst[l+1];n++)
+         {
+            int cam = ba->term[ba->lterm[n]].cam;
+            if (cam>=ba->fixed) addcol(ba,mark,i,cam-ba->fixed,&N,&max);
+         }
+      }
+      qsort(ba->scol+ba->sfirst[i],N-ba->sfirst[i],sizeof(int),cmpint);
+   }
+   ba->sfirst[ba->Nf] = N;
+   free(mark);
+   ba->S = (double*)alloc(16*(size_t)N,sizeof(double));
+
+   //  Envelope of the lower triangle
+   ba->fs  = (int*)alloc(4*ba->Nf,sizeof(int));
+   ba->off = (size_t*)alloc(4*ba->Nf,sizeof(size_t));
+   for (i=0;i<4*ba->Nf;i++)
+   {
+      ba->fs[i]  = 4*ba->scol[ba->sfirst[i/4]];
+      ba->off[i] = size;
+      size += i-ba->fs[i]+1;
+   }
+   ba->cholesky = ba->opt->solver==1 || (ba->opt->solver==0 && size<=BA_ENVELOPE);
+   if (ba->cholesky)
+      ba->env = (double*)alloc(size,sizeof(double));
+   else
+   {
+      ba->Mi = (double*)alloc(16*ba->Nf,sizeof(double));
+      ba->pr = (double*)alloc(4*ba->Nf,sizeof(double));
+      ba->pz = (double*)alloc(4*ba->Nf,sizeof(double));
+      ba->pp = (double*)alloc(4*ba->Nf,sizeof(double));
+      ba->pq = (double*)alloc(4*ba->Nf,sizeof(double));
+   }
+}
+
+//
+//  Solve the reduced camera system with envelope Cholesky
+//    Returns 0 if the system is not positive definite
+//
+static int envsolve(ba_t* ba)
+{
+   int i,r,col,k,a,b,n=4*ba->Nf;
+   double* x = ba->dc;
+   //  Copy the lower triangle
+   for (i=0;i<ba->Nf;i++)
+      for (k=ba->sfirst[i];k<ba->sfirst[i+1];k++)
+      {
+         int j = ba->scol[k];
+         if (j>i) break;
+         for (a=0;a<4;a++)
+            for (b=0;b<4;b++)
+            {
+               r = 4*i+a;
+               col = 4*j+b;
+               if (col<=r) ba->env[ba->off[r]+col-ba->fs[r]] = ba->S[16*k+4*a+b];
+            }
+      }
+   //  Factor row by row
+   for (r=0;r<n;r++)
+   {
+      double* Lr = ba->env+ba->off[r]-ba->fs[r];
+      for (col=ba->fs[r];col<=r;col++)
+      {
+         const double* Lc = ba->env+ba->off[col]-ba->fs[col];
+         double s = Lr[col];
+         for (k=ba->fs[r]>ba->fs[col]?ba->fs[r]:ba->fs[col];k<col;k++)
+            s -= Lr[k]*Lc[k];
+         if (col<r)
+            Lr[col] = s/Lc[col];
+         else if (s>0)
+            Lr[r] = sqrt(s);
+         else
+            return 0;
+      }
+   }
+   //  Forward and back substitution
+   for (r=0;r<n;r++)
+   {
+      const double* Lr = ba->env+ba->off[r]-ba->fs[r];
+      double s = ba->rhs[r];
+      for (k=ba->fs[r];k<r;k++)
+         s -= Lr[k]*x[k];
+      x[r] = s/Lr[r];
+   }
+   for (r=n-1;r>=0;r--)
+   {
+      const double* Lr = ba->env+ba->off[r]-ba->fs[r];
+      x[r] /= Lr[r];
+      for (k=ba->fs[r];k<r;k++)
+         x[k] -= Lr[k]*x[r];
+   }
+   return 1;
+}
+
+//
+//  Solve the reduced camera system with block Jacobi preconditioned
+//  conjugate gradients
+//    Returns 0 if the system is not positive definite
+//
+static int pcgsolve(ba_t* ba)
+{
+   int i,k,a,b,it,n=4*ba->Nf;
+   double rz=0,bb=0,tol;
+   double *x=ba->dc,*r=ba->pr,*z=ba->pz,*p=ba->pp,*q=ba->pq;
+   //  Factor diagonal blocks
+   for (i=0;i<ba->Nf;i++)
+   {
+      memcpy(ba->Mi+16*i,block(ba,i,i),16*sizeof(double));
+      if (!chol(ba->Mi+16*i,4)) return 0;
+   }
+   //  Start from zero
+   for (k=0;k<n;k++)
+   {
+      x[k] = 0;
+      r[k] = z[k] = ba->rhs[k];
+      bb += r[k]*r[k];
+   }
+   for (i=0;i<ba->Nf;i++)
+      cholsolve(ba->Mi+16*i,4,z+4*i);
+   for (k=0;k<n;k++)
+   {
+      p[k] = z[k];
+      rz += r[k]*z[k];
+   }
+   tol = 1e-12*bb;
+   for (it=0;it<n && bb>0;it++)
+   {
+      double pq=0,rr=0,rz1=0,alpha,beta;
+      //  q = S p
+      for (i=0;i<ba->Nf;i++)
+      {
+         double* qi = q+4*i;
+         qi[0] = qi[1] = qi[2] = qi[3] = 0;
+         for (k=ba->sfirst[i];k<ba->sfirst[i+1];k++)
+         {
+            const double* B = ba->S+16*k;
+            const double* pj = p+4*ba->scol[k];
+            for (a=0;a<4;a++)
+               for (b=0;b<4;b++)
+                  qi[a] += B[4*a+b]*pj[b];
+         }
+      }
+      for (k=0;k<n;k++)
+         pq += p[k]*q[k];
+      if (!(pq>0)) return 0;
+      alpha = rz/pq;
+      for (k=0;k<n;k++)
+      {
+         x[k] += alpha*p[k];
+         r[k] -= alpha*q[k];
+         rr += r[k]*r[k];
+         z[k] = r[k];
+      }
+      if (rr<=tol) break;
+      for (i=0;i<ba->Nf;i++)
+         cholsolve(ba->Mi+16*i,4,z+4*i);
+      for (k=0;k<n;k++)
+         rz1 += r[k]*z[k];
+      beta = rz1/rz;
+      rz = rz1;
+      for (k=0;k<n;k++)
+         p[k] = z[k] + beta*p[k];
+   }
+   ba->cg = it+1;
+   return 1;
+}
+
+//
+//  Set up the problem
+//    Landmarks with at least two measured observations are optimized
+//
+static void setup(ba_t* ba,slammap_t* map,const baopt_t* opt)
+{
+   int k,o,l,n;
+   memset(ba,0,sizeof(ba_t));
+   ba->map = map;
+   ba->opt = opt;
+   ba->threads = opt->threads>0 ? opt->threads : Processors();
+   ba->chunk = (chunk_t*)alloc(ba->threads,sizeof(chunk_t));
+   ba->Ncam  = map->Ncam;
+   ba->fixed = opt->fixed<0 ? 0 : opt->fixed>map->Ncam ? map->Ncam : opt->fixed;
+   ba->Nf    = ba->Ncam-ba->fixed;
+   ba->f  = opt->focal;
+   ba->h  = opt->huber;
+   ba->st = opt->sigma_t;
+   ba->sr = opt->sigma_d*M_PI/180;
+   ba->lambda = 1e-4;
+
+   //  Count measured observations of each landmark
+   ba->lmidx = (int*)alloc(map->Nlm,sizeof(int));
+   for (o=0;o<map->Nobs;o++)
+      if (isfinite(map->u[o]) && isfinite(map->v[o]))
+         ba->lmidx[map->lm[o]]++;
+   ba->lmid = (int*)alloc(map->Nlm,sizeof(int));
+   for (l=0;l<map->Nlm;l++)
+      if (ba->lmidx[l]>1)
+      {
+         ba->lmid[ba->Nl] = l;
+         ba->lmidx[l] = ba->Nl++;
+      }
+      else
+         ba->lmidx[l] = -1;
+
+   //  Parameters
+   ba->P  = (double*)alloc(4*ba->Ncam,sizeof(double));
+   ba->Pt = (double*)alloc(4*ba->Ncam,sizeof(double));
+   ba->L  = (double*)alloc(3*ba->Nl,sizeof(double));
+   ba->Lt = (double*)alloc(3*ba->Nl,sizeof(double));
+   for (k=0;k<ba->Ncam;k++)
+   {
+      ba->P[4*k+0] = map->pose[k].x;
+      ba->P[4*k+1] = map->pose[k].y;
+      ba->P[4*k+2] = map->pose[k].z;
+      ba->P[4*k+3] = map->pose[k].d*M_PI/180;
+   }
+   for (l=0;l<ba->Nl;l++)
+   {
+      ba->L[3*l+0] = map->X[ba->lmid[l]];
+      ba->L[3*l+1] = map->Y[ba->lmid[l]];
+      ba->L[3*l+2] = map->Z[ba->lmid[l]];
+   }
+
+   //  Observation terms in keyframe order
+   ba->term = (term_t*)alloc(map->Nobs,sizeof(term_t));
+   ba->tfirst = (int*)alloc(ba->Ncam+1,sizeof(int));
+   for (k=0;k<ba->Ncam;k++)
+   {
+      ba->tfirst[k] = ba->Nt;
+      for (o=map->first[k];o<map->first[k+1];o++)
+      {
+         l = ba->lmidx[map->lm[o]];
+         if (l<0 || !isfinite(map->u[o]) || !isfinite(map->v[o])) continue;
+         ba->term[ba->Nt].cam = k;
+         ba->term[ba->Nt].lm  = l;
+         ba->term[ba->Nt].obs = o;
+         ba->Nt++;
+      }
+   }
+   ba->tfirst[ba->Ncam] = ba->Nt;
+
+   //  Terms of each landmark
+   ba->lfirst = (int*)alloc(ba->Nl+1,sizeof(int));
+   ba->lterm  = (int*)alloc(ba->Nt,sizeof(int));
+   for (n=0;n<ba->Nt;n++)
+      ba->lfirst[ba->term[n].lm+1]++;
+   for (l=0;l<ba->Nl;l++)
+      ba->lfirst[l+1] += ba->lfirst[l];
+   for (n=0;n<ba->Nt;n++)
+      ba->lterm[ba->lfirst[ba->term[n].lm]++] = n;
+   for (l=ba->Nl;l>0;l--)
+      ba->lfirst[l] = ba->lfirst[l-1];
+   ba->lfirst[0] = 0;
+
+   //  Odometry terms
+   ba->odo = (odo_t*)alloc(ba->Ncam,sizeof(odo_t));
+   if (ba->st>0 && ba->sr>0)
+      for (k=1;k<ba->Ncam;k++)
+      {
+         const pose_t* m = map->odom+k;
+         ba->odo[k].valid = isfinite(m->x) && isfinite(m->y) && isfinite(m->z) && isfinite(m->d);
+         ba->No += ba->odo[k].valid;
+      }
+
+   //  Normal equations
+   ba->U    = (double*)alloc(16*ba->Nf,sizeof(double));
+   ba->gc   = (double*)alloc(4*ba->Nf,sizeof(double));
+   ba->V    = (double*)alloc(9*ba->Nl,sizeof(double));
+   ba->gl   = (double*)alloc(3*ba->Nl,sizeof(double));
+   ba->Vinv = (double*)alloc(9*ba->Nl,sizeof(double));
+   ba->rhs  = (double*)alloc(4*ba->Nf,sizeof(double));
+   ba->dc   = (double*)alloc(4*ba->Nf,sizeof(double));
+   ba->dl   = (double*)alloc(3*ba->Nl,sizeof(double));
+   structure(ba);
+}
+
+//
+//  Release problem memory
+//
+static void release(ba_t* ba)
+{
+   free(ba->chunk);
+   free(ba->lmidx);
+   free(ba->lmid);
+   free(ba->P);
+   free(ba->L);
+   free(ba->Pt);
+   free(ba->Lt);
+   free(ba->term);
+   free(ba->tfirst);
+   free(ba->lfirst);
+   free(ba->lterm);
+   free(ba->odo);
+   free(ba->U);
+   free(ba->gc);
+   free(ba->V);
+   free(ba->gl);
+   free(ba->Vinv);
+   free(ba->sfirst);
+   free(ba->scol);
+   free(ba->S);
+   free(ba->rhs);
+   free(ba->dc);
+   free(ba->dl);
+   free(ba->fs);
+   free(ba->off);
+   free(ba->env);
+   free(ba->Mi);
+   free(ba->pr);
+   free(ba->pz);
+   free(ba->pp);
+   free(ba->pq);
+}
+
+/*
+ *  Default bundle adjustment options
+ */
+void BAOptions(baopt_t* opt)
+{
+   opt->iterations = 20;
+   opt->threads    = 0;
+   opt->fixed      = 1;
+   opt->solver     = 0;
+   opt->focal      = 500;
+   opt->huber      = 2;
+   opt->sigma_t    = 0.05;
+   opt->sigma_d    = 1;
+   opt->verbose    = 0;
+}
+
+/*
+ *  Bundle adjust keyframe poses and landmark positions
+ *    Minimizes the Huber loss of the reprojection errors in pixels of
+ *    measured observations plus the squared odometry errors in standard
+ *    deviations.  Landmarks seen fewer than twice are not changed.
+ *    opt may be NULL for the defaults and report may be NULL.
+ *    Returns the number of iterations taken
+ */
+int BundleAdjust(slammap_t* map,const baopt_t* opt,bareport_t* report)
+{
+   ba_t ba;
+   baopt_t def;
+   bareport_t rep;
+   int it,k,a;
+   double* swap;
+   double cost,t0=now();
+
+   if (!opt)
+   {
+      BAOptions(&def);
+      opt = &def;
+   }
+   memset(&rep,0,sizeof(rep));
+   setup(&ba,map,opt);
+   rep.terms = ba.Nt+ba.No;
+   if (opt->verbose)
+      printf("BA %d keyframes (%d fixed) %d landmarks %d observations %d odometry %d threads %s\n",
+         ba.Ncam,ba.fixed,ba.Nl,ba.Nt,ba.No,ba.threads,ba.cholesky?"cholesky":"pcg");
+
+   //  Levenberg-Marquardt iterations
+   cost = 0;
+   for (it=0;it<opt->iterations;it++)
+   {
+      int ok=0,tries;
+      double trial=0,t1,t2,t3,tj,ts=0,tl=0,tu=0;
+
+      //  Linearize at the current parameters
+      t1 = now();
+      cost = parallel(&ba,linearize,ba.Nt) + odocost(&ba,ba.P,1);
+      parallel(&ba,camblocks,ba.Nf);
+      parallel(&ba,lmblocks,ba.Nl);
+      tj = now()-t1;
+      if (it==0) rep.cost0 = cost;
+      if (ba.Nf==0 && ba.Nl==0) break;
+
+      //  Increase damping until the cost decreases
+      for (tries=0;tries<BA_TRIES && !ok;tries++)
+      {
+         t1 = now();
+         parallel(&ba,invert,ba.Nl);
+         parallel(&ba,schur,ba.Nf);
+         parallel(&ba,mirror,ba.Nf);
+         t2 = now();
+         ok = ba.cholesky ? envsolve(&ba) : pcgsolve(&ba);
+         t3 = now();
+         ts += t2-t1;
+         tl += t3-t2;
+         if (ok)
+         {
+            memcpy(ba.Pt,ba.P,4*ba.Ncam*sizeof(double));
+            for (k=0;k<ba.Nf;k++)
+               for (a=0;a<4;a++)
+                  ba.Pt[4*(k+ba.fixed)+a] += ba.dc[4*k+a];
+            parallel(&ba,backsub,ba.Nl);
+            trial = parallel(&ba,evaluate,ba.Nt) + odocost(&ba,ba.Pt,0);
+            ok = trial<cost;
+         }
+         tu += now()-t3;
+         ba.lambda *= ok ? 1.0/3 : 4;
+      }
+      rep.t_jacobian += tj;
+      rep.t_schur += ts;
+      rep.t_solve += tl;
+      rep.t_update += tu;
+      if (opt->verbose)
+      {
+         printf("BA %3d cost %12.6g lambda %8.2g jacobian %8.2f ms schur %8.2f ms solve %8.2f ms update %8.2f ms",
+            it,ok?trial:cost,ba.lambda,1e3*tj,1e3*ts,1e3*tl,1e3*tu);
+         if (ba.cholesky)
+            printf("\n");
+         else
+            printf(" (%d cg)\n",ba.cg);
+      }
+      if (!ok) break;
+
+      //  Accept step
+      swap = ba.P;  ba.P = ba.Pt;  ba.Pt = swap;
+      swap = ba.L;  ba.L = ba.Lt;  ba.Lt = swap;
+      rep.iterations = it+1;
+      if (cost-trial<=1e-6*cost)
+      {
+         cost = trial;
+         break;
+      }
+      cost = trial;
+   }
+   rep.cost = rep.iterations ? cost : rep.cost0;
+
+   //  Copy back to the map
+   for (k=ba.fixed;k<ba.Ncam;k++)
+   {
+      map->pose[k].x = ba.P[4*k+0];
+      map->pose[k].y = ba.P[4*k+1];
+      map->pose[k].z = ba.P[4*k+2];
+      map->pose[k].d = ba.P[4*k+3]*180/M_PI;
+   }
+   for (k=0;k<ba.Nl;k++)
+   {
+      map->X[ba.lmid[k]] = ba.L[3*k+0];
+      map->Y[ba.lmid[k]] = ba.L[3*k+1];
+      map->Z[ba.lmid[k]] = ba.L[3*k+2];
+   }
+   map->adjusted++;
+   release(&ba);
+   rep.t_total = now()-t0;
+   if (report) *report = rep;
+   return rep.iterations;
+}
@@ -0,0 +1,163 @@
+/*
+ *  Bundle adjustment benchmark
+ *
+ *  Builds a synthetic map of keyframes on a circle looking out at
+ *  landmarks on a surrounding wall, starts the keyframes from dead
+ *  reckoning of noisy odometry and the landmarks from perturbed positions,
+ *  then bundle adjusts it with timing for each iteration.  Run it with
+ *  growing sizes to see how the solve scales.
+ *
+ *  Usage:
+ *    babench [keyframes] [landmarks] [threads] [solver]
+ *      solver is 0 for automatic, 1 for Cholesky and 2 for conjugate gradients
+ */
+#include "CSCIx229.h"
+#include "slam.h"
+
+//
+//  Normally distributed random number (Box-Muller)
+//
+static double gauss(double sigma)
+{
+   double u = (rand()+1.0)/(RAND_MAX+2.0);
+   double v = (rand()+1.0)/(RAND_MAX+2.0);
+   return sigma*sqrt(-2*log(u))*cos(2*M_PI*v);
+}
+
+//
+//  Landmark (x,y,z) in the frame of pose p
+//
+static void local(pose_t p,double x,double y,double z,double* px,double* py,double* pz)
+{
+   double c = Cos(p.d);
+   double s = Sin(p.d);
+   *px =  c*(x-p.x) + s*(y-p.y);
+   *py = -s*(x-p.x) + c*(y-p.y);
+   *pz = z-p.z;
+}
+
+//
+//  Root mean square position error of keyframes against the truth
+//
+static double poserr(const slammap_t* map,const pose_t* truth)
+{
+   int k;
+   double e=0;
+   for (k=0;k<map->Ncam;k++)
+   {
+      double dx = map->pose[k].x-truth[k].x;
+      double dy = map->pose[k].y-truth[k].y;
+      double dz = map->pose[k].z-truth[k].z;
+      e += dx*dx+dy*dy+dz*dz;
+   }
+   return sqrt(e/map->Ncam);
+}
+
+int main(int argc,char* argv[])
+{
+   int Ncam=200,Nlm=5000;
+   int k,l;
+   const double R=5,W=15,noise=0.5,sigma_t=0.02,sigma_d=0.2;
+   slammap_t map;
+   pose_t* truth;
+   baopt_t opt;
+   bareport_t rep;
+   double *X,*Y,*Z;
+
+   BAOptions(&opt);
+   if (argc>5)
+   {
+      fprintf(stderr,"Usage: babench [keyframes] [landmarks] [threads] [solver]\n");
+      return 1;
+   }
+   if (argc>1) Ncam = atoi(argv[1]);
+   if (argc>2) Nlm = atoi(argv[2]);
+   if (argc>3) opt.threads = atoi(argv[3]);
+   if (argc>4) opt.solver = atoi(argv[4]);
+   if (Ncam<2 || Nlm<1) Fatal("Need at least two keyframes and one landmark\n");
+   opt.sigma_t = sigma_t;
+   opt.sigma_d = sigma_d;
+   opt.verbose = 1;
+   srand(1);
+
+   //  Keyframes on a circle looking outwards
+   truth = (pose_t*)malloc(Ncam*sizeof(pose_t));
+   X = (double*)malloc(3*Nlm*sizeof(double));
+   if (!truth || !X) Fatal("Cannot allocate memory for benchmark\n");
+   Y = X+Nlm;
+   Z = Y+Nlm;
+   for (k=0;k<Ncam;k++)
+   {
+      double th = 360.0*k/Ncam;
+      truth[k].x = R*Cos(th);
+      truth[k].y = R*Sin(th);
+      truth[k].z = 1.5;
+      truth[k].d = th-90;
+   }
+   //  Landmarks on a wall around the circle
+   for (l=0;l<Nlm;l++)
+   {
+      double th = 360.0*rand()/RAND_MAX;
+      X[l] = W*Cos(th);
+      Y[l] = W*Sin(th);
+      Z[l] = 3.0*rand()/RAND_MAX;
+   }
+
+   //  Map from noisy odometry and measurements
+   InitMap(&map);
+   for (l=0;l<Nlm;l++)
+      AddLandmark(&map,X[l]+gauss(0.1),Y[l]+gauss(0.1),Z[l]+gauss(0.1));
+   for (k=0;k<Ncam;k++)
+   {
+      pose_t p = truth[k];
+      if (k>0)
+      {
+         //  Odometry is the true step plus noise, and the initial pose is
+         //  its dead reckoning from the previous estimate
+         pose_t q = map.pose[k-1];
+         double mx,my,mz,c,s;
+         local(truth[k-1],truth[k].x,truth[k].y,truth[k].z,&mx,&my,&mz);
+         mx += gauss(sigma_t);
+         my += gauss(sigma_t);
+         mz += gauss(sigma_t);
+         c = Cos(q.d);
+         s = Sin(q.d);
+         p.x = q.x + c*mx - s*my;
+         p.y = q.y + s*mx + c*my;
+         p.z = q.z + mz;
+         p.d = q.d + truth[k].d-truth[k-1].d + gauss(sigma_d);
+         AddKeyframe(&map,p);
+         map.odom[k].x = mx;
+         map.odom[k].y = my;
+         map.odom[k].z = mz;
+         map.odom[k].d = p.d-q.d;
+      }
+      else
+         AddKeyframe(&map,p);
+      //  Landmarks within a 90 degree field of view
+      for (l=0;l<Nlm;l++)
+      {
+         double px,py,pz;
+         local(truth[k],X[l],Y[l],Z[l],&px,&py,&pz);
+         if (py>1 && fabs(px)<py && fabs(pz)<py)
+            AddObservation(&map,l,px/py+gauss(noise/opt.focal),pz/py+gauss(noise/opt.focal));
+      }
+   }
+   printf("%d keyframes %d landmarks %d observations\n",map.Ncam,map.Nlm,map.Nobs);
+   printf("keyframe error %.4f before\n",poserr(&map,truth));
+
+   //  Solve
+   BundleAdjust(&map,&opt,&rep);
+   printf("keyframe error %.4f after\n",poserr(&map,truth));
+   printf("%d iterations cost %.6g to %.6g\n",rep.iterations,rep.cost0,rep.cost);
+   printf("jacobian %8.2f ms\n",1e3*rep.t_jacobian);
+   printf("schur    %8.2f ms\n",1e3*rep.t_schur);
+   printf("solve    %8.2f ms\n",1e3*rep.t_solve);
+   printf("update   %8.2f ms\n",1e3*rep.t_update);
+   printf("total    %8.2f ms\n",1e3*rep.t_total);
+
+   FreeMap(&map);
+   free(truth);
+   free(X);
+   return 0;
+}
@@ -0,0 +1,120 @@
+/*
+ *  Baked static scene
+ *
+ *  Scenery that does not change between frames only needs to be drawn
+ *  when the view does.  BakeBegin() redirects drawing into an offscreen
+ *  framebuffer the size of the viewport, and BakeEnd() goes back to the
+ *  window (or the Headless() framebuffer).  BakeDraw() then copies the
+ *  baked color and depth into the current framebuffer with one blit, so
+ *  the rest of the frame is drawn over the scenery and depth tested
+ *  against it exactly as if it had been drawn again.
+ *
+ *  Depth can only be blitted between buffers of the same format, so the
+ *  bake copies the format of the framebuffer it is drawn into.  If the
+ *  blit still fails BakeDraw() returns 0 and the caller should draw the
+ *  scene directly instead.
+ */
+#include "CSCIx229.h"
+
+static unsigned int fbo=0;  //  Bake framebuffer
+static unsigned int rbo[2]; //  Color and depth renderbuffers
+static int W=0,H=0;         //  Size of renderbuffers
+static int depthfmt=0;      //  Depth format
+static int target=0;        //  Framebuffer drawn into outside the bake
+static int baked=0;         //  Bake holds an image
+
+//
+//  Depth format of the current framebuffer
+//
+static int depthformat(void)
+{
+   int depth=24,stencil=0;
+   glGetIntegerv(GL_DEPTH_BITS,&depth);
+   glGetIntegerv(GL_STENCIL_BITS,&stencil);
+   if (stencil>0) return GL_DEPTH24_STENCIL8;
+   if (depth<=16) return GL_DEPTH_COMPONENT16;
+   if (depth>24)  return GL_DEPTH_COMPONENT32;
+   return GL_DEPTH_COMPONENT24;
+}
+
+/*
+ *  Start baking
+ *    Drawing until BakeEnd() goes into the bake (clear it first)
+ *    Returns 0 if framebuffers are not available (nothing is redirected)
+ */
+int BakeBegin(void)
+{
+   int vp[4],w,h,fmt;
+   //  Framebuffer objects are core in OpenGL 3.0
+   if (!fbo)
+   {
+      int major=0;
+      const char* version = (const char*)glGetString(GL_VERSION);
+      const char* ext = (const char*)glGetString(GL_EXTENSIONS);
+      if (!(version && sscanf(version,"%d",&major)==1 && major>=3) && !(ext && strstr(ext,"GL_ARB_framebuffer_object")))
+         return 0;
+      glGenFramebuffers(1,&fbo);
+      glGenRenderbuffers(2,rbo);
+   }
+   glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING,&target);
+   glGetIntegerv(GL_VIEWPORT,vp);
+   w = vp[0]+vp[2];
+   h = vp[1]+vp[3];
+   fmt = depthformat();
+   //  Resize with the viewport
+   glBindFramebuffer(GL_FRAMEBUFFER,fbo);
+   if (w!=W || h!=H || fmt!=depthfmt)
+   {
+      glBindRenderbuffer(GL_RENDERBUFFER,rbo[0]);
+      glRenderbufferStorage(GL_RENDERBUFFER,GL_RGBA8,w,h);
+      glFramebufferRenderbuffer(GL_FRAMEBUFFER,GL_COLOR_ATTACHMENT0,GL_RENDERBUFFER,rbo[0]);
+      glBindRenderbuffer(GL_RENDERBUFFER,rbo[1]);
+      glRenderbufferStorage(GL_RENDERBUFFER,fmt,w,h);
+      glFramebufferRenderbuffer(GL_FRAMEBUFFER,GL_DEPTH_ATTACHMENT,GL_RENDERBUFFER,rbo[1]);
+      glFramebufferRenderbuffer(GL_FRAMEBUFFER,GL_STENCIL_ATTACHMENT,GL_RENDERBUFFER,fmt==GL_DEPTH24_STENCIL8 ? rbo[1] : 0);
+      glBindRenderbuffer(GL_RENDERBUFFER,0);
+      W = w;
+      H = h;
+      depthfmt = fmt;
+      if (glCheckFramebufferStatus(GL_FRAMEBUFFER)!=GL_FRAMEBUFFER_COMPLETE)
+      {
+         glBindFramebuffer(GL_FRAMEBUFFER,target);
+         W = H = 0;
+         return 0;
+      }
+   }
+   baked = 0;
+   return 1;
+}
+
+/*
+ *  Finish baking and draw into the previous framebuffer again
+ */
+void BakeEnd(void)
+{
+   glBindFramebuffer(GL_FRAMEBUFFER,target);
+   baked = 1;
+}
+
+/*
+ *  Copy the baked color and depth into the current framebuffer
+ *    Returns 0 if there is no bake or it cannot be copied
+ */
+int BakeDraw(void)
+{
+   int vp[4],cur;
+   if (!baked) return 0;
+   glGetIntegerv(GL_VIEWPORT,vp);
+   if (vp[0]+vp[2]!=W || vp[1]+vp[3]!=H) return 0;
+   glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING,&cur);
+   glBindFramebuffer(GL_READ_FRAMEBUFFER,fbo);
+   glBlitFramebuffer(vp[0],vp[1],W,H,vp[0],vp[1],W,H,GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT,GL_NEAREST);
+   glBindFramebuffer(GL_READ_FRAMEBUFFER,cur);
+   //  Formats that cannot be blitted give up on the bake
+   if (glGetError()!=GL_NO_ERROR)
+   {
+      baked = 0;
+      return 0;
+   }
+   return 1;
+}
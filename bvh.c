@@ -0,0 +1,731 @@
+/*
+ *  Bounding volume hierarchy over triangles
+ *
+ *  A BVH holds a triangle soup (9 floats per triangle, for example from
+ *  CaptureTriangles) for ray and proximity queries on the CPU, so they
+ *  run without drawing anything.  BuildBVH() splits the triangles with
+ *  the surface area heuristic, choosing the cheapest of BVH_BINS bins of
+ *  centroids along each axis, and stops at leaves of a few triangles when
+ *  splitting would cost more than testing them all.
+ *
+ *  Nodes are stored depth first in 32 bytes each: the first child of an
+ *  interior node is the next node and only the second child is stored.
+ *  Triangles are copied in leaf order so a leaf is one contiguous run.
+ *
+ *  RayBVH() follows one ray front to back and returns the nearest hit or
+ *  stops at the first one.  RaysBVH() traces many rays, eight at a time
+ *  with AVX: a packet visits a node once if any of its rays cross the box
+ *  and tests each triangle against all eight rays together, which pays
+ *  off for coherent rays such as the pixels of an image.  ClosestBVH()
+ *  finds the nearest point on any triangle.
+ */
+#include "CSCIx229.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BVH_SIMD
+#endif
+
+#define BVH_BINS     16  //  Candidate splits along each axis
+#define BVH_LEAF     16  //  Most triangles in a leaf
+#define BVH_SAHDEPTH 32  //  Deeper nodes split at the median
+#define BVH_DEPTH    64  //  Traversal stack (deepest possible node)
+
+//  Node (32 bytes)
+typedef struct
+{
+   float lo[3];  //  Bounds
+   int first;    //  First triangle of a leaf or second child of an interior node
+   float hi[3];
+   int n;        //  Triangles in a leaf, or -1-axis of the split for an interior node
+} bnode_t;
+
+//  BVH
+typedef struct
+{
+   int Nnode;      //  Nodes (node 0 is the root)
+   bnode_t* node;  //  Nodes
+   int Ntri;       //  Triangles
+   float* tri;     //  Corners in leaf order (9 floats per triangle)
+   int* id;        //  Index of each triangle as given to BuildBVH
+   int depth;      //  Deepest leaf
+} bvh_t;
+
+//  Triangles being split
+typedef struct
+{
+   const float* box;  //  Bounds (lo xyz then hi xyz)
+   const float* c;    //  Centroids
+   int* idx;          //  Triangles of the nodes being built
+} build_t;
+
+static int Nbvh=0;          //  Number of BVHs
+static bvh_t* bvhs=NULL;    //  BVHs
+static int packets=-1;      //  Packets use AVX (-1 until checked)
+
+//
+//  Look up BVH
+//
+static bvh_t* bvh(int k)
+{
+   if (k<0 || k>=Nbvh) Fatal("Invalid BVH %d\n",k);
+   return bvhs+k;
+}
+
+//
+//  Half the surface area of a box
+//
+static float area(const float lo[3],const float hi[3])
+{
+   float dx=hi[0]-lo[0],dy=hi[1]-lo[1],dz=hi[2]-lo[2];
+   return dx*dy + dy*dz + dz*dx;
+}
+
+//
+//  Grow box lo-hi to hold box b
+//
+static void enclose(float lo[3],float hi[3],const float* b)
+{
+   int i;
+   for (i=0;i<3;i++)
+   {
+      if (b[i]<lo[i]) lo[i] = b[i];
+      if (b[i+3]>hi[i]) hi[i] = b[i+3];
+   }
+}
+
+//
+//  Build node k over triangles idx[i0..i0+n-1]
+//
+static void build(bvh_t* t,build_t* B,int k,int i0,int n,int depth)
+{
+   bnode_t* nd = t->node+k;
+   float clo[3],chi[3],best=INFINITY;
+   int i,j,axis=-1,split=0,m;
+   //  Bounds of the triangles and of their centroids
+   for (i=0;i<3;i++)
+   {
+      nd->lo[i] = clo[i] = INFINITY;
+      nd->hi[i] = chi[i] = -INFINITY;
+   }
+   for (j=i0;j<i0+n;j++)
+   {
+      const float* c = B->c+3*B->idx[j];
+      enclose(nd->lo,nd->hi,B->box+6*B->idx[j]);
+      for (i=0;i<3;i++)
+      {
+         if (c[i]<clo[i]) clo[i] = c[i];
+         if (c[i]>chi[i]) chi[i] = c[i];
+      }
+   }
+   if (depth>t->depth) t->depth = depth;
+
+   //  Cheapest split: one node visit plus the triangles on each side
+   //  weighted by the chance a ray through this node crosses that side
+   if (n>1 && depth<BVH_SAHDEPTH)
+   {
+      float A = area(nd->lo,nd->hi);
+      for (i=0;i<3;i++)
+      {
+         int cnt[BVH_BINS];
+         float blo[BVH_BINS][3],bhi[BVH_BINS][3],right[BVH_BINS];
+         float lo[3],hi[3],scale;
+         int b,N;
+         if (!(chi[i]>clo[i])) continue;
+         scale = BVH_BINS/(chi[i]-clo[i]);
+         for (b=0;b<BVH_BINS;b++)
+         {
+            cnt[b] = 0;
+            blo[b][0] = blo[b][1] = blo[b][2] = INFINITY;
+            bhi[b][0] = bhi[b][1] = bhi[b][2] = -INFINITY;
+         }
+         for (j=i0;j<i0+n;j++)
+         {
+            int tr = B->idx[j];
+            b = (int)((B->c[3*tr+i]-clo[i])*scale);
+            if (b>=BVH_BINS) b = BVH_BINS-1;
+            cnt[b]++;
+            enclose(blo[b],bhi[b],B->box+6*tr);
+         }
+         //  Sweep from the right to get the cost of everything above each split
+         lo[0] = lo[1] = lo[2] = INFINITY;
+         hi[0] = hi[1] = hi[2] = -INFINITY;
+         for (N=0,b=BVH_BINS-1;b>0;b--)
+         {
+            float bb[6] = {blo[b][0],blo[b][1],blo[b][2],bhi[b][0],bhi[b][1],bhi[b][2]};
+            N += cnt[b];
+            if (cnt[b]) enclose(lo,hi,bb);
+            right[b] = N ? N*area(lo,hi) : 0;
+         }
+         //  Then from the left to add the cost below each split
+         lo[0] = lo[1] = lo[2] = INFINITY;
+         hi[0] = hi[1] = hi[2] = -INFINITY;
+         for (N=0,b=0;b<BVH_BINS-1;b++)
+         {
+            float bb[6] = {blo[b][0],blo[b][1],blo[b][2],bhi[b][0],bhi[b][1],bhi[b][2]};
+            float cost;
+            N += cnt[b];
+            if (cnt[b]) enclose(lo,hi,bb);
+            if (N==0 || N==n) continue;
+            cost = 1 + (N*area(lo,hi) + right[b+1])/A;
+            if (cost<best)
+            {
+               best = cost;
+               axis = i;
+               split = b;
+            }
+         }
+      }
+   }
+
+   //  Leaf when testing every triangle is cheaper than splitting
+   if (n==1 || (n<=BVH_LEAF && !(best<n)))
+   {
+      nd->first = i0;
+      nd->n = n;
+      return;
+   }
+
+   //  Partition about the split, or at the median of the widest axis when
+   //  the centroids cannot be told apart or the tree is already deep
+   if (axis>=0)
+   {
+      float scale = BVH_BINS/(chi[axis]-clo[axis]);
+      for (i=i0,j=i0+n-1;i<=j;)
+      {
+         int b = (int)((B->c[3*B->idx[i]+axis]-clo[axis])*scale);
+         if (b>=BVH_BINS) b = BVH_BINS-1;
+         if (b<=split)
+            i++;
+         else
+         {
+            int tmp = B->idx[i];
+            B->idx[i] = B->idx[j];
+            B->idx[j--] = tmp;
+         }
+      }
+      m = i-i0;
+   }
+   else
+   {
+      float w=-1;
+      for (i=0;i<3;i++)
+         if (nd->hi[i]-nd->lo[i]>w)
+         {
+            w = nd->hi[i]-nd->lo[i];
+            axis = i;
+         }
+      m = n/2;
+      //  Quickselect the median centroid
+      for (i=i0,j=i0+n-1;i<j;)
+      {
+         float pivot = B->c[3*B->idx[i0+m]+axis];
+         int a=i,b=j;
+         while (a<=b)
+         {
+            while (B->c[3*B->idx[a]+axis]<pivot) a++;
+            while (B->c[3*B->idx[b]+axis]>pivot) b--;
+            if (a<=b)
+            {
+               int tmp = B->idx[a];
+               B->idx[a++] = B->idx[b];
+               B->idx[b--] = tmp;
+            }
+         }
+         if (i0+m<=b) j = b;
+         else if (i0+m>=a) i = a;
+         else break;
+      }
+   }
+
+   //  Children follow depth first
+   nd->n = -1-axis;
+   build(t,B,t->Nnode++,i0,m,depth+1);
+   nd->first = t->Nnode++;
+   build(t,B,nd->first,i0+m,n-m,depth+1);
+}
+
+/*
+ *  Create an empty BVH
+ *    Returns the handle for the other BVH functions
+ */
+int NewBVH(void)
+{
+   bvhs = (bvh_t*)realloc(bvhs,(Nbvh+1)*sizeof(bvh_t));
+   if (!bvhs) Fatal("Cannot allocate memory for BVH\n");
+   memset(bvhs+Nbvh,0,sizeof(bvh_t));
+   return Nbvh++;
+}
+
+/*
+ *  Build BVH k over n triangles (9 floats each)
+ *    Replaces whatever it held before (n=0 frees it)
+ */
+void BuildBVH(int k,const float* tri,int n)
+{
+   bvh_t* t = bvh(k);
+   build_t B;
+   float *box,*c;
+   int i,j;
+   free(t->node);
+   free(t->tri);
+   free(t->id);
+   memset(t,0,sizeof(bvh_t));
+   if (n<=0) return;
+
+   //  Bounds and centroids of the triangles
+   t->node = (bnode_t*)malloc((2*(size_t)n-1)*sizeof(bnode_t));
+   t->tri = (float*)malloc(9*(size_t)n*sizeof(float));
+   t->id = (int*)malloc(n*sizeof(int));
+   box = (float*)malloc(9*(size_t)n*sizeof(float));
+   if (!t->node || !t->tri || !t->id || !box) Fatal("Cannot allocate memory for BVH\n");
+   c = box+6*(size_t)n;
+   for (j=0;j<n;j++)
+   {
+      const float* v = tri+9*(size_t)j;
+      float* b = box+6*(size_t)j;
+      for (i=0;i<3;i++)
+      {
+         b[i] = fminf(v[i],fminf(v[3+i],v[6+i]));
+         b[i+3] = fmaxf(v[i],fmaxf(v[3+i],v[6+i]));
+         c[3*j+i] = 0.5f*(b[i]+b[i+3]);
+      }
+      t->id[j] = j;
+   }
+   B.box = box;
+   B.c = c;
+   B.idx = t->id;
+   t->Nnode = 1;
+   build(t,&B,0,0,n,0);
+
+   //  Triangles in leaf order
+   for (j=0;j<n;j++)
+      memcpy(t->tri+9*(size_t)j,tri+9*(size_t)t->id[j],9*sizeof(float));
+   t->Ntri = n;
+   free(box);
+}
+
+/*
+ *  Size and quality of BVH k
+ *    Returns the number of nodes, and sets depth to the deepest leaf and
+ *    cost to the expected node visits plus triangle tests of a ray
+ *    crossing the root box (the surface area heuristic)
+ */
+int BVHInfo(int k,int* depth,double* cost)
+{
+   bvh_t* t = bvh(k);
+   double sum=0;
+   int j;
+   for (j=0;j<t->Nnode;j++)
+   {
+      const bnode_t* nd = t->node+j;
+      sum += (nd->n>0 ? nd->n : 1)*(double)area(nd->lo,nd->hi);
+   }
+   if (depth) *depth = t->depth;
+   if (cost) *cost = t->Nnode ? sum/area(t->node->lo,t->node->hi) : 0;
+   return t->Nnode;
+}
+
+//
+//  Does the ray o+t*d with inverse direction id cross the box for t in [0,tmax]
+//    The comparisons leave the bounds alone for NaN (a zero direction at
+//    the edge of a slab) the same way as the packet version
+//
+static int slab(const bnode_t* nd,const float o[3],const float id[3],float tmax)
+{
+   float t0=0,t1=tmax;
+   int i;
+   for (i=0;i<3;i++)
+   {
+      float ta = (nd->lo[i]-o[i])*id[i];
+      float tb = (nd->hi[i]-o[i])*id[i];
+      float near = tb<ta ? tb : ta;
+      float far  = ta>tb ? ta : tb;
+      if (near>t0) t0 = near;
+      if (far<t1) t1 = far;
+   }
+   return t0<=t1;
+}
+
+//
+//  Does the ray o+t*d cross triangle v for t in (0,tmax) (Moller-Trumbore)
+//    Sets tmax to the distance to the hit
+//
+static int triangle(const float* v,const float o[3],const float d[3],float* tmax)
+{
+   float e1[3],e2[3],s[3],p[3],q[3],det,inv,a,b,t;
+   int i;
+   for (i=0;i<3;i++)
+   {
+      e1[i] = v[3+i]-v[i];
+      e2[i] = v[6+i]-v[i];
+      s[i] = o[i]-v[i];
+   }
+   p[0] = d[1]*e2[2]-d[2]*e2[1];
+   p[1] = d[2]*e2[0]-d[0]*e2[2];
+   p[2] = d[0]*e2[1]-d[1]*e2[0];
+   det = e1[0]*p[0]+e1[1]*p[1]+e1[2]*p[2];
+   if (det==0) return 0;
+   inv = 1/det;
+   a = (s[0]*p[0]+s[1]*p[1]+s[2]*p[2])*inv;
+   if (!(a>=0 && a<=1)) return 0;
+   q[0] = s[1]*e1[2]-s[2]*e1[1];
+   q[1] = s[2]*e1[0]-s[0]*e1[2];
+   q[2] = s[0]*e1[1]-s[1]*e1[0];
+   b = (d[0]*q[0]+d[1]*q[1]+d[2]*q[2])*inv;
+   if (!(b>=0 && a+b<=1)) return 0;
+   t = (e2[0]*q[0]+e2[1]*q[1]+e2[2]*q[2])*inv;
+   if (!(t>0 && t<*tmax)) return 0;
+   *tmax = t;
+   return 1;
+}
+
+//
+//  Trace one ray
+//    Returns the hit in leaf order (-1 for none) and sets tmax to its distance
+//
+static int ray(const bvh_t* t,const float o[3],const float d[3],float* tmax,int any)
+{
+   int stack[BVH_DEPTH],sp=0,k=0,hit=-1,j;
+   float id[3] = {1/d[0],1/d[1],1/d[2]};
+   if (!t->Nnode) return -1;
+   for (;;)
+   {
+      const bnode_t* nd = t->node+k;
+      if (slab(nd,o,id,*tmax))
+      {
+         //  Visit the child on the near side of the split first
+         if (nd->n<0)
+         {
+            int near=k+1,far=nd->first;
+            if (d[-1-nd->n]<0)
+            {
+               near = far;
+               far = k+1;
+            }
+            stack[sp++] = far;
+            k = near;
+            continue;
+         }
+         for (j=nd->first;j<nd->first+nd->n;j++)
+            if (triangle(t->tri+9*(size_t)j,o,d,tmax))
+            {
+               hit = j;
+               if (any) return hit;
+            }
+      }
+      if (!sp) return hit;
+      k = stack[--sp];
+   }
+}
+
+/*
+ *  Cast the ray o+t*d for t in (0,tmax) against BVH k
+ *    With any set, stops at the first triangle crossed, otherwise finds
+ *    the nearest
+ *    Returns the triangle hit (-1 for none) and sets t to its distance
+ *    (t may be NULL)
+ */
+int RayBVH(int k,const float o[3],const float d[3],float tmax,int any,float* t)
+{
+   bvh_t* b = bvh(k);
+   int hit = ray(b,o,d,&tmax,any);
+   if (t) *t = tmax;
+   return hit<0 ? -1 : b->id[hit];
+}
+
+#ifdef BVH_SIMD
+//
+//  Trace eight rays together with AVX
+//    Rays past m are idle.  The operations are those of slab() and
+//    triangle() in the same order, so each triangle is hit at the same
+//    distance as alone.  The packet visits nodes in its own order though,
+//    so a ray through an edge may report the other triangle at a distance
+//    that differs by rounding.
+//
+__attribute__((target("avx")))
+static void packet(const bvh_t* t,int m,const float* o,const float* d,const float* tmax,int any,float* tout,int* hout)
+{
+   float buf[10][8];
+   int stack[BVH_DEPTH],sp=0,k=0,i,j,todo;
+   __m256 O[3],D[3],ID[3],T,H,act;
+   const __m256 zero = _mm256_setzero_ps(),one = _mm256_set1_ps(1);
+   //  Rays as structures of arrays
+   for (i=0;i<8;i++)
+   {
+      int r = i<m ? i : 0;
+      for (j=0;j<3;j++)
+      {
+         buf[j][i] = o[3*r+j];
+         buf[3+j][i] = d[3*r+j];
+         buf[6+j][i] = 1/d[3*r+j];
+      }
+      buf[9][i] = tmax ? tmax[r] : INFINITY;
+   }
+   for (j=0;j<3;j++)
+   {
+      O[j] = _mm256_loadu_ps(buf[j]);
+      D[j] = _mm256_loadu_ps(buf[3+j]);
+      ID[j] = _mm256_loadu_ps(buf[6+j]);
+   }
+   T = _mm256_loadu_ps(buf[9]);
+   H = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+   act = _mm256_cmp_ps(_mm256_set_ps(7,6,5,4,3,2,1,0),_mm256_set1_ps(m),_CMP_LT_OQ);
+   todo = t->Nnode ? _mm256_movemask_ps(act) : 0;
+   while (todo)
+   {
+      const bnode_t* nd = t->node+k;
+      __m256 t0=zero,t1=T,cross;
+      int live;
+      for (j=0;j<3;j++)
+      {
+         __m256 ta = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(nd->lo[j]),O[j]),ID[j]);
+         __m256 tb = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(nd->hi[j]),O[j]),ID[j]);
+         t0 = _mm256_max_ps(_mm256_min_ps(tb,ta),t0);
+         t1 = _mm256_min_ps(_mm256_max_ps(ta,tb),t1);
+      }
+      cross = _mm256_and_ps(_mm256_cmp_ps(t0,t1,_CMP_LE_OQ),act);
+      live = _mm256_movemask_ps(cross);
+      if (live && nd->n<0)
+      {
+         //  Near side first for most of the rays still crossing
+         int axis = -1-nd->n;
+         int back = _mm256_movemask_ps(_mm256_cmp_ps(D[axis],zero,_CMP_LT_OQ)) & live;
+         int near=k+1,far=nd->first;
+         if (2*__builtin_popcount(back)>__builtin_popcount(live))
+         {
+            near = far;
+            far = k+1;
+         }
+         stack[sp++] = far;
+         k = near;
+         continue;
+      }
+      for (j=nd->first;live && j<nd->first+nd->n;j++)
+      {
+         const float* v = t->tri+9*(size_t)j;
+         __m256 e1[3],e2[3],s[3],p[3],q[3],det,inv,a,b,tt,ok;
+         int c;
+         for (c=0;c<3;c++)
+         {
+            e1[c] = _mm256_set1_ps(v[3+c]-v[c]);
+            e2[c] = _mm256_set1_ps(v[6+c]-v[c]);
+            s[c] = _mm256_sub_ps(O[c],_mm256_set1_ps(v[c]));
+         }
+         p[0] = _mm256_sub_ps(_mm256_mul_ps(D[1],e2[2]),_mm256_mul_ps(D[2],e2[1]));
+         p[1] = _mm256_sub_ps(_mm256_mul_ps(D[2],e2[0]),_mm256_mul_ps(D[0],e2[2]));
+         p[2] = _mm256_sub_ps(_mm256_mul_ps(D[0],e2[1]),_mm256_mul_ps(D[1],e2[0]));
+         det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1[0],p[0]),_mm256_mul_ps(e1[1],p[1])),_mm256_mul_ps(e1[2],p[2]));
+         inv = _mm256_div_ps(one,det);
+         a = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(s[0],p[0]),_mm256_mul_ps(s[1],p[1])),_mm256_mul_ps(s[2],p[2])),inv);
+         q[0] = _mm256_sub_ps(_mm256_mul_ps(s[1],e1[2]),_mm256_mul_ps(s[2],e1[1]));
+         q[1] = _mm256_sub_ps(_mm256_mul_ps(s[2],e1[0]),_mm256_mul_ps(s[0],e1[2]));
+         q[2] = _mm256_sub_ps(_mm256_mul_ps(s[0],e1[1]),_mm256_mul_ps(s[1],e1[0]));
+         b = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(D[0],q[0]),_mm256_mul_ps(D[1],q[1])),_mm256_mul_ps(D[2],q[2])),inv);
+         tt = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2[0],q[0]),_mm256_mul_ps(e2[1],q[1])),_mm256_mul_ps(e2[2],q[2])),inv);
+         ok = _mm256_and_ps(cross,_mm256_cmp_ps(det,zero,_CMP_NEQ_OQ));
+         ok = _mm256_and_ps(ok,_mm256_and_ps(_mm256_cmp_ps(a,zero,_CMP_GE_OQ),_mm256_cmp_ps(a,one,_CMP_LE_OQ)));
+         ok = _mm256_and_ps(ok,_mm256_and_ps(_mm256_cmp_ps(b,zero,_CMP_GE_OQ),_mm256_cmp_ps(_mm256_add_ps(a,b),one,_CMP_LE_OQ)));
+         ok = _mm256_and_ps(ok,_mm256_and_ps(_mm256_cmp_ps(tt,zero,_CMP_GT_OQ),_mm256_cmp_ps(tt,T,_CMP_LT_OQ)));
+         if (!_mm256_movemask_ps(ok)) continue;
+         T = _mm256_blendv_ps(T,tt,ok);
+         H = _mm256_blendv_ps(H,_mm256_castsi256_ps(_mm256_set1_epi32(j)),ok);
+         //  Rays that only want a hit are done
+         if (any)
+         {
+            act = _mm256_andnot_ps(ok,act);
+            cross = _mm256_andnot_ps(ok,cross);
+            todo = _mm256_movemask_ps(act);
+            live = _mm256_movemask_ps(cross);
+         }
+      }
+      if (!sp) break;
+      k = stack[--sp];
+   }
+   _mm256_storeu_ps(buf[0],T);
+   _mm256_storeu_ps(buf[1],H);
+   for (i=0;i<m;i++)
+   {
+      int h;
+      memcpy(&h,buf[1]+i,sizeof(int));
+      tout[i] = buf[0][i];
+      hout[i] = h<0 ? -1 : t->id[h];
+   }
+}
+#endif
+
+/*
+ *  Cast n rays against BVH k
+ *    Ray i is o+t*d for t in (0,tmax[i]) with o and d at 3*i (tmax NULL
+ *    for no limit).  With any set each ray stops at the first triangle
+ *    crossed, otherwise it finds the nearest.
+ *    Sets hit[i] to the triangle hit (-1 for none) and t[i] to its distance
+ *    (as RayBVH, up to rounding where a ray hits an edge)
+ *    Neighbouring rays should be close for packets to pay off
+ */
+void RaysBVH(int k,int n,const float* o,const float* d,const float* tmax,int any,float* t,int* hit)
+{
+   bvh_t* b = bvh(k);
+   int i;
+   if (packets<0)
+   {
+      packets = 0;
+#ifdef BVH_SIMD
+      __builtin_cpu_init();
+      packets = __builtin_cpu_supports("avx");
+#endif
+   }
+#ifdef BVH_SIMD
+   if (packets)
+   {
+      for (i=0;i<n;i+=8)
+         packet(b,n-i<8?n-i:8,o+3*(size_t)i,d+3*(size_t)i,tmax?tmax+i:NULL,any,t+i,hit+i);
+      return;
+   }
+#endif
+   for (i=0;i<n;i++)
+   {
+      t[i] = tmax ? tmax[i] : INFINITY;
+      hit[i] = ray(b,o+3*(size_t)i,d+3*(size_t)i,t+i,any);
+      if (hit[i]>=0) hit[i] = b->id[hit[i]];
+   }
+}
+
+//
+//  Squared distance from p to the box of a node
+//
+static float boxdist(const bnode_t* nd,const float p[3])
+{
+   float d2=0;
+   int i;
+   for (i=0;i<3;i++)
+   {
+      float x = p[i]<nd->lo[i] ? nd->lo[i]-p[i] : p[i]>nd->hi[i] ? p[i]-nd->hi[i] : 0;
+      d2 += x*x;
+   }
+   return d2;
+}
+
+//
+//  Closest point q to p on triangle v (Ericson, Real-Time Collision Detection 5.1.5)
+//
+static void closest(const float* v,const float p[3],float q[3])
+{
+   float ab[3],ac[3],ap[3],bp[3],cp[3];
+   float d1,d2,d3,d4,d5,d6,va,vb,vc,w,s,den;
+   int i;
+   for (i=0;i<3;i++)
+   {
+      ab[i] = v[3+i]-v[i];
+      ac[i] = v[6+i]-v[i];
+      ap[i] = p[i]-v[i];
+      bp[i] = p[i]-v[3+i];
+      cp[i] = p[i]-v[6+i];
+   }
+   d1 = ab[0]*ap[0]+ab[1]*ap[1]+ab[2]*ap[2];
+   d2 = ac[0]*ap[0]+ac[1]*ap[1]+ac[2]*ap[2];
+   d3 = ab[0]*bp[0]+ab[1]*bp[1]+ab[2]*bp[2];
+   d4 = ac[0]*bp[0]+ac[1]*bp[1]+ac[2]*bp[2];
+   d5 = ab[0]*cp[0]+ab[1]*cp[1]+ab[2]*cp[2];
+   d6 = ac[0]*cp[0]+ac[1]*cp[1]+ac[2]*cp[2];
+   vc = d1*d4-d3*d2;
+   vb = d5*d2-d1*d6;
+   va = d3*d6-d5*d4;
+   //  Corners
+   if (d1<=0 && d2<=0)
+      s = w = 0;
+   else if (d3>=0 && d4<=d3)
+   {
+      s = 1;
+      w = 0;
+   }
+   else if (d6>=0 && d5<=d6)
+   {
+      s = 0;
+      w = 1;
+   }
+   //  Edges
+   else if (vc<=0 && d1>=0 && d3<=0)
+   {
+      s = d1/(d1-d3);
+      w = 0;
+   }
+   else if (vb<=0 && d2>=0 && d6<=0)
+   {
+      s = 0;
+      w = d2/(d2-d6);
+   }
+   else if (va<=0 && d4-d3>=0 && d5-d6>=0)
+   {
+      w = (d4-d3)/((d4-d3)+(d5-d6));
+      s = 1-w;
+   }
+   //  Face
+   else
+   {
+      den = 1/(va+vb+vc);
+      s = vb*den;
+      w = vc*den;
+   }
+   for (i=0;i<3;i++)
+      q[i] = v[i]+s*ab[i]+w*ac[i];
+}
+
+/*
+ *  Closest point to p on any triangle of BVH k within distance maxd
+ *    Returns the triangle (-1 if none is that close) and sets q to the
+ *    point on it
+ */
+int ClosestBVH(int k,const float p[3],float maxd,float q[3])
+{
+   bvh_t* t = bvh(k);
+   int stack[BVH_DEPTH],sp=0,n=0,hit=-1,j;
+   float best = maxd*maxd;
+   if (!t->Nnode || boxdist(t->node,p)>best) return -1;
+   for (;;)
+   {
+      const bnode_t* nd = t->node+n;
+      if (nd->n<0)
+      {
+         //  Nearer child first, the other when it could still be closer
+         int a=n+1,b=nd->first;
+         float da = boxdist(t->node+a,p);
+         float db = boxdist(t->node+b,p);
+         if (db<da)
+         {
+            int tmp=a;
+            float dt=da;
+            a = b;  da = db;
+            b = tmp;  db = dt;
+         }
+         if (da<=best)
+         {
+            if (db<=best) stack[sp++] = b;
+            n = a;
+            continue;
+         }
+      }
+      else
+         for (j=nd->first;j<nd->first+nd->n;j++)
+         {
+            float c[3],d2=0;
+            int i;
+            closest(t->tri+9*(size_t)j,p,c);
+            for (i=0;i<3;i++)
+               d2 += (c[i]-p[i])*(c[i]-p[i]);
+            if (d2<=best)
+            {
+               best = d2;
+               hit = j;
+               q[0] = c[0];
+               q[1] = c[1];
+               q[2] = c[2];
+            }
+         }
+      //  Skip nodes the best so far has ruled out
+      do
+      {
+         if (!sp) return hit<0 ? -1 : t->id[hit];
+         n = stack[--sp];
+      } while (boxdist(t->node+n,p)>best);
+   }
+}
@@ -0,0 +1,208 @@
+/*
+ *  BVH benchmark
+ *
+ *  Captures a room of boxes, tori and poles (and copies of a mesh when
+ *  one is given) with CaptureTriangles(), then times BuildBVH() and
+ *  reports millions of rays per second for camera rays (coherent) and
+ *  random rays (incoherent), traced one at a time with RayBVH() and in
+ *  packets with RaysBVH(), for both nearest and any hit.  Packet results
+ *  are checked against single rays.  Closest point queries are timed for
+ *  random points in the room.
+ *
+ *  Usage:
+ *    bvhbench [file.obj] [image size] [repeats]
+ */
+#include "CSCIx229.h"
+#include "slam.h"
+#include <ctype.h>
+#include <time.h>
+
+#define TOL 1e-5  //  Relative difference in distance from rounding
+
+static int boxes;      //  Cube list
+static int mesh=-1;    //  Mesh (-1 for none)
+static float mlo[3],mhi[3];  //  Mesh bounds
+
+//
+//  Wall clock time in seconds
+//
+static double now()
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC,&t);
+   return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+//
+//  Draw the room
+//
+static void room()
+{
+   int i,j;
+   DrawCubes(boxes);
+   for (i=-3;i<=3;i++)
+      for (j=-3;j<=3;j++)
+      {
+         glPushMatrix();
+         glTranslated(2.5*i+1.25,2.5*j+1.25,0);
+         if ((i+j)&1)
+            DrawPole(2,0.1);
+         else
+         {
+            glTranslated(0,0,1);
+            DrawTorus(0.1,0.4);
+         }
+         glPopMatrix();
+      }
+   //  Copies of the mesh scaled to one unit
+   for (i=0;i<4 && mesh>=0;i++)
+   {
+      double s = 1/fmax(mhi[0]-mlo[0],fmax(mhi[1]-mlo[1],mhi[2]-mlo[2]));
+      glPushMatrix();
+      glTranslated(6*Cos(90*i+45),6*Sin(90*i+45),0);
+      glScaled(s,s,s);
+      glTranslated(-0.5*(mlo[0]+mhi[0]),-0.5*(mlo[1]+mhi[1]),-mlo[2]);
+      DrawOBJ(mesh);
+      glPopMatrix();
+   }
+}
+
+//
+//  Trace rays one at a time and in packets and report rays per second
+//
+static void trace(const char* name,int bvh,int n,const float* o,const float* d,int reps,float* t,int* hit)
+{
+   int any,k,r;
+   float* t0 = t+n;
+   int* hit0 = hit+n;
+   for (any=0;any<2;any++)
+   {
+      double ts,tp,tm;
+      long bad=0,hits=0;
+      tm = now();
+      for (r=0;r<reps;r++)
+         for (k=0;k<n;k++)
+            hit0[k] = RayBVH(bvh,o+3*k,d+3*k,INFINITY,any,t0+k);
+      ts = now()-tm;
+      tm = now();
+      for (r=0;r<reps;r++)
+         RaysBVH(bvh,n,o,d,NULL,any,t,hit);
+      tp = now()-tm;
+      //  Nearest hits agree on the distance up to rounding (a ray through
+      //  an edge may report either triangle) and any hits on whether there
+      //  is one
+      for (k=0;k<n;k++)
+      {
+         hits += hit0[k]>=0;
+         if ((hit[k]<0)!=(hit0[k]<0) || (!any && hit[k]>=0 && fabsf(t[k]-t0[k])>TOL*t0[k])) bad++;
+      }
+      printf("%-10s %-8s %10.2f %10.2f %10.1f%% %10ld\n",name,any?"any":"nearest",1e-6*n*reps/ts,1e-6*n*reps/tp,100.0*hits/n,bad);
+   }
+}
+
+int main(int argc,char* argv[])
+{
+   int size=256,reps=4,views=16;
+   int i,j,k,n,Ntri,bvh,nodes,depth;
+   double t0,t,cost,sum;
+   float *tri,*o,*d,*tt;
+   int* hit;
+   intrinsics_t K;
+   const char* file=NULL;
+
+   if (argc>1 && !isdigit(argv[1][0]))
+   {
+      file = argv[1];
+      argc--;
+      argv++;
+   }
+   if (argc>3)
+   {
+      fprintf(stderr,"Usage: bvhbench [file.obj] [image size] [repeats]\n");
+      return 1;
+   }
+   if (argc>1) size = atoi(argv[1]);
+   if (argc>2) reps = atoi(argv[2]);
+   if (size<1 || reps<1) Fatal("Need at least one pixel and repeat\n");
+   srand(1);
+
+   //  Capture the room
+   Headless(64,64);
+   boxes = NewCubes();
+   for (i=-4;i<=4;i++)
+      for (j=-4;j<=4;j++)
+         AddCube(boxes,2.5*i,2.5*j,0.25,0.3,0.3,0.25,15*(i+j));
+   AddCube(boxes,0,0,-0.05,10,10,0.05,0);
+   if (file)
+   {
+      mesh = LoadOBJ(file);
+      OBJBounds(mesh,mlo,mhi);
+   }
+   Ntri = CaptureTriangles(room,12,&tri);
+
+   //  Build
+   bvh = NewBVH();
+   t0 = now();
+   for (k=0;k<reps;k++)
+      BuildBVH(bvh,tri,Ntri);
+   t = (now()-t0)/reps;
+   nodes = BVHInfo(bvh,&depth,&cost);
+   printf("%d triangles: build %.1f ms (%.2f Mtri/s), %d nodes, depth %d, SAH cost %.1f\n",Ntri,1e3*t,1e-6*Ntri/t,nodes,depth,cost);
+
+   //  Camera rays from views around the room looking in
+   n = size*size*views;
+   o = (float*)malloc(6*(size_t)n*sizeof(float));
+   tt = (float*)malloc(2*(size_t)n*sizeof(float));
+   hit = (int*)malloc(2*(size_t)n*sizeof(int));
+   if (!o || !tt || !hit) Fatal("Cannot allocate memory for rays\n");
+   d = o+3*(size_t)n;
+   CameraIntrinsics(&K,size,size,90);
+   for (k=0;k<views;k++)
+   {
+      double th = 360.0*k/views,c=Cos(th+120),s=Sin(th+120);
+      for (j=0;j<size;j++)
+         for (i=0;i<size;i++)
+         {
+            size_t r = 3*((size_t)(k*size+j)*size+i);
+            double px = (i+0.5-K.cu)/K.f;
+            o[r]   = 8*Cos(th);
+            o[r+1] = 8*Sin(th);
+            o[r+2] = 1.5;
+            d[r]   = c*px - s;
+            d[r+1] = s*px + c;
+            d[r+2] = (j+0.5-K.cv)/K.f;
+         }
+   }
+   printf("%-10s %-8s %10s %10s %11s %10s\n","rays","hit","single","packet","hit","mismatch");
+   trace("camera",bvh,n,o,d,reps,tt,hit);
+
+   //  Random rays from anywhere in the room
+   for (k=0;k<3*n;k+=3)
+   {
+      double th = 360.0*rand()/RAND_MAX,ph = 180.0*rand()/RAND_MAX-90;
+      o[k]   = 20.0*rand()/RAND_MAX-10;
+      o[k+1] = 20.0*rand()/RAND_MAX-10;
+      o[k+2] = 3.0*rand()/RAND_MAX;
+      d[k]   = Cos(th)*Cos(ph);
+      d[k+1] = Sin(th)*Cos(ph);
+      d[k+2] = Sin(ph);
+   }
+   trace("random",bvh,n,o,d,reps,tt,hit);
+
+   //  Closest points to the random origins
+   t0 = now();
+   for (k=0,sum=0;k<n;k++)
+   {
+      float q[3];
+      if (ClosestBVH(bvh,o+3*k,INFINITY,q)>=0)
+         sum += sqrt((q[0]-o[3*k])*(q[0]-o[3*k])+(q[1]-o[3*k+1])*(q[1]-o[3*k+1])+(q[2]-o[3*k+2])*(q[2]-o[3*k+2]));
+   }
+   printf("closest point %.2f Mqueries/s, mean distance %.3f\n",1e-6*n/(now()-t0),sum/n);
+
+   BuildBVH(bvh,NULL,0);
+   free(tri);
+   free(o);
+   free(tt);
+   free(hit);
+   return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ *  Triangle capture
+ *
+ *  CaptureTriangles() runs a drawing function in feedback mode, so the
+ *  triangles it draws come back to the CPU instead of being rasterized.
+ *  Any geometry the program can draw (cube lists, meshes, quadrics) can
+ *  then be used for ray casting without a second copy of the code that
+ *  builds it.
+ *
+ *  Feedback returns window coordinates, so the capture uses an identity
+ *  projection and a modelview that scales the region of interest into
+ *  the view volume, then maps the window coordinates back to the world.
+ *  Geometry outside the region is clipped away.
+ */
+#include "CSCIx229.h"
+
+#define CAPTURE_VIEWPORT 4096  //  Viewport size (sets the precision)
+
+/*
+ *  Triangles drawn by a function
+ *    Calls draw with the modelview set to world coordinates and returns
+ *    the triangles inside the cube -size..size in tri (9 floats each, in
+ *    world coordinates, to be freed by the caller)
+ *    Quads and polygons are split into triangles, points and lines are
+ *    dropped
+ *    Returns the number of triangles
+ */
+int CaptureTriangles(void (*draw)(void),double size,float** tri)
+{
+   int k,n,Ntri=0,Mtri=0;
+   int max = 1<<20;
+   float* buf = NULL;
+   const double s = 0.5*CAPTURE_VIEWPORT;
+
+   //  Draw in feedback mode until the buffer is large enough
+   //  (colors, materials and textures it sets are put back afterwards)
+   glPushAttrib(GL_ENABLE_BIT|GL_VIEWPORT_BIT|GL_TRANSFORM_BIT|GL_CURRENT_BIT|GL_LIGHTING_BIT|GL_TEXTURE_BIT);
+   glDisable(GL_CULL_FACE);
+   glViewport(0,0,CAPTURE_VIEWPORT,CAPTURE_VIEWPORT);
+   glDepthRange(0,1);
+   glMatrixMode(GL_PROJECTION);
+   glPushMatrix();
+   glLoadIdentity();
+   glMatrixMode(GL_MODELVIEW);
+   glPushMatrix();
+   glLoadIdentity();
+   glScaled(1/size,1/size,1/size);
+   do
+   {
+      max *= 2;
+      buf = (float*)realloc(buf,max*sizeof(float));
+      if (!buf) Fatal("Cannot allocate feedback buffer\n");
+      glFeedbackBuffer(max,GL_3D,buf);
+      glRenderMode(GL_FEEDBACK);
+      draw();
+      n = glRenderMode(GL_RENDER);
+   } while (n<0);
+   glMatrixMode(GL_PROJECTION);
+   glPopMatrix();
+   glMatrixMode(GL_MODELVIEW);
+   glPopMatrix();
+   glPopAttrib();
+   ErrCheck("CaptureTriangles");
+
+   //  Split polygons into fans and skip everything else
+   *tri = NULL;
+   for (k=0;k<n;)
+   {
+      int token = (int)buf[k++];
+      if (token==GL_POLYGON_TOKEN)
+      {
+         int j,m = (int)buf[k++];
+         const float* v = buf+k;
+         for (j=2;j<m;j++)
+         {
+            int c,i;
+            const float* corner[3] = {v,v+3*(j-1),v+3*j};
+            float* t;
+            if (Ntri==Mtri)
+            {
+               Mtri = Mtri ? 2*Mtri : 1024;
+               *tri = (float*)realloc(*tri,9*Mtri*sizeof(float));
+               if (!*tri) Fatal("Cannot allocate memory for triangles\n");
+            }
+            t = *tri+9*Ntri++;
+            //  Window to world coordinates
+            for (c=0;c<3;c++)
+               for (i=0;i<3;i++)
+                  t[3*c+i] = size*(i<2 ? corner[c][i]/s-1 : 2*corner[c][i]-1);
+         }
+         k += 3*m;
+      }
+      else if (token==GL_LINE_TOKEN || token==GL_LINE_RESET_TOKEN)
+         k += 6;
+      else if (token==GL_POINT_TOKEN || token==GL_BITMAP_TOKEN || token==GL_DRAW_PIXEL_TOKEN || token==GL_COPY_PIXEL_TOKEN)
+         k += 3;
+      else if (token==GL_PASS_THROUGH_TOKEN)
+         k += 1;
+      else
+         Fatal("Unknown feedback token %d\n",token);
+   }
+   free(buf);
+   return Ntri;
+}
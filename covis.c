@@ -0,0 +1,360 @@
+/*
+ *  Covisibility graph
+ *
+ *  UpdateCovis() indexes keyframes as they are added to the map.  Each
+ *  landmark keeps a list of the keyframes that observe it, and each new
+ *  keyframe walks those lists once to find every earlier keyframe it
+ *  shares landmarks with.  The result is an edge per keyframe pair that
+ *  records the shared landmarks, so correspondences between any two
+ *  keyframes or the most covisible neighbors of a keyframe come back
+ *  without searching observations again.
+ */
+#include "CSCIx229.h"
+#include "slam.h"
+
+//
+//  Grow keyframe arrays to hold n keyframes
+//
+static void growcam(covis_t* c,int n)
+{
+   int k,m;
+   if (n<=c->Mcam) return;
+   m = ArrayCapacity(c->Mcam,n);
+   c->back  = (int*)ResizeArray(c->back,m+1,sizeof(int));
+   c->fwd   = (int*)ResizeArray(c->fwd,m,sizeof(int));
+   c->count = (int*)ResizeArray(c->count,m,sizeof(int));
+   for (k=c->Mcam;k<m;k++)
+      c->count[k] = 0;
+   c->Mcam = m;
+}
+
+//
+//  Grow landmark arrays to hold n landmarks
+//
+static void growlm(covis_t* c,int n)
+{
+   int k,m;
+   if (n<=c->Mlm) return;
+   m = ArrayCapacity(c->Mlm,n);
+   c->head = (int*)ResizeArray(c->head,m,sizeof(int));
+   c->seen = (int*)ResizeArray(c->seen,m,sizeof(int));
+   for (k=c->Mlm;k<m;k++)
+   {
+      c->head[k] = -1;
+      c->seen[k] = 0;
+   }
+   c->Mlm = m;
+}
+
+//
+//  Grow index node arrays to hold n nodes
+//
+static void grownode(covis_t* c,int n)
+{
+   if (n<=c->Mnode) return;
+   c->Mnode = ArrayCapacity(c->Mnode,n);
+   c->cam  = (int*)ResizeArray(c->cam,c->Mnode,sizeof(int));
+   c->next = (int*)ResizeArray(c->next,c->Mnode,sizeof(int));
+}
+
+//
+//  Grow edge array to hold n edges
+//
+static void growedge(covis_t* c,int n)
+{
+   if (n<=c->Medge) return;
+   c->Medge = ArrayCapacity(c->Medge,n);
+   c->edge = (covedge_t*)ResizeArray(c->edge,c->Medge,sizeof(covedge_t));
+}
+
+//
+//  Grow shared landmark array to hold n landmarks
+//
+static void growshared(covis_t* c,int n)
+{
+   if (n<=c->Mshared) return;
+   c->Mshared = ArrayCapacity(c->Mshared,n);
+   c->shared = (int*)ResizeArray(c->shared,c->Mshared,sizeof(int));
+}
+
+//
+//  Sort edges by first keyframe
+//
+static int cmpedge(const void* p,const void* q)
+{
+   return ((const covedge_t*)p)->a - ((const covedge_t*)q)->a;
+}
+
+//
+//  Index keyframe k
+//    Its edges to earlier keyframes are appended in order of keyframe so
+//    Correspondences can binary search them
+//
+static void addkeyframe(covis_t* c,const slammap_t* map,int k)
+{
+   int o,e,n,e0=c->Nedge;
+
+   //  Count shared landmarks with each earlier keyframe
+   for (o=map->first[k];o<map->first[k+1];o++)
+   {
+      int l = map->lm[o];
+      if (c->seen[l]==k+1) continue;
+      c->seen[l] = k+1;
+      for (n=c->head[l];n>=0;n=c->next[n])
+      {
+         int a = c->cam[n];
+         if (!c->count[a])
+         {
+            growedge(c,c->Nedge+1);
+            c->edge[c->Nedge].a = a;
+            c->edge[c->Nedge].b = k;
+            c->edge[c->Nedge].w = 0;
+            c->count[a] = ++c->Nedge;
+         }
+         c->edge[c->count[a]-1].w++;
+      }
+   }
+
+   //  Order edges and reserve room for shared landmarks
+   qsort(c->edge+e0,c->Nedge-e0,sizeof(covedge_t),cmpedge);
+   for (e=e0;e<c->Nedge;e++)
+   {
+      covedge_t* E = c->edge+e;
+      E->first = c->Nshared;
+      c->Nshared += E->w;
+      E->w = 0;
+      c->count[E->a] = e+1;
+   }
+   growshared(c,c->Nshared);
+
+   //  Record shared landmarks and add k to each landmark's list
+   for (o=map->first[k];o<map->first[k+1];o++)
+   {
+      int l = map->lm[o];
+      if (c->seen[l]==-(k+1)) continue;
+      c->seen[l] = -(k+1);
+      for (n=c->head[l];n>=0;n=c->next[n])
+      {
+         covedge_t* E = c->edge+c->count[c->cam[n]]-1;
+         c->shared[E->first+E->w++] = l;
+      }
+      grownode(c,c->Nnode+1);
+      c->cam[c->Nnode]  = k;
+      c->next[c->Nnode] = c->head[l];
+      c->head[l] = c->Nnode++;
+   }
+
+   //  Link edges from the earlier keyframes
+   for (e=e0;e<c->Nedge;e++)
+   {
+      covedge_t* E = c->edge+e;
+      c->count[E->a] = 0;
+      E->next = c->fwd[E->a];
+      c->fwd[E->a] = e;
+   }
+   c->fwd[k] = -1;
+   c->back[k+1] = c->Nedge;
+   c->Ncam = k+1;
+}
+
+/*
+ *  Initialize an empty covisibility graph
+ */
+void InitCovis(covis_t* covis)
+{
+   memset(covis,0,sizeof(covis_t));
+   growcam(covis,1);
+   covis->back[0] = 0;
+}
+
+/*
+ *  Release covisibility graph memory
+ */
+void FreeCovis(covis_t* covis)
+{
+   free(covis->back);
+   free(covis->fwd);
+   free(covis->count);
+   free(covis->head);
+   free(covis->seen);
+   free(covis->cam);
+   free(covis->next);
+   free(covis->edge);
+   free(covis->shared);
+   memset(covis,0,sizeof(covis_t));
+}
+
+/*
+ *  Make dst a copy of covisibility graph src of map
+ *    dst must be initialized and keeps its arrays when they are big enough.
+ *    When dst was last copied from src and the graph has not been rebuilt
+ *    since, only the keyframes src has indexed since are copied, along with
+ *    the lists of the landmarks and earlier keyframes they joined.
+ */
+void CopyCovis(covis_t* dst,const covis_t* src,const slammap_t* map)
+{
+   int k,o,e;
+   int cam=0,node=0,edge=0,shared=0;
+   if (dst->builds==src->builds && dst->Ncam<=src->Ncam && map->edited>=src->Ncam)
+   {
+      cam = dst->Ncam;
+      node = dst->Nnode;
+      edge = dst->Nedge;
+      shared = dst->Nshared;
+   }
+   growlm(dst,src->Mlm);
+   growcam(dst,src->Ncam);
+   grownode(dst,src->Nnode);
+   growedge(dst,src->Nedge);
+   growshared(dst,src->Nshared);
+   if (cam==0)
+   {
+      memcpy(dst->head,src->head,src->Mlm*sizeof(int));
+      memcpy(dst->seen,src->seen,src->Mlm*sizeof(int));
+      //  Landmarks the source has no room for are seen by no keyframe
+      for (k=src->Mlm;k<dst->Mlm;k++)
+      {
+         dst->head[k] = -1;
+         dst->seen[k] = 0;
+      }
+   }
+   else
+   {
+      //  Lists of the landmarks seen by the new keyframes and of the keyframes they link to
+      for (o=map->first[cam];o<map->first[src->Ncam];o++)
+      {
+         int l = map->lm[o];
+         dst->head[l] = src->head[l];
+         dst->seen[l] = src->seen[l];
+      }
+      for (e=edge;e<src->Nedge;e++)
+         dst->fwd[src->edge[e].a] = src->fwd[src->edge[e].a];
+   }
+   memcpy(dst->back+cam,src->back+cam,(src->Ncam+1-cam)*sizeof(int));
+   memcpy(dst->fwd+cam,src->fwd+cam,(src->Ncam-cam)*sizeof(int));
+   memcpy(dst->cam+node,src->cam+node,(src->Nnode-node)*sizeof(int));
+   memcpy(dst->next+node,src->next+node,(src->Nnode-node)*sizeof(int));
+   memcpy(dst->edge+edge,src->edge+edge,(src->Nedge-edge)*sizeof(covedge_t));
+   memcpy(dst->shared+shared,src->shared+shared,(src->Nshared-shared)*sizeof(int));
+   dst->Ncam = src->Ncam;
+   dst->Nnode = src->Nnode;
+   dst->Nedge = src->Nedge;
+   dst->Nshared = src->Nshared;
+   dst->builds = src->builds;
+}
+
+/*
+ *  Index keyframes added to the map since the last update
+ *    Call once the observations of new keyframes are complete.  If the
+ *    observations of an indexed keyframe changed the graph is rebuilt.
+ */
+void UpdateCovis(covis_t* covis,slammap_t* map)
+{
+   int k;
+   //  Start over when indexed keyframes changed
+   if (map->edited<covis->Ncam)
+   {
+      for (k=0;k<covis->Mlm;k++)
+      {
+         covis->head[k] = -1;
+         covis->seen[k] = 0;
+      }
+      covis->Ncam = covis->Nnode = covis->Nedge = covis->Nshared = 0;
+      covis->builds++;
+   }
+   growlm(covis,map->Nlm);
+   growcam(covis,map->Ncam);
+   for (k=covis->Ncam;k<map->Ncam;k++)
+      addkeyframe(covis,map,k);
+   map->edited = map->Ncam;
+}
+
+/*
+ *  Landmarks seen by both keyframes a and b
+ *    Returns the shared landmarks in the order the later keyframe observes
+ *    them and sets n to how many there are
+ */
+const int* Correspondences(const covis_t* covis,int a,int b,int* n)
+{
+   int lo,hi;
+   *n = 0;
+   if (a>b)
+   {
+      int t = a;
+      a = b;
+      b = t;
+   }
+   if (a<0 || b>=covis->Ncam || a==b) return NULL;
+   //  Binary search the edges of b
+   lo = covis->back[b];
+   hi = covis->back[b+1]-1;
+   while (lo<=hi)
+   {
+      int mid = (lo+hi)/2;
+      const covedge_t* E = covis->edge+mid;
+      if (E->a==a)
+      {
+         *n = E->w;
+         return covis->shared+E->first;
+      }
+      else if (E->a<a)
+         lo = mid+1;
+      else
+         hi = mid-1;
+   }
+   return NULL;
+}
+
+//
+//  Insert neighbor into top k list sorted by decreasing weight
+//
+static void insert(int* best,int* weight,int* n,int k,int cam,int w)
+{
+   int i;
+   if (*n==k && w<=weight[k-1]) return;
+   i = (*n<k) ? (*n)++ : k-1;
+   for (;i>0 && weight[i-1]<w;i--)
+   {
+      best[i]   = best[i-1];
+      weight[i] = weight[i-1];
+   }
+   best[i]   = cam;
+   weight[i] = w;
+}
+
+/*
+ *  Find the k keyframes sharing the most landmarks with cam
+ *    Fills best and weight (if not NULL) in decreasing order of weight
+ *    Returns the number found
+ */
+int TopCovisible(const covis_t* covis,int cam,int k,int* best,int* weight)
+{
+   int e,n=0;
+   int* w = weight;
+   if (cam<0 || cam>=covis->Ncam || k<1) return 0;
+   if (!w)
+   {
+      w = (int*)malloc(k*sizeof(int));
+      if (!w) Fatal("Cannot allocate memory for covisible keyframes\n");
+   }
+   //  Earlier and later keyframes
+   for (e=covis->back[cam];e<covis->back[cam+1];e++)
+      insert(best,w,&n,k,covis->edge[e].a,covis->edge[e].w);
+   for (e=covis->fwd[cam];e>=0;e=covis->edge[e].next)
+      insert(best,w,&n,k,covis->edge[e].b,covis->edge[e].w);
+   if (!weight) free(w);
+   return n;
+}
+
+/*
+ *  Keyframes that observe landmark lm (newest first)
+ *    Fills up to max entries of cam and returns the total number
+ */
+int LandmarkCameras(const covis_t* covis,int lm,int* cam,int max)
+{
+   int n,k=0;
+   if (lm<0 || lm>=covis->Mlm) return 0;
+   for (n=covis->head[lm];n>=0;n=covis->next[n],k++)
+      if (k<max) cam[k] = covis->cam[n];
+   return k;
+}
@@ -0,0 +1,177 @@
+/*
+ *  Batched cubes
+ *
+ *  A cube list holds any number of boxes, each given exactly like the
+ *  arguments of cube(): position (x,y,z), half size (dx,dy,dz) and
+ *  rotation th about the y axis.  DrawCubes() expands the list into one
+ *  vertex and index buffer the first time it is drawn after a change and
+ *  then draws every box with a single glDrawElements, so static
+ *  furniture costs one draw call per material however many boxes it has.
+ */
+#include "CSCIx229.h"
+
+#define CUBE_INST 7  //  Floats per box: x,y,z,dx,dy,dz,th
+
+//  Cube list
+typedef struct
+{
+   int n,max;             //  Number of boxes and capacity
+   float* box;            //  Boxes (CUBE_INST floats each)
+   unsigned int vbo,ibo;  //  Vertex and index buffers
+   int built;             //  Number of boxes in the buffers (-1 if stale)
+} cubes_t;
+
+static int Ncubes=0;         //  Number of cube lists
+static cubes_t* cubes=NULL;  //  Cube lists
+
+//  Unit cube faces: normal then four corners with texture coordinates 00,10,11,01
+static const float face[6][5][3] =
+{
+   {{ 0, 0, 1}, {-1,-1, 1},{+1,-1, 1},{+1,+1, 1},{-1,+1, 1}},  //  Front
+   {{ 0, 0,-1}, {+1,-1,-1},{-1,-1,-1},{-1,+1,-1},{+1,+1,-1}},  //  Back
+   {{+1, 0, 0}, {+1,-1,+1},{+1,-1,-1},{+1,+1,-1},{+1,+1,+1}},  //  Right
+   {{-1, 0, 0}, {-1,-1,-1},{-1,-1,+1},{-1,+1,+1},{-1,+1,-1}},  //  Left
+   {{ 0,+1, 0}, {-1,+1,+1},{+1,+1,+1},{+1,+1,-1},{-1,+1,-1}},  //  Top
+   {{ 0,-1, 0}, {-1,-1,-1},{+1,-1,-1},{+1,-1,+1},{-1,-1,+1}},  //  Bottom
+};
+static const float st[4][2] = {{0,0},{1,0},{1,1},{0,1}};
+
+//
+//  Look up cube list
+//
+static cubes_t* list(int k)
+{
+   if (k<0 || k>=Ncubes) Fatal("Invalid cube list %d\n",k);
+   return cubes+k;
+}
+
+/*
+ *  Create an empty cube list
+ *    Returns the handle for AddCube and DrawCubes
+ */
+int NewCubes(void)
+{
+   cubes = (cubes_t*)realloc(cubes,(Ncubes+1)*sizeof(cubes_t));
+   if (!cubes) Fatal("Cannot allocate memory for cube list\n");
+   memset(cubes+Ncubes,0,sizeof(cubes_t));
+   cubes[Ncubes].built = -1;
+   return Ncubes++;
+}
+
+/*
+ *  Add a box to a cube list
+ *     at (x,y,z)
+ *     dimentions (dx,dy,dz)
+ *     rotated th about the y axis
+ */
+void AddCube(int k,double x,double y,double z,double dx,double dy,double dz,double th)
+{
+   float* b;
+   cubes_t* c = list(k);
+   if (c->n==c->max)
+   {
+      c->max = c->max ? 2*c->max : 64;
+      c->box = (float*)realloc(c->box,CUBE_INST*sizeof(float)*c->max);
+      if (!c->box) Fatal("Cannot allocate memory for cubes\n");
+   }
+   b = c->box+CUBE_INST*c->n++;
+   b[0] = x;   b[1] = y;   b[2] = z;
+   b[3] = dx;  b[4] = dy;  b[5] = dz;
+   b[6] = th;
+   c->built = -1;
+}
+
+/*
+ *  Remove all boxes from a cube list
+ */
+void ClearCubes(int k)
+{
+   cubes_t* c = list(k);
+   c->n = 0;
+   c->built = -1;
+}
+
+//
+//  Expand boxes into vertex and index buffers
+//
+static void build(cubes_t* c)
+{
+   int k,f,i;
+   float* vert = (float*)malloc(8*24*sizeof(float)*(c->n>0?c->n:1));
+   unsigned int* idx = (unsigned int*)malloc(36*sizeof(unsigned int)*(c->n>0?c->n:1));
+   float* v = vert;
+   unsigned int* t = idx;
+   if (!vert || !idx) Fatal("Cannot allocate memory for cube buffers\n");
+
+   for (k=0;k<c->n;k++)
+   {
+      const float* b = c->box+CUBE_INST*k;
+      //  Same order as glTranslate, glRotate(th,0,1,0), glScale
+      float C = Cos(b[6]);
+      float S = Sin(b[6]);
+      for (f=0;f<6;f++)
+      {
+         const float* n = face[f][0];
+         unsigned int v0 = 24*k+4*f;
+         for (i=0;i<4;i++)
+         {
+            const float* p = face[f][i+1];
+            float x = b[3]*p[0];
+            float y = b[4]*p[1];
+            float z = b[5]*p[2];
+            v[0] = st[i][0];
+            v[1] = st[i][1];
+            v[2] =  C*n[0] + S*n[2];
+            v[3] =  n[1];
+            v[4] = -S*n[0] + C*n[2];
+            v[5] = b[0] + C*x + S*z;
+            v[6] = b[1] + y;
+            v[7] = b[2] - S*x + C*z;
+            v += 8;
+         }
+         t[0] = v0;  t[1] = v0+1;  t[2] = v0+2;
+         t[3] = v0;  t[4] = v0+2;  t[5] = v0+3;
+         t += 6;
+      }
+   }
+
+   //  Copy to buffers
+   if (!c->vbo) glGenBuffers(1,&c->vbo);
+   glBindBuffer(GL_ARRAY_BUFFER,c->vbo);
+   glBufferData(GL_ARRAY_BUFFER,8*24*sizeof(float)*c->n,vert,GL_STATIC_DRAW);
+   glBindBuffer(GL_ARRAY_BUFFER,0);
+   if (!c->ibo) glGenBuffers(1,&c->ibo);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,c->ibo);
+   glBufferData(GL_ELEMENT_ARRAY_BUFFER,36*sizeof(unsigned int)*c->n,idx,GL_STATIC_DRAW);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+   ErrCheck("cubes");
+   free(vert);
+   free(idx);
+   c->built = c->n;
+}
+
+/*
+ *  Draw all boxes in a cube list with the current color, material,
+ *  texture and transformation
+ */
+void DrawCubes(int k)
+{
+   const int stride = 8*sizeof(float);
+   cubes_t* c = list(k);
+   if (c->built<0) build(c);
+   if (!c->built) return;
+
+   glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+   glBindBuffer(GL_ARRAY_BUFFER,c->vbo);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,c->ibo);
+   glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+   glTexCoordPointer(2,GL_FLOAT,stride,(void*)0);
+   glEnableClientState(GL_NORMAL_ARRAY);
+   glNormalPointer(GL_FLOAT,stride,(void*)(2*sizeof(float)));
+   glEnableClientState(GL_VERTEX_ARRAY);
+   glVertexPointer(3,GL_FLOAT,stride,(void*)(5*sizeof(float)));
+   glDrawElements(GL_TRIANGLES,36*c->built,GL_UNSIGNED_INT,(void*)0);
+   glBindBuffer(GL_ARRAY_BUFFER,0);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+   glPopClientAttrib();
+}
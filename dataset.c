@@ -0,0 +1,315 @@
+/*
+ *  Dataset playback
+ *
+ *  Streams a recorded trajectory into the map a pose at a time.  The
+ *  trajectory is in the TUM format, one pose per line:
+ *
+ *    time x y z qx qy qz qw
+ *
+ *  with the camera looking along its local +z axis.  Only the position and
+ *  heading of the view direction about the world z axis are kept, since
+ *  map poses have four degrees of freedom.  An optional observation file
+ *  lists the landmarks seen at each pose, sorted by time:
+ *
+ *    time landmark u v
+ *
+ *  where landmark indexes the map (see ReadLandmarks) and u,v are image
+ *  coordinates as in slam.h.  Blank lines and lines starting with # are
+ *  ignored and fields may be separated by blanks or commas.
+ *
+ *  A pose becomes a keyframe when it has moved mindist or turned minturn
+ *  from the last keyframe, so dense trajectories produce sparse maps.
+ *  Files are read through fixed DATASET_BUFFER buffers with one pose and
+ *  one observation read ahead, so the reader's memory does not depend on
+ *  the length of the recording.
+ */
+#include "CSCIx229.h"
+#include "slam.h"
+
+#define DATASET_BUFFER 65536  //  Read buffer for each file (longest line)
+
+//
+//  Open text file
+//
+static void openfile(textfile_t* tf,const char* file)
+{
+   size_t n = strlen(file);
+   tf->f = fopen(file,"rb");
+   if (!tf->f) Fatal("Cannot open %s\n",file);
+   tf->name = (char*)malloc(n+1);
+   tf->buf = (char*)malloc(DATASET_BUFFER+1);
+   if (!tf->name || !tf->buf) Fatal("Cannot allocate buffer for %s\n",file);
+   memcpy(tf->name,file,n+1);
+   tf->n = tf->pos = 0;
+   tf->line = 0;
+}
+
+//
+//  Close text file
+//
+static void closefile(textfile_t* tf)
+{
+   if (tf->f) fclose(tf->f);
+   free(tf->name);
+   free(tf->buf);
+   memset(tf,0,sizeof(textfile_t));
+}
+
+//
+//  Next line
+//    Returns the line terminated by a NUL in the buffer or NULL at the end
+//    The line stays valid until the next call
+//
+static char* readline(textfile_t* tf)
+{
+   for (;;)
+   {
+      char* p = tf->buf+tf->pos;
+      char* q = (char*)memchr(p,'\n',tf->n-tf->pos);
+      int m;
+      if (q)
+      {
+         *q = 0;
+         tf->pos = q-tf->buf+1;
+         tf->line++;
+         return p;
+      }
+      //  Move the partial line to the front and fill the rest
+      m = tf->n-tf->pos;
+      memmove(tf->buf,p,m);
+      tf->pos = 0;
+      tf->n = m;
+      if (m==DATASET_BUFFER) Fatal("Line %ld of %s is too long\n",tf->line+1,tf->name);
+      m = fread(tf->buf+tf->n,1,DATASET_BUFFER-tf->n,tf->f);
+      if (m==0)
+      {
+         //  Last line without a newline
+         if (tf->n==0 || ferror(tf->f)) return NULL;
+         tf->buf[tf->n] = 0;
+         tf->pos = tf->n;
+         tf->line++;
+         return tf->buf;
+      }
+      tf->n += m;
+   }
+}
+
+//
+//  Read up to n numbers from a line
+//    Returns the number read (0 for blank and comment lines)
+//
+static int readnumbers(char* p,double x[],int n)
+{
+   int k;
+   while (*p==' ' || *p=='\t' || *p=='\r') p++;
+   if (*p=='#') return 0;
+   for (k=0;k<n;k++)
+   {
+      char* end;
+      while (*p==' ' || *p=='\t' || *p==',') p++;
+      if (!*p || *p=='\r') break;
+      x[k] = strtod(p,&end);
+      if (end==p) return -1;
+      p = end;
+   }
+   return k;
+}
+
+//
+//  Read the next record with n numbers
+//    Returns 1 if found and 0 at the end of the file
+//
+static int record(textfile_t* tf,double x[],int n)
+{
+   char* line;
+   while ((line=readline(tf)))
+   {
+      int k = readnumbers(line,x,n);
+      if (k==n) return 1;
+      if (k!=0) Fatal("Expected %d numbers at line %ld of %s\n",n,tf->line,tf->name);
+   }
+   return 0;
+}
+
+//
+//  Read ahead the next pose
+//    Heading is the direction of the camera z axis about world z
+//
+static void nextpose(dataset_t* ds)
+{
+   double r[8];
+   ds->ahead = record(&ds->traj,r,8);
+   if (ds->ahead)
+   {
+      double qx=r[4],qy=r[5],qz=r[6],qw=r[7];
+      double fx = 2*(qx*qz+qw*qy);
+      double fy = 2*(qy*qz-qw*qx);
+      ds->t = r[0];
+      ds->pose.x = r[1];
+      ds->pose.y = r[2];
+      ds->pose.z = r[3];
+      //  Map cameras look along +y, which is 90 degrees from heading
+      ds->pose.d = atan2(fy,fx)*180/M_PI - 90;
+      ds->poses++;
+   }
+}
+
+//
+//  Read ahead the next observation
+//
+static void nextobs(dataset_t* ds)
+{
+   double r[4];
+   ds->obsahead = ds->obs.f && record(&ds->obs,r,4);
+   if (ds->obsahead)
+   {
+      ds->to = r[0];
+      ds->lm = (int)r[1];
+      ds->u = r[2];
+      ds->v = r[3];
+   }
+}
+
+/*
+ *  Add landmarks read from a file
+ *    One landmark per line as x y z, numbered in order after those in the map
+ *    Returns the number added
+ */
+int ReadLandmarks(slammap_t* map,const char* file)
+{
+   textfile_t tf;
+   double x[3];
+   int n=0;
+   openfile(&tf,file);
+   while (record(&tf,x,3))
+   {
+      AddLandmark(map,x[0],x[1],x[2]);
+      n++;
+   }
+   closefile(&tf);
+   return n;
+}
+
+/*
+ *  Open a trajectory and optional observations (NULL for none)
+ *    Thresholds default to a keyframe every 10cm or 10 degrees
+ */
+void OpenDataset(dataset_t* ds,const char* trajectory,const char* observations)
+{
+   memset(ds,0,sizeof(dataset_t));
+   ds->mindist = 0.1;
+   ds->minturn = 10;
+   ds->tol = 1e-3;
+   ds->key = -1;
+   openfile(&ds->traj,trajectory);
+   if (observations) openfile(&ds->obs,observations);
+   nextpose(ds);
+   nextobs(ds);
+   if (!ds->ahead) Fatal("No poses in %s\n",trajectory);
+   ds->t0 = ds->t;
+}
+
+/*
+ *  Close dataset
+ */
+void CloseDataset(dataset_t* ds)
+{
+   closefile(&ds->traj);
+   closefile(&ds->obs);
+   free(ds->lmindex);
+   ds->lmindex = NULL;
+   ds->ahead = ds->obsahead = 0;
+}
+
+/*
+ *  Follow keyframes and landmarks renumbered by CullMap or RemoveFromMap
+ *    cammap and lmmap give the new index of the old ones (-1 if removed)
+ *    and Nlm is the number of landmarks before.  Later observations of a
+ *    removed landmark are skipped.
+ */
+void RenumberDataset(dataset_t* ds,const int* cammap,const int* lmmap,int Nlm)
+{
+   int l;
+   if (ds->key>=0) ds->key = cammap[ds->key];
+   if (!ds->lmindex)
+   {
+      ds->lmindex = (int*)malloc((Nlm+1)*sizeof(int));
+      if (!ds->lmindex) Fatal("Cannot allocate memory for landmark numbers\n");
+      ds->Nindex = Nlm;
+      for (l=0;l<Nlm;l++)
+         ds->lmindex[l] = l;
+   }
+   for (l=0;l<ds->Nindex;l++)
+      if (ds->lmindex[l]>=0)
+         ds->lmindex[l] = lmmap[ds->lmindex[l]];
+}
+
+/*
+ *  Add the poses up to time until as keyframes with their observations
+ *    At most max keyframes are added (no limit if max<=0)
+ *    Returns the number of keyframes added
+ *    ds->ahead is zero when the whole trajectory has been read
+ */
+int StreamDataset(dataset_t* ds,slammap_t* map,double until,int max)
+{
+   int added=0;
+   while (ds->ahead && ds->t<=until && (max<=0 || added<max))
+   {
+      pose_t p = ds->pose;
+      double t = ds->t;
+      int key = (ds->key<0);
+      //  Keyframe when far enough from the last one
+      if (!key)
+      {
+         double dx = p.x-ds->last.x;
+         double dy = p.y-ds->last.y;
+         double dz = p.z-ds->last.z;
+         double dd = fmod(fabs(p.d-ds->last.d),360);
+         if (dd>180) dd = 360-dd;
+         key = (dx*dx+dy*dy+dz*dz>=ds->mindist*ds->mindist || dd>=ds->minturn);
+      }
+      if (key)
+      {
+         int k = AddKeyframe(map,p);
+         //  Odometry is the step from the last keyframe in its frame
+         if (ds->key>=0 && ds->key==k-1)
+         {
+            double c = Cos(ds->last.d);
+            double s = Sin(ds->last.d);
+            double dx = p.x-ds->last.x;
+            double dy = p.y-ds->last.y;
+            map->odom[k].x =  c*dx + s*dy;
+            map->odom[k].y = -s*dx + c*dy;
+            map->odom[k].z = p.z-ds->last.z;
+            map->odom[k].d = p.d-ds->last.d;
+         }
+         ds->key = k;
+         ds->last = p;
+         ds->keyframes++;
+         added++;
+      }
+      //  Observations up to this pose (earlier ones have no pose)
+      while (ds->obsahead && ds->to<=t+ds->tol)
+      {
+         //  Landmark in the map (none once culled)
+         int l = ds->lm,culled = 0;
+         if (ds->lmindex)
+         {
+            l = (l>=0 && l<ds->Nindex) ? ds->lmindex[l] : map->Nlm;
+            culled = (l<0);
+         }
+         if (key && ds->to>=t-ds->tol && !culled)
+         {
+            if (l<0 || l>=map->Nlm)
+               Fatal("Invalid landmark %d at line %ld of %s\n",ds->lm,ds->obs.line,ds->obs.name);
+            AddObservation(map,l,ds->u,ds->v);
+            ds->observations++;
+         }
+         else
+            ds->skipped++;
+         nextobs(ds);
+      }
+      nextpose(ds);
+   }
+   return added;
+}
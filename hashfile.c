@@ -0,0 +1,56 @@
+/*
+ *  File stamps and content hashes for cache validation
+ */
+#include "CSCIx229.h"
+#include <sys/stat.h>
+
+/*
+ *  Hash bytes a word at a time
+ */
+unsigned long long HashBytes(const void* buf,size_t n)
+{
+   const unsigned char* p = (const unsigned char*)buf;
+   unsigned long long h = 0xCBF29CE484222325ULL ^ n;
+   size_t k;
+   for (k=0;k+8<=n;k+=8)
+   {
+      unsigned long long w;
+      memcpy(&w,p+k,8);
+      h = (h ^ w) * 0x100000001B3ULL;
+      h ^= h >> 29;
+   }
+   for (;k<n;k++)
+      h = (h ^ p[k]) * 0x100000001B3ULL;
+   return h;
+}
+
+/*
+ *  Hash contents of a file
+ *    Returns 0 if the file cannot be read
+ */
+unsigned long long HashFile(const char* file)
+{
+   size_t size;
+   unsigned long long hash;
+   void* buf = MapFile(file,&size);
+   if (!buf) return 0;
+   hash = HashBytes(buf,size);
+   UnmapFile(buf,size);
+   return hash;
+}
+
+/*
+ *  Get modification time and size of a file
+ *    Both are -1 if the file does not exist
+ */
+void FileStamp(const char* file,long long* mtime,long long* size)
+{
+   struct stat st;
+   if (stat(file,&st))
+      *mtime = *size = -1;
+   else
+   {
+      *mtime = st.st_mtime;
+      *size  = st.st_size;
+   }
+}
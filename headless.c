@@ -0,0 +1,86 @@
+/*
+ *  Headless rendering and draw call counting
+ *
+ *  Headless() makes an OpenGL context without a window or display using
+ *  EGL (Mesa's surfaceless platform, so llvmpipe works on machines with no
+ *  GPU or X server) and renders into an offscreen framebuffer.  It needs
+ *  to be built with USEEGL and linked with -lEGL.
+ *
+ *  CSCIx229.h wraps glBegin, glDrawArrays and glDrawElements so every draw
+ *  call bumps a counter, which DrawCalls() reads once per frame.
+ */
+#include "CSCIx229.h"
+#ifdef USEEGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+int Ndraw=0;             //  Draw calls since the last DrawCalls()
+static int offscreen=0;  //  Rendering with Headless()
+
+/*
+ *  Number of draw calls since the last call
+ *    Call once per frame to get draw calls per frame
+ */
+int DrawCalls(void)
+{
+   int n = Ndraw;
+   Ndraw = 0;
+   return n;
+}
+
+/*
+ *  Rendering offscreen (GLUT is not initialized)
+ */
+int Offscreen(void)
+{
+   return offscreen;
+}
+
+/*
+ *  Create an offscreen context with a width x height framebuffer
+ *    The framebuffer stays bound, so rendering goes there instead of a window
+ */
+void Headless(int width,int height)
+{
+#ifdef USEEGL
+   const EGLint attr[] = {EGL_SURFACE_TYPE,EGL_PBUFFER_BIT,EGL_RENDERABLE_TYPE,EGL_OPENGL_BIT,EGL_NONE};
+   EGLint major,minor,n;
+   EGLConfig config;
+   EGLContext context;
+   EGLDisplay display = EGL_NO_DISPLAY;
+   unsigned int fbo,rbo[2];
+   //  Prefer the surfaceless platform, which needs no display server
+   PFNEGLGETPLATFORMDISPLAYEXTPROC platform = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+   if (platform) display = platform(EGL_PLATFORM_SURFACELESS_MESA,EGL_DEFAULT_DISPLAY,NULL);
+#endif
+   if (display==EGL_NO_DISPLAY) display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+   if (display==EGL_NO_DISPLAY || !eglInitialize(display,&major,&minor)) Fatal("Cannot initialize EGL\n");
+   if (!eglBindAPI(EGL_OPENGL_API)) Fatal("EGL does not support OpenGL\n");
+   if (!eglChooseConfig(display,attr,&config,1,&n) || n<1) Fatal("No EGL configuration for OpenGL\n");
+   context = eglCreateContext(display,config,EGL_NO_CONTEXT,NULL);
+   if (context==EGL_NO_CONTEXT) Fatal("Cannot create EGL context\n");
+   if (!eglMakeCurrent(display,EGL_NO_SURFACE,EGL_NO_SURFACE,context)) Fatal("Cannot make EGL context current\n");
+
+   //  Color and depth buffers
+   glGenFramebuffers(1,&fbo);
+   glBindFramebuffer(GL_FRAMEBUFFER,fbo);
+   glGenRenderbuffers(2,rbo);
+   glBindRenderbuffer(GL_RENDERBUFFER,rbo[0]);
+   glRenderbufferStorage(GL_RENDERBUFFER,GL_RGBA8,width,height);
+   glFramebufferRenderbuffer(GL_FRAMEBUFFER,GL_COLOR_ATTACHMENT0,GL_RENDERBUFFER,rbo[0]);
+   glBindRenderbuffer(GL_RENDERBUFFER,rbo[1]);
+   glRenderbufferStorage(GL_RENDERBUFFER,GL_DEPTH_COMPONENT24,width,height);
+   glFramebufferRenderbuffer(GL_FRAMEBUFFER,GL_DEPTH_ATTACHMENT,GL_RENDERBUFFER,rbo[1]);
+   glBindRenderbuffer(GL_RENDERBUFFER,0);
+   if (glCheckFramebufferStatus(GL_FRAMEBUFFER)!=GL_FRAMEBUFFER_COMPLETE) Fatal("Cannot create %dx%d offscreen framebuffer\n",width,height);
+   glDrawBuffer(GL_COLOR_ATTACHMENT0);
+   glReadBuffer(GL_COLOR_ATTACHMENT0);
+   glViewport(0,0,width,height);
+   ErrCheck("Headless");
+   offscreen = 1;
+#else
+   Fatal("Headless rendering needs EGL (build with -DUSEEGL and link with -lEGL)\n");
+#endif
+}
@@ -0,0 +1,156 @@
+/*
+ *  Dataset playback benchmark
+ *
+ *  Writes a synthetic TUM trajectory of a camera wandering around a room
+ *  at a fixed sensor rate, with landmark observations for some of the
+ *  poses, then streams it into a map and reports how many times faster
+ *  than real time it plays back.  The files are removed afterwards.
+ *
+ *  With a memory budget the map is culled with CullMap() every CHUNK
+ *  keyframes as it streams, and what was culled is reported.
+ *
+ *  Usage:
+ *    ingestbench [poses] [rate] [mindist] [budget MB]
+ */
+#include "CSCIx229.h"
+#include "slam.h"
+#include <time.h>
+
+#define LANDMARKS 10000  //  Landmarks in the room
+#define SEEN      10     //  Landmarks observed at a pose with observations
+#define EVERY     10     //  Poses between poses with observations
+#define CHUNK     1000   //  Keyframes streamed between culls
+
+//
+//  Wall clock time in seconds
+//
+static double now()
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC,&t);
+   return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+//
+//  Size of a file in bytes
+//
+static double filesize(const char* file)
+{
+   long long mtime,size;
+   FileStamp(file,&mtime,&size);
+   return size;
+}
+
+int main(int argc,char* argv[])
+{
+   const char* trajfile = "ingest_traj.txt";
+   const char* obsfile  = "ingest_obs.txt";
+   const char* lmfile   = "ingest_lm.txt";
+   long N=2000000,k;
+   double rate=200,mindist=0.1;
+   double t0,t,bytes,mb;
+   int i,n;
+   FILE* f;
+   FILE* g;
+   slammap_t map;
+   dataset_t ds;
+   cullopt_t opt;
+   cullreport_t rep;
+
+   if (argc>5)
+   {
+      fprintf(stderr,"Usage: ingestbench [poses] [rate] [mindist] [budget MB]\n");
+      return 1;
+   }
+   CullOptions(&opt);
+   memset(&rep,0,sizeof(rep));
+   if (argc>1) N = atol(argv[1]);
+   if (argc>2) rate = atof(argv[2]);
+   if (argc>3) mindist = atof(argv[3]);
+   if (argc>4) opt.maxbytes = 1048576*atof(argv[4]);
+   if (N<1 || rate<=0) Fatal("Need at least one pose and a positive rate\n");
+   srand(1);
+
+   //  Landmarks on the walls of a 10x10m room
+   f = fopen(lmfile,"w");
+   if (!f) Fatal("Cannot write %s\n",lmfile);
+   for (i=0;i<LANDMARKS;i++)
+   {
+      double s = 20.0*rand()/RAND_MAX-10;
+      double z = 3.0*rand()/RAND_MAX;
+      if (i%4==0) fprintf(f,"%.4f %.4f %.4f\n",s,10.0,z);
+      else if (i%4==1) fprintf(f,"%.4f %.4f %.4f\n",s,-10.0,z);
+      else if (i%4==2) fprintf(f,"%.4f %.4f %.4f\n",10.0,s,z);
+      else fprintf(f,"%.4f %.4f %.4f\n",-10.0,s,z);
+   }
+   fclose(f);
+
+   //  Camera walking slowly around the room and turning its head
+   t0 = now();
+   f = fopen(trajfile,"w");
+   g = fopen(obsfile,"w");
+   if (!f || !g) Fatal("Cannot write %s and %s\n",trajfile,obsfile);
+   fprintf(f,"# timestamp tx ty tz qx qy qz qw\n");
+   for (k=0;k<N;k++)
+   {
+      double ts = 1400000000.0 + k/rate;
+      double a = 0.02*k/rate;
+      double yaw = 0.3*k/rate;
+      //  Camera z axis horizontal at yaw, so rotate -90 about x then yaw about z
+      double cy = cos(yaw/2),sy = sin(yaw/2);
+      double cx = cos(-M_PI/4),sx = sin(-M_PI/4);
+      fprintf(f,"%.6f %.4f %.4f %.4f %.6f %.6f %.6f %.6f\n",ts,
+         8*cos(a),8*sin(a),1.5+0.1*sin(5*a),
+         cy*sx,sy*sx,sy*cx,cy*cx);
+      if (k%EVERY==0)
+         for (i=0;i<SEEN;i++)
+            fprintf(g,"%.6f %d %.4f %.4f\n",ts,rand()%LANDMARKS,
+               2.0*rand()/RAND_MAX-1,2.0*rand()/RAND_MAX-1);
+   }
+   fclose(f);
+   fclose(g);
+   bytes = filesize(trajfile)+filesize(obsfile);
+   mb = bytes/(1<<20);
+   printf("wrote %ld poses (%.1f s at %.0f Hz) and %.1f MB in %.2f s\n",N,N/rate,rate,mb,now()-t0);
+
+   //  Stream it
+   InitMap(&map);
+   ReadLandmarks(&map,lmfile);
+   t0 = now();
+   OpenDataset(&ds,trajfile,obsfile);
+   ds.mindist = mindist;
+   if (opt.maxbytes>0)
+   {
+      //  A chunk at a time, culling after each
+      int* cammap = NULL;
+      int* lmmap = (int*)malloc((map.Nlm+1)*sizeof(int));
+      if (!lmmap) Fatal("Cannot allocate memory for culling\n");
+      n = 0;
+      while (ds.ahead)
+      {
+         int Nlm = map.Nlm;
+         n += StreamDataset(&ds,&map,INFINITY,CHUNK);
+         cammap = (int*)realloc(cammap,(map.Ncam+1)*sizeof(int));
+         if (!cammap) Fatal("Cannot allocate memory for culling\n");
+         if (CullMap(&map,&opt,&rep,cammap,lmmap)) RenumberDataset(&ds,cammap,lmmap,Nlm);
+      }
+      free(cammap);
+      free(lmmap);
+   }
+   else
+      n = StreamDataset(&ds,&map,INFINITY,0);
+   t = now()-t0;
+   CloseDataset(&ds);
+   printf("%d keyframes %ld observations (%ld at other poses or culled landmarks)\n",n,ds.observations,ds.skipped);
+   printf("read %.2f s, %.2f Mposes/s, %.1f MB/s, %.0fx real time\n",t,1e-6*N/t,mb/t,N/rate/t);
+   if (rep.calls)
+      printf("culled %ld keyframes, %ld landmarks and %ld observations (%.1f MB, %.1f MB given back) in %ld calls\n",
+             rep.cams,rep.lms,rep.obs,rep.bytes/1048576,rep.freed/1048576,rep.calls);
+   printf("map %d keyframes %d landmarks %.1f MB, first keyframe heading %.1f\n",map.Ncam,map.Nlm,MapMemory(&map)/1048576.0,map.pose[0].d);
+
+   FreeMap(&map);
+   remove(trajfile);
+   remove(obsfile);
+   remove(lmfile);
+   return 0;
+}
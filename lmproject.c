@@ -0,0 +1,261 @@
+/*
+ *  Batched landmark projection
+ *
+ *  ProjectLandmarks() moves a batch of landmarks into the frame of one or
+ *  more keyframes and projects them to pixels, giving the depth along the
+ *  view direction and whether each landmark lands in the image.  The
+ *  camera model is the map's (see slam.h) scaled to pixels:
+ *
+ *    pixel u = cu + f*px/py    pixel v = cv + f*pz/py    depth = py
+ *
+ *  The work is done by the widest kernel the CPU has: AVX2 four landmarks
+ *  at a time (gathering indexed landmarks), SSE2 two at a time, or plain C.
+ *  Every kernel does the same double precision operations in the same
+ *  order, so they give identical results.
+ */
+#include "CSCIx229.h"
+#include "slam.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define LMPROJECT_SIMD
+#endif
+
+//  One keyframe and the camera model
+typedef struct
+{
+   double x,y,z;     //  Position
+   double c,s;       //  Cosine and sine of heading
+   double f,cu,cv;   //  Focal length and principal point
+   double w,h;       //  Image size
+   double zn,zf;     //  Depth range
+} view_t;
+
+//  Kernel projecting n landmarks into one view
+typedef int (*kernel_t)(const view_t* V,const double* X,const double* Y,const double* Z,const int* lm,int n,
+                        float* u,float* v,float* depth,unsigned char* in);
+
+static int selected=0;  //  Kernel in use (0 until chosen)
+
+//
+//  Plain C kernel
+//    Landmark i is lm[i], or i when lm is NULL
+//
+static int scalar(const view_t* V,const double* X,const double* Y,const double* Z,const int* lm,int n,
+                  float* u,float* v,float* depth,unsigned char* in)
+{
+   int i,m=0;
+   for (i=0;i<n;i++)
+   {
+      int k = lm ? lm[i] : i;
+      double dx = X[k]-V->x;
+      double dy = Y[k]-V->y;
+      double dz = Z[k]-V->z;
+      double px = V->c*dx + V->s*dy;
+      double py = V->c*dy - V->s*dx;
+      double r  = V->f/py;
+      double pu = V->cu + px*r;
+      double pv = V->cv + dz*r;
+      int vis = py>=V->zn && py<=V->zf && pu>=0 && pu<V->w && pv>=0 && pv<V->h;
+      u[i] = pu;
+      v[i] = pv;
+      depth[i] = py;
+      in[i] = vis;
+      m += vis;
+   }
+   return m;
+}
+
+//
+//  Landmarks left over by a SIMD kernel starting at i
+//
+static int tail(const view_t* V,const double* X,const double* Y,const double* Z,const int* lm,int i,int n,
+                float* u,float* v,float* depth,unsigned char* in)
+{
+   if (i>=n) return 0;
+   if (lm)
+      return scalar(V,X,Y,Z,lm+i,n-i,u+i,v+i,depth+i,in+i);
+   else
+      return scalar(V,X+i,Y+i,Z+i,NULL,n-i,u+i,v+i,depth+i,in+i);
+}
+
+#ifdef LMPROJECT_SIMD
+//
+//  SSE2 kernel (two landmarks at a time)
+//
+__attribute__((target("sse2")))
+static int sse2(const view_t* V,const double* X,const double* Y,const double* Z,const int* lm,int n,
+                float* u,float* v,float* depth,unsigned char* in)
+{
+   int i,m=0;
+   const __m128d x  = _mm_set1_pd(V->x),  y  = _mm_set1_pd(V->y),  z = _mm_set1_pd(V->z);
+   const __m128d c  = _mm_set1_pd(V->c),  s  = _mm_set1_pd(V->s),  f = _mm_set1_pd(V->f);
+   const __m128d cu = _mm_set1_pd(V->cu), cv = _mm_set1_pd(V->cv);
+   const __m128d w  = _mm_set1_pd(V->w),  h  = _mm_set1_pd(V->h),  zero = _mm_setzero_pd();
+   const __m128d zn = _mm_set1_pd(V->zn), zf = _mm_set1_pd(V->zf);
+   for (i=0;i+2<=n;i+=2)
+   {
+      __m128d dx,dy,dz,px,py,r,pu,pv,ok;
+      int bits;
+      if (lm)
+      {
+         dx = _mm_set_pd(X[lm[i+1]],X[lm[i]]);
+         dy = _mm_set_pd(Y[lm[i+1]],Y[lm[i]]);
+         dz = _mm_set_pd(Z[lm[i+1]],Z[lm[i]]);
+      }
+      else
+      {
+         dx = _mm_loadu_pd(X+i);
+         dy = _mm_loadu_pd(Y+i);
+         dz = _mm_loadu_pd(Z+i);
+      }
+      dx = _mm_sub_pd(dx,x);
+      dy = _mm_sub_pd(dy,y);
+      dz = _mm_sub_pd(dz,z);
+      px = _mm_add_pd(_mm_mul_pd(c,dx),_mm_mul_pd(s,dy));
+      py = _mm_sub_pd(_mm_mul_pd(c,dy),_mm_mul_pd(s,dx));
+      r  = _mm_div_pd(f,py);
+      pu = _mm_add_pd(cu,_mm_mul_pd(px,r));
+      pv = _mm_add_pd(cv,_mm_mul_pd(dz,r));
+      ok = _mm_and_pd(_mm_cmpge_pd(py,zn),_mm_cmple_pd(py,zf));
+      ok = _mm_and_pd(ok,_mm_and_pd(_mm_cmpge_pd(pu,zero),_mm_cmplt_pd(pu,w)));
+      ok = _mm_and_pd(ok,_mm_and_pd(_mm_cmpge_pd(pv,zero),_mm_cmplt_pd(pv,h)));
+      _mm_storel_pi((__m64*)(u+i),_mm_cvtpd_ps(pu));
+      _mm_storel_pi((__m64*)(v+i),_mm_cvtpd_ps(pv));
+      _mm_storel_pi((__m64*)(depth+i),_mm_cvtpd_ps(py));
+      bits = _mm_movemask_pd(ok);
+      in[i]   = bits&1;
+      in[i+1] = bits>>1;
+      m += (bits&1) + (bits>>1);
+   }
+   return m + tail(V,X,Y,Z,lm,i,n,u,v,depth,in);
+}
+
+//
+//  AVX2 kernel (four landmarks at a time)
+//
+__attribute__((target("avx2")))
+static int avx2(const view_t* V,const double* X,const double* Y,const double* Z,const int* lm,int n,
+                float* u,float* v,float* depth,unsigned char* in)
+{
+   int i,m=0;
+   const __m256d x  = _mm256_set1_pd(V->x),  y  = _mm256_set1_pd(V->y),  z = _mm256_set1_pd(V->z);
+   const __m256d c  = _mm256_set1_pd(V->c),  s  = _mm256_set1_pd(V->s),  f = _mm256_set1_pd(V->f);
+   const __m256d cu = _mm256_set1_pd(V->cu), cv = _mm256_set1_pd(V->cv);
+   const __m256d w  = _mm256_set1_pd(V->w),  h  = _mm256_set1_pd(V->h),  zero = _mm256_setzero_pd();
+   const __m256d zn = _mm256_set1_pd(V->zn), zf = _mm256_set1_pd(V->zf);
+   for (i=0;i+4<=n;i+=4)
+   {
+      __m256d dx,dy,dz,px,py,r,pu,pv,ok;
+      int bits;
+      if (lm)
+      {
+         __m128i k = _mm_loadu_si128((const __m128i*)(lm+i));
+         dx = _mm256_i32gather_pd(X,k,8);
+         dy = _mm256_i32gather_pd(Y,k,8);
+         dz = _mm256_i32gather_pd(Z,k,8);
+      }
+      else
+      {
+         dx = _mm256_loadu_pd(X+i);
+         dy = _mm256_loadu_pd(Y+i);
+         dz = _mm256_loadu_pd(Z+i);
+      }
+      dx = _mm256_sub_pd(dx,x);
+      dy = _mm256_sub_pd(dy,y);
+      dz = _mm256_sub_pd(dz,z);
+      px = _mm256_add_pd(_mm256_mul_pd(c,dx),_mm256_mul_pd(s,dy));
+      py = _mm256_sub_pd(_mm256_mul_pd(c,dy),_mm256_mul_pd(s,dx));
+      r  = _mm256_div_pd(f,py);
+      pu = _mm256_add_pd(cu,_mm256_mul_pd(px,r));
+      pv = _mm256_add_pd(cv,_mm256_mul_pd(dz,r));
+      ok = _mm256_and_pd(_mm256_cmp_pd(py,zn,_CMP_GE_OQ),_mm256_cmp_pd(py,zf,_CMP_LE_OQ));
+      ok = _mm256_and_pd(ok,_mm256_and_pd(_mm256_cmp_pd(pu,zero,_CMP_GE_OQ),_mm256_cmp_pd(pu,w,_CMP_LT_OQ)));
+      ok = _mm256_and_pd(ok,_mm256_and_pd(_mm256_cmp_pd(pv,zero,_CMP_GE_OQ),_mm256_cmp_pd(pv,h,_CMP_LT_OQ)));
+      _mm_storeu_ps(u+i,_mm256_cvtpd_ps(pu));
+      _mm_storeu_ps(v+i,_mm256_cvtpd_ps(pv));
+      _mm_storeu_ps(depth+i,_mm256_cvtpd_ps(py));
+      bits = _mm256_movemask_pd(ok);
+      in[i]   = bits&1;
+      in[i+1] = (bits>>1)&1;
+      in[i+2] = (bits>>2)&1;
+      in[i+3] = bits>>3;
+      m += __builtin_popcount(bits);
+   }
+   return m + tail(V,X,Y,Z,lm,i,n,u,v,depth,in);
+}
+#endif
+
+/*
+ *  Choose the projection kernel
+ *    0 for the best the CPU has, 1 for plain C, 2 for SSE2 and 3 for AVX2
+ *    (or -1 to keep the current one)
+ *    Returns the kernel in use, which is plain C if the one asked for is
+ *    not available
+ */
+int ProjectionKernel(int kernel)
+{
+   int best = 1;
+   if (kernel<0 && selected) return selected;
+#ifdef LMPROJECT_SIMD
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("sse2")) best = 2;
+   if (__builtin_cpu_supports("avx2")) best = 3;
+#endif
+   selected = (kernel<=0) ? best : (kernel>best) ? 1 : kernel;
+   return selected;
+}
+
+/*
+ *  Camera model for a width x height image with horizontal field of view fov
+ *    The principal point is the image center and every depth in front of
+ *    the camera counts as in view
+ */
+void CameraIntrinsics(intrinsics_t* K,int width,int height,double fov)
+{
+   K->w = width;
+   K->h = height;
+   K->f = 0.5*width/tan(fov*M_PI/360);
+   K->cu = 0.5*width;
+   K->cv = 0.5*height;
+   K->znear = 1e-6;
+   K->zfar = INFINITY;
+}
+
+/*
+ *  Project landmarks into keyframes
+ *    Projects landmarks lm[0..n-1] (0..n-1 when lm is NULL) into each of
+ *    the Npose poses with camera model K.  The results for pose k are at
+ *    k*n in u and v (pixels), depth and in (1 if the landmark is within the
+ *    depth range and the image).
+ *    Returns how many are in view summed over the poses
+ */
+int ProjectLandmarks(const slammap_t* map,const int* lm,int n,const pose_t* pose,int Npose,const intrinsics_t* K,
+                     float* u,float* v,float* depth,unsigned char* in)
+{
+   int k,m=0;
+   kernel_t kernel = scalar;
+   if (!selected) ProjectionKernel(0);
+#ifdef LMPROJECT_SIMD
+   if (selected==2) kernel = sse2;
+   if (selected==3) kernel = avx2;
+#endif
+   for (k=0;k<Npose;k++)
+   {
+      size_t o = (size_t)k*n;
+      view_t V;
+      V.x = pose[k].x;
+      V.y = pose[k].y;
+      V.z = pose[k].z;
+      V.c = Cos(pose[k].d);
+      V.s = Sin(pose[k].d);
+      V.f = K->f;
+      V.cu = K->cu;
+      V.cv = K->cv;
+      V.w = K->w;
+      V.h = K->h;
+      V.zn = K->znear;
+      V.zf = K->zfar;
+      m += kernel(&V,map->X,map->Y,map->Z,lm,n,u+o,v+o,depth+o,in+o);
+   }
+   return m;
+}
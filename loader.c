@@ -0,0 +1,168 @@
+/*
+ *  Asynchronous asset loading
+ *
+ *  Files are read, decoded and parsed on background threads.  PollAssets()
+ *  runs on the OpenGL thread and uploads whatever has finished, so the only
+ *  work left there is copying prepared mipmap levels and buffers.  Textures get a
+ *  placeholder image immediately and mesh handles read -1 until the mesh
+ *  has been uploaded.
+ */
+#include "CSCIx229.h"
+#include "object.h"
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#define LOADER_THREADS 4  //  Maximum number of background threads
+
+//  Asset waiting to be loaded or uploaded
+typedef struct job_s
+{
+   char*          file;     //  File name
+   unsigned int   texture;  //  Texture to fill (0 for a mesh)
+   texdata_t*     img;      //  Mipmapped texture
+   int*           obj;      //  Mesh handle to fill
+   mesh_t*        mesh;     //  Mesh ready for upload
+   struct job_s*  next;     //  Next job in list
+} job_t;
+
+static job_t*  todo=NULL;       //  Jobs waiting for a thread (oldest first)
+static job_t** last=&todo;      //  End of todo list
+static job_t*  done=NULL;       //  Jobs waiting for upload
+static int     pending=0;       //  Jobs not yet uploaded (OpenGL thread only)
+#ifndef _WIN32
+static int     threads=0;       //  Background threads started
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  wake = PTHREAD_COND_INITIALIZER;
+#endif
+
+//
+//  Read, decode and parse (no OpenGL calls)
+//
+static void work(job_t* job)
+{
+   if (job->texture)
+      job->img = ReadTexture(job->file);
+   else
+      job->mesh = ReadOBJ(job->file);
+}
+
+#ifndef _WIN32
+//
+//  Background thread
+//    Takes jobs in order and moves them to the done list
+//
+static void* worker(void* arg)
+{
+   pthread_mutex_lock(&lock);
+   for (;;)
+   {
+      job_t* job;
+      while (!todo)
+         pthread_cond_wait(&wake,&lock);
+      job = todo;
+      todo = job->next;
+      if (!todo) last = &todo;
+      pthread_mutex_unlock(&lock);
+
+      work(job);
+
+      pthread_mutex_lock(&lock);
+      job->next = done;
+      done = job;
+   }
+   return NULL;
+}
+#endif
+
+//
+//  Queue a job
+//    Without threads the job is done immediately and uploaded by PollAssets
+//
+static void submit(const char* file,unsigned int texture,int* obj)
+{
+   job_t* job = (job_t*)calloc(1,sizeof(job_t));
+   if (!job) Fatal("Cannot allocate memory for %s\n",file);
+   job->file = (char*)malloc(strlen(file)+1);
+   if (!job->file) Fatal("Cannot allocate memory for %s\n",file);
+   strcpy(job->file,file);
+   job->texture = texture;
+   job->obj     = obj;
+   pending++;
+#ifdef _WIN32
+   work(job);
+   job->next = done;
+   done = job;
+#else
+   pthread_mutex_lock(&lock);
+   *last = job;
+   last = &job->next;
+   //  Start another thread while there are fewer threads than jobs
+   if (threads<LOADER_THREADS && threads<pending)
+   {
+      pthread_t tid;
+      if (pthread_create(&tid,NULL,worker,NULL)) Fatal("Cannot create loader thread\n");
+      pthread_detach(tid);
+      threads++;
+   }
+   pthread_cond_signal(&wake);
+   pthread_mutex_unlock(&lock);
+#endif
+}
+
+/*
+ *  Load texture from BMP file in the background
+ *    Returns a texture name holding a grey placeholder until PollAssets
+ *    replaces it with the image
+ */
+unsigned int LoadTexBMPAsync(const char* file)
+{
+   static const unsigned char grey[12] = {128,128,128, 128,128,128, 128,128,128, 128,128,128};
+   unsigned int texture = UploadTexBMP(0,grey,2,2,file);
+   submit(file,texture,NULL);
+   return texture;
+}
+
+/*
+ *  Load OBJ file in the background
+ *    *obj is set to -1 now and to the mesh handle once PollAssets uploads it,
+ *    so obj must stay valid until then
+ */
+void LoadOBJAsync(const char* file,int* obj)
+{
+   *obj = -1;
+   submit(file,0,obj);
+}
+
+/*
+ *  Upload finished assets
+ *    Call from the OpenGL thread (e.g. the idle function)
+ *    Returns the number of assets still loading
+ */
+int PollAssets(void)
+{
+   job_t* job;
+   //  Take the done list
+#ifndef _WIN32
+   pthread_mutex_lock(&lock);
+#endif
+   job = done;
+   done = NULL;
+#ifndef _WIN32
+   pthread_mutex_unlock(&lock);
+#endif
+
+   while (job)
+   {
+      job_t* next = job->next;
+      if (job->texture)
+         UploadTexture(job->texture,job->img,job->file);
+      else
+         *job->obj = UploadOBJ(job->mesh);
+      free(job->file);
+      free(job);
+      pending--;
+      job = next;
+   }
+   return pending;
+}
@@ -2,6 +2,7 @@
  *  Load texture from BMP file
  */
 #include "CSCIx229.h"
+#include "texture.h"
 
 /*
  *  Reverse n bytes
@@ -19,11 +20,12 @@ static void Reverse(void* x,const int n)
 }
 
 /*
- *  Load texture from BMP file
+ *  Read image from BMP file
+ *    Returns RGB pixels (free with free) and sets the dimensions
+ *    Makes no OpenGL calls so it may be used from any thread
  */
-unsigned int LoadTexBMP(const char* file)
+unsigned char* ReadBMP(const char* file,int* width,int* height)
 {
-   unsigned int   texture;    // Texture name
    FILE*          f;          // File pointer
    unsigned short magic;      // Image magic
   int   dx,dy,size; // Image dimensions
@@ -31,7 +33,6 @@ unsigned int LoadTexBMP(const char* file)
    unsigned char* image;      // Image data
    unsigned int   off;        // Image offset
    unsigned int   k;          // Counter
-   int            max;        // Maximum texture dimensions
 
    //  Open file
    f = fopen(file,"rb");
@@ -55,21 +56,13 @@ unsigned int LoadTexBMP(const char* file)
       Reverse(&k,4);
    }
    //  Check image parameters
-   glGetIntegerv(GL_MAX_TEXTURE_SIZE,&max);
    dy = abs(dy);
    dx = abs(dx);
-   if (dx<1 || dx>max) Fatal("%s image width %d out of range 1-%d\n",file,dx,max);
-   if (dy<1 || dy>max) Fatal("%s image height %d out of range 1-%d\n",file,dy,max);
+   if (dx<1) Fatal("%s image width %d out of range\n",file,dx);
+   if (dy<1) Fatal("%s image height %d out of range\n",file,dy);
    if (nbp!=1)  Fatal("%s bit planes is not 1: %d\n",file,nbp);
    if (bpp!=24) Fatal("%s bits per pixel is not 24: %d\n",file,bpp);
    if (k!=0)    Fatal("%s compressed files not supported\n",file);
-#ifndef GL_VERSION_2_0
-   //  OpenGL 2.0 lifts the restriction that texture size must be a power of two
-   for (k=1;k<dx;k*=2);
-   if (k!=dx) Fatal("%s image width not a power of two: %d\n",file,dx);
-   for (k=1;k<dy;k*=2);
-   if (k!=dy) Fatal("%s image height not a power of two: %d\n",file,dy);
-#endif
 
    //  Allocate image memory
    size = 3*dx*dy;
@@ -85,21 +78,56 @@ unsigned int LoadTexBMP(const char* file)
       image[k]   = image[k+2];
       image[k+2] = temp;
    }
+   *width  = dx;
+   *height = dy;
+   return image;
+}
+
+/*
+ *  Copy RGB image to texture
+ *    Creates a new texture if texture is zero
+ *    Returns the texture name
+ */
+unsigned int UploadTexBMP(unsigned int texture,const unsigned char* image,int dx,int dy,const char* file)
+{
+   int max;  // Maximum texture dimensions
+
+   //  Check image size
+   glGetIntegerv(GL_MAX_TEXTURE_SIZE,&max);
+   if (dx<1 || dx>max) Fatal("%s image width %d out of range 1-%d\n",file,dx,max);
+   if (dy<1 || dy>max) Fatal("%s image height %d out of range 1-%d\n",file,dy,max);
+#ifndef GL_VERSION_2_0
+   //  OpenGL 2.0 lifts the restriction that texture size must be a power of two
+   int k;
+   for (k=1;k<dx;k*=2);
+   if (k!=dx) Fatal("%s image width not a power of two: %d\n",file,dx);
+   for (k=1;k<dy;k*=2);
+   if (k!=dy) Fatal("%s image height not a power of two: %d\n",file,dy);
+#endif
 
    //  Sanity check
    ErrCheck("LoadTexBMP");
    //  Generate 2D texture
-   glGenTextures(1,&texture);
+   if (!texture) glGenTextures(1,&texture);
    glBindTexture(GL_TEXTURE_2D,texture);
-   //  Copy image
+   //  Copy image (rows are packed, so not 4 byte aligned for all widths)
+   glPixelStorei(GL_UNPACK_ALIGNMENT,1);
    glTexImage2D(GL_TEXTURE_2D,0,3,dx,dy,0,GL_RGB,GL_UNSIGNED_BYTE,image);
+   glPixelStorei(GL_UNPACK_ALIGNMENT,4);
    if (glGetError()) Fatal("Error in glTexImage2D %s %dx%d\n",file,dx,dy);
    //  Scale linearly when image size doesn't match
    glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
    glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR);
 
-   //  Free image memory
-   free(image);
    //  Return texture name
    return texture;
 }
+
+/*
+ *  Load texture from BMP file
+ *    Uses the mipmapped texture cache (file.tex) when it is up to date
+ */
+unsigned int LoadTexBMP(const char* file)
+{
+   return UploadTexture(0,ReadTexture(file),file);
+}
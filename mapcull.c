@@ -0,0 +1,281 @@
+/*
+ *  Map culling
+ *
+ *  CullMap() keeps a growing map within budgets on keyframes, landmarks
+ *  and memory by retiring what it will miss least:
+ *
+ *    Keyframes are ranked by redundancy, the fraction of their landmarks
+ *    that at least opt->others other keyframes also see, so a keyframe
+ *    whose view is covered by its neighbors goes first (one with no
+ *    landmarks is fully redundant).  Ties go to fewer observations.  Each
+ *    keyframe culled is taken from the rest, so two keyframes redundant
+ *    only because of each other do not both go.  The first opt->fixed
+ *    keyframes anchor the map and the newest opt->recent are still being
+ *    tracked, so neither is culled.
+ *
+ *    Landmarks are ranked by their worth, the number of keyframes that
+ *    still see them divided by 1+(e/sigma)^2 for RMS reprojection error e,
+ *    so a landmark seen rarely or badly goes first.
+ *
+ *  At most opt->batch keyframes and opt->batch landmarks go per call, so
+ *  a map far over budget shrinks over several calls instead of stalling
+ *  one.
+ *
+ *  The memory budget is on what the map allocates (MapMemory).  Once the
+ *  arrays outgrow it, entries are culled to SLACK of the budget and the
+ *  capacities are trimmed to the budget, sharing what is left over among
+ *  the arrays so they can grow a while before the next cull.  The map only
+ *  exceeds the budget from when an array grows until the next call.
+ */
+#include "CSCIx229.h"
+#include "slam.h"
+
+#define SLACK 0.9  //  Fraction of the memory budget the entries are culled to
+
+//  Keyframe or landmark with its rank
+typedef struct
+{
+   int    i;     //  Index
+   double key;   //  Rank (lowest goes first)
+   int    n;     //  Observations (to break ties)
+} rank_t;
+
+//
+//  Order by rank, then fewer observations, then index
+//
+static int cmprank(const void* p,const void* q)
+{
+   const rank_t* a = (const rank_t*)p;
+   const rank_t* b = (const rank_t*)q;
+   if (a->key!=b->key) return (a->key>b->key) - (a->key<b->key);
+   if (a->n!=b->n) return a->n - b->n;
+   return a->i - b->i;
+}
+
+//
+//  Bytes the entries of a map of this size take (capacity aside)
+//
+static double used(double Nlm,double Ncam,double Nobs)
+{
+   return 3*sizeof(double)*Nlm +
+          (2*sizeof(pose_t)+sizeof(unsigned int)+sizeof(int))*Ncam +
+          (sizeof(int)+2*sizeof(float))*Nobs;
+}
+
+//
+//  Trim the capacities to fit maxbytes, each array keeping the same share
+//  of the room to spare (none when the entries alone are over)
+//
+static void trim(slammap_t* map,double maxbytes)
+{
+   double f = (maxbytes-sizeof(int))/used(map->Nlm,map->Ncam,map->Nobs);
+   if (f<1) f = 1;
+   TrimMap(map,(int)(f*map->Nlm),(int)(f*map->Ncam),(int)(f*map->Nobs));
+}
+
+//
+//  Restore heap order below r[i] (lowest rank on top)
+//
+static void sift(rank_t* r,int n,int i)
+{
+   for (;;)
+   {
+      int j = 2*i+1;
+      rank_t t;
+      if (j>=n) return;
+      if (j+1<n && cmprank(r+j+1,r+j)<0) j++;
+      if (cmprank(r+j,r+i)>=0) return;
+      t = r[i];
+      r[i] = r[j];
+      r[j] = t;
+      i = j;
+   }
+}
+
+//
+//  Rank of keyframe k by redundancy (minus the fraction of its landmarks
+//  seen by at least others other keyframes, -1 with no landmarks)
+//
+static double redundancy(const slammap_t* map,const int* seen,int k,int others)
+{
+   int o,o0=map->first[k],o1=map->first[k+1],shared=0;
+   if (o1==o0) return -1;
+   for (o=o0;o<o1;o++)
+      if (seen[map->lm[o]]-1>=others) shared++;
+   return -(double)shared/(o1-o0);
+}
+
+/*
+ *  Default culling options (no budgets, so nothing is culled)
+ */
+void CullOptions(cullopt_t* opt)
+{
+   opt->maxcam = 0;
+   opt->maxlm = 0;
+   opt->maxbytes = 0;
+   opt->others = 3;
+   opt->sigma = 0.01;
+   opt->fixed = 1;
+   opt->recent = 10;
+   opt->batch = 1000;
+}
+
+/*
+ *  Retire keyframes and landmarks until the map is within the budgets of
+ *  opt (or opt->batch of each have gone)
+ *    When something is culled, cammap and lmmap (if not NULL, with room for
+ *    the keyframes and landmarks before the call) are set as RemoveFromMap
+ *    does and report (if not NULL) adds what was culled
+ *    Returns the number of keyframes and landmarks culled
+ */
+int CullMap(slammap_t* map,const cullopt_t* opt,cullreport_t* report,int* cammap,int* lmmap)
+{
+   int Ncam=map->Ncam,Nlm=map->Nlm;
+   int k,l,o,n,tcam,tlm,Dcam=0,Dlm=0;
+   int *seen;
+   double *err;
+   unsigned char *dropcam,*droplm;
+   rank_t* r;
+   int Nobs = map->Nobs;
+
+   //  Targets from the count budgets, lowered in proportion when the arrays outgrow the memory budget
+   tcam = (opt->maxcam>0 && Ncam>opt->maxcam) ? opt->maxcam : Ncam;
+   tlm = (opt->maxlm>0 && Nlm>opt->maxlm) ? opt->maxlm : Nlm;
+   if (opt->maxbytes>0 && MapMemory(map)>opt->maxbytes)
+   {
+      double u = used(tlm,tcam,(double)Nobs*tcam/(Ncam>0?Ncam:1));
+      if (u>SLACK*opt->maxbytes)
+      {
+         double f = SLACK*opt->maxbytes/u;
+         tcam = (int)(f*tcam);
+         tlm = (int)(f*tlm);
+      }
+   }
+   if (tcam<opt->fixed+opt->recent) tcam = opt->fixed+opt->recent;
+   if (tcam>=Ncam && tlm>=Nlm)
+   {
+      //  Nothing to cull, but the arrays may still be bigger than the budget
+      if (opt->maxbytes>0 && MapMemory(map)>opt->maxbytes)
+      {
+         size_t before = MapMemory(map);
+         trim(map,opt->maxbytes);
+         if (report) report->freed += (double)before-MapMemory(map);
+      }
+      return 0;
+   }
+
+   seen = (int*)malloc((Nlm+1)*sizeof(int));
+   err = (double*)malloc((Nlm+1)*sizeof(double));
+   dropcam = (unsigned char*)calloc(Ncam+1,1);
+   droplm = (unsigned char*)calloc(Nlm+1,1);
+   r = (rank_t*)malloc(((Ncam>Nlm?Ncam:Nlm)+1)*sizeof(rank_t));
+   if (!seen || !err || !dropcam || !droplm || !r) Fatal("Cannot allocate memory for culling\n");
+
+   //  Keyframes seeing each landmark
+   memset(seen,0,Nlm*sizeof(int));
+   for (o=0;o<Nobs;o++)
+      seen[map->lm[o]]++;
+
+   //  Most redundant keyframes
+   //    Dropping a keyframe only makes the others less redundant, so each
+   //    candidate is ranked again when it comes up and goes only if it
+   //    still ranks first
+   if (tcam<Ncam)
+   {
+      n = 0;
+      for (k=opt->fixed;k<Ncam-opt->recent;k++)
+      {
+         r[n].i = k;
+         r[n].key = redundancy(map,seen,k,opt->others);
+         r[n].n = map->first[k+1]-map->first[k];
+         n++;
+      }
+      for (k=n/2-1;k>=0;k--)
+         sift(r,n,k);
+      Dcam = Ncam-tcam;
+      if (Dcam>n) Dcam = n;
+      if (Dcam>opt->batch) Dcam = opt->batch;
+      for (k=0;k<Dcam;)
+      {
+         int c = r[0].i;
+         double key = redundancy(map,seen,c,opt->others);
+         if (key!=r[0].key)
+         {
+            r[0].key = key;
+            sift(r,n,0);
+            continue;
+         }
+         dropcam[c] = 1;
+         for (o=map->first[c];o<map->first[c+1];o++)
+            seen[map->lm[o]]--;
+         r[0] = r[--n];
+         sift(r,n,0);
+         k++;
+      }
+   }
+
+   //  Least worthy landmarks seen by the keyframes kept
+   if (tlm<Nlm)
+   {
+      int* cnt = (int*)calloc(Nlm+1,sizeof(int));
+      if (!cnt) Fatal("Cannot allocate memory for culling\n");
+      memset(err,0,Nlm*sizeof(double));
+      for (k=0;k<Ncam;k++)
+      {
+         double c = Cos(map->pose[k].d),s = Sin(map->pose[k].d);
+         if (dropcam[k]) continue;
+         for (o=map->first[k];o<map->first[k+1];o++)
+         {
+            double dx,dy,dz,px,py,du,dv;
+            l = map->lm[o];
+            if (isnan(map->u[o]) || isnan(map->v[o])) continue;
+            dx = map->X[l]-map->pose[k].x;
+            dy = map->Y[l]-map->pose[k].y;
+            dz = map->Z[l]-map->pose[k].z;
+            px = c*dx + s*dy;
+            py = c*dy - s*dx;
+            //  Behind the camera counts as far off
+            du = (py>0) ? px/py-map->u[o] : 1;
+            dv = (py>0) ? dz/py-map->v[o] : 1;
+            err[l] += du*du+dv*dv;
+            cnt[l]++;
+         }
+      }
+      for (l=0;l<Nlm;l++)
+      {
+         double e2 = cnt[l] ? err[l]/cnt[l] : 0;
+         r[l].i = l;
+         r[l].key = seen[l]/(1+e2/(opt->sigma*opt->sigma));
+         r[l].n = seen[l];
+      }
+      free(cnt);
+      qsort(r,Nlm,sizeof(rank_t),cmprank);
+      Dlm = Nlm-tlm;
+      if (Dlm>opt->batch) Dlm = opt->batch;
+      for (l=0;l<Dlm;l++)
+         droplm[r[l].i] = 1;
+   }
+
+   //  Retire them
+   if (Dcam || Dlm)
+   {
+      size_t before = MapMemory(map);
+      RemoveFromMap(map,dropcam,droplm,cammap,lmmap);
+      if (opt->maxbytes>0) trim(map,opt->maxbytes);
+      if (report)
+      {
+         report->cams += Dcam;
+         report->lms += Dlm;
+         report->obs += Nobs-map->Nobs;
+         report->bytes += used(Dlm,Dcam,Nobs-map->Nobs);
+         report->freed += (double)before-MapMemory(map);
+         report->calls++;
+      }
+   }
+   free(seen);
+   free(err);
+   free(dropcam);
+   free(droplm);
+   free(r);
+   return Dcam+Dlm;
+}
@@ -0,0 +1,70 @@
+/*
+ *  Map a file read-only into memory
+ *    Returns a pointer to the contents and sets size
+ *    Returns NULL if the file cannot be opened
+ *    Falls back to reading the whole file where mmap is not available
+ */
+#include "CSCIx229.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+//  Returned for empty files so callers always get a valid pointer
+static char empty[1];
+
+void* MapFile(const char* file,size_t* size)
+{
+#ifdef _WIN32
+   long  n;
+   char* buf;
+   FILE* f = fopen(file,"rb");
+   if (!f) return NULL;
+   if (fseek(f,0,SEEK_END) || (n=ftell(f))<0 || fseek(f,0,SEEK_SET)) Fatal("Cannot size file %s\n",file);
+   *size = n;
+   if (n==0)
+   {
+      fclose(f);
+      return empty;
+   }
+   buf = (char*)malloc(n);
+   if (!buf) Fatal("Cannot allocate %ld bytes for %s\n",n,file);
+   if (fread(buf,n,1,f)!=1) Fatal("Error reading %s\n",file);
+   fclose(f);
+   return buf;
+#else
+   struct stat st;
+   void* buf;
+   int fd = open(file,O_RDONLY);
+   if (fd<0) return NULL;
+   if (fstat(fd,&st)) Fatal("Cannot stat file %s\n",file);
+   *size = st.st_size;
+   if (*size==0)
+   {
+      close(fd);
+      return empty;
+   }
+   buf = mmap(NULL,*size,PROT_READ,MAP_PRIVATE,fd,0);
+   if (buf==MAP_FAILED) Fatal("Cannot map file %s\n",file);
+   //  The mapping stays valid after the descriptor is closed
+   close(fd);
+   //  Files are parsed front to back
+   madvise(buf,*size,MADV_SEQUENTIAL);
+   return buf;
+#endif
+}
+
+/*
+ *  Release memory returned by MapFile
+ */
+void UnmapFile(void* buf,size_t size)
+{
+   if (!buf || size==0) return;
+#ifdef _WIN32
+   free(buf);
+#else
+   munmap(buf,size);
+#endif
+}
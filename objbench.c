@@ -0,0 +1,277 @@
+/*
+ *  OBJ loader benchmark
+ *
+ *  Compares ParseOBJ() against the original fgetc()/sscanf() reader
+ *  and reports throughput in MB/s and faces/s, then reports how the
+ *  chunked parser scales from one thread up to threads threads
+ *
+ *  Usage:
+ *    objbench file.obj [repeat] [threads]   Benchmark parsing file
+ *    objbench -g n file.obj       Write an n x n torus to file for testing
+ */
+#include "CSCIx229.h"
+#include "object.h"
+#include <ctype.h>
+#include <time.h>
+
+//
+//  Wall clock time in seconds
+//
+static double now()
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC,&t);
+   return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+/*
+ *  Reference reader
+ *    This is the original line reader from object.c with the OpenGL calls
+ *    removed so only parsing is timed
+ */
+static int CRLF(char ch)
+{
+   return ch == '\r' || ch == '\n';
+}
+
+static int linelen=0;
+static char* line=NULL;
+static char* readline(FILE* f)
+{
+   int ch;
+   int k=0;
+   while ((ch = fgetc(f)) != EOF)
+   {
+      if (k>=linelen)
+      {
+         linelen += 8192;
+         line = (char*)realloc(line,linelen);
+         if (!line) Fatal("Out of memory in readline\n");
+      }
+      if (CRLF(ch))
+      {
+         while ((ch = fgetc(f)) != EOF)
+           if (!CRLF(ch)) break;
+         if (ch != EOF) ungetc(ch,f);
+         break;
+      }
+      else
+         line[k++] = ch;
+   }
+   if (k>0) line[k] = 0;
+   return k>0 ? line : NULL;
+}
+
+static char* getword(char** line)
+{
+   char* word;
+   while (**line && isspace(**line))
+      (*line)++;
+   if (!**line) return NULL;
+   word = *line;
+   while (**line && !isspace(**line))
+      (*line)++;
+   if (**line)
+   {
+      **line = 0;
+      (*line)++;
+   }
+   return word;
+}
+
+static void readfloat(char* line,int n,float x[])
+{
+   int i;
+   for (i=0;i<n;i++)
+   {
+      char* str = getword(&line);
+      if (!str)  Fatal("Premature EOL reading %d floats\n",n);
+      if (sscanf(str,"%f",x+i)!=1) Fatal("Error reading float %d\n",i);
+   }
+}
+
+static void readcoord(char* line,int n,float* x[],int* N,int* M)
+{
+   if (*N+n > *M)
+   {
+      *M += 8192;
+      *x = (float*)realloc(*x,(*M)*sizeof(float));
+      if (!*x) Fatal("Cannot allocate memory\n");
+   }
+   readfloat(line,n,(*x)+*N);
+   (*N)+=n;
+}
+
+//
+//  Parse file with the reference reader
+//    Returns number of facets
+//
+static int reference(const char* file)
+{
+   int Nv,Nn,Nt,Mv,Mn,Mt,Nf=0;
+   float *V,*N,*T;
+   char* line;
+   char* str;
+   FILE* f = fopen(file,"r");
+   if (!f) Fatal("Cannot open file %s\n",file);
+   V  = N  = T  = NULL;
+   Nv = Nn = Nt = 0;
+   Mv = Mn = Mt = 0;
+   while ((line = readline(f)))
+   {
+      if (line[0]=='v' && line[1]==' ')
+         readcoord(line+2,3,&V,&Nv,&Mv);
+      else if (line[0]=='v' && line[1] == 'n')
+         readcoord(line+2,3,&N,&Nn,&Mn);
+      else if (line[0]=='v' && line[1] == 't')
+         readcoord(line+2,2,&T,&Nt,&Mt);
+      else if (line[0]=='f')
+      {
+         line++;
+         while ((str = getword(&line)))
+         {
+            int Kv,Kt,Kn;
+            if (sscanf(str,"%d/%d/%d",&Kv,&Kt,&Kn)==3) {}
+            else if (sscanf(str,"%d//%d",&Kv,&Kn)==2) {}
+            else if (sscanf(str,"%d",&Kv)==1) {}
+            else Fatal("Invalid facet %s\n",str);
+         }
+         Nf++;
+      }
+   }
+   fclose(f);
+   free(V);
+   free(T);
+   free(N);
+   return Nf;
+}
+
+//
+//  Write an n x n torus with texture coordinates and normals
+//
+static void generate(const char* file,int n)
+{
+   int i,j;
+   FILE* f = fopen(file,"w");
+   if (!f) Fatal("Cannot create %s\n",file);
+   fprintf(f,"# %dx%d torus\n",n,n);
+   for (i=0;i<n;i++)
+      for (j=0;j<n;j++)
+      {
+         double th = 360.0*i/n;
+         double ph = 360.0*j/n;
+         fprintf(f,"v %f %f %f\n",(1+0.3*Cos(th))*Cos(ph),(1+0.3*Cos(th))*Sin(ph),0.3*Sin(th));
+         fprintf(f,"vt %f %f\n",(double)i/n,(double)j/n);
+         fprintf(f,"vn %f %f %f\n",Cos(th)*Cos(ph),Cos(th)*Sin(ph),Sin(th));
+      }
+   for (i=0;i<n;i++)
+      for (j=0;j<n;j++)
+      {
+         int a = n*i+j+1;
+         int b = n*((i+1)%n)+j+1;
+         int c = n*((i+1)%n)+(j+1)%n+1;
+         int d = n*i+(j+1)%n+1;
+         fprintf(f,"f %d/%d/%d %d/%d/%d %d/%d/%d %d/%d/%d\n",a,a,a,b,b,b,c,c,c,d,d,d);
+      }
+   fclose(f);
+}
+
+//
+//  Check parsed files are identical
+//
+static void compare(const obj_t* a,const obj_t* b,int threads)
+{
+   int k;
+   if (a->Nv!=b->Nv || a->Nt!=b->Nt || a->Nn!=b->Nn || a->Nf!=b->Nf ||
+       a->Nuse!=b->Nuse || a->Nlib!=b->Nlib ||
+       memcmp(a->V,b->V,3*a->Nv*sizeof(float)) ||
+       memcmp(a->T,b->T,2*a->Nt*sizeof(float)) ||
+       memcmp(a->N,b->N,3*a->Nn*sizeof(float)) ||
+       memcmp(a->F,b->F,(a->Nf+1)*sizeof(int)) ||
+       memcmp(a->M,b->M,a->Nf*sizeof(int)) ||
+       memcmp(a->K,b->K,3*a->F[a->Nf]*sizeof(int)))
+      Fatal("Parse with %d threads differs from serial parse\n",threads);
+   for (k=0;k<a->Nuse;k++)
+      if (strcmp(a->use[k],b->use[k])) Fatal("Material %d differs with %d threads\n",k,threads);
+   for (k=0;k<a->Nlib;k++)
+      if (strcmp(a->lib[k],b->lib[k])) Fatal("Library %d differs with %d threads\n",k,threads);
+}
+
+//
+//  Report throughput
+//
+static void report(const char* name,double t,size_t size,int Nf)
+{
+   printf("%-10s %8.3f s %10.1f MB/s %12.0f faces/s\n",name,t,size/1e6/t,Nf/t);
+}
+
+int main(int argc,char* argv[])
+{
+   int k,n,Nf=0,rep=3,threads=8;
+   size_t size;
+   double t0,tr,tp,t1=0;
+   obj_t obj,ref;
+   void* buf;
+
+   //  Generate test file
+   if (argc==4 && !strcmp(argv[1],"-g"))
+   {
+      generate(argv[3],atoi(argv[2]));
+      return 0;
+   }
+   if (argc<2 || argc>4) Fatal("Usage: %s file.obj [repeat] [threads] | -g n file.obj\n",argv[0]);
+   if (argc>2) rep = atoi(argv[2]);
+   if (argc>3) threads = atoi(argv[3]);
+   if (rep<1) rep = 1;
+   if (threads<1) threads = 1;
+
+   //  File size
+   buf = MapFile(argv[1],&size);
+   if (!buf) Fatal("Cannot open file %s\n",argv[1]);
+   UnmapFile(buf,size);
+
+   //  Reference reader
+   t0 = now();
+   for (k=0;k<rep;k++)
+      Nf = reference(argv[1]);
+   tr = (now()-t0)/rep;
+
+   //  Mapped reader
+   t0 = now();
+   for (k=0;k<rep;k++)
+   {
+      ParseOBJ(argv[1],&obj,1);
+      if (obj.Nf!=Nf) Fatal("Facet count mismatch %d vs %d\n",obj.Nf,Nf);
+      FreeOBJ(&obj);
+   }
+   tp = (now()-t0)/rep;
+
+   printf("%s: %.1f MB, %d faces, average of %d runs\n",argv[1],size/1e6,Nf,rep);
+   report("reference",tr,size,Nf);
+   report("mapped",tp,size,Nf);
+   printf("speedup    %8.2fx\n",tr/tp);
+
+   //  Thread scaling (output must match the serial parse)
+   ParseOBJ(argv[1],&ref,1);
+   printf("threads\n");
+   for (n=1;n<=threads;n*=2)
+   {
+      char name[16];
+      t0 = now();
+      for (k=0;k<rep;k++)
+      {
+         ParseOBJ(argv[1],&obj,n);
+         if (k==0) compare(&ref,&obj,n);
+         FreeOBJ(&obj);
+      }
+      tp = (now()-t0)/rep;
+      if (n==1) t1 = tp;
+      sprintf(name,"%d",n);
+      report(name,tp,size,Nf);
+      printf("speedup    %8.2fx\n",t1/tp);
+      //  Make sure the requested count is included
+      if (n<threads && 2*n>threads) n = threads/2;
+   }
+   FreeOBJ(&ref);
+   return 0;
+}
@@ -0,0 +1,297 @@
+/*
+ *  Binary mesh cache
+ *
+ *  LoadOBJ() writes the indexed mesh it builds to file.mesh next to the
+ *  source so later runs can skip parsing.  The file is laid out as
+ *
+ *    header     counts, blob offsets and the source files it was built from
+ *    vertexes   interleaved texture, normal and vertex coordinates
+ *    indexes    triangle indexes
+ *    ranges     material ranges
+ *    materials  colors, shininess and texture file names
+ *
+ *  Each blob starts on a 64 byte boundary so the mapped file can be handed
+ *  straight to glBufferData.  The cache is only used when the modification
+ *  time, size and content hash of the OBJ file and its material libraries
+ *  all match the values recorded when it was written.
+ */
+#include "CSCIx229.h"
+#include "object.h"
+
+#define CACHE_MAGIC   0x4853454D  //  "MESH" in little endian
+#define CACHE_VERSION 2
+#define CACHE_ALIGN   64          //  Alignment of each blob
+#define CACHE_MAXDEP  16          //  Maximum number of source files
+#define CACHE_NAME    256         //  Maximum length of file and material names
+
+//  Source file the cache was built from
+typedef struct
+{
+   char name[CACHE_NAME];   //  File name
+   long long mtime;         //  Modification time (-1 if missing)
+   long long size;          //  Size in bytes (-1 if missing)
+   unsigned long long hash; //  Content hash
+} dep_t;
+
+//  Material record
+typedef struct
+{
+   char  name[CACHE_NAME];     //  Material name
+   char  tex[CACHE_NAME];      //  Texture file (empty for none)
+   float Ka[4],Kd[4],Ks[4],Ns; //  Colors and shininess
+   float d;                    //  Transparency
+} mtlrec_t;
+
+//  Cache header
+typedef struct
+{
+   unsigned int magic;          //  CACHE_MAGIC
+   unsigned int version;        //  CACHE_VERSION
+   int Ndep;                    //  Number of source files
+   int Nvert,Nidx,Nrange,Nmtl;  //  Counts
+   int attr;                    //  Attributes present (MESH_TEX|MESH_NORM)
+   long long vert,idx,range,mtl;//  Offsets of each blob
+   long long size;              //  Total size of the cache
+   dep_t dep[CACHE_MAXDEP];     //  Source files
+} cachehdr_t;
+
+//
+//  Record modification time and size of a source file
+//    Missing files are recorded with -1 so they still match while missing
+//
+static void statdep(const char* file,dep_t* dep)
+{
+   memset(dep,0,sizeof(dep_t));
+   strncpy(dep->name,file,CACHE_NAME-1);
+   FileStamp(file,&dep->mtime,&dep->size);
+}
+
+//
+//  Hash contents of a source file
+//
+static unsigned long long hashdep(const dep_t* dep)
+{
+   return (dep->size<0) ? 0 : HashFile(dep->name);
+}
+
+//
+//  Name of cache file for an OBJ file
+//
+static char* cachename(const char* file)
+{
+   char* name = (char*)malloc(strlen(file)+6);
+   if (!name) Fatal("Cannot allocate memory for cache name\n");
+   strcpy(name,file);
+   strcat(name,".mesh");
+   return name;
+}
+
+//
+//  Round up to blob alignment
+//
+static long long align(long long off)
+{
+   return (off+CACHE_ALIGN-1) & ~(long long)(CACHE_ALIGN-1);
+}
+
+//
+//  Write blob at offset
+//
+static void writeblob(FILE* f,long long off,const void* data,size_t n)
+{
+   static const char zero[CACHE_ALIGN] = {0};
+   long long pad = off-ftell(f);
+   if (pad>0) fwrite(zero,1,pad,f);
+   if (n>0) fwrite(data,n,1,f);
+}
+
+//
+//  Write mesh to cache next to file
+//    Failure only produces a warning since the cache is optional
+//
+void WriteMeshCache(const char* file,const obj_t* obj,const mesh_t* mesh)
+{
+   int k;
+   FILE* f;
+   cachehdr_t hdr;
+   mtlrec_t* rec;
+   char* name = cachename(file);
+   char* tmp  = (char*)malloc(strlen(name)+5);
+   if (!tmp) Fatal("Cannot allocate memory for cache name\n");
+   sprintf(tmp,"%s.tmp",name);
+
+   //  Source files
+   memset(&hdr,0,sizeof(hdr));
+   if (1+obj->Nlib > CACHE_MAXDEP || strlen(file)>=CACHE_NAME)
+   {
+      fprintf(stderr,"Not caching %s: too many material libraries or name too long\n",file);
+      goto done;
+   }
+   statdep(file,hdr.dep+hdr.Ndep++);
+   for (k=0;k<obj->Nlib;k++)
+      statdep(obj->lib[k],hdr.dep+hdr.Ndep++);
+   for (k=0;k<hdr.Ndep;k++)
+      hdr.dep[k].hash = hashdep(hdr.dep+k);
+
+   //  Material records
+   rec = (mtlrec_t*)calloc(mesh->Nmtl>0?mesh->Nmtl:1,sizeof(mtlrec_t));
+   if (!rec) Fatal("Cannot allocate memory for cache materials\n");
+   for (k=0;k<mesh->Nmtl;k++)
+   {
+      const mtl_t* m = mesh->mtl+k;
+      strncpy(rec[k].name,m->name,CACHE_NAME-1);
+      if (m->tex) strncpy(rec[k].tex,m->tex,CACHE_NAME-1);
+      memcpy(rec[k].Ka,m->Ka,sizeof(m->Ka));
+      memcpy(rec[k].Kd,m->Kd,sizeof(m->Kd));
+      memcpy(rec[k].Ks,m->Ks,sizeof(m->Ks));
+      rec[k].Ns = m->Ns;
+      rec[k].d  = m->d;
+   }
+
+   //  Layout
+   hdr.magic   = CACHE_MAGIC;
+   hdr.version = CACHE_VERSION;
+   hdr.Nvert   = mesh->Nvert;
+   hdr.Nidx    = mesh->Nidx;
+   hdr.Nrange  = mesh->Nrange;
+   hdr.Nmtl    = mesh->Nmtl;
+   hdr.attr    = mesh->attr;
+   hdr.vert    = align(sizeof(hdr));
+   hdr.idx     = align(hdr.vert  + 8*sizeof(float)*(long long)mesh->Nvert);
+   hdr.range   = align(hdr.idx   + sizeof(unsigned int)*(long long)mesh->Nidx);
+   hdr.mtl     = align(hdr.range + sizeof(range_t)*(long long)mesh->Nrange);
+   hdr.size    = hdr.mtl + sizeof(mtlrec_t)*(long long)mesh->Nmtl;
+
+   //  Write to a temporary file and rename so readers never see a partial cache
+   f = fopen(tmp,"wb");
+   if (!f)
+      fprintf(stderr,"Cannot write mesh cache %s\n",tmp);
+   else
+   {
+      fwrite(&hdr,sizeof(hdr),1,f);
+      writeblob(f,hdr.vert ,mesh->vert ,8*sizeof(float)*mesh->Nvert);
+      writeblob(f,hdr.idx  ,mesh->idx  ,sizeof(unsigned int)*mesh->Nidx);
+      writeblob(f,hdr.range,mesh->range,sizeof(range_t)*mesh->Nrange);
+      writeblob(f,hdr.mtl  ,rec        ,sizeof(mtlrec_t)*mesh->Nmtl);
+      int err = ferror(f);
+      if (fclose(f) || err)
+         fprintf(stderr,"Error writing mesh cache %s\n",tmp);
+      else
+      {
+         remove(name);
+         if (rename(tmp,name)) fprintf(stderr,"Cannot rename %s to %s\n",tmp,name);
+      }
+   }
+   free(rec);
+done:
+   free(name);
+   free(tmp);
+}
+
+//
+//  Does a blob of n elements of size bytes at off lie within the cache
+//
+static int inside(const cachehdr_t* hdr,long long off,int n,size_t size)
+{
+   return off>=(long long)sizeof(cachehdr_t) && off<=hdr->size && n>=0 &&
+          (long long)size*n <= hdr->size-off;
+}
+
+//
+//  Read mesh from cache next to file
+//    Returns the mapped cache (release with UnmapFile) or NULL if the cache
+//    is missing, out of date or corrupt.  The vertex and index arrays of the
+//    mesh point into the mapping; ranges and materials are copied and
+//    texture mipmapped textures are read for UploadOBJ.
+//
+void* ReadMeshCache(const char* file,mesh_t* mesh,size_t* size)
+{
+   int k;
+   const cachehdr_t* hdr;
+   const range_t* range;
+   const mtlrec_t* rec;
+   const unsigned int* idx;
+   char* name = cachename(file);
+   char* buf  = (char*)MapFile(name,size);
+   free(name);
+   if (!buf) return NULL;
+
+   //  Check header and layout
+   hdr = (const cachehdr_t*)buf;
+   if (*size<sizeof(cachehdr_t) || hdr->magic!=CACHE_MAGIC || hdr->version!=CACHE_VERSION ||
+       hdr->size!=(long long)*size || hdr->Ndep<1 || hdr->Ndep>CACHE_MAXDEP ||
+       !inside(hdr,hdr->vert,hdr->Nvert,8*sizeof(float)) ||
+       !inside(hdr,hdr->idx,hdr->Nidx,sizeof(unsigned int)) ||
+       !inside(hdr,hdr->range,hdr->Nrange,sizeof(range_t)) ||
+       !inside(hdr,hdr->mtl,hdr->Nmtl,sizeof(mtlrec_t)))
+      goto stale;
+   range = (const range_t*)(buf+hdr->range);
+   for (k=0;k<hdr->Nrange;k++)
+      if (range[k].start<0 || range[k].count<0 || range[k].start>hdr->Nidx-range[k].count ||
+          range[k].mat<-1 || range[k].mat>=hdr->Nmtl)
+         goto stale;
+   rec = (const mtlrec_t*)(buf+hdr->mtl);
+   for (k=0;k<hdr->Nmtl;k++)
+      if (!memchr(rec[k].name,0,CACHE_NAME) || !memchr(rec[k].tex,0,CACHE_NAME)) goto stale;
+
+   //  Check source files are unchanged (cheap checks first)
+   for (k=0;k<hdr->Ndep;k++)
+      if (!memchr(hdr->dep[k].name,0,CACHE_NAME)) goto stale;
+   if (strcmp(hdr->dep[0].name,file)) goto stale;
+   for (k=0;k<hdr->Ndep;k++)
+   {
+      dep_t dep;
+      statdep(hdr->dep[k].name,&dep);
+      if (dep.mtime!=hdr->dep[k].mtime || dep.size!=hdr->dep[k].size) goto stale;
+   }
+   for (k=0;k<hdr->Ndep;k++)
+      if (hashdep(hdr->dep+k)!=hdr->dep[k].hash) goto stale;
+
+   //  Check every index is a vertex
+   idx = (const unsigned int*)(buf+hdr->idx);
+   for (k=0;k<hdr->Nidx;k++)
+      if (idx[k]>=(unsigned int)hdr->Nvert) goto stale;
+
+   //  Point at mapped arrays
+   memset(mesh,0,sizeof(mesh_t));
+   mesh->Nvert  = hdr->Nvert;
+   mesh->Nidx   = hdr->Nidx;
+   mesh->Nrange = hdr->Nrange;
+   mesh->Nmtl   = hdr->Nmtl;
+   mesh->attr   = hdr->attr;
+   mesh->vert   = (float*)(buf+hdr->vert);
+   mesh->idx    = (unsigned int*)idx;
+
+   //  Copy ranges
+   mesh->range = (range_t*)malloc((hdr->Nrange>0?hdr->Nrange:1)*sizeof(range_t));
+   if (!mesh->range) Fatal("Cannot allocate memory for mesh ranges\n");
+   memcpy(mesh->range,range,hdr->Nrange*sizeof(range_t));
+
+   //  Rebuild materials and read textures
+   mesh->mtl = (mtl_t*)calloc(hdr->Nmtl>0?hdr->Nmtl:1,sizeof(mtl_t));
+   if (!mesh->mtl) Fatal("Cannot allocate memory for materials\n");
+   for (k=0;k<hdr->Nmtl;k++)
+   {
+      mtl_t* m = mesh->mtl+k;
+      m->name = (char*)malloc(strlen(rec[k].name)+1);
+      if (!m->name) Fatal("Cannot allocate memory for material name\n");
+      strcpy(m->name,rec[k].name);
+      memcpy(m->Ka,rec[k].Ka,sizeof(m->Ka));
+      memcpy(m->Kd,rec[k].Kd,sizeof(m->Kd));
+      memcpy(m->Ks,rec[k].Ks,sizeof(m->Ks));
+      m->Ns = rec[k].Ns;
+      m->d  = rec[k].d;
+      if (rec[k].tex[0])
+      {
+         m->tex = (char*)malloc(strlen(rec[k].tex)+1);
+         if (!m->tex) Fatal("Cannot allocate memory for texture name\n");
+         strcpy(m->tex,rec[k].tex);
+         m->img = ReadTexture(m->tex);
+      }
+   }
+   return buf;
+
+stale:
+   UnmapFile(buf,*size);
+   return NULL;
+}
@@ -1,11 +1,16 @@
 #include "CSCIx229.h"
-#include <ctype.h>
+#include "object.h"
 
 //  Load an OBJ file
 //  Vertex, Normal and Texture coordinates are supported
 //  Materials are supported
 //  Textures must be BMP files
 //  Surfaces are not supported
+//  Files are memory mapped and tokenized in place (no line copies or sscanf)
+//  Facets are triangulated into an indexed mesh drawn from vertex buffers
+//  Meshes are cached in binary form as file.mesh (see objcache.c)
+//  Large files are parsed in parallel in chunks split at line boundaries
+//  Facets are sorted by material so each material is set once per draw
 //
 //  WARNING:  This is a minimalist implementation of the OBJ file loader.  It
 //  will only correctly load a small subset of possible OBJ files.  It is
@@ -17,344 +22,1054 @@
 //  files may have correct surfaces, but the normals are complete junk and so
 //  the lighting is totally broken.  So beware of which OBJ files you use.
 
-//  Material structure
-typedef struct
+//  Loaded meshes
+static int Nmesh=0;
+static mesh_t* meshes=NULL;
+
+//
+//  Return true if blank (whitespace other than CR or LF)
+//
+static int blank(char ch)
 {
-   char* name;                 //  Material name
-   float Ka[4],Kd[4],Ks[4],Ns; //  Colors and shininess
-   float d;                    //  Transparency
-   int map;                    //  Texture
-} mtl_t;
+   return ch==' ' || ch=='\t' || ch=='\v' || ch=='\f';
+}
 
-//  Material count and array
-static int Nmtl=0;
-static mtl_t* mtl=NULL;
+//
+//  Return true if decimal digit
+//
+static int digit(char ch)
+{
+   return ch>='0' && ch<='9';
+}
+
+//
+//  Skip blanks
+//
+static const char* skipblank(const char* p,const char* e)
+{
+   while (p<e && blank(*p))
+      p++;
+   return p;
+}
+
+//
+//  Find end of line (CR, LF or end of buffer)
+//
+static const char* endline(const char* p,const char* e)
+{
+   const char* q = (const char*)memchr(p,'\n',e-p);
+   if (!q) q = e;
+   //  CR characters also end lines
+   const char* r = (const char*)memchr(p,'\r',q-p);
+   return r ? r : q;
+}
 
 //
-//  Return true if CR or LF
+//  Start of the line after eol
 //
-static int CRLF(char ch)
+static const char* nextline(const char* eol,const char* e)
 {
-   return ch == '\r' || ch == '\n';
+   //  Eat extra CR or LF characters (if any)
+   while (eol<e && (*eol=='\r' || *eol=='\n'))
+      eol++;
+   return eol;
 }
 
 //
-//  Read line from file
-//    Returns pointer to line or NULL on EOF
+//  Match keyword followed by a blank
+//    Returns pointer past the keyword or NULL if no match
 //
-static int linelen=0;    //  Length of line
-static char* line=NULL;  //  Internal storage for line
-static char* readline(FILE* f)
+static const char* keyword(const char* p,const char* e,const char* key)
 {
-   char ch;  //  Character read
-   int k=0;  //  Character count
-   while ((ch = fgetc(f)) != EOF)
+   while (*key && p<e && *key==*p)
    {
-      //  Allocate more memory for long strings
-      if (k>=linelen)
-      {
-         linelen += 8192;
-         line = (char*)realloc(line,linelen);
-         if (!line) Fatal("Out of memory in readline\n");
-      }
-      //  End of Line
-      if (CRLF(ch))
+      key++;
+      p++;
+   }
+   return (!*key && p<e && blank(*p)) ? p : NULL;
+}
+
+//
+//  Read to next non-blank word
+//    Returns length of the word and sets word to its start
+//
+static int scanword(const char** p,const char* e,const char** word)
+{
+   const char* q = *word = skipblank(*p,e);
+   while (q<e && !blank(*q))
+      q++;
+   *p = q;
+   return q-*word;
+}
+
+//
+//  Copy word to a newly allocated string
+//
+static char* copyword(const char* word,int n)
+{
+   char* str = (char*)malloc(n+1);
+   if (!str) Fatal("Cannot allocate %d for name\n",n+1);
+   memcpy(str,word,n);
+   str[n] = 0;
+   return str;
+}
+
+//
+//  Read integer
+//    Returns 1 on success
+//
+static int scanint(const char** p,const char* e,int* x)
+{
+   const char* q = *p;
+   int neg=0,k=0;
+   if (q<e && (*q=='-' || *q=='+')) neg = (*q++=='-');
+   if (q>=e || !digit(*q)) return 0;
+   while (q<e && digit(*q))
+      k = 10*k + (*q++-'0');
+   *x = neg ? -k : k;
+   *p = q;
+   return 1;
+}
+
+//
+//  Read float
+//    Decimal mantissa and exponent are accumulated as integers and scaled once
+//    Anything unusual (inf, nan, hex) falls back to strtod
+//    Returns 1 on success
+//
+static int scanfloat(const char** p,const char* e,float* x)
+{
+   static const double pow10[] = {1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,
+                                  1e11,1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22};
+   const char* q = *p = skipblank(*p,e);
+   unsigned long long m=0; //  Mantissa digits
+   int exp=0;              //  Decimal exponent
+   int n=0;                //  Digit count
+   int neg=0;              //  Negative
+   double v;
+
+   //  Sign
+   if (q<e && (*q=='-' || *q=='+')) neg = (*q++=='-');
+   //  Integer part (digits past 18 only scale the value)
+   for (;q<e && digit(*q);q++,n++)
+      if (m<100000000000000000ULL)
+         m = 10*m + (*q-'0');
+      else
+         exp++;
+   //  Fraction
+   if (q<e && *q=='.')
+      for (q++;q<e && digit(*q);q++,n++)
+         if (m<100000000000000000ULL)
+         {
+            m = 10*m + (*q-'0');
+            exp--;
+         }
+   //  Exponent
+   if (n && q<e && (*q=='e' || *q=='E'))
+   {
+      const char* r = q+1;
+      int eneg=0,ev=0;
+      if (r<e && (*r=='-' || *r=='+')) eneg = (*r++=='-');
+      if (r<e && digit(*r))
       {
-         // Eat extra CR or LF characters (if any)
-         while ((ch = fgetc(f)) != EOF)
-           if (!CRLF(ch)) break;
-         //  Stick back the overrun
-         if (ch != EOF) ungetc(ch,f);
-         //  Bail
-         break;
+         for (;r<e && digit(*r);r++)
+            if (ev<10000) ev = 10*ev + (*r-'0');
+         exp += eneg ? -ev : ev;
+         q = r;
       }
-      //  Pad character to line
-      else
-         line[k++] = ch;
    }
-   //  Terminate line if anything was read
-   if (k>0) line[k] = 0;
-   //  Return pointer to line or NULL on EOF
-   return k>0 ? line : NULL;
-}
-
-//
-//  Read to next non-whitespace word
-//  Note that this destroys line in the process
-//
-static char* getword(char** line)
-{
-   char* word;
-   //  Skip leading whitespace
-   while (**line && isspace(**line))
-      (*line)++;
-   if (!**line) return NULL;
-   //  Start of word
-   word = *line;
-   //  Read until next whitespace
-   while (**line && !isspace(**line))
-      (*line)++;
-   //  Mark end of word if not NULL
-   if (**line)
+   //  Slow path for anything that is not a plain decimal
+   if (!n || (q<e && !blank(*q)))
    {
-      **line = 0;
-      (*line)++;
+      char buf[64];
+      char* end;
+      const char* word;
+      int len = scanword(p,e,&word);
+      if (len==0 || len>=(int)sizeof(buf)) return 0;
+      memcpy(buf,word,len);
+      buf[len] = 0;
+      *x = strtod(buf,&end);
+      return *end==0;
    }
-   return word;
+   //  Scale mantissa
+   v = (double)m;
+   if (exp<0)
+      v = (exp>=-22) ? v/pow10[-exp] : v*pow(10,exp);
+   else if (exp>0)
+      v = (exp<=22) ? v*pow10[exp] : v*pow(10,exp);
+   *x = neg ? -v : v;
+   *p = q;
+   return 1;
 }
 
 //
 //  Read n floats
 //
-static void readfloat(char* line,int n,float x[])
+static void readfloat(const char* p,const char* e,int n,float x[])
 {
    int i;
    for (i=0;i<n;i++)
    {
-      char* str = getword(&line);
-      if (!str)  Fatal("Premature EOL reading %d floats\n",n);
-      if (sscanf(str,"%f",x+i)!=1) Fatal("Error reading float %d\n",i);
+      if (skipblank(p,e)==e) Fatal("Premature EOL reading %d floats\n",n);
+      if (!scanfloat(&p,e,x+i)) Fatal("Error reading float %d\n",i);
    }
 }
 
 //
 //  Read coordinates
 //    n is how many coordiantes to read
-//    N is the coordinate index
-//    M is the number of coordinates
+//    N is the coordinate count
+//    M is the capacity in coordinates
 //    x is the array
-//    This function adds more memory as needed in 8192 work chunks
 //
-static void readcoord(char* line,int n,float* x[],int* N,int* M)
+static void readcoord(const char* p,const char* e,int n,float* x[],int* N,int* M)
 {
-   //  Allocate memory if necessary
-   if (*N+n > *M)
-   {
-      *M += 8192;
-      *x = (float*)realloc(*x,(*M)*sizeof(float));
-      if (!*x) Fatal("Cannot allocate memory\n");
-   }
-   //  Read n coordinates
-   readfloat(line,n,(*x)+*N);
-   (*N)+=n;
+   *x = (float*)GrowArray(*x,n*(*N+1),M,sizeof(float));
+   readfloat(p,e,n,(*x)+n*(*N));
+   (*N)++;
+}
+
+//  Hashed table of names
+typedef struct
+{
+   int    n;     //  Number of names
+   char** name;  //  Names in the order they were added
+   int    mask;  //  Hash table size - 1
+   int*   slot;  //  Index of the name in each slot (-1 if empty)
+} names_t;
+
+//
+//  Hash a name (FNV-1a)
+//
+static unsigned int hashname(const char* word,int l)
+{
+   unsigned int h = 2166136261u;
+   while (l-- > 0)
+      h = (h ^ (unsigned char)*word++) * 16777619u;
+   return h;
 }
 
 //
-//  Read string conditionally
-//     Line must start with skip string
-//     After skip sting return first word
-//     getword terminates the line
+//  Find a name in a table
+//    Returns the index of the name, or -1 if add is zero and it is missing
 //
-static char* readstr(char* line,const char* skip)
+static int intern(names_t* tab,const char* word,int l,int add)
 {
-   //  Check for a match on the skip string
-   while (*skip && *line && *skip==*line)
+   unsigned int h;
+   //  Keep the table at most half full
+   if (2*(tab->n+1) > tab->mask)
    {
-      skip++;
-      line++;
+      int k;
+      tab->mask = tab->mask ? 2*tab->mask+1 : 15;
+      tab->slot = (int*)realloc(tab->slot,(tab->mask+1)*sizeof(int));
+      if (!tab->slot) Fatal("Cannot allocate memory for names\n");
+      memset(tab->slot,-1,(tab->mask+1)*sizeof(int));
+      for (k=0;k<tab->n;k++)
+      {
+         h = hashname(tab->name[k],strlen(tab->name[k])) & tab->mask;
+         while (tab->slot[h]>=0)
+            h = (h+1) & tab->mask;
+         tab->slot[h] = k;
+      }
    }
-   //  Skip must be NULL for a match
-   if (*skip || !isspace(*line)) return NULL;
-   //  Read string
-   return getword(&line);
+   //  Linear probe for a match or an empty slot
+   h = hashname(word,l) & tab->mask;
+   while (tab->slot[h]>=0)
+   {
+      const char* name = tab->name[tab->slot[h]];
+      if (!strncmp(name,word,l) && !name[l]) return tab->slot[h];
+      h = (h+1) & tab->mask;
+   }
+   if (!add) return -1;
+   //  Add name
+   tab->name = (char**)realloc(tab->name,(tab->n+1)*sizeof(char*));
+   if (!tab->name) Fatal("Cannot allocate memory for names\n");
+   tab->name[tab->n] = copyword(word,l);
+   tab->slot[h] = tab->n;
+   return tab->n++;
+}
+
+//
+//  Release hash slots and move names to an array
+//
+static void unhash(names_t* tab,char*** name,int* n)
+{
+   *name = tab->name;
+   *n    = tab->n;
+   free(tab->slot);
+   memset(tab,0,sizeof(names_t));
+}
+
+//
+//  Free names table
+//
+static void freenames(names_t* tab)
+{
+   int k;
+   for (k=0;k<tab->n;k++)
+      free(tab->name[k]);
+   free(tab->name);
+   free(tab->slot);
+   memset(tab,0,sizeof(names_t));
 }
 
+//  Materials being loaded
+typedef struct
+{
+   int     n;      //  Number of materials
+   mtl_t*  mtl;    //  Materials
+   names_t names;  //  Material names
+   int*    index;  //  Material each name refers to
+} mtllib_t;
+
 //
 //  Load materials from file
+//    Texture images are read here and uploaded by UploadOBJ
 //
-static void LoadMaterial(const char* file)
+static void LoadMaterial(const char* file,mtllib_t* lib)
 {
    int k=-1;
-   char* line;
-   char* str;
+   mtl_t* mtl=NULL;
+   size_t size;
+   const char *p,*e,*eol,*str;
 
-   //  Open file or return with warning on error
-   FILE* f = fopen(file,"r");
-   if (!f)
+   //  Map file or return with warning on error
+   char* buf = (char*)MapFile(file,&size);
+   if (!buf)
    {
       fprintf(stderr,"Cannot open material file %s\n",file);
       return;
    }
 
    //  Read lines
-   while ((line = readline(f)))
+   for (p=buf,e=buf+size ; p<e ; p=nextline(eol,e))
    {
+      eol = endline(p,e);
+      p = skipblank(p,eol);
+      if (eol-p<2)
+      {}
       //  New material
-      if ((str = readstr(line,"newmtl")))
+      else if ((str = keyword(p,eol,"newmtl")))
       {
-         int l = strlen(str);
+         const char* name;
+         int n,l = scanword(&str,eol,&name);
          //  Allocate memory for structure
-         k = Nmtl++;
-         mtl = (mtl_t*)realloc(mtl,Nmtl*sizeof(mtl_t));
-         //  Store name
-         mtl[k].name = (char*)malloc(l+1);
-         if (!mtl[k].name) Fatal("Cannot allocate %d for name\n",l+1);
-         strcpy(mtl[k].name,str);
+         k = lib->n++;
+         lib->mtl = (mtl_t*)realloc(lib->mtl,lib->n*sizeof(mtl_t));
+         if (!lib->mtl) Fatal("Cannot allocate memory for material\n");
+         mtl = lib->mtl;
+         //  Store name (the first material with a name is the one used)
+         mtl[k].name = copyword(name,l);
+         n = lib->names.n;
+         if (intern(&lib->names,name,l,1)==n)
+         {
+            lib->index = (int*)realloc(lib->index,lib->names.n*sizeof(int));
+            if (!lib->index) Fatal("Cannot allocate memory for material\n");
+            lib->index[n] = k;
+         }
          //  Initialize materials
          mtl[k].Ka[0] = mtl[k].Ka[1] = mtl[k].Ka[2] = 0;   mtl[k].Ka[3] = 1;
          mtl[k].Kd[0] = mtl[k].Kd[1] = mtl[k].Kd[2] = 0;   mtl[k].Kd[3] = 1;
          mtl[k].Ks[0] = mtl[k].Ks[1] = mtl[k].Ks[2] = 0;   mtl[k].Ks[3] = 1;
          mtl[k].Ns  = 0;
          mtl[k].d   = 0;
+         mtl[k].tex = NULL;
+         mtl[k].img = NULL;
          mtl[k].map = 0;
       }
       //  If no material short circuit here
       else if (k<0)
       {}
       //  Ambient color
-      else if (line[0]=='K' && line[1]=='a')
-         readfloat(line+2,3,mtl[k].Ka);
+      else if (p[0]=='K' && p[1]=='a')
+         readfloat(p+2,eol,3,mtl[k].Ka);
       //  Diffuse color
-      else if (line[0]=='K' && line[1] == 'd')
-         readfloat(line+2,3,mtl[k].Kd);
+      else if (p[0]=='K' && p[1] == 'd')
+         readfloat(p+2,eol,3,mtl[k].Kd);
       //  Specular color
-      else if (line[0]=='K' && line[1] == 's')
-         readfloat(line+2,3,mtl[k].Ks);
+      else if (p[0]=='K' && p[1] == 's')
+         readfloat(p+2,eol,3,mtl[k].Ks);
       //  Material Shininess
-      else if (line[0]=='N' && line[1]=='s')
-         readfloat(line+2,1,&mtl[k].Ns);
+      else if (p[0]=='N' && p[1]=='s')
+         readfloat(p+2,eol,1,&mtl[k].Ns);
       //  Textures (must be BMP - will fail if not)
-      else if ((str = readstr(line,"map_Kd")))
-         mtl[k].map = LoadTexBMP(str);
+      else if ((str = keyword(p,eol,"map_Kd")))
+      {
+         const char* name;
+         int l = scanword(&str,eol,&name);
+         free(mtl[k].tex);
+         FreeTexture(mtl[k].img);
+         mtl[k].tex = copyword(name,l);
+         mtl[k].img = ReadTexture(mtl[k].tex);
+      }
       //  Ignore line if we get here
    }
-   fclose(f);
+   UnmapFile(buf,size);
+}
+
+//
+//  Find material by name
+//    Returns index in lib->mtl or -1 if not found
+//
+static int FindMaterial(mtllib_t* lib,const char* name)
+{
+   int k = intern(&lib->names,name,strlen(name),0);
+   //  No matches
+   if (k<0) fprintf(stderr,"Unknown material %s\n",name);
+   return k<0 ? -1 : lib->index[k];
+}
+
+//  Number of material changes since last asked
+static int switches=0;
+
+//
+//  Return the number of material changes made by DrawOBJ since the last call
+//    Call once per frame to get material switches per frame
+//
+int MaterialSwitches(void)
+{
+   int n = switches;
+   switches = 0;
+   return n;
 }
 
 //
 //  Set material
 //
-static void SetMaterial(const char* name)
+static void SetMaterial(const mtl_t* m)
 {
-   int k;
-   //  Search materials for a matching name
-   for (k=0;k<Nmtl;k++)
-      if (!strcmp(mtl[k].name,name))
+   switches++;
+   //  Set material colors
+   glMaterialfv(GL_FRONT_AND_BACK,GL_AMBIENT  ,m->Ka);
+   glMaterialfv(GL_FRONT_AND_BACK,GL_DIFFUSE  ,m->Kd);
+   glMaterialfv(GL_FRONT_AND_BACK,GL_SPECULAR ,m->Ks);
+   glMaterialfv(GL_FRONT_AND_BACK,GL_SHININESS,&m->Ns);
+   //  Bind texture if specified
+   if (m->map)
+   {
+      glEnable(GL_TEXTURE_2D);
+      glBindTexture(GL_TEXTURE_2D,m->map);
+   }
+   else
+      glDisable(GL_TEXTURE_2D);
+}
+
+//  Chunk of an OBJ file parsed by one thread
+//    Coordinate and facet counts in obj are local to the chunk.  Absolute
+//    indexes are already global.  Relative (negative) indexes are stored as
+//    chunk local 1-based indexes (which may be zero or negative when they
+//    reach back into earlier chunks) and listed in rel so the merge can add
+//    the number of coordinates read by earlier chunks.
+typedef struct
+{
+   const char *p,*e;   //  Text to parse
+   obj_t obj;          //  Chunk contents
+   int Mv,Mn,Mt;       //  Capacity of vertex, normal and texture arrays
+   int Mf,Mm,Mk,Mr;    //  Capacity of facet, material, triplet and rel arrays
+   names_t names,libs; //  Material names and libraries
+   int mat;            //  Material in effect at end of chunk (-1 if no usemtl)
+   int Nrel;           //  Number of relative indexes
+   int* rel;           //  Position in K of each relative index
+   int ahead[3];       //  Furthest an absolute index points past the coordinates read
+   int back[3];        //  Lowest chunk local index from a relative index
+   int off[5];         //  Vertex, texture, normal, facet and triplet offsets for merge
+   int* use;           //  Global material for each local material name
+   int carry;          //  Global material in effect at start of chunk
+   obj_t* out;         //  Merged file
+} chunk_t;
+
+//
+//  Read facet
+//    Vertex, Vertex/Texture, Vertex//Normal and Vertex/Texture/Normal
+//
+static void readfacet(const char* p,const char* e,chunk_t* c)
+{
+   obj_t* obj = &c->obj;
+   int nk = obj->F[obj->Nf];
+   int n[3] = {obj->Nv,obj->Nt,obj->Nn};
+   while ((p = skipblank(p,e)) < e)
+   {
+      int j,K[3]={0,0,0};
+      const char* word = p;
+      if (!scanint(&p,e,K)) goto bad;
+      if (p<e && *p=='/')
       {
-         //  Set material colors
-         glMaterialfv(GL_FRONT_AND_BACK,GL_AMBIENT  ,mtl[k].Ka);
-         glMaterialfv(GL_FRONT_AND_BACK,GL_DIFFUSE  ,mtl[k].Kd);
-         glMaterialfv(GL_FRONT_AND_BACK,GL_SPECULAR ,mtl[k].Ks);
-         glMaterialfv(GL_FRONT_AND_BACK,GL_SHININESS,&mtl[k].Ns);
-         //  Bind texture if specified
-         if (mtl[k].map)
+         p++;
+         //  Texture (absent in Vertex//Normal)
+         if (p<e && *p!='/' && !scanint(&p,e,K+1)) goto bad;
+         //  Normal
+         if (p<e && *p=='/')
          {
-            glEnable(GL_TEXTURE_2D);
-            glBindTexture(GL_TEXTURE_2D,mtl[k].map);
+            p++;
+            if (!scanint(&p,e,K+2)) goto bad;
          }
-         else
-            glDisable(GL_TEXTURE_2D);
-         return;
       }
-   //  No matches
-   fprintf(stderr,"Unknown material %s\n",name);
+      if (p<e && !blank(*p)) goto bad;
+      //  Store triplet
+      obj->K = (int*)GrowArray(obj->K,3*(nk+1),&c->Mk,sizeof(int));
+      for (j=0;j<3;j++)
+      {
+         //  Absolute index must not point past the coordinates read so far
+         if (K[j]>0)
+         {
+            if (K[j]-n[j] > c->ahead[j]) c->ahead[j] = K[j]-n[j];
+         }
+         //  Relative index counts back from the last coordinate read
+         else if (K[j]<0)
+         {
+            K[j] += n[j]+1;
+            if (K[j] < c->back[j]) c->back[j] = K[j];
+            c->rel = (int*)GrowArray(c->rel,c->Nrel+1,&c->Mr,sizeof(int));
+            c->rel[c->Nrel++] = 3*nk+j;
+         }
+         obj->K[3*nk+j] = K[j];
+      }
+      nk++;
+      continue;
+      //  This is an error
+bad:
+      while (p<e && !blank(*p)) p++;
+      Fatal("Invalid facet %.*s\n",(int)(p-word),word);
+   }
+   obj->F[++obj->Nf] = nk;
 }
 
 //
-//  Load OBJ file
+//  Parse one chunk of an OBJ file
 //
-int LoadOBJ(const char* file)
+static void* parsechunk(void* arg)
 {
-   int k;
-   int  Nv,Nn,Nt;  //  Number of vertex, normal and textures
-   int  Mv,Mn,Mt;  //  Maximum vertex, normal and textures
-   float* V;       //  Array of vertexes
-   float* N;       //  Array of normals
-   float* T;       //  Array if textures coordinates
-   char*  line;    //  Line pointer
-   char*  str;     //  String pointer
-
-   //  Open file
-   FILE* f = fopen(file,"r");
-   if (!f) Fatal("Cannot open file %s\n",file);
-
-   // Reset materials
-   mtl = NULL;
-   Nmtl = 0;
-
-   //  Start new displaylist
-   int list = glGenLists(1);
-   glNewList(list,GL_COMPILE);
-   //  Push attributes for textures
-   glPushAttrib(GL_TEXTURE_BIT);
+   chunk_t* c = (chunk_t*)arg;
+   obj_t* obj = &c->obj;
+   const char *p,*e,*eol,*str;
+
+   //  Start empty
+   obj->F = (int*)GrowArray(NULL,1,&c->Mf,sizeof(int));
+   obj->F[0] = 0;
+   c->mat = -1;
+   c->back[0] = c->back[1] = c->back[2] = 1;
 
    //  Read vertexes and facets
-   V  = N  = T  = NULL;
-   Nv = Nn = Nt = 0;
-   Mv = Mn = Mt = 0;
-   while ((line = readline(f)))
+   for (p=c->p,e=c->e ; p<e ; p=nextline(eol,e))
    {
+      eol = endline(p,e);
+      p = skipblank(p,eol);
+      if (eol-p<2)
+      {}
       //  Vertex coordinates (always 3)
-      if (line[0]=='v' && line[1]==' ')
-         readcoord(line+2,3,&V,&Nv,&Mv);
+      else if (p[0]=='v' && blank(p[1]))
+         readcoord(p+2,eol,3,&obj->V,&obj->Nv,&c->Mv);
       //  Normal coordinates (always 3)
-      else if (line[0]=='v' && line[1] == 'n')
-         readcoord(line+2,3,&N,&Nn,&Mn);
+      else if (p[0]=='v' && p[1] == 'n')
+         readcoord(p+2,eol,3,&obj->N,&obj->Nn,&c->Mn);
       //  Texture coordinates (always 2)
-      else if (line[0]=='v' && line[1] == 't')
-         readcoord(line+2,2,&T,&Nt,&Mt);
-      //  Read and draw facets
-      else if (line[0]=='f')
+      else if (p[0]=='v' && p[1] == 't')
+         readcoord(p+2,eol,2,&obj->T,&obj->Nt,&c->Mt);
+      //  Read facets
+      else if (p[0]=='f' && blank(p[1]))
       {
-         line++;
-         //  Read Vertex/Texture/Normal triplets
-         glBegin(GL_POLYGON);
-         while ((str = getword(&line)))
-         {
-            int Kv,Kt,Kn;
-            //  Try Vertex/Texture/Normal triplet
-            if (sscanf(str,"%d/%d/%d",&Kv,&Kt,&Kn)==3)
-            {
-               if (Kv<0 || Kv>Nv/3) Fatal("Vertex %d out of range 1-%d\n",Kv,Nv/3);
-               if (Kn<0 || Kn>Nn/3) Fatal("Normal %d out of range 1-%d\n",Kn,Nn/3);
-               if (Kt<0 || Kt>Nt/2) Fatal("Texture %d out of range 1-%d\n",Kt,Nt/2);
-            }
-            //  Try Vertex//Normal pairs
-            else if (sscanf(str,"%d//%d",&Kv,&Kn)==2)
-            {
-               if (Kv<0 || Kv>Nv/3) Fatal("Vertex %d out of range 1-%d\n",Kv,Nv/3);
-               if (Kn<0 || Kn>Nn/3) Fatal("Normal %d out of range 1-%d\n",Kn,Nn/3);
-               Kt = 0;
-            }
-            //  Try Vertex index
-            else if (sscanf(str,"%d",&Kv)==1)
-            {
-               if (Kv<0 || Kv>Nv/3) Fatal("Vertex %d out of range 1-%d\n",Kv,Nv/3);
-               Kn = 0;
-               Kt = 0;
-            }
-            //  This is an error
-            else
-               Fatal("Invalid facet %s\n",str);
-            //  Draw vectors
-            if (Kt) glTexCoord2fv(T+2*(Kt-1));
-            if (Kn) glNormal3fv(N+3*(Kn-1));
-            if (Kv) glVertex3fv(V+3*(Kv-1));
-         }
-         glEnd();
+         obj->F = (int*)GrowArray(obj->F,obj->Nf+2,&c->Mf,sizeof(int));
+         obj->M = (int*)GrowArray(obj->M,obj->Nf+1,&c->Mm,sizeof(int));
+         obj->M[obj->Nf] = c->mat;
+         readfacet(p+1,eol,c);
       }
       //  Use material
-      else if ((str = readstr(line,"usemtl")))
-         SetMaterial(str);
+      else if ((str = keyword(p,eol,"usemtl")))
+      {
+         const char* name;
+         int l = scanword(&str,eol,&name);
+         c->mat = intern(&c->names,name,l,1);
+      }
       //  Load materials
-      else if ((str = readstr(line,"mtllib")))
-         LoadMaterial(str);
+      else if ((str = keyword(p,eol,"mtllib")))
+      {
+         const char* name;
+         int l = scanword(&str,eol,&name);
+         intern(&c->libs,name,l,1);
+      }
       //  Skip this line
    }
-   fclose(f);
-   //  Pop attributes (textures)
-   glPopAttrib();
-   glEndList();
+   unhash(&c->names,&obj->use,&obj->Nuse);
+   unhash(&c->libs,&obj->lib,&obj->Nlib);
+   return NULL;
+}
 
-   //  Free materials
-   for (k=0;k<Nmtl;k++)
-      free(mtl[k].name);
-   free(mtl);
+//
+//  Copy chunk into merged file
+//    Facet starts and relative indexes are shifted by the prefix sums
+//
+static void* mergechunk(void* arg)
+{
+   int k;
+   chunk_t* c = (chunk_t*)arg;
+   const obj_t* in = &c->obj;
+   obj_t* out = c->out;
+   int* K = out->K+3*c->off[4];
 
-   //  Free arrays
-   free(V);
-   free(T);
-   free(N);
+   memcpy(out->V+3*c->off[0],in->V,3*in->Nv*sizeof(float));
+   memcpy(out->T+2*c->off[1],in->T,2*in->Nt*sizeof(float));
+   memcpy(out->N+3*c->off[2],in->N,3*in->Nn*sizeof(float));
+   memcpy(K,in->K,3*in->F[in->Nf]*sizeof(int));
+   for (k=0;k<c->Nrel;k++)
+      K[c->rel[k]] += c->off[c->rel[k]%3];
+   for (k=0;k<in->Nf;k++)
+   {
+      out->F[c->off[3]+k] = in->F[k] + c->off[4];
+      out->M[c->off[3]+k] = (in->M[k]<0) ? c->carry : c->use[in->M[k]];
+   }
+   return NULL;
+}
 
-   return list;
+//
+//  Free chunk work arrays
+//
+static void freechunk(chunk_t* c)
+{
+   FreeOBJ(&c->obj);
+   free(c->rel);
+   free(c->use);
+}
+
+//
+//  Parse OBJ file
+//    Coordinates and facets are read into obj
+//    Material libraries and names are recorded but not loaded
+//    The file is split at line boundaries into chunks parsed by up to
+//    threads threads (0 uses every processor) and merged in order
+//
+void ParseOBJ(const char* file,obj_t* obj,int threads)
+{
+   int k,j;
+   int n;               //  Number of chunks
+   int tot[5]={0};      //  Running vertex, texture, normal, facet and triplet totals
+   int mat=-1;          //  Material in effect after each chunk
+   names_t use,lib;     //  Merged material names and libraries
+   size_t size;
+   chunk_t* c;
+   const char* what[3] = {"Vertex","Texture","Normal"};
+
+   //  Map file
+   char* buf = (char*)MapFile(file,&size);
+   if (!buf) Fatal("Cannot open file %s\n",file);
+
+   //  At most one chunk per megabyte
+   n = (threads>0) ? threads : Processors();
+   if ((size_t)n > size/(1<<20)+1) n = size/(1<<20)+1;
+   c = (chunk_t*)calloc(n,sizeof(chunk_t));
+   if (!c) Fatal("Cannot allocate memory for chunks\n");
+
+   //  Split at line boundaries
+   for (k=0;k<n;k++)
+   {
+      const char* e = buf+size;
+      c[k].p = k ? c[k-1].e : buf;
+      c[k].e = (k==n-1) ? e : buf + size/n*(k+1);
+      if (c[k].e<c[k].p) c[k].e = c[k].p;
+      while (c[k].e>buf && c[k].e<e && c[k].e[-1]!='\n')
+         c[k].e++;
+   }
+   RunThreads(parsechunk,c,sizeof(chunk_t),n);
+
+   //  Prefix sums, index checks and material names
+   memset(obj,0,sizeof(obj_t));
+   memset(&use,0,sizeof(use));
+   memset(&lib,0,sizeof(lib));
+   for (k=0;k<n;k++)
+   {
+      const obj_t* in = &c[k].obj;
+      int cnt[5] = {in->Nv,in->Nt,in->Nn,in->Nf,in->F[in->Nf]};
+      for (j=0;j<3;j++)
+         if (c[k].ahead[j]>tot[j] || c[k].back[j]+tot[j]<1)
+            Fatal("%s index out of range in %s\n",what[j],file);
+      for (j=0;j<5;j++)
+      {
+         c[k].off[j] = tot[j];
+         tot[j] += cnt[j];
+      }
+      //  Intern names in file order
+      for (j=0;j<in->Nlib;j++)
+         intern(&lib,in->lib[j],strlen(in->lib[j]),1);
+      c[k].use = (int*)malloc((in->Nuse>0?in->Nuse:1)*sizeof(int));
+      if (!c[k].use) Fatal("Cannot allocate memory for materials\n");
+      for (j=0;j<in->Nuse;j++)
+         c[k].use[j] = intern(&use,in->use[j],strlen(in->use[j]),1);
+      //  Facets before the first usemtl continue the previous material
+      c[k].carry = mat;
+      if (c[k].mat>=0) mat = c[k].use[c[k].mat];
+      c[k].out = obj;
+   }
+   unhash(&use,&obj->use,&obj->Nuse);
+   unhash(&lib,&obj->lib,&obj->Nlib);
+
+   //  A single chunk is used as is
+   if (n==1)
+   {
+      obj->Nv = c->obj.Nv;  obj->V = c->obj.V;  c->obj.V = NULL;
+      obj->Nt = c->obj.Nt;  obj->T = c->obj.T;  c->obj.T = NULL;
+      obj->Nn = c->obj.Nn;  obj->N = c->obj.N;  c->obj.N = NULL;
+      obj->Nf = c->obj.Nf;  obj->F = c->obj.F;  c->obj.F = NULL;
+      obj->K = c->obj.K;  c->obj.K = NULL;
+      obj->M = c->obj.M;  c->obj.M = NULL;
+   }
+   //  Merge chunks in parallel
+   else
+   {
+      obj->Nv = tot[0];
+      obj->Nt = tot[1];
+      obj->Nn = tot[2];
+      obj->Nf = tot[3];
+      obj->V = (float*)malloc((3*tot[0]+1)*sizeof(float));
+      obj->T = (float*)malloc((2*tot[1]+1)*sizeof(float));
+      obj->N = (float*)malloc((3*tot[2]+1)*sizeof(float));
+      obj->F = (int*)malloc((tot[3]+1)*sizeof(int));
+      obj->M = (int*)malloc((tot[3]+1)*sizeof(int));
+      obj->K = (int*)malloc((3*tot[4]+1)*sizeof(int));
+      if (!obj->V || !obj->T || !obj->N || !obj->F || !obj->M || !obj->K)
+         Fatal("Cannot allocate memory for %s\n",file);
+      RunThreads(mergechunk,c,sizeof(chunk_t),n);
+      obj->F[obj->Nf] = tot[4];
+   }
+
+   for (k=0;k<n;k++)
+      freechunk(c+k);
+   free(c);
+   UnmapFile(buf,size);
+}
+
+//
+//  Free parsed OBJ
+//
+void FreeOBJ(obj_t* obj)
+{
+   int k;
+   for (k=0;k<obj->Nuse;k++)
+      free(obj->use[k]);
+   for (k=0;k<obj->Nlib;k++)
+      free(obj->lib[k]);
+   free(obj->use);
+   free(obj->lib);
+   free(obj->V);
+   free(obj->N);
+   free(obj->T);
+   free(obj->F);
+   free(obj->K);
+   free(obj->M);
+}
+
+//
+//  Hash a Vertex/Texture/Normal triplet
+//
+static unsigned int hashtriplet(const int* K)
+{
+   unsigned int h = K[0]*0x9E3779B1u;
+   h = (h ^ (h>>15)) + K[1]*0x85EBCA77u;
+   h = (h ^ (h>>13)) + K[2]*0xC2B2AE3Du;
+   return h ^ (h>>16);
+}
+
+//
+//  Add a material range to the mesh
+//    Consecutive facets with the same material share a range
+//
+static void addrange(mesh_t* mesh,int mat,int start,int* Mr)
+{
+   if (mesh->Nrange>0 && mesh->range[mesh->Nrange-1].mat==mat) return;
+   mesh->range = (range_t*)GrowArray(mesh->range,mesh->Nrange+1,Mr,sizeof(range_t));
+   mesh->range[mesh->Nrange].mat   = mat;
+   mesh->range[mesh->Nrange].start = start;
+   mesh->range[mesh->Nrange].count = 0;
+   mesh->Nrange++;
+}
+
+//
+//  Material of a facet (-1 for none)
+//
+static int facetmtl(const obj_t* obj,const int* mat,int k)
+{
+   return (obj->M[k]<0) ? -1 : mat[obj->M[k]];
+}
+
+//
+//  Build indexed triangle mesh from parsed OBJ
+//    Each unique Vertex/Texture/Normal triplet becomes one vertex
+//    Polygons are triangulated as fans
+//    Facets are grouped so each material is drawn as one range
+//    mat maps usemtl names to materials and Nmtl is the number of materials
+//
+void BuildMesh(const obj_t* obj,const int* mat,int Nmtl,mesh_t* mesh)
+{
+   int k,i,j;
+   int* first;              //  Start of each material in order
+   int* order;              //  Facets sorted by material
+   int Mr=0;                //  Capacity of range array
+   int Nk = obj->F[obj->Nf]; //  Number of triplets
+   unsigned int mask;       //  Hash table size - 1
+   int* slot;               //  Hash table (vertex index or -1)
+   int* remap;              //  Vertex index of each triplet
+
+   memset(mesh,0,sizeof(mesh_t));
+   mesh->Nmtl = Nmtl;
+
+   //  Hash table at most half full
+   for (mask=1;mask<2*(unsigned int)Nk;mask*=2);
+   slot  = (int*)malloc(mask*sizeof(int));
+   remap = (int*)malloc((Nk>0?Nk:1)*sizeof(int));
+   mesh->vert = (float*)malloc((Nk>0?Nk:1)*8*sizeof(float));
+   if (!slot || !remap || !mesh->vert) Fatal("Cannot allocate memory for mesh\n");
+   memset(slot,-1,mask*sizeof(int));
+   mask--;
+
+   //  Deduplicate triplets
+   for (k=0;k<Nk;k++)
+   {
+      const int* K = obj->K+3*k;
+      unsigned int h = hashtriplet(K) & mask;
+      //  Linear probe for a match or an empty slot
+      while (slot[h]>=0 && memcmp(obj->K+3*slot[h],K,3*sizeof(int)))
+         h = (h+1) & mask;
+      if (slot[h]<0)
+      {
+         float* v = mesh->vert + 8*mesh->Nvert;
+         //  Remember the first triplet with this value
+         slot[h] = k;
+         remap[k] = mesh->Nvert++;
+         //  Interleave texture, normal and vertex coordinates
+         if (K[1]) memcpy(v+0,obj->T+2*(K[1]-1),2*sizeof(float));
+         else      v[0] = v[1] = 0;
+         if (K[2]) memcpy(v+2,obj->N+3*(K[2]-1),3*sizeof(float));
+         else      v[2] = v[3] = v[4] = 0;
+         if (K[0]) memcpy(v+5,obj->V+3*(K[0]-1),3*sizeof(float));
+         else      v[5] = v[6] = v[7] = 0;
+         if (K[1]) mesh->attr |= MESH_TEX;
+         if (K[2]) mesh->attr |= MESH_NORM;
+      }
+      else
+         remap[k] = remap[slot[h]];
+   }
+   free(slot);
+
+   //  Group facets by material with a counting sort (no material first)
+   first = (int*)calloc(mesh->Nmtl+2,sizeof(int));
+   order = (int*)malloc((obj->Nf>0?obj->Nf:1)*sizeof(int));
+   if (!first || !order) Fatal("Cannot allocate memory for mesh\n");
+   for (k=0;k<obj->Nf;k++)
+      first[facetmtl(obj,mat,k)+2]++;
+   for (k=0;k<=mesh->Nmtl;k++)
+      first[k+1] += first[k];
+   for (k=0;k<obj->Nf;k++)
+      order[first[facetmtl(obj,mat,k)+1]++] = k;
+
+   //  Triangulate facets
+   for (k=0;k<obj->Nf;k++)
+      if (obj->F[k+1]-obj->F[k]>=3) mesh->Nidx += 3*(obj->F[k+1]-obj->F[k]-2);
+   mesh->idx = (unsigned int*)malloc((mesh->Nidx>0?mesh->Nidx:1)*sizeof(unsigned int));
+   if (!mesh->idx) Fatal("Cannot allocate memory for mesh\n");
+   mesh->Nidx = 0;
+   for (j=0;j<obj->Nf;j++)
+   {
+      k = order[j];
+      addrange(mesh,facetmtl(obj,mat,k),mesh->Nidx,&Mr);
+      for (i=obj->F[k]+2;i<obj->F[k+1];i++)
+      {
+         mesh->idx[mesh->Nidx++] = remap[obj->F[k]];
+         mesh->idx[mesh->Nidx++] = remap[i-1];
+         mesh->idx[mesh->Nidx++] = remap[i];
+      }
+      mesh->range[mesh->Nrange-1].count = mesh->Nidx - mesh->range[mesh->Nrange-1].start;
+   }
+   free(first);
+   free(order);
+   free(remap);
+}
+
+//
+//  Copy mesh to vertex and index buffers
+//
+static void UploadMesh(mesh_t* mesh)
+{
+   glGenBuffers(1,&mesh->vbo);
+   glBindBuffer(GL_ARRAY_BUFFER,mesh->vbo);
+   glBufferData(GL_ARRAY_BUFFER,8*sizeof(float)*mesh->Nvert,mesh->vert,GL_STATIC_DRAW);
+   glBindBuffer(GL_ARRAY_BUFFER,0);
+
+   glGenBuffers(1,&mesh->ibo);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,mesh->ibo);
+   glBufferData(GL_ELEMENT_ARRAY_BUFFER,sizeof(unsigned int)*mesh->Nidx,mesh->idx,GL_STATIC_DRAW);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+   ErrCheck("UploadMesh");
+}
+
+//
+//  Read OBJ file into a mesh ready for upload
+//    Uses the binary cache if it is up to date
+//    Makes no OpenGL calls so it may be used from any thread
+//
+mesh_t* ReadOBJ(const char* file)
+{
+   int k;
+   int* mat;         //  Material for each usemtl name
+   obj_t obj;        //  Parsed file
+   mtllib_t lib;     //  Materials
+   size_t size;      //  Size of cached mesh
+   mesh_t* mesh = (mesh_t*)malloc(sizeof(mesh_t));
+   if (!mesh) Fatal("Cannot allocate memory for mesh\n");
+
+   //  Use binary cache if it is up to date
+   mesh->map = ReadMeshCache(file,mesh,&size);
+   if (mesh->map)
+   {
+      mesh->mapsize = size;
+      return mesh;
+   }
+
+   //  Parse file using every processor
+   ParseOBJ(file,&obj,0);
+
+   //  Load materials
+   memset(&lib,0,sizeof(lib));
+   for (k=0;k<obj.Nlib;k++)
+      LoadMaterial(obj.lib[k],&lib);
+   //  Resolve material names
+   mat = (int*)malloc((obj.Nuse>0?obj.Nuse:1)*sizeof(int));
+   if (!mat) Fatal("Cannot allocate memory for materials\n");
+   for (k=0;k<obj.Nuse;k++)
+      mat[k] = FindMaterial(&lib,obj.use[k]);
+
+   //  Build mesh and save it for next time
+   BuildMesh(&obj,mat,lib.n,mesh);
+   mesh->mtl = lib.mtl;
+   WriteMeshCache(file,&obj,mesh);
+
+   //  Free parsed file and material names
+   freenames(&lib.names);
+   free(lib.index);
+   free(mat);
+   FreeOBJ(&obj);
+   return mesh;
+}
+
+//
+//  Upload mesh from ReadOBJ to OpenGL
+//    Releases the CPU copy and returns a mesh handle for DrawOBJ
+//
+int UploadOBJ(mesh_t* mesh)
+{
+   int k;
+
+   //  Material textures
+   for (k=0;k<mesh->Nmtl;k++)
+   {
+      mtl_t* m = mesh->mtl+k;
+      if (m->img)
+      {
+         m->map = UploadTexture(0,m->img,m->tex);
+         m->img = NULL;
+      }
+   }
+   //  Vertex and index buffers
+   UploadMesh(mesh);
+
+   //  Bounds for culling
+   for (k=0;k<3;k++)
+   {
+      mesh->lo[k] = mesh->Nvert ? +INFINITY : 0;
+      mesh->hi[k] = mesh->Nvert ? -INFINITY : 0;
+   }
+   for (k=0;k<mesh->Nvert;k++)
+   {
+      const float* v = mesh->vert+8*k+5;
+      int i;
+      for (i=0;i<3;i++)
+      {
+         if (v[i]<mesh->lo[i]) mesh->lo[i] = v[i];
+         if (v[i]>mesh->hi[i]) mesh->hi[i] = v[i];
+      }
+   }
+
+   //  Release CPU copy
+   if (mesh->map)
+      UnmapFile(mesh->map,mesh->mapsize);
+   else
+   {
+      free(mesh->vert);
+      free(mesh->idx);
+   }
+   mesh->vert = NULL;
+   mesh->idx  = NULL;
+   mesh->map  = NULL;
+
+   //  Store mesh
+   meshes = (mesh_t*)realloc(meshes,(Nmesh+1)*sizeof(mesh_t));
+   if (!meshes) Fatal("Cannot allocate memory for mesh\n");
+   meshes[Nmesh] = *mesh;
+   free(mesh);
+   return Nmesh++;
+}
+
+//
+//  Load OBJ file
+//    Returns a mesh handle for DrawOBJ
+//
+int LoadOBJ(const char* file)
+{
+   return UploadOBJ(ReadOBJ(file));
+}
+
+//
+//  Bounding box of mesh returned by LoadOBJ
+//
+void OBJBounds(int obj,float lo[3],float hi[3])
+{
+   int k;
+   if (obj<0 || obj>=Nmesh) Fatal("Invalid mesh %d\n",obj);
+   for (k=0;k<3;k++)
+   {
+      lo[k] = meshes[obj].lo[k];
+      hi[k] = meshes[obj].hi[k];
+   }
+}
+
+//
+//  Draw mesh returned by LoadOBJ
+//
+void DrawOBJ(int obj)
+{
+   int k;
+   mesh_t* mesh;
+   const int stride = 8*sizeof(float);
+   if (obj<0 || obj>=Nmesh) Fatal("Invalid mesh %d\n",obj);
+   mesh = meshes+obj;
+
+   //  Push attributes for textures and vertex arrays
+   glPushAttrib(GL_TEXTURE_BIT);
+   glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+   glBindBuffer(GL_ARRAY_BUFFER,mesh->vbo);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,mesh->ibo);
+   //  Interleaved texture, normal and vertex arrays
+   if (mesh->attr & MESH_TEX)
+   {
+      glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+      glTexCoordPointer(2,GL_FLOAT,stride,(void*)0);
+   }
+   if (mesh->attr & MESH_NORM)
+   {
+      glEnableClientState(GL_NORMAL_ARRAY);
+      glNormalPointer(GL_FLOAT,stride,(void*)(2*sizeof(float)));
+   }
+   glEnableClientState(GL_VERTEX_ARRAY);
+   glVertexPointer(3,GL_FLOAT,stride,(void*)(5*sizeof(float)));
+
+   //  Draw each material range
+   for (k=0;k<mesh->Nrange;k++)
+   {
+      const range_t* r = mesh->range+k;
+      if (r->mat>=0) SetMaterial(mesh->mtl+r->mat);
+      glDrawElements(GL_TRIANGLES,r->count,GL_UNSIGNED_INT,(void*)(r->start*sizeof(unsigned int)));
+   }
+
+   //  Restore state
+   glBindBuffer(GL_ARRAY_BUFFER,0);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+   glPopClientAttrib();
+   glPopAttrib();
 }
@@ -0,0 +1,83 @@
+/*
+ *  OBJ loader internals
+ *    Shared by object.c and the loader benchmark
+ */
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include "texture.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Material
+typedef struct
+{
+   char* name;                 //  Material name
+   float Ka[4],Kd[4],Ks[4],Ns; //  Colors and shininess
+   float d;                    //  Transparency
+   char* tex;                  //  Texture file (NULL for none)
+   texdata_t* img;             //  Texture waiting for upload
+   int map;                    //  Texture
+} mtl_t;
+
+//  Parsed OBJ file
+typedef struct
+{
+   int    Nv,Nn,Nt;  //  Number of vertex, normal and texture coordinates
+   float  *V,*N,*T;  //  Vertex (xyz), normal (xyz) and texture (st) arrays
+   int    Nf;        //  Number of facets
+   int*   F;         //  Start of each facet in K (Nf+1 entries)
+   int*   K;         //  Vertex/Texture/Normal triplets (1-based, 0 if absent)
+   int*   M;         //  Material of each facet (index into use, -1 for none)
+   int    Nuse;      //  Number of material names
+   char** use;       //  Material names from usemtl
+   int    Nlib;      //  Number of material libraries
+   char** lib;       //  Material library names from mtllib
+} obj_t;
+
+//  Mesh vertex attributes
+#define MESH_TEX  1
+#define MESH_NORM 2
+
+//  Triangles drawn with one material
+typedef struct
+{
+   int mat;    //  Material (-1 for none)
+   int start;  //  First index
+   int count;  //  Number of indexes
+} range_t;
+
+//  Indexed triangle mesh
+typedef struct
+{
+   int           Nvert;   //  Number of vertexes
+   float*        vert;    //  Interleaved texture, normal and vertex coordinates
+   int           Nidx;    //  Number of indexes
+   unsigned int* idx;     //  Triangle indexes
+   int           Nrange;  //  Number of material ranges
+   range_t*      range;   //  Material ranges
+   int           Nmtl;    //  Number of materials
+   mtl_t*        mtl;     //  Materials
+   int           attr;    //  Attributes present (MESH_TEX|MESH_NORM)
+   unsigned int  vbo,ibo; //  Vertex and index buffers
+   void*         map;     //  Mapped cache holding vert and idx (NULL if allocated)
+   size_t        mapsize; //  Size of mapped cache
+   float         lo[3];   //  Bounding box of the vertexes
+   float         hi[3];
+} mesh_t;
+
+void ParseOBJ(const char* file,obj_t* obj,int threads);
+void FreeOBJ(obj_t* obj);
+void BuildMesh(const obj_t* obj,const int* mat,int Nmtl,mesh_t* mesh);
+void WriteMeshCache(const char* file,const obj_t* obj,const mesh_t* mesh);
+void* ReadMeshCache(const char* file,mesh_t* mesh,size_t* size);
+mesh_t* ReadOBJ(const char* file);
+int UploadOBJ(mesh_t* mesh);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
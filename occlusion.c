@@ -0,0 +1,317 @@
+/*
+ *  Software occlusion culling
+ *
+ *  OcclusionBegin() clears a small depth buffer for the current view,
+ *  OcclusionDraw() rasterizes occluding triangles into it on the CPU, and
+ *  OcclusionVisible() tests the box of anything that might be drawn, so
+ *  objects hidden behind the occluders are never sent to OpenGL.
+ *
+ *  The buffer holds window depth reversed (1 at the near plane and 0 at
+ *  the far plane), which is linear across a triangle on screen for both
+ *  perspective and orthogonal projections, so an empty pixel is 0.
+ *  Triangles are clipped to the near plane and their front faces filled
+ *  where pixel centers fall inside, eight pixels at a time with AVX when
+ *  the CPU has it.  A surface wound the wrong way simply hides nothing.
+ *
+ *  A box counts as hidden only when every pixel it touches holds an
+ *  occluder nearer than the nearest corner of the box.  Occluders are
+ *  stored at their farthest depth within each pixel, so neither an
+ *  occluder nor anything lying on its surface is hidden by it, and boxes
+ *  are tested one pixel beyond their edges to allow for occluders filling
+ *  pixels they only partly cover.  Holes in an occluder smaller than a pixel of the
+ *  buffer are missed, which can hide something seen through one.
+ */
+#include "CSCIx229.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define OCCLUSION_SIMD
+#endif
+
+#define OCCLUSION_SLACK 1e-3  //  Relative depth within which a box counts as in front
+
+static int W=0,H=0;        //  Size of buffer
+static int S=0;            //  Row stride (W rounded up to eight)
+static int Mbuf=0;         //  Capacity of buffer
+static float* buf=NULL;    //  Depth of the nearest occluder in each pixel
+static double M[16];       //  Projection times modelview
+static double scale=1;     //  Buffer pixels per viewport pixel
+static int simd=-1;        //  Use AVX (-1 until checked)
+
+//
+//  Fill pixels [0,n) of a row where the edge functions are not negative
+//    e and z are the edge functions and depth at the first pixel center,
+//    de and dz their steps to the next pixel
+//
+static void fill(float* row,int n,const float e[3],const float de[3],float z,float dz)
+{
+   int i;
+   for (i=0;i<n;i++)
+   {
+      float a=e[0]+i*de[0],b=e[1]+i*de[1],c=e[2]+i*de[2],w=z+i*dz;
+      if (a>=0 && b>=0 && c>=0 && w>row[i]) row[i] = w;
+   }
+}
+
+//
+//  Is any of pixels [0,n) of a row at or behind depth z
+//
+static int open(const float* row,int n,float z)
+{
+   int i;
+   for (i=0;i<n;i++)
+      if (row[i]<=z) return 1;
+   return 0;
+}
+
+#ifdef OCCLUSION_SIMD
+//
+//  fill() eight pixels at a time
+//    Rows are padded to a multiple of eight so the last group fits
+//
+__attribute__((target("avx")))
+static void fill8(float* row,int n,const float e[3],const float de[3],float z,float dz)
+{
+   int i;
+   const __m256 lane = _mm256_set_ps(7,6,5,4,3,2,1,0),zero = _mm256_setzero_ps(),N = _mm256_set1_ps(n);
+   for (i=0;i<n;i+=8)
+   {
+      __m256 k = _mm256_add_ps(_mm256_set1_ps(i),lane);
+      __m256 a = _mm256_add_ps(_mm256_set1_ps(e[0]),_mm256_mul_ps(k,_mm256_set1_ps(de[0])));
+      __m256 b = _mm256_add_ps(_mm256_set1_ps(e[1]),_mm256_mul_ps(k,_mm256_set1_ps(de[1])));
+      __m256 c = _mm256_add_ps(_mm256_set1_ps(e[2]),_mm256_mul_ps(k,_mm256_set1_ps(de[2])));
+      __m256 w = _mm256_add_ps(_mm256_set1_ps(z),_mm256_mul_ps(k,_mm256_set1_ps(dz)));
+      __m256 in = _mm256_and_ps(_mm256_cmp_ps(a,zero,_CMP_GE_OQ),_mm256_cmp_ps(b,zero,_CMP_GE_OQ));
+      in = _mm256_and_ps(in,_mm256_cmp_ps(c,zero,_CMP_GE_OQ));
+      in = _mm256_and_ps(in,_mm256_cmp_ps(k,N,_CMP_LT_OQ));
+      if (_mm256_movemask_ps(in))
+      {
+         __m256 old = _mm256_loadu_ps(row+i);
+         _mm256_storeu_ps(row+i,_mm256_blendv_ps(old,_mm256_max_ps(w,old),in));
+      }
+   }
+}
+
+//
+//  open() eight pixels at a time
+//
+__attribute__((target("avx")))
+static int open8(const float* row,int n,float z)
+{
+   int i;
+   const __m256 lane = _mm256_set_ps(7,6,5,4,3,2,1,0),Z = _mm256_set1_ps(z),N = _mm256_set1_ps(n);
+   for (i=0;i<n;i+=8)
+   {
+      __m256 k = _mm256_add_ps(_mm256_set1_ps(i),lane);
+      __m256 in = _mm256_and_ps(_mm256_cmp_ps(k,N,_CMP_LT_OQ),_mm256_cmp_ps(_mm256_loadu_ps(row+i),Z,_CMP_LE_OQ));
+      if (_mm256_movemask_ps(in)) return 1;
+   }
+   return 0;
+}
+#endif
+
+/*
+ *  Start a width x height occlusion buffer covering the viewport
+ *    Uses the current projection, modelview and viewport
+ */
+void OcclusionBegin(int width,int height)
+{
+   double P[16],V[16];
+   int vp[4],i,j,k;
+   if (simd<0)
+   {
+      simd = 0;
+#ifdef OCCLUSION_SIMD
+      __builtin_cpu_init();
+      simd = __builtin_cpu_supports("avx");
+#endif
+   }
+   if (width<1 || height<1) Fatal("Invalid occlusion buffer size %dx%d\n",width,height);
+   W = width;
+   H = height;
+   S = (W+7)&~7;
+   //  The last group of eight may run past the end of the last row
+   if (S*H+8>Mbuf)
+   {
+      Mbuf = S*H+8;
+      buf = (float*)realloc(buf,Mbuf*sizeof(float));
+      if (!buf) Fatal("Cannot allocate occlusion buffer\n");
+   }
+   memset(buf,0,S*H*sizeof(float));
+   glGetDoublev(GL_PROJECTION_MATRIX,P);
+   glGetDoublev(GL_MODELVIEW_MATRIX,V);
+   glGetIntegerv(GL_VIEWPORT,vp);
+   for (i=0;i<4;i++)
+      for (j=0;j<4;j++)
+      {
+         double s=0;
+         for (k=0;k<4;k++)
+            s += P[4*k+i]*V[4*j+k];
+         M[4*j+i] = s;
+      }
+   scale = vp[2]>0 ? (double)W/vp[2] : 1;
+}
+
+//
+//  Clip coordinates of world point p
+//
+static void clip(const float* p,double c[4])
+{
+   int i;
+   for (i=0;i<4;i++)
+      c[i] = M[i]*p[0] + M[4+i]*p[1] + M[8+i]*p[2] + M[12+i];
+}
+
+//
+//  Buffer x, y and depth of clip coordinates c (in front of the near plane)
+//
+static void window(const double c[4],float s[3])
+{
+   s[0] = (0.5*c[0]/c[3]+0.5)*W;
+   s[1] = (0.5*c[1]/c[3]+0.5)*H;
+   s[2] = 0.5-0.5*c[2]/c[3];
+}
+
+//
+//  Rasterize the triangle with window coordinates a, b and c
+//
+static void triangle(const float* a,const float* b,const float* c)
+{
+   float area,e[3],de[3],dz,dzdy,z,back;
+   float xmin,xmax,ymin,ymax;
+   int x0,x1,y0,y1,y;
+   //  Only front faces (counterclockwise), since the front of a closed
+   //  surface always hides its back, and the inside is then where every
+   //  edge function is positive
+   area = (b[0]-a[0])*(c[1]-a[1]) - (c[0]-a[0])*(b[1]-a[1]);
+   if (!(area>0)) return;
+   //  Pixels whose centers can be inside
+   xmin = fminf(a[0],fminf(b[0],c[0]));
+   xmax = fmaxf(a[0],fmaxf(b[0],c[0]));
+   ymin = fminf(a[1],fminf(b[1],c[1]));
+   ymax = fmaxf(a[1],fmaxf(b[1],c[1]));
+   if (!(xmax>0.5f && xmin<W-0.5f && ymax>0.5f && ymin<H-0.5f)) return;
+   x0 = xmin<0 ? 0 : (int)ceilf(xmin-0.5f);
+   x1 = xmax>W ? W-1 : (int)floorf(xmax-0.5f);
+   y0 = ymin<0 ? 0 : (int)ceilf(ymin-0.5f);
+   y1 = ymax>H ? H-1 : (int)floorf(ymax-0.5f);
+   if (x0>x1 || y0>y1) return;
+   //  Depth plane, moved back to the farthest point of each pixel so
+   //  anything lying on the triangle stays in front of it
+   dz   = ((b[2]-a[2])*(c[1]-a[1]) - (c[2]-a[2])*(b[1]-a[1]))/area;
+   dzdy = ((c[2]-a[2])*(b[0]-a[0]) - (b[2]-a[2])*(c[0]-a[0]))/area;
+   back = 0.5f*(fabsf(dz)+fabsf(dzdy));
+   //  Edge functions step by -dy across and dx down
+   de[0] = a[1]-b[1];
+   de[1] = b[1]-c[1];
+   de[2] = c[1]-a[1];
+   for (y=y0;y<=y1;y++)
+   {
+      float px = x0+0.5f,py = y+0.5f;
+      e[0] = (b[0]-a[0])*(py-a[1]) - (b[1]-a[1])*(px-a[0]);
+      e[1] = (c[0]-b[0])*(py-b[1]) - (c[1]-b[1])*(px-b[0]);
+      e[2] = (a[0]-c[0])*(py-c[1]) - (a[1]-c[1])*(px-c[0]);
+      z = a[2] + dz*(px-a[0]) + dzdy*(py-a[1]) - back;
+#ifdef OCCLUSION_SIMD
+      if (simd)
+         fill8(buf+y*S+x0,x1-x0+1,e,de,z,dz);
+      else
+#endif
+         fill(buf+y*S+x0,x1-x0+1,e,de,z,dz);
+   }
+}
+
+/*
+ *  Draw n occluding triangles (9 floats each in world coordinates)
+ */
+void OcclusionDraw(const float* tri,int n)
+{
+   int k,i,j;
+   if (!W) return;
+   for (k=0;k<n;k++)
+   {
+      double c[3][4],p[4][4];
+      float s[4][3];
+      int m=0,out=0;
+      for (i=0;i<3;i++)
+         clip(tri+9*k+3*i,c[i]);
+      //  Skip triangles entirely beyond one side of the view volume
+      for (j=0;j<2;j++)
+      {
+         int below=1,above=1;
+         for (i=0;i<3;i++)
+         {
+            if (c[i][j]>=-c[i][3]) below = 0;
+            if (c[i][j]<=c[i][3]) above = 0;
+         }
+         out |= below|above;
+      }
+      if (out) continue;
+      //  Clip to the near plane z=-w
+      for (i=0;i<3;i++)
+      {
+         const double* a = c[i];
+         const double* b = c[(i+1)%3];
+         double da = a[2]+a[3],db = b[2]+b[3];
+         if (da>=0) memcpy(p[m++],a,sizeof(p[0]));
+         if ((da>=0)!=(db>=0))
+         {
+            double f = da/(da-db);
+            for (j=0;j<4;j++)
+               p[m][j] = a[j]+f*(b[j]-a[j]);
+            m++;
+         }
+      }
+      for (i=0;i<m;i++)
+         window(p[i],s[i]);
+      for (i=2;i<m;i++)
+         triangle(s[0],s[i-1],s[i]);
+   }
+}
+
+/*
+ *  Can any of box lo-hi be seen past the occluders
+ *    pad widens the box on screen by that many viewport pixels
+ *    Always true before OcclusionBegin() and for boxes crossing the near
+ *    plane
+ */
+int OcclusionVisible(const float lo[3],const float hi[3],double pad)
+{
+   float xmin=INFINITY,xmax=-INFINITY,ymin=INFINITY,ymax=-INFINITY,z=0;
+   int k,x0,x1,y0,y1,y;
+   if (!W) return 1;
+   for (k=0;k<8;k++)
+   {
+      float p[3] = {(k&1)?hi[0]:lo[0],(k&2)?hi[1]:lo[1],(k&4)?hi[2]:lo[2]};
+      double c[4];
+      float s[3];
+      clip(p,c);
+      if (c[2]+c[3]<0 || c[3]<=0) return 1;
+      window(c,s);
+      xmin = fminf(xmin,s[0]);
+      xmax = fmaxf(xmax,s[0]);
+      ymin = fminf(ymin,s[1]);
+      ymax = fmaxf(ymax,s[1]);
+      z = fmaxf(z,s[2]);
+   }
+   //  Every pixel the box touches and one more, since an occluder fills a
+   //  pixel whose center it covers even if it misses the rest
+   pad = pad*scale + 1;
+   x0 = (int)floor(fmax(xmin-pad,0));
+   x1 = (int)floor(fmin(xmax+pad,W-1));
+   y0 = (int)floor(fmax(ymin-pad,0));
+   y1 = (int)floor(fmin(ymax+pad,H-1));
+   if (x0>x1 || y0>y1) return 0;
+   z = z*(1+OCCLUSION_SLACK) + 1e-6f;
+   for (y=y0;y<=y1;y++)
+   {
+#ifdef OCCLUSION_SIMD
+      if (simd)
+      {
+         if (open8(buf+y*S+x0,x1-x0+1,z)) return 1;
+      }
+      else
+#endif
+      if (open(buf+y*S+x0,x1-x0+1,z)) return 1;
+   }
+   return 0;
+}
@@ -0,0 +1,381 @@
+/*
+ *  Octree for view frustum culling
+ *
+ *  An octree holds items identified by an integer with an axis aligned
+ *  bounding box.  Each item sits in the smallest node that contains its
+ *  box, and leaves split once they hold more than OCTREE_LEAF items, so
+ *  points end up in small leaves while large objects stay near the root.
+ *  The root doubles towards items that fall outside it, so items can be
+ *  added in any order without knowing the extent of the world first.
+ *
+ *  CullOctree() extracts the view frustum from the current projection and
+ *  modelview matrices and returns the items whose boxes intersect it.
+ *  Nodes entirely outside are skipped and nodes entirely inside are taken
+ *  whole, so the cost follows what is on screen rather than the number
+ *  of items.
+ */
+#include "CSCIx229.h"
+
+#define OCTREE_LEAF  16  //  Items in a leaf before it splits
+#define OCTREE_DEPTH 20  //  Deepest level below the first root
+
+//  Octree node (children are 8 consecutive nodes)
+typedef struct
+{
+   float c[3];  //  Center
+   float h;     //  Half size
+   int child;   //  First child (-1 for a leaf)
+   int head;    //  First item stored here (-1 for none)
+   int n;       //  Number of items stored here
+   int depth;   //  Level (0 for the first root, negative above it)
+} onode_t;
+
+//  Octree
+typedef struct
+{
+   int Nnode,Mnode;    //  Nodes and capacity (node 0 is the root)
+   onode_t* node;      //  Nodes
+   int Nitem,Mitem;    //  Items and capacity
+   int* id;            //  Item identifiers
+   float* box;         //  Item boxes (lo xyz then hi xyz)
+   int* next;          //  Next item in the same node (-1 for none)
+   int Nout,Mout;      //  Culled items and capacity
+   int* out;           //  Culled items
+} octree_t;
+
+static int Ntree=0;            //  Number of octrees
+static octree_t* trees=NULL;   //  Octrees
+
+//
+//  Look up octree
+//
+static octree_t* tree(int k)
+{
+   if (k<0 || k>=Ntree) Fatal("Invalid octree %d\n",k);
+   return trees+k;
+}
+
+//
+//  Add n empty leaves and return the first
+//
+static int newnodes(octree_t* t,int n)
+{
+   int k,first = t->Nnode;
+   t->node = (onode_t*)GrowArray(t->node,t->Nnode+n,&t->Mnode,sizeof(onode_t));
+   for (k=first;k<first+n;k++)
+   {
+      t->node[k].child = -1;
+      t->node[k].head = -1;
+      t->node[k].n = 0;
+   }
+   t->Nnode += n;
+   return first;
+}
+
+//
+//  Does node k contain the box
+//
+static int contains(const onode_t* nd,const float* b)
+{
+   int i;
+   for (i=0;i<3;i++)
+      if (b[i]<nd->c[i]-nd->h || b[i+3]>nd->c[i]+nd->h) return 0;
+   return 1;
+}
+
+//
+//  Octant of node holding the center of the box
+//
+static int octant(const onode_t* nd,const float* b)
+{
+   int i,o=0;
+   for (i=0;i<3;i++)
+      if (b[i]+b[i+3]>2*nd->c[i]) o |= 1<<i;
+   return o;
+}
+
+//
+//  Create the 8 children of node k
+//
+static void split(octree_t* t,int k)
+{
+   int o,i;
+   int first = newnodes(t,8);
+   onode_t* nd = t->node+k;
+   nd->child = first;
+   for (o=0;o<8;o++)
+   {
+      onode_t* ch = t->node+first+o;
+      for (i=0;i<3;i++)
+         ch->c[i] = nd->c[i] + ((o>>i)&1 ? 0.5f : -0.5f)*nd->h;
+      ch->h = 0.5f*nd->h;
+      ch->depth = nd->depth+1;
+   }
+}
+
+//
+//  Link item into node k
+//
+static void link(octree_t* t,int k,int item)
+{
+   t->next[item] = t->node[k].head;
+   t->node[k].head = item;
+   t->node[k].n++;
+}
+
+//
+//  Put item in the smallest node below k that contains it
+//
+static void place(octree_t* t,int k,int item)
+{
+   const float* b = t->box+6*item;
+   for (;;)
+   {
+      onode_t* nd = t->node+k;
+      int ch;
+      if (nd->child<0)
+      {
+         //  Split full leaves and push their items down
+         if (nd->n<OCTREE_LEAF || nd->depth>=OCTREE_DEPTH)
+         {
+            link(t,k,item);
+            return;
+         }
+         else
+         {
+            int i = nd->head;
+            split(t,k);
+            nd = t->node+k;
+            nd->head = -1;
+            nd->n = 0;
+            while (i>=0)
+            {
+               int j = t->next[i];
+               const float* bi = t->box+6*i;
+               int c = nd->child+octant(nd,bi);
+               link(t,contains(t->node+c,bi) ? c : k,i);
+               i = j;
+            }
+         }
+      }
+      ch = nd->child+octant(nd,b);
+      if (!contains(t->node+ch,b))
+      {
+         link(t,k,item);
+         return;
+      }
+      k = ch;
+   }
+}
+
+//
+//  Double the root towards box b
+//    The old root becomes one of the new root's children
+//
+static void enlarge(octree_t* t,const float* b)
+{
+   int i,o=0;
+   onode_t root = t->node[0];
+   int first = newnodes(t,8);
+   onode_t* nd = t->node;
+   //  Grow towards the side the box is on
+   for (i=0;i<3;i++)
+   {
+      float s = (b[i]+b[i+3]<2*root.c[i]) ? -1 : 1;
+      nd->c[i] = root.c[i] + s*root.h;
+      if (s<0) o |= 1<<i;
+   }
+   nd->h = 2*root.h;
+   nd->child = first;
+   nd->head = -1;
+   nd->n = 0;
+   nd->depth = root.depth-1;
+   for (i=0;i<8;i++)
+   {
+      onode_t* ch = t->node+first+i;
+      int j;
+      if (i==o)
+         *ch = root;
+      else
+      {
+         for (j=0;j<3;j++)
+            ch->c[j] = nd->c[j] + ((i>>j)&1 ? 0.5f : -0.5f)*nd->h;
+         ch->h = root.h;
+         ch->depth = root.depth;
+      }
+   }
+}
+
+/*
+ *  Create an empty octree
+ *    Returns the handle for the other octree functions
+ */
+int NewOctree(void)
+{
+   trees = (octree_t*)realloc(trees,(Ntree+1)*sizeof(octree_t));
+   if (!trees) Fatal("Cannot allocate memory for octree\n");
+   memset(trees+Ntree,0,sizeof(octree_t));
+   return Ntree++;
+}
+
+/*
+ *  Remove all items from an octree
+ */
+void ClearOctree(int k)
+{
+   octree_t* t = tree(k);
+   t->Nnode = 0;
+   t->Nitem = 0;
+}
+
+/*
+ *  Add an item with bounding box lo to hi
+ */
+void OctreeAdd(int k,int id,const float lo[3],const float hi[3])
+{
+   int i,item;
+   float* b;
+   octree_t* t = tree(k);
+   //  Items without a finite box are never visible
+   for (i=0;i<3;i++)
+      if (!(lo[i]<=hi[i]) || !isfinite(lo[i]) || !isfinite(hi[i])) return;
+   item = t->Nitem++;
+   if (t->Nitem>t->Mitem)
+   {
+      t->id   = (int*)GrowArray(t->id,t->Nitem,&t->Mitem,sizeof(int));
+      t->next = (int*)realloc(t->next,t->Mitem*sizeof(int));
+      t->box  = (float*)realloc(t->box,6*t->Mitem*sizeof(float));
+      if (!t->next || !t->box) Fatal("Cannot allocate memory for octree\n");
+   }
+   t->id[item] = id;
+   b = t->box+6*item;
+   for (i=0;i<3;i++)
+   {
+      b[i] = lo[i];
+      b[i+3] = hi[i];
+   }
+   //  The first item sets the root
+   if (t->Nnode==0)
+   {
+      float h = 1;
+      newnodes(t,1);
+      for (i=0;i<3;i++)
+      {
+         t->node[0].c[i] = 0.5f*(lo[i]+hi[i]);
+         while (h<hi[i]-lo[i]) h *= 2;
+      }
+      t->node[0].h = h;
+      t->node[0].depth = 0;
+   }
+   while (!contains(t->node,b))
+      enlarge(t,b);
+   place(t,0,item);
+}
+
+//
+//  Classify box against frustum
+//    Returns 0 if outside, 1 if crossing and 2 if inside
+//
+static int classify(const double P[6][4],const float* lo,const float* hi)
+{
+   int k,in=2;
+   for (k=0;k<6;k++)
+   {
+      const double* p = P[k];
+      //  Corners furthest along and against the plane normal
+      double far  = p[0]*(p[0]>0?hi[0]:lo[0]) + p[1]*(p[1]>0?hi[1]:lo[1]) + p[2]*(p[2]>0?hi[2]:lo[2]) + p[3];
+      double near = p[0]*(p[0]>0?lo[0]:hi[0]) + p[1]*(p[1]>0?lo[1]:hi[1]) + p[2]*(p[2]>0?lo[2]:hi[2]) + p[3];
+      if (far<0) return 0;
+      if (near<0) in = 1;
+   }
+   return in;
+}
+
+//
+//  Add item to the culled list
+//
+static void emit(octree_t* t,int item)
+{
+   t->out[t->Nout++] = t->id[item];
+}
+
+//
+//  Add every item at and below node k
+//
+static void all(octree_t* t,int k)
+{
+   int i,o;
+   for (i=t->node[k].head;i>=0;i=t->next[i])
+      emit(t,i);
+   if (t->node[k].child>=0)
+      for (o=0;o<8;o++)
+         all(t,t->node[k].child+o);
+}
+
+//
+//  Add items at and below node k that intersect the frustum
+//
+static void cull(octree_t* t,int k,const double P[6][4])
+{
+   int i,o,in;
+   float lo[3],hi[3];
+   const onode_t* nd = t->node+k;
+   for (i=0;i<3;i++)
+   {
+      lo[i] = nd->c[i]-nd->h;
+      hi[i] = nd->c[i]+nd->h;
+   }
+   in = classify(P,lo,hi);
+   if (in==2)
+      all(t,k);
+   else if (in==1)
+   {
+      for (i=nd->head;i>=0;i=t->next[i])
+         if (classify(P,t->box+6*i,t->box+6*i+3))
+            emit(t,i);
+      if (nd->child>=0)
+         for (o=0;o<8;o++)
+            cull(t,t->node[k].child+o,P);
+   }
+}
+
+/*
+ *  Items visible with the current projection and modelview
+ *    Returns the identifiers of items whose boxes intersect the view
+ *    frustum in no particular order and sets n to their number
+ *    The list may be reordered and is valid until the next call for the
+ *    same octree
+ */
+int* CullOctree(int k,int* n)
+{
+   int i;
+   double mv[16],pr[16],m[16],P[6][4];
+   octree_t* t = tree(k);
+   t->Nout = 0;
+   if (t->Nnode>0)
+   {
+      //  Clip matrix is projection times modelview
+      glGetDoublev(GL_MODELVIEW_MATRIX,mv);
+      glGetDoublev(GL_PROJECTION_MATRIX,pr);
+      for (i=0;i<16;i++)
+      {
+         int r=i%4,c=i/4;
+         m[i] = pr[r]*mv[4*c] + pr[r+4]*mv[4*c+1] + pr[r+8]*mv[4*c+2] + pr[r+12]*mv[4*c+3];
+      }
+      //  Planes are the w row plus or minus the x, y and z rows
+      for (i=0;i<3;i++)
+      {
+         int j;
+         for (j=0;j<4;j++)
+         {
+            P[2*i][j]   = m[4*j+3] + m[4*j+i];
+            P[2*i+1][j] = m[4*j+3] - m[4*j+i];
+         }
+      }
+      //  Room for every item so adding one is a store
+      t->out = (int*)GrowArray(t->out,t->Nitem,&t->Mout,sizeof(int));
+      cull(t,0,P);
+   }
+   *n = t->Nout;
+   return t->out;
+}
@@ -0,0 +1,144 @@
+/*
+ *  Batched overlay
+ *
+ *  OverlayPoint() and OverlayLine() gather points and lines into vertex
+ *  arrays, one batch per primitive and point size or line width.
+ *  DrawOverlay() submits each batch with a single glDrawArrays, so the
+ *  overlay costs a handful of draw calls however many landmarks and
+ *  cameras there are.
+ *
+ *  The overlay is kept until ClearOverlay(), so it only has to be built
+ *  again when what it shows changes.  Batches are copied to a vertex
+ *  buffer the first time they are drawn after a change and redrawn from
+ *  there.
+ */
+#include "CSCIx229.h"
+#include <stddef.h>
+
+#define OVERLAY_BATCHES 16  //  Maximum number of batches
+
+//  Overlay vertex (color and position)
+typedef struct
+{
+   unsigned char c[4];  //  RGBA color
+   float x,y,z;         //  Position
+} ovtx_t;
+
+//  Vertexes drawn with one primitive and size
+typedef struct
+{
+   GLenum mode;  //  GL_POINTS or GL_LINES
+   float size;   //  Point size or line width
+   int n,max;    //  Number of vertexes and capacity
+   ovtx_t* v;    //  Vertexes
+   unsigned int vbo;  //  Vertex buffer
+   int built;    //  Vertexes in the buffer (-1 if changed since)
+} batch_t;
+
+static int Nbatch=0;                    //  Number of batches
+static batch_t batch[OVERLAY_BATCHES];  //  Batches (kept to reuse memory)
+
+//
+//  Find or add batch for a primitive and size
+//
+static batch_t* find(GLenum mode,float size)
+{
+   int k;
+   for (k=0;k<Nbatch;k++)
+      if (batch[k].mode==mode && batch[k].size==size)
+         return batch+k;
+   if (Nbatch==OVERLAY_BATCHES) Fatal("Too many overlay styles\n");
+   batch[Nbatch].mode = mode;
+   batch[Nbatch].size = size;
+   batch[Nbatch].built = -1;
+   return batch+Nbatch++;
+}
+
+//
+//  Add vertex to batch
+//
+static void add(batch_t* b,const float rgba[4],double x,double y,double z)
+{
+   int k;
+   ovtx_t* v;
+   if (b->n==b->max)
+   {
+      b->max = b->max ? 2*b->max : 256;
+      b->v = (ovtx_t*)realloc(b->v,b->max*sizeof(ovtx_t));
+      if (!b->v) Fatal("Cannot allocate memory for overlay\n");
+   }
+   v = b->v+b->n++;
+   b->built = -1;
+   for (k=0;k<4;k++)
+      v->c[k] = rgba[k]<=0 ? 0 : rgba[k]>=1 ? 255 : (unsigned char)(255*rgba[k]+0.5);
+   v->x = x;
+   v->y = y;
+   v->z = z;
+}
+
+/*
+ *  Add a point of the given size and color to the overlay
+ */
+void OverlayPoint(float size,const float rgba[4],double x,double y,double z)
+{
+   add(find(GL_POINTS,size),rgba,x,y,z);
+}
+
+/*
+ *  Add a line of the given width and color to the overlay
+ */
+void OverlayLine(float width,const float rgba[4],double x0,double y0,double z0,double x1,double y1,double z1)
+{
+   batch_t* b = find(GL_LINES,width);
+   add(b,rgba,x0,y0,z0);
+   add(b,rgba,x1,y1,z1);
+}
+
+/*
+ *  Empty the overlay
+ */
+void ClearOverlay(void)
+{
+   int k;
+   for (k=0;k<Nbatch;k++)
+   {
+      batch[k].n = 0;
+      batch[k].built = -1;
+   }
+}
+
+/*
+ *  Draw the overlay
+ *    Uses the current transformation with lighting and textures as set
+ */
+void DrawOverlay(void)
+{
+   int k;
+   glPushAttrib(GL_POINT_BIT|GL_LINE_BIT|GL_CURRENT_BIT);
+   glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+   glEnableClientState(GL_COLOR_ARRAY);
+   glEnableClientState(GL_VERTEX_ARRAY);
+   for (k=0;k<Nbatch;k++)
+   {
+      batch_t* b = batch+k;
+      if (!b->n) continue;
+      if (!b->vbo) glGenBuffers(1,&b->vbo);
+      glBindBuffer(GL_ARRAY_BUFFER,b->vbo);
+      //  Copy to the buffer after a change
+      if (b->built<0)
+      {
+         glBufferData(GL_ARRAY_BUFFER,b->n*sizeof(ovtx_t),b->v,GL_STATIC_DRAW);
+         b->built = b->n;
+      }
+      if (b->mode==GL_POINTS)
+         glPointSize(b->size);
+      else
+         glLineWidth(b->size);
+      glColorPointer(4,GL_UNSIGNED_BYTE,sizeof(ovtx_t),(void*)0);
+      glVertexPointer(3,GL_FLOAT,sizeof(ovtx_t),(void*)offsetof(ovtx_t,x));
+      glDrawArrays(b->mode,0,b->built);
+   }
+   glBindBuffer(GL_ARRAY_BUFFER,0);
+   glPopClientAttrib();
+   glPopAttrib();
+}
@@ -0,0 +1,399 @@
+/*
+ *  Bag of words place recognition
+ *
+ *  A vocabulary tree quantizes descriptors into words by descending a
+ *  hierarchical k-means tree, so a lookup costs k*levels distances however
+ *  many words there are.  The place database keeps an inverted file with
+ *  the keyframes that contain each word and their TF-IDF weights.  A query
+ *  only visits the postings of its own words, so it costs the number of
+ *  keyframes that share words with it rather than the size of the history.
+ *  To bound that as the database grows, a query visits its rarest words
+ *  first and stops before exceeding a budget of postings.  Common words
+ *  carry little weight and say little about where the camera is, so they
+ *  are the ones left out.
+ */
+#include "CSCIx229.h"
+#include "slam.h"
+
+#define VOCAB_ITER 10  //  k-means iterations at each node
+
+//
+//  Squared distance between descriptors
+//
+static float dist2(const float* a,const float* b,int dim)
+{
+   int i;
+   float d=0;
+   for (i=0;i<dim;i++)
+      d += (a[i]-b[i])*(a[i]-b[i]);
+   return d;
+}
+
+//
+//  Nearest of k centers
+//
+static int nearest(const float* center,int k,int dim,const float* desc)
+{
+   int j,best=0;
+   float d,dmin=dist2(center,desc,dim);
+   for (j=1;j<k;j++)
+   {
+      d = dist2(center+j*dim,desc,dim);
+      if (d<dmin)
+      {
+         dmin = d;
+         best = j;
+      }
+   }
+   return best;
+}
+
+//
+//  Add k nodes to the vocabulary tree
+//    Returns the index of the first
+//
+static int addnodes(vocab_t* voc,int k)
+{
+   int j,n=voc->Nnode;
+   if (n+k>voc->Mnode)
+   {
+      voc->Mnode  = ArrayCapacity(voc->Mnode,n+k);
+      voc->center = (float*)ResizeArray(voc->center,voc->Mnode,voc->dim*sizeof(float));
+      voc->child  = (int*)ResizeArray(voc->child,voc->Mnode,sizeof(int));
+      voc->word   = (int*)ResizeArray(voc->word,voc->Mnode,sizeof(int));
+   }
+   for (j=n;j<n+k;j++)
+      voc->child[j] = voc->word[j] = -1;
+   voc->Nnode += k;
+   return n;
+}
+
+//
+//  Cluster descriptors idx[0..n-1] under node
+//    Centers are seeded with evenly spaced descriptors and refined with
+//    Lloyd iterations, then each cluster is split in turn
+//
+static void split(vocab_t* voc,int node,const float* desc,int* idx,int n,int levels)
+{
+   int i,j,it,c0,k=voc->k,dim=voc->dim;
+   int *assign,*count,*tmp;
+   float* center;
+
+   //  Leaf
+   if (levels==0 || n<=k)
+   {
+      voc->word[node] = voc->Nword++;
+      return;
+   }
+   c0 = addnodes(voc,k);
+   voc->child[node] = c0;
+   center = voc->center+c0*dim;
+   for (j=0;j<k;j++)
+      memcpy(center+j*dim,desc+(size_t)idx[(long long)j*n/k]*dim,dim*sizeof(float));
+
+   //  Lloyd iterations
+   assign = (int*)ResizeArray(NULL,n,sizeof(int));
+   count  = (int*)ResizeArray(NULL,k+1,sizeof(int));
+   for (it=0;it<VOCAB_ITER;it++)
+   {
+      int moved=0;
+      for (i=0;i<n;i++)
+      {
+         int a = nearest(center,k,dim,desc+(size_t)idx[i]*dim);
+         if (it==0 || a!=assign[i]) moved++;
+         assign[i] = a;
+      }
+      if (!moved) break;
+      //  New centers are the means (an empty cluster keeps its center)
+      memset(count,0,k*sizeof(int));
+      for (i=0;i<n;i++)
+         count[assign[i]]++;
+      for (j=0;j<k;j++)
+         if (count[j]) memset(center+j*dim,0,dim*sizeof(float));
+      for (i=0;i<n;i++)
+      {
+         const float* d = desc+(size_t)idx[i]*dim;
+         float* c = center+assign[i]*dim;
+         for (j=0;j<dim;j++)
+            c[j] += d[j];
+      }
+      for (j=0;j<k;j++)
+         for (i=0;i<dim && count[j];i++)
+            center[j*dim+i] /= count[j];
+   }
+
+   //  Group descriptors by cluster
+   memset(count,0,(k+1)*sizeof(int));
+   for (i=0;i<n;i++)
+      count[assign[i]+1]++;
+   for (j=0;j<k;j++)
+      count[j+1] += count[j];
+   tmp = (int*)ResizeArray(NULL,n,sizeof(int));
+   for (i=0;i<n;i++)
+      tmp[count[assign[i]]++] = idx[i];
+   memcpy(idx,tmp,n*sizeof(int));
+   free(tmp);
+   free(assign);
+
+   //  Split clusters (count[j] is now the end of cluster j)
+   for (j=0;j<k;j++)
+   {
+      int start = j ? count[j-1] : 0;
+      split(voc,c0+j,desc,idx+start,count[j]-start,levels-1);
+   }
+   free(count);
+}
+
+/*
+ *  Build a vocabulary tree from n descriptors of dim floats
+ *    Each level splits clusters k ways, so there are up to k^levels words
+ */
+void BuildVocabulary(vocab_t* voc,const float* desc,int n,int dim,int k,int levels)
+{
+   int i;
+   int* idx;
+   if (dim<1 || k<2 || levels<1) Fatal("Invalid vocabulary shape %d %d %d\n",dim,k,levels);
+   memset(voc,0,sizeof(vocab_t));
+   voc->dim = dim;
+   voc->k   = k;
+   addnodes(voc,1);
+   memset(voc->center,0,dim*sizeof(float));
+   idx = (int*)ResizeArray(NULL,n,sizeof(int));
+   for (i=0;i<n;i++)
+      idx[i] = i;
+   split(voc,0,desc,idx,n,levels);
+   free(idx);
+}
+
+/*
+ *  Release vocabulary memory
+ */
+void FreeVocabulary(vocab_t* voc)
+{
+   free(voc->center);
+   free(voc->child);
+   free(voc->word);
+   memset(voc,0,sizeof(vocab_t));
+}
+
+/*
+ *  Word of a descriptor
+ */
+int LookupWord(const vocab_t* voc,const float* desc)
+{
+   int node=0;
+   if (!voc->Nnode) Fatal("Empty vocabulary\n");
+   while (voc->child[node]>=0)
+      node = voc->child[node] + nearest(voc->center+voc->child[node]*voc->dim,voc->k,voc->dim,desc);
+   return voc->word[node];
+}
+
+/*
+ *  Initialize an empty place database
+ *    budget limits the postings visited by a query (0 for no limit)
+ */
+void InitPlaces(placedb_t* db,int budget)
+{
+   memset(db,0,sizeof(placedb_t));
+   db->budget = budget;
+}
+
+/*
+ *  Release place database memory
+ */
+void FreePlaces(placedb_t* db)
+{
+   int w;
+   for (w=0;w<db->Nword;w++)
+      free(db->post[w]);
+   free(db->post);
+   free(db->Npost);
+   free(db->Mpost);
+   free(db->score);
+   free(db->touched);
+   free(db->word);
+   free(db->count);
+   free(db->weight);
+   free(db->order);
+   memset(db,0,sizeof(placedb_t));
+}
+
+//
+//  Sort integers
+//
+static int cmpint(const void* p,const void* q)
+{
+   int a = *(const int*)p;
+   int b = *(const int*)q;
+   return (a>b) - (a<b);
+}
+
+//
+//  Distinct words and their counts
+//    Returns the number of distinct words in db->word and db->count
+//
+static int distinct(placedb_t* db,const int* words,int n)
+{
+   int i,m=0;
+   if (!db->word || n>db->Mq)
+   {
+      db->Mq = ArrayCapacity(db->Mq,n);
+      db->word  = (int*)ResizeArray(db->word,db->Mq,sizeof(int));
+      db->count = (int*)ResizeArray(db->count,db->Mq,sizeof(int));
+      db->weight = (float*)ResizeArray(db->weight,db->Mq,sizeof(float));
+      db->order  = (int*)ResizeArray(db->order,db->Mq,2*sizeof(int));
+   }
+   memcpy(db->word,words,n*sizeof(int));
+   qsort(db->word,n,sizeof(int),cmpint);
+   for (i=0;i<n;i++)
+   {
+      if (db->word[i]<0) Fatal("Invalid word %d\n",db->word[i]);
+      if (m && db->word[m-1]==db->word[i])
+         db->count[m-1]++;
+      else
+      {
+         db->word[m] = db->word[i];
+         db->count[m++] = 1;
+      }
+   }
+   return m;
+}
+
+//
+//  Normalized TF-IDF weights of the distinct words
+//    Uses smoothed IDF so words in every keyframe still count a little
+//
+static void weights(placedb_t* db,int m,float* w)
+{
+   int i;
+   double norm=0;
+   for (i=0;i<m;i++)
+   {
+      int df = db->word[i]<db->Nword ? db->Npost[db->word[i]] : 0;
+      w[i] = db->count[i]*(log((db->Ncam+1.0)/(df+1.0))+1);
+      norm += w[i]*w[i];
+   }
+   norm = norm>0 ? 1/sqrt(norm) : 0;
+   for (i=0;i<m;i++)
+      w[i] *= norm;
+}
+
+/*
+ *  Add keyframe cam containing n words (repeats allowed)
+ *    Weights use the IDF when the keyframe is added
+ */
+void AddPlace(placedb_t* db,int cam,const int* words,int n)
+{
+   int i,m;
+   float* w;
+   if (cam<0) Fatal("Invalid keyframe %d\n",cam);
+   m = distinct(db,words,n);
+   w = db->weight;
+   weights(db,m,w);
+
+   //  Grow word lists and score array
+   if (m && db->word[m-1]>=db->Nword)
+   {
+      int N = db->word[m-1]+1;
+      db->Npost = (int*)ResizeArray(db->Npost,N,sizeof(int));
+      db->Mpost = (int*)ResizeArray(db->Mpost,N,sizeof(int));
+      db->post  = (placepost_t**)ResizeArray(db->post,N,sizeof(placepost_t*));
+      for (i=db->Nword;i<N;i++)
+      {
+         db->Npost[i] = db->Mpost[i] = 0;
+         db->post[i] = NULL;
+      }
+      db->Nword = N;
+   }
+   if (cam>=db->Mcam)
+   {
+      int M = ArrayCapacity(db->Mcam,cam+1);
+      db->score = (float*)ResizeArray(db->score,M,sizeof(float));
+      for (i=db->Mcam;i<M;i++)
+         db->score[i] = 0;
+      db->Mcam = M;
+   }
+
+   //  Append postings
+   for (i=0;i<m;i++)
+   {
+      int k = db->word[i];
+      if (db->Npost[k]==db->Mpost[k])
+      {
+         db->Mpost[k] = db->Mpost[k] ? 2*db->Mpost[k] : 4;
+         db->post[k] = (placepost_t*)ResizeArray(db->post[k],db->Mpost[k],sizeof(placepost_t));
+      }
+      db->post[k][db->Npost[k]].cam = cam;
+      db->post[k][db->Npost[k]].w = w[i];
+      db->Npost[k]++;
+   }
+   db->Ncam++;
+}
+
+//
+//  Insert match into top k list sorted by decreasing score
+//
+static void insert(placematch_t* match,int* n,int k,int cam,float score)
+{
+   int i;
+   if (*n==k && score<=match[k-1].score) return;
+   i = (*n<k) ? (*n)++ : k-1;
+   for (;i>0 && match[i-1].score<score;i--)
+      match[i] = match[i-1];
+   match[i].cam   = cam;
+   match[i].score = score;
+}
+
+/*
+ *  Find the k keyframes before keyframe 'before' most similar to n words
+ *    Fills match in decreasing order of score and returns the number found
+ *    Keyframes sharing no visited word with the query are not returned
+ */
+int QueryPlaces(placedb_t* db,const int* words,int n,int before,placematch_t* match,int k)
+{
+   int i,j,m,Ntouch=0,found=0;
+   long budget = db->budget>0 ? db->budget : -1;
+   if (k<1) return 0;
+   m = distinct(db,words,n);
+   weights(db,m,db->weight);
+   if (db->Mtouch<db->Mcam)
+   {
+      db->Mtouch = db->Mcam;
+      db->touched = (int*)ResizeArray(db->touched,db->Mtouch,sizeof(int));
+   }
+
+   //  Visit rare words first (pairs sort by their first element)
+   for (i=0;i<m;i++)
+   {
+      db->order[2*i]   = db->word[i]<db->Nword ? db->Npost[db->word[i]] : 0;
+      db->order[2*i+1] = i;
+   }
+   qsort(db->order,m,2*sizeof(int),cmpint);
+
+   //  Accumulate scores over the postings of each word within budget
+   for (i=0;i<m;i++)
+   {
+      int W = db->word[db->order[2*i+1]];
+      float w = db->weight[db->order[2*i+1]];
+      const placepost_t* P;
+      if (W>=db->Nword) continue;
+      if (budget>=0 && (budget-=db->Npost[W])<0) break;
+      P = db->post[W];
+      for (j=0;j<db->Npost[W];j++)
+      {
+         int cam = P[j].cam;
+         if (cam>=before) continue;
+         if (db->score[cam]==0) db->touched[Ntouch++] = cam;
+         db->score[cam] += w*P[j].w;
+      }
+   }
+
+   //  Best k and reset scores
+   for (i=0;i<Ntouch;i++)
+   {
+      int cam = db->touched[i];
+      insert(match,&found,k,cam,db->score[cam]);
+      db->score[cam] = 0;
+   }
+   return found;
+}
@@ -0,0 +1,134 @@
+/*
+ *  Place recognition benchmark
+ *
+ *  Trains a vocabulary tree on random descriptors, then drives a camera
+ *  around a loop of places so every place is revisited again and again.
+ *  Each keyframe sees its place's features with some replaced by
+ *  clutter, queries the database for an earlier keyframe of the same
+ *  place and is then added.  Reports the time per query and how often the
+ *  best match is the right place as the database grows, with and without
+ *  a budget on the postings a query visits.
+ *
+ *  Usage:
+ *    placebench [keyframes] [places] [budget]
+ */
+#include "CSCIx229.h"
+#include "slam.h"
+#include <time.h>
+
+#define DIM      16    //  Descriptor length
+#define FEATURES 100   //  Features seen in each keyframe
+#define WINDOW   50    //  Recent keyframes not considered for loops
+#define CLUTTER  0.3   //  Fraction of features replaced by clutter
+#define BUCKETS  10    //  Reports as the database grows
+
+//
+//  Wall clock time in seconds
+//
+static double now()
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC,&t);
+   return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+//
+//  Random descriptor
+//
+static void descriptor(float* d)
+{
+   int i;
+   for (i=0;i<DIM;i++)
+      d[i] = (float)rand()/RAND_MAX;
+}
+
+//
+//  Run the loop against one database
+//
+static void run(const int* place,int Ncam,int Nplace,int Nword,int budget)
+{
+   int k,i,b;
+   int words[FEATURES];
+   placedb_t db;
+   InitPlaces(&db,budget);
+   printf("\nbudget %d\n%10s %10s %10s %10s\n",budget,"keyframes","query us","max us","correct");
+   srand(2);
+   for (b=0;b<BUCKETS;b++)
+   {
+      int k0 = (long long)Ncam*b/BUCKETS;
+      int k1 = (long long)Ncam*(b+1)/BUCKETS;
+      int queries=0,correct=0;
+      double t=0,tmax=0;
+      for (k=k0;k<k1;k++)
+      {
+         placematch_t match;
+         int p = k%Nplace;
+         double t0,dt;
+         for (i=0;i<FEATURES;i++)
+            words[i] = (rand()<CLUTTER*RAND_MAX) ? rand()%Nword : place[p*FEATURES+i];
+         if (k>=Nplace+WINDOW)
+         {
+            t0 = now();
+            if (QueryPlaces(&db,words,FEATURES,k-WINDOW,&match,1) && match.cam%Nplace==p) correct++;
+            dt = now()-t0;
+            t += dt;
+            if (dt>tmax) tmax = dt;
+            queries++;
+         }
+         AddPlace(&db,k,words,FEATURES);
+      }
+      printf("%10d %10.2f %10.2f %9.1f%%\n",k1,queries?1e6*t/queries:0,1e6*tmax,queries?100.0*correct/queries:0);
+   }
+   FreePlaces(&db);
+}
+
+int main(int argc,char* argv[])
+{
+   int Ncam=100000,Nplace=2000,budget=20000;
+   int Ntrain=50000;
+   int i;
+   float* desc;
+   int* place;
+   vocab_t voc;
+   double t0;
+
+   if (argc>4)
+   {
+      fprintf(stderr,"Usage: placebench [keyframes] [places] [budget]\n");
+      return 1;
+   }
+   if (argc>1) Ncam = atoi(argv[1]);
+   if (argc>2) Nplace = atoi(argv[2]);
+   if (argc>3) budget = atoi(argv[3]);
+   if (Ncam<1 || Nplace<1) Fatal("Need at least one keyframe and place\n");
+   srand(1);
+
+   //  Vocabulary
+   desc = (float*)malloc(Ntrain*DIM*sizeof(float));
+   place = (int*)malloc(Nplace*FEATURES*sizeof(int));
+   if (!desc || !place) Fatal("Cannot allocate memory for benchmark\n");
+   for (i=0;i<Ntrain;i++)
+      descriptor(desc+i*DIM);
+   t0 = now();
+   BuildVocabulary(&voc,desc,Ntrain,DIM,10,4);
+   printf("vocabulary %d words from %d descriptors in %.1f ms\n",voc.Nword,Ntrain,1e3*(now()-t0));
+
+   //  Words of the features at each place
+   t0 = now();
+   for (i=0;i<Nplace*FEATURES;i++)
+   {
+      float d[DIM];
+      descriptor(d);
+      place[i] = LookupWord(&voc,d);
+   }
+   printf("lookup %.3f us per descriptor\n",1e6*(now()-t0)/(Nplace*FEATURES));
+
+   //  Unlimited and budgeted queries
+   run(place,Ncam,Nplace,voc.Nword,0);
+   if (budget>0) run(place,Ncam,Nplace,voc.Nword,budget);
+
+   FreeVocabulary(&voc);
+   free(desc);
+   free(place);
+   return 0;
+}
@@ -10,6 +10,8 @@ void Print(const char* format , ...)
    char    buf[LEN];
    char*   ch=buf;
    va_list args;
+   //  GLUT fonts need GLUT, which is not initialized when headless
+   if (Offscreen()) return;
    //  Turn the parameters into a character string
    va_start(args,format);
    vsnprintf(buf,LEN,format,args);
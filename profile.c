@@ -0,0 +1,346 @@
+/*
+ *  Frame profiler
+ *
+ *  ZoneBegin() and ZoneEnd() bracket named phases of a frame and record
+ *  their CPU time.  Zones may nest.  The outermost open zone is also timed
+ *  on the GPU with a GL_TIME_ELAPSED query when the driver has timer
+ *  queries (these cannot nest, so inner zones report CPU time only).
+ *  ProfileFrame() ends the frame.
+ *
+ *  Query results arrive a few frames late, so frames are kept in a small
+ *  ring and retired PROFILE_LAG frames later, when their results are
+ *  almost always ready.  A retired frame is written to the log and added
+ *  to the averages that ProfileHUD() shows.  The log is CSV with one row
+ *  per zone per frame, or a Chrome trace (chrome://tracing or Perfetto)
+ *  when the file name ends in .json.
+ *
+ *  CSCIx229.h wraps the calls so they only test a flag while profiling is
+ *  off.
+ */
+#include "CSCIx229.h"
+#include <time.h>
+
+#define PROFILE_LAG   4   //  Frames before query results are read
+#define PROFILE_ZONES 64  //  Maximum number of zone names
+#define PROFILE_DEPTH 16  //  Maximum zone nesting
+#define PROFILE_AVG   30  //  Frames averaged for the HUD
+
+int Profiling=0;  //  Profiler running
+
+//  One pass through a zone
+typedef struct
+{
+   int zone;      //  Zone name
+   int query;     //  Timer query (-1 for none)
+   double t0,t1;  //  CPU start and end (s)
+} zevent_t;
+
+//  Zones recorded during one frame
+typedef struct
+{
+   long frame;          //  Frame number (-1 for unused)
+   double t0,t1;        //  CPU start and end of frame (s)
+   int n,max;           //  Number of events and capacity
+   zevent_t* ev;        //  Events
+   int Nquery,Mquery;   //  Queries used and created
+   unsigned int* query; //  Timer queries
+} zframe_t;
+
+static const char* zname[PROFILE_ZONES];  //  Zone names
+static int Nzone=0;                       //  Number of zones
+static zframe_t ring[PROFILE_LAG];        //  Recent frames
+static int cur=0;                         //  Frame being recorded
+static long frames=0;                     //  Frames started
+static int stack[PROFILE_DEPTH];          //  Open events
+static int depth=0;                       //  Number of open events
+static int gpu=0;                         //  Timer queries available
+static int timing=-1;                     //  Event with an active query
+static FILE* out=NULL;                    //  Log file
+static int trace=0;                       //  Log is a Chrome trace
+static int Nwritten=0;                    //  Trace events written
+static double epoch=0;                    //  Start of profile (s)
+//  Sums and published averages for the HUD
+static int Navg=0;
+static double sumcpu[PROFILE_ZONES],sumgpu[PROFILE_ZONES],sumframe;
+static double avgcpu[PROFILE_ZONES],avggpu[PROFILE_ZONES],avgframe;
+static int shown=0;
+
+//
+//  Wall clock time in seconds
+//
+static double now()
+{
+#ifdef _WIN32
+   return (double)clock()/CLOCKS_PER_SEC;
+#else
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC,&t);
+   return t.tv_sec + 1e-9*t.tv_nsec;
+#endif
+}
+
+//
+//  Does the current context have GL_TIME_ELAPSED queries
+//    Core in OpenGL 3.3, otherwise ARB or EXT_timer_query
+//
+static int timerquery()
+{
+   int major=0,minor=0;
+   const char* version = (const char*)glGetString(GL_VERSION);
+   const char* ext = (const char*)glGetString(GL_EXTENSIONS);
+   if (version && sscanf(version,"%d.%d",&major,&minor)==2 && (major>3 || (major==3 && minor>=3)))
+      return 1;
+   return ext && (strstr(ext,"GL_ARB_timer_query") || strstr(ext,"GL_EXT_timer_query"));
+}
+
+//
+//  Zone index for a name
+//    Names are usually string literals, so compare pointers first
+//
+static int zone(const char* name)
+{
+   int k;
+   for (k=0;k<Nzone;k++)
+      if (zname[k]==name) return k;
+   for (k=0;k<Nzone;k++)
+      if (!strcmp(zname[k],name)) return k;
+   if (Nzone==PROFILE_ZONES) Fatal("Too many profile zones\n");
+   zname[Nzone] = name;
+   sumcpu[Nzone] = sumgpu[Nzone] = avgcpu[Nzone] = avggpu[Nzone] = 0;
+   return Nzone++;
+}
+
+//
+//  Start recording a frame in the current ring slot
+//
+static void start(void)
+{
+   zframe_t* f = ring+cur;
+   f->frame = frames++;
+   f->n = 0;
+   f->Nquery = 0;
+   f->t0 = now();
+}
+
+//
+//  Write trace event
+//
+static void traceevent(const char* name,int tid,double ts,double dur)
+{
+   fprintf(out,"%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+      Nwritten++ ? "," : "",name,tid,1e6*(ts-epoch),1e6*dur);
+}
+
+//
+//  Collect a finished frame
+//    Reads its queries (waiting if they are not done), then logs it and
+//    adds it to the HUD averages
+//
+static void retire(zframe_t* f)
+{
+   int k;
+   double cpu[PROFILE_ZONES],ms[PROFILE_ZONES];
+   int calls[PROFILE_ZONES];
+   double t = now();
+   if (f->frame<0) return;
+   for (k=0;k<Nzone;k++)
+   {
+      cpu[k] = ms[k] = 0;
+      calls[k] = 0;
+   }
+   for (k=0;k<f->n;k++)
+   {
+      zevent_t* e = f->ev+k;
+      double g = 0;
+      if (e->query>=0)
+      {
+         GLuint64 ns=0;
+         glGetQueryObjectui64v(f->query[e->query],GL_QUERY_RESULT,&ns);
+         g = 1e-9*ns;
+         //  Cannot take longer than since it started (llvmpipe returns
+         //  garbage for the first query in a context)
+         if (g>t-e->t0) g = 0;
+      }
+      calls[e->zone]++;
+      cpu[e->zone] += e->t1-e->t0;
+      ms[e->zone] += g;
+      if (out && trace)
+      {
+         traceevent(zname[e->zone],1,e->t0,e->t1-e->t0);
+         //  Durations only, so GPU zones are placed at their CPU start
+         if (e->query>=0) traceevent(zname[e->zone],2,e->t0,g);
+      }
+   }
+   //  CSV row per zone and one for the whole frame
+   if (out && !trace)
+   {
+      for (k=0;k<Nzone;k++)
+         if (calls[k]) fprintf(out,"%ld,%s,%d,%.4f,%.4f\n",f->frame,zname[k],calls[k],1e3*cpu[k],1e3*ms[k]);
+      fprintf(out,"%ld,frame,1,%.4f,\n",f->frame,1e3*(f->t1-f->t0));
+   }
+   else if (out)
+      traceevent("frame",0,f->t0,f->t1-f->t0);
+
+   //  Publish HUD averages every PROFILE_AVG frames
+   for (k=0;k<Nzone;k++)
+   {
+      sumcpu[k] += cpu[k];
+      sumgpu[k] += ms[k];
+   }
+   sumframe += f->t1-f->t0;
+   if (++Navg==PROFILE_AVG)
+   {
+      for (k=0;k<Nzone;k++)
+      {
+         avgcpu[k] = sumcpu[k]/Navg;
+         avggpu[k] = sumgpu[k]/Navg;
+         sumcpu[k] = sumgpu[k] = 0;
+      }
+      avgframe = sumframe/Navg;
+      sumframe = 0;
+      Navg = 0;
+      shown = Nzone;
+   }
+   f->frame = -1;
+}
+
+/*
+ *  Start profiling
+ *    Logs to file (CSV, or a Chrome trace if it ends in .json) unless NULL
+ *    Needs a current OpenGL context to use timer queries
+ */
+void ProfileStart(const char* file)
+{
+   int k;
+   if (Profiling) ProfileStop();
+   for (k=0;k<PROFILE_LAG;k++)
+      ring[k].frame = -1;
+   if (file)
+   {
+      size_t n = strlen(file);
+      out = fopen(file,"w");
+      if (!out) Fatal("Cannot open profile %s\n",file);
+      trace = n>=5 && !strcmp(file+n-5,".json");
+      if (trace)
+         fprintf(out,"{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+      else
+         fprintf(out,"frame,zone,calls,cpu_ms,gpu_ms\n");
+   }
+   gpu = timerquery();
+   cur = depth = Navg = shown = Nwritten = 0;
+   frames = 0;
+   timing = -1;
+   sumframe = 0;
+   epoch = now();
+   Profiling = 1;
+   start();
+}
+
+/*
+ *  Stop profiling
+ *    Retires the frames still waiting for queries and closes the log
+ */
+void ProfileStop(void)
+{
+   int k;
+   if (!Profiling) return;
+   //  The frame being recorded is incomplete, so drop it
+   ring[cur].frame = -1;
+   for (k=1;k<=PROFILE_LAG;k++)
+      retire(ring+(cur+k)%PROFILE_LAG);
+   if (out)
+   {
+      if (trace) fprintf(out,"\n]}\n");
+      fclose(out);
+      out = NULL;
+   }
+   depth = 0;
+   Profiling = 0;
+}
+
+/*
+ *  Start a zone
+ */
+void (ZoneBegin)(const char* name)
+{
+   zframe_t* f = ring+cur;
+   zevent_t* e;
+   if (depth==PROFILE_DEPTH) Fatal("Profile zones nested too deeply at %s\n",name);
+   if (f->n==f->max)
+   {
+      f->max = f->max ? 2*f->max : 64;
+      f->ev = (zevent_t*)realloc(f->ev,f->max*sizeof(zevent_t));
+      if (!f->ev) Fatal("Cannot allocate memory for profile\n");
+   }
+   e = f->ev+f->n;
+   e->zone = zone(name);
+   e->query = -1;
+   //  GPU timing for the outermost zone
+   if (gpu && timing<0)
+   {
+      if (f->Nquery==f->Mquery)
+      {
+         int m = f->Mquery ? 2*f->Mquery : 16;
+         f->query = (unsigned int*)realloc(f->query,m*sizeof(unsigned int));
+         if (!f->query) Fatal("Cannot allocate memory for profile\n");
+         glGenQueries(m-f->Mquery,f->query+f->Mquery);
+         f->Mquery = m;
+      }
+      e->query = f->Nquery++;
+      timing = f->n;
+      glBeginQuery(GL_TIME_ELAPSED,f->query[e->query]);
+   }
+   stack[depth++] = f->n++;
+   e->t0 = now();
+}
+
+/*
+ *  End the most recently started zone
+ */
+void (ZoneEnd)(void)
+{
+   zframe_t* f = ring+cur;
+   int k;
+   double t = now();
+   if (depth==0) Fatal("ZoneEnd without ZoneBegin\n");
+   k = stack[--depth];
+   f->ev[k].t1 = t;
+   if (k==timing)
+   {
+      glEndQuery(GL_TIME_ELAPSED);
+      timing = -1;
+   }
+}
+
+/*
+ *  End the frame
+ *    Call once per frame after the last zone
+ */
+void (ProfileFrame)(void)
+{
+   if (depth) Fatal("Profile zone %s not ended at end of frame\n",zname[ring[cur].ev[stack[depth-1]].zone]);
+   ring[cur].t1 = now();
+   cur = (cur+1)%PROFILE_LAG;
+   retire(ring+cur);
+   start();
+}
+
+/*
+ *  Show average zone times at the top left of the viewport
+ */
+void ProfileHUD(void)
+{
+   int k,vp[4];
+   if (!Profiling) return;
+   glGetIntegerv(GL_VIEWPORT,vp);
+   glWindowPos2i(5,vp[3]-20);
+   Print("Frame %.2f ms (%d frame average)",1e3*avgframe,PROFILE_AVG);
+   for (k=0;k<shown;k++)
+   {
+      glWindowPos2i(5,vp[3]-40-20*k);
+      if (gpu && avggpu[k]>0)
+         Print("%-16s CPU %6.3f ms  GPU %6.3f ms",zname[k],1e3*avgcpu[k],1e3*avggpu[k]);
+      else
+         Print("%-16s CPU %6.3f ms",zname[k],1e3*avgcpu[k]);
+   }
+}
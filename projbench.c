@@ -0,0 +1,120 @@
+/*
+ *  Landmark projection benchmark
+ *
+ *  Projects a room full of landmarks into keyframes walking around it
+ *  with each kernel ProjectLandmarks() has, both for all landmarks in
+ *  order and for a shuffled list of them (as visibility and matching
+ *  code pass), and reports millions of projected points per second.
+ *  Results are checked against the plain C kernel.
+ *
+ *  Usage:
+ *    projbench [landmarks] [keyframes] [repeats]
+ */
+#include "CSCIx229.h"
+#include "slam.h"
+#include <time.h>
+
+//
+//  Wall clock time in seconds
+//
+static double now()
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC,&t);
+   return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+int main(int argc,char* argv[])
+{
+   const char* name[] = {"","scalar","sse2","avx2"};
+   int Nlm=100000,Ncam=64,reps=10;
+   int i,k,r,best,order;
+   size_t N;
+   int* lm;
+   pose_t* pose;
+   intrinsics_t K;
+   slammap_t map;
+   float *u,*v,*d,*u0,*v0,*d0;
+   unsigned char *in,*in0;
+
+   if (argc>4)
+   {
+      fprintf(stderr,"Usage: projbench [landmarks] [keyframes] [repeats]\n");
+      return 1;
+   }
+   if (argc>1) Nlm = atoi(argv[1]);
+   if (argc>2) Ncam = atoi(argv[2]);
+   if (argc>3) reps = atoi(argv[3]);
+   if (Nlm<1 || Ncam<1 || reps<1) Fatal("Need at least one landmark, keyframe and repeat\n");
+   srand(1);
+
+   //  Landmarks filling a 20x20x3m room and keyframes on a circle in it
+   InitMap(&map);
+   for (i=0;i<Nlm;i++)
+      AddLandmark(&map,20.0*rand()/RAND_MAX-10,20.0*rand()/RAND_MAX-10,3.0*rand()/RAND_MAX);
+   pose = (pose_t*)malloc(Ncam*sizeof(pose_t));
+   lm = (int*)malloc(Nlm*sizeof(int));
+   N = (size_t)Nlm*Ncam;
+   u = (float*)malloc(6*N*sizeof(float));
+   in = (unsigned char*)malloc(2*N);
+   if (!pose || !lm || !u || !in) Fatal("Cannot allocate memory for benchmark\n");
+   v = u+N;   d = v+N;
+   u0 = d+N;  v0 = u0+N;  d0 = v0+N;
+   in0 = in+N;
+   for (k=0;k<Ncam;k++)
+   {
+      pose[k].x = 5*Cos(360.0*k/Ncam);
+      pose[k].y = 5*Sin(360.0*k/Ncam);
+      pose[k].z = 1.5;
+      pose[k].d = 360.0*k/Ncam + 30;
+   }
+   //  Shuffled landmark list
+   for (i=0;i<Nlm;i++)
+      lm[i] = i;
+   for (i=Nlm-1;i>0;i--)
+   {
+      int j = rand()%(i+1);
+      int t = lm[i];
+      lm[i] = lm[j];
+      lm[j] = t;
+   }
+   CameraIntrinsics(&K,640,480,90);
+   K.zfar = 15;
+
+   best = ProjectionKernel(0);
+   printf("%d landmarks x %d keyframes, %d repeats, best kernel %s\n",Nlm,Ncam,reps,name[best]);
+   printf("%-8s %-8s %10s %10s %10s\n","kernel","order","Mpoints/s","in view","mismatch");
+   for (order=0;order<2;order++)
+   {
+      const int* list = order ? lm : NULL;
+      for (k=1;k<=best;k++)
+      {
+         double t,t0;
+         int m=0;
+         long bad=0;
+         ProjectionKernel(k);
+         t0 = now();
+         for (r=0;r<reps;r++)
+            m = ProjectLandmarks(&map,list,Nlm,pose,Ncam,&K,u,v,d,in);
+         t = now()-t0;
+         //  Keep the plain C results to check the others
+         if (k==1)
+         {
+            memcpy(u0,u,3*N*sizeof(float));
+            memcpy(in0,in,N);
+         }
+         else
+            for (i=0;i<(int)N;i++)
+               if (memcmp(u+i,u0+i,sizeof(float)) || memcmp(v+i,v0+i,sizeof(float)) ||
+                   memcmp(d+i,d0+i,sizeof(float)) || in[i]!=in0[i]) bad++;
+         printf("%-8s %-8s %10.1f %10d %10ld\n",name[k],order?"shuffled":"in order",1e-6*N*reps/t,m,bad);
+      }
+   }
+
+   FreeMap(&map);
+   free(pose);
+   free(lm);
+   free(u);
+   free(in);
+   return 0;
+}
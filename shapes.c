@@ -0,0 +1,217 @@
+/*
+ *  Pre-tessellated shapes
+ *
+ *  DrawTorus() and DrawPole() generate each shape once per set of
+ *  parameters and level of detail into vertex and index buffers, then
+ *  draw it with a single glDrawElements.  The level of detail is picked
+ *  from the size the shape covers on screen, so distant shapes use fewer
+ *  triangles.  Vertexes use the same interleaved layout as OBJ meshes.
+ */
+#include "CSCIx229.h"
+
+#define SHAPE_TORUS   0
+#define SHAPE_POLE    1
+#define SHAPE_LEVELS  4  //  Number of levels of detail
+#define SHAPE_PIXELS  6  //  Target edge length on screen in pixels
+
+//  Segments around each circle for each level (divide 360 degrees evenly)
+static const int segments[SHAPE_LEVELS] = {72,36,18,9};
+
+//  Shape buffers
+typedef struct
+{
+   int type;              //  SHAPE_TORUS or SHAPE_POLE
+   double p,q;            //  Shape parameters
+   int level;             //  Level of detail
+   unsigned int vbo,ibo;  //  Vertex and index buffers
+   int count;             //  Number of indexes
+} shape_t;
+
+static int Nshape=0,Mshape=0;  //  Number of shapes and capacity
+static shape_t* shapes=NULL;   //  Shapes built so far
+
+//
+//  Choose level of detail for a sphere at (x,y,z) with radius r
+//    Uses the current modelview, projection and viewport
+//
+static int level(double x,double y,double z,double r)
+{
+   int k,vp[4];
+   double mv[16],pr[16],s=0,px,need;
+   glGetDoublev(GL_MODELVIEW_MATRIX,mv);
+   glGetDoublev(GL_PROJECTION_MATRIX,pr);
+   glGetIntegerv(GL_VIEWPORT,vp);
+
+   //  Radius in eye coordinates from the largest axis scale
+   for (k=0;k<3;k++)
+   {
+      double l = mv[4*k]*mv[4*k] + mv[4*k+1]*mv[4*k+1] + mv[4*k+2]*mv[4*k+2];
+      if (l>s) s = l;
+   }
+   r *= sqrt(s);
+   //  Radius in pixels
+   px = 0.5*vp[3]*pr[5]*r;
+   if (pr[15]==0)
+   {
+      //  Perspective divides by the depth of the center
+      double d = -(mv[2]*x + mv[6]*y + mv[10]*z + mv[14]);
+      if (d<=r) return 0;
+      px /= d;
+   }
+
+   //  Coarsest level with edges no longer than SHAPE_PIXELS
+   need = 2*3.1415926*px/SHAPE_PIXELS;
+   for (k=SHAPE_LEVELS-1;k>0;k--)
+      if (segments[k]>=need) break;
+   return k;
+}
+
+//
+//  Set one interleaved vertex (texture, normal, vertex)
+//
+static float* vertex(float* v,double x,double y,double z,double nx,double ny,double nz)
+{
+   v[0] = x;   v[1] = y;
+   v[2] = nx;  v[3] = ny;  v[4] = nz;
+   v[5] = x;   v[6] = y;   v[7] = z;
+   return v+8;
+}
+
+//
+//  Add two triangles for the quad with corners k, k+1, k+n+1, k+n+2
+//
+static unsigned int* quad(unsigned int* i,int k,int n)
+{
+   i[0] = k;  i[1] = k+1;    i[2] = k+n+2;
+   i[3] = k;  i[4] = k+n+2;  i[5] = k+n+1;
+   return i+6;
+}
+
+//
+//  Find or build shape buffers
+//
+static shape_t* shape(int type,double p,double q,int lod)
+{
+   int i,j,n,Nv,Ni;
+   float *vert,*v;
+   unsigned int *idx,*t;
+   shape_t* s;
+
+   //  Already built
+   for (i=0;i<Nshape;i++)
+      if (shapes[i].type==type && shapes[i].p==p && shapes[i].q==q && shapes[i].level==lod)
+         return shapes+i;
+
+   //  Vertexes on an (n+1) x (n+1) grid for a torus or n+1 x 2 for a pole
+   n = segments[lod];
+   Nv = (type==SHAPE_TORUS) ? (n+1)*(n+1) : 2*(n+1);
+   Ni = (type==SHAPE_TORUS) ? 6*n*n : 6*n;
+   vert = (float*)malloc(8*sizeof(float)*Nv);
+   idx  = (unsigned int*)malloc(sizeof(unsigned int)*Ni);
+   if (!vert || !idx) Fatal("Cannot allocate memory for shape\n");
+   v = vert;
+   t = idx;
+   if (type==SHAPE_TORUS)
+   {
+      //  Tube radius p, ring radius q
+      //  Normals point away from the center like the original strips
+      for (i=0;i<=n;i++)
+      {
+         double th = 360.0*i/n;
+         for (j=0;j<=n;j++)
+         {
+            double ph = 360.0*j/n;
+            double x = (q+p*Cos(th))*Cos(ph);
+            double y = (q+p*Cos(th))*Sin(ph);
+            double z = p*Sin(th);
+            v = vertex(v,x,y,z,x,y,z);
+            if (i<n && j<n) t = quad(t,i*(n+1)+j,n);
+         }
+      }
+   }
+   else
+   {
+      //  Height p, radius q
+      for (i=0;i<2;i++)
+         for (j=0;j<=n;j++)
+         {
+            double x = q*Cos(360.0*j/n);
+            double y = q*Sin(360.0*j/n);
+            v = vertex(v,x,y,i*p,x,y,0);
+            if (i==0 && j<n) t = quad(t,j,n);
+         }
+   }
+
+   //  Add to table
+   if (Nshape==Mshape)
+   {
+      Mshape = Mshape ? 2*Mshape : 16;
+      shapes = (shape_t*)realloc(shapes,Mshape*sizeof(shape_t));
+      if (!shapes) Fatal("Cannot allocate memory for shapes\n");
+   }
+   s = shapes+Nshape++;
+   s->type  = type;
+   s->p     = p;
+   s->q     = q;
+   s->level = lod;
+   s->count = Ni;
+
+   //  Copy to buffers
+   glGenBuffers(1,&s->vbo);
+   glBindBuffer(GL_ARRAY_BUFFER,s->vbo);
+   glBufferData(GL_ARRAY_BUFFER,8*sizeof(float)*Nv,vert,GL_STATIC_DRAW);
+   glBindBuffer(GL_ARRAY_BUFFER,0);
+   glGenBuffers(1,&s->ibo);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,s->ibo);
+   glBufferData(GL_ELEMENT_ARRAY_BUFFER,sizeof(unsigned int)*Ni,idx,GL_STATIC_DRAW);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+   ErrCheck("shape");
+   free(vert);
+   free(idx);
+   return s;
+}
+
+//
+//  Draw shape buffers
+//
+static void draw(const shape_t* s)
+{
+   const int stride = 8*sizeof(float);
+   glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+   glBindBuffer(GL_ARRAY_BUFFER,s->vbo);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,s->ibo);
+   glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+   glTexCoordPointer(2,GL_FLOAT,stride,(void*)0);
+   glEnableClientState(GL_NORMAL_ARRAY);
+   glNormalPointer(GL_FLOAT,stride,(void*)(2*sizeof(float)));
+   glEnableClientState(GL_VERTEX_ARRAY);
+   glVertexPointer(3,GL_FLOAT,stride,(void*)(5*sizeof(float)));
+   glDrawElements(GL_TRIANGLES,s->count,GL_UNSIGNED_INT,(void*)0);
+   glBindBuffer(GL_ARRAY_BUFFER,0);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+   glPopClientAttrib();
+}
+
+/*
+ *  Draw a torus about the z axis
+ *     tube radius a
+ *     ring radius c
+ */
+void DrawTorus(double a,double c)
+{
+   draw(shape(SHAPE_TORUS,a,c,level(0,0,0,c+a)));
+}
+
+/*
+ *  Draw a pole along the z axis
+ *     from z=0 to height in steps of 0.1 (rounded up like the original
+ *     ring by ring version)
+ *     radius r
+ */
+void DrawPole(double height,double r)
+{
+   double z,top=0;
+   for (z=0;z<=height;z+=.1)
+      top = z+.1;
+   draw(shape(SHAPE_POLE,top,r,level(0,0,top/2,sqrt(r*r+top*top/4))));
+}
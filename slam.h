@@ -0,0 +1,290 @@
+/*
+ *  SLAM map store
+ *    Landmarks are kept as structure of arrays, keyframe poses in one
+ *    contiguous array and the landmarks each keyframe observes in a
+ *    compressed row (CSR) table:
+ *
+ *      keyframe k observes landmarks lm[first[k]] .. lm[first[k+1]-1]
+ *
+ *    Every index is valid, so landmark 0 is an ordinary landmark.
+ *
+ *    Cameras look along their local +y axis with z up.  A landmark at
+ *    (px,py,pz) in camera coordinates is measured at u=px/py, v=pz/py.
+ */
+#ifndef SLAM_H
+#define SLAM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Camera pose (position and heading in degrees about z)
+typedef struct
+{
+   double x,y,z,d;
+} pose_t;
+
+//  Map
+typedef struct
+{
+   //  Landmarks
+   int     Nlm,Mlm;   //  Number of landmarks and capacity
+   double  *X,*Y,*Z;  //  Landmark positions
+   //  Keyframes
+   int     Ncam,Mcam; //  Number of keyframes and capacity
+   pose_t* pose;      //  Keyframe poses
+   unsigned int* flags; //  Application flags for each keyframe
+   pose_t* odom;      //  Measured motion from the previous keyframe in its frame (x NAN if none)
+   //  Observations
+   int*    first;     //  Start of each keyframe's observations (Ncam+1 entries)
+   int     Nobs,Mobs; //  Number of observations and capacity
+   int*    lm;        //  Landmark seen by each observation
+   float   *u,*v;     //  Measured image coordinates of each observation (NAN if none)
+   int     edited;    //  First keyframe whose observations changed since UpdateCovis
+   long    reshaped;  //  Times entries were removed or observations replaced (see CopyMap)
+   long    adjusted;  //  Times keyframe poses and landmark positions were adjusted
+} slammap_t;
+
+//  Camera model for projecting landmarks to pixels
+//    pixel u = cu + f*px/py, v = cv + f*pz/py in camera coordinates
+typedef struct
+{
+   double f;            //  Focal length in pixels
+   double cu,cv;        //  Principal point in pixels
+   int    w,h;          //  Image size in pixels
+   double znear,zfar;   //  Depths that count as in view
+} intrinsics_t;
+
+//  Triangles that hide landmarks from keyframes
+typedef struct
+{
+   int    Ntri,Mtri;  //  Triangles and capacity
+   float* tri;        //  Corners (9 floats per triangle)
+   int    bvh;        //  BVH over the triangles (-1 before the first)
+} occluders_t;
+
+//  Covisibility edge between keyframes a<b
+typedef struct
+{
+   int a,b;   //  Keyframes
+   int w;     //  Number of shared landmarks
+   int first; //  Shared landmarks are shared[first] .. shared[first+w-1]
+   int next;  //  Next edge with the same a (-1 for none)
+} covedge_t;
+
+//  Covisibility graph and landmark to keyframe index
+typedef struct
+{
+   int  Ncam;             //  Keyframes indexed
+   int  Mcam;             //  Capacity of keyframe arrays
+   int* back;             //  Edges to earlier keyframes of b are edge[back[b]] .. edge[back[b+1]-1]
+   int* fwd;              //  First edge to a later keyframe (-1 for none)
+   int* count;            //  Scratch counts per keyframe
+   int  Mlm;              //  Capacity of landmark arrays
+   int* head;             //  First index node of each landmark (-1 for none)
+   int* seen;             //  Last keyframe+1 that added each landmark
+   int  Nnode,Mnode;      //  Index nodes
+   int* cam;              //  Keyframe of each index node
+   int* next;             //  Next index node for the same landmark (-1 for none)
+   int  Nedge,Medge;      //  Edges
+   covedge_t* edge;       //  Edges
+   int  Nshared,Mshared;  //  Shared landmarks of all edges
+   int* shared;           //  Shared landmarks
+   long builds;           //  Times the graph was rebuilt from scratch (see CopyCovis)
+} covis_t;
+
+//  Map published by the SLAM thread for drawing (see slamthread.c)
+typedef struct
+{
+   slammap_t map;       //  Landmarks, keyframes and observations
+   covis_t   covis;     //  Covisibility graph of the map
+   void*     app;       //  Application state published with the map
+   size_t    size,Mapp; //  Bytes of application state and capacity
+   long      version;   //  Number of snapshots published up to this one
+} snapshot_t;
+
+//  Map culling budgets and policy (see mapcull.c)
+typedef struct
+{
+   int    maxcam;     //  Most keyframes kept (0 for no limit)
+   int    maxlm;      //  Most landmarks kept (0 for no limit)
+   double maxbytes;   //  Most bytes allocated by the map (0 for no limit)
+   int    others;     //  Other keyframes that must see a landmark for it to be redundant
+   double sigma;      //  Reprojection error that halves a landmark's worth (image units, >0)
+   int    fixed;      //  Leading keyframes never culled (anchor the map)
+   int    recent;     //  Newest keyframes never culled (still being tracked)
+   int    batch;      //  Most keyframes and most landmarks culled per call
+} cullopt_t;
+
+//  Culling totals
+typedef struct
+{
+   long   cams,lms,obs; //  Keyframes, landmarks and observations culled
+   double bytes;        //  Bytes their entries took
+   double freed;        //  Bytes of map memory given back
+   long   calls;        //  Calls that culled something
+} cullreport_t;
+
+//  Bundle adjustment options
+typedef struct
+{
+   int    iterations; //  Maximum Levenberg-Marquardt iterations
+   int    threads;    //  Threads for Jacobians and the Schur complement (0 for all CPUs)
+   int    fixed;      //  Leading keyframes held fixed to anchor the map
+   int    solver;     //  0 automatic, 1 envelope Cholesky, 2 conjugate gradients
+   double focal;      //  Focal length in pixels (scales reprojection errors)
+   double huber;      //  Huber threshold in pixels (0 for plain least squares)
+   double sigma_t;    //  Odometry position standard deviation
+   double sigma_d;    //  Odometry heading standard deviation (degrees)
+   int    verbose;    //  Print timing for each iteration
+} baopt_t;
+
+//  Bundle adjustment report (times in seconds summed over iterations)
+typedef struct
+{
+   int    iterations;       //  Iterations taken
+   int    terms;            //  Residual terms used
+   double cost0,cost;       //  Initial and final cost
+   double t_jacobian;       //  Residuals and Jacobians
+   double t_schur;          //  Normal equations and Schur complement
+   double t_solve;          //  Reduced camera system
+   double t_update;         //  Back substitution and trial cost
+   double t_total;          //  Whole solve
+} bareport_t;
+
+//  Vocabulary tree (hierarchical k-means of descriptors)
+typedef struct
+{
+   int    dim;          //  Descriptor length
+   int    k;            //  Branching factor
+   int    Nnode,Mnode;  //  Nodes and capacity (node 0 is the root)
+   float* center;       //  Cluster center of each node (dim floats)
+   int*   child;        //  First of k consecutive children (-1 for a leaf)
+   int*   word;         //  Word of each leaf (-1 for inner nodes)
+   int    Nword;        //  Number of words
+} vocab_t;
+
+//  Place recognition posting (keyframe containing a word)
+typedef struct
+{
+   int   cam;  //  Keyframe
+   float w;    //  Normalized TF-IDF weight of the word in the keyframe
+} placepost_t;
+
+//  Place recognition match
+typedef struct
+{
+   int   cam;    //  Keyframe
+   float score;  //  Cosine similarity of TF-IDF vectors (0 to 1)
+} placematch_t;
+
+//  Place recognition database (inverted file of keyframes for each word)
+typedef struct
+{
+   int   Nword;           //  Words indexed
+   int   *Npost,*Mpost;   //  Postings of each word and capacity
+   placepost_t** post;    //  Postings of each word in the order keyframes were added
+   int   Ncam;            //  Keyframes added
+   int   budget;          //  Most postings a query visits (0 for no limit)
+   int   Mcam;            //  Capacity of the score array (highest keyframe+1)
+   float* score;          //  Scratch score of each keyframe
+   int   *touched,Mtouch; //  Scratch keyframes with a score
+   int   *word,*count,Mq; //  Scratch distinct words and counts
+   float* weight;         //  Scratch word weights
+   int*  order;           //  Scratch (postings,word) pairs
+} placedb_t;
+
+//  Text file read a line at a time through a fixed buffer
+typedef struct
+{
+   FILE* f;        //  File (NULL if not open)
+   char* name;     //  File name for messages
+   char* buf;      //  Buffer
+   int   n,pos;    //  Bytes in buffer and start of the next line
+   long  line;     //  Number of the last line read
+} textfile_t;
+
+//  Dataset playback
+//    Trajectory lines are TUM poses: time x y z qx qy qz qw
+//    Observation lines are: time landmark u v (same times as the poses)
+typedef struct
+{
+   textfile_t traj;   //  Trajectory
+   textfile_t obs;    //  Observations (f is NULL if none)
+   double mindist;    //  Least motion from the last keyframe for a new one
+   double minturn;    //  Least heading change from the last keyframe (degrees)
+   double tol;        //  Greatest time difference of an observation and its pose (s)
+   double t0;         //  Time of the first pose
+   int    ahead;      //  Pose read ahead (0 at the end of the trajectory)
+   double t;          //  Time of the pose read ahead
+   pose_t pose;       //  Pose read ahead
+   int    obsahead;   //  Observation read ahead (0 at the end)
+   double to;         //  Time of the observation read ahead
+   int    lm;         //  Landmark of the observation read ahead
+   double u,v;        //  Image coordinates of the observation read ahead
+   int    key;        //  Last keyframe added (-1 for none)
+   pose_t last;       //  Pose of the last keyframe added
+   long   poses;      //  Poses read
+   long   keyframes;  //  Keyframes added
+   long   observations; //  Observations added
+   long   skipped;    //  Observations of poses that were not keyframes or of culled landmarks
+   int*   lmindex;    //  Map landmark of each landmark number (-1 if culled, NULL while the same)
+   int    Nindex;     //  Landmark numbers in lmindex
+} dataset_t;
+
+void InitMap(slammap_t* map);
+void FreeMap(slammap_t* map);
+void ReserveMap(slammap_t* map,int Nlm,int Ncam,int Nobs);
+void RemoveFromMap(slammap_t* map,const unsigned char* dropcam,const unsigned char* droplm,int* cammap,int* lmmap);
+void TrimMap(slammap_t* map,int Mlm,int Mcam,int Mobs);
+void CopyMap(slammap_t* dst,const slammap_t* src);
+size_t MapMemory(const slammap_t* map);
+int  AddLandmark(slammap_t* map,double x,double y,double z);
+int  AddKeyframe(slammap_t* map,pose_t pose);
+void AddObservation(slammap_t* map,int lm,double u,double v);
+void SetObservations(slammap_t* map,int cam,const int* lm,const float* u,const float* v,int n);
+void InitCovis(covis_t* covis);
+void FreeCovis(covis_t* covis);
+void CopyCovis(covis_t* dst,const covis_t* src,const slammap_t* map);
+void UpdateCovis(covis_t* covis,slammap_t* map);
+const int* Correspondences(const covis_t* covis,int a,int b,int* n);
+int  TopCovisible(const covis_t* covis,int cam,int k,int* best,int* weight);
+int  LandmarkCameras(const covis_t* covis,int lm,int* cam,int max);
+void BAOptions(baopt_t* opt);
+int  BundleAdjust(slammap_t* map,const baopt_t* opt,bareport_t* report);
+void CullOptions(cullopt_t* opt);
+int  CullMap(slammap_t* map,const cullopt_t* opt,cullreport_t* report,int* cammap,int* lmmap);
+void BuildVocabulary(vocab_t* voc,const float* desc,int n,int dim,int k,int levels);
+void FreeVocabulary(vocab_t* voc);
+int  LookupWord(const vocab_t* voc,const float* desc);
+void InitPlaces(placedb_t* db,int budget);
+void FreePlaces(placedb_t* db);
+void AddPlace(placedb_t* db,int cam,const int* words,int n);
+int  QueryPlaces(placedb_t* db,const int* words,int n,int before,placematch_t* match,int k);
+int  ProjectionKernel(int kernel);
+void CameraIntrinsics(intrinsics_t* K,int width,int height,double fov);
+int  ProjectLandmarks(const slammap_t* map,const int* lm,int n,const pose_t* pose,int Npose,const intrinsics_t* K,
+                      float* u,float* v,float* depth,unsigned char* in);
+void InitOccluders(occluders_t* occ);
+void FreeOccluders(occluders_t* occ);
+void AddOccluders(occluders_t* occ,const float* tri,int n);
+int  Occluded(const occluders_t* occ,const double a[3],const double b[3]);
+int  SeeLandmarks(slammap_t* map,int cam,int n,const pose_t* from,const intrinsics_t* K,const occluders_t* occ,int threads);
+void SyntheticDepth(const occluders_t* occ,const pose_t* pose,const intrinsics_t* K,float* depth);
+int  ReadLandmarks(slammap_t* map,const char* file);
+void OpenDataset(dataset_t* ds,const char* trajectory,const char* observations);
+void CloseDataset(dataset_t* ds);
+int  StreamDataset(dataset_t* ds,slammap_t* map,double until,int max);
+void RenumberDataset(dataset_t* ds,const int* cammap,const int* lmmap,int Nlm);
+void StartSLAM(int (*func)(int request,void* data));
+void PostSLAM(int request,void* data);
+void WaitSLAM(void);
+void PublishSnapshot(const slammap_t* map,const covis_t* covis,const void* app,size_t size);
+int  SnapshotWaiting(void);
+const snapshot_t* LatestSnapshot(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
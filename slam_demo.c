@@ -3,9 +3,12 @@
  *
  */
 #include "CSCIx229.h"
+#include "slam.h"
 #include <stdio.h>
 #include <stdbool.h>
 #include <math.h>
+#include <time.h>
+#include <ctype.h>
 
 
 #define MATCH 0
@@ -14,6 +17,46 @@
 #define BAD_MATCH 3
 #define TRANSFORM 4
 
+//  Keyframe display flags
+#define CAM_VISIBLE   0x01  // Draw the camera
+#define CAM_LANDMARKS 0x02  // Draw the landmarks it sees
+#define CAM_NEW       0x04  // Draw rays to its landmarks as the new frame
+#define CAM_OLD       0x08  // Draw rays to its landmarks as the old frame
+#define CAM_SELECTED  0x10  // Viewing from this camera
+#define CAM_POINTS    0x20  // Show correspondences with the previous frame
+#define CAM_TRANSFORM 0x40  // Draw the transform from the previous frame
+
+//  Static objects in the scene octree
+#define OBJ_TORI      0
+#define OBJ_TABLE     1
+#define OBJ_SEATS     2
+#define OBJ_ROOM      3
+#define OBJ_ARMADILLO 4  // Two of them
+#define OBJECTS       6
+
+//  Occlusion culling
+#define OCCLUSION_WIDTH 256  // Pixels across the occlusion buffer
+#define LANDMARK_PAD    5    // Half the landmark point size in pixels
+
+//  Loop detection
+#define LOOP_WINDOW 3    // Most recent keyframes that cannot close a loop
+#define LOOP_SCORE  0.5  // Least similarity that counts as a revisit
+
+//  Requests for the SLAM thread
+#define SLAM_STEP      0  // Advance the demo a step
+#define SLAM_OCCLUDERS 1  // Take new occluders (data is an occluders_t without a BVH)
+#define SLAM_PLAY      2  // Stream the recorded run as its time comes
+
+//  Demo state published with each map snapshot
+typedef struct
+{
+  int iteration,step; // Demo progress
+  int loop;           // Keyframe revisited by the newest one (-1 for none)
+  int moved;          // Times landmarks and keyframes moved or were renumbered
+  long poses;         // Recorded poses played
+  cullreport_t culled; // Keyframes and landmarks retired to stay within the budget
+} progress_t;
+
 int axes=1;       //  Display axes
 int mode=1;       //  Projection mode
 int move=1;       //  Move light
@@ -37,9 +80,10 @@ int local     =   0;  // Local Viewer Model
 float shiny   =   1;  // Shininess (value)
 int zh        =  90;  // Light azimuth
 float zlight  =   0;  // Elevation of light
-int iteration = 0;
+int iteration = 0;  // Demo progress (SLAM thread, drawn from demo->iteration and demo->step)
 int step = 0;
 int potential_landmarks_index = 0;
+int first_frame = -1; //  Time of first frame (ms)
 int camera_corners[4][3] ={
               {1,1,1},
               {1,1,-1},
@@ -101,140 +145,91 @@ double init_landmarks_array[24][3] ={
 
 };
 
-int cam_landmark_array[10][10]={
-            {3,4,12,20,19,5,0,0,0,0},
-            {3,4,19,20,5,6,0,0,0,0},
-            {1,6,4,2,13,10,17,21,0,0},
-            {1,9,21,22,13,0,0,0,0,0},
-            {9,3,1,21,23,6,0,0,0,0},//5
-            {0,0,0,0,0,0,0,0,0,0},
-            {0,0,0,0,0,0,0,0,0,0},
-            {0,0,0,0,0,0,0,0,0,0},
-            {0,0,0,0,0,0,0,0,0,0},
-            {3,4,12,20,19,5,0,0,0,0}//10
-};
-
-bool camera_transforms[10];
-
-struct Pose{
-  double x;
-  double y;
-  double z;
-  double d;
-};
-
-struct Landmark{
-  double x;
-  double y;
-  double z;
-};
-
-struct Point{
-  double x;
-  double y;
-  double z;
-};
 
-struct Camera{
-  struct Pose pose;
-  //the indexes of landmarks this camera can see (up to 10)
-  // the corners of the camera
-  struct Point camera_corners[4];
-  bool draw_landmarks;
-  bool visible;
-  int visible_landmarks[10];
-  bool show_new;
-  bool show_old;
-  bool is_selected;
-  bool show_camera_points;
-};
 
 
 unsigned int texture[4]; // Textures
-unsigned int objects[4];
-struct Camera cameras[10];
-struct Landmark landmarks[100];
+int objects[4];  // Meshes (-1 while loading)
+slammap_t map;    // Landmarks, keyframes and observations (SLAM thread)
+covis_t covis;    // Covisibility between keyframes (SLAM thread)
+placedb_t places; // Keyframes indexed by the landmarks they see (SLAM thread)
+const snapshot_t* snap; // Newest map the SLAM thread published (drawn)
+const progress_t* demo; // Demo state published with it
+long drawn=0;     // Version of the snapshot drawn last
+int selected=-1;  // Keyframe viewed from (-1 for none)
+int hud=0;        // Show profile zones (p key)
+int logging=0;    // Profile log given with -profile
+int loop=-1;      // Keyframe revisited by the newest one (-1 for none)
+int moved=0;      // Times landmarks and keyframes moved or were renumbered
+cullopt_t budget; // Map budgets for recorded runs (-maxkeyframes, -maxlandmarks, -maxmb)
+cullreport_t culled; // What the budgets retired
+dataset_t dataset; // Recorded run being played back
+int recorded=0;    // Map comes from a recorded run instead of the demo
+double play0=0;    // Wall clock time playback started
+double speed=1;    // Playback speed (1 for real time)
+int scene_tree;    // Octrees of static objects, landmarks and keyframes
+int landmark_tree;
+int keyframe_tree;
+int Nlm_indexed=0;  // Landmarks and keyframes in the octrees
+int Ncam_indexed=0;
+int armadillos_indexed=0;
+int moved_indexed=0; // Moves when the octrees were filled
+int shown[OBJECTS];  // Static objects on screen
+float object_box[OBJECTS][6]; // World boxes of the static objects (lo xyz then hi xyz)
+int* vislm;          // Landmarks on screen
+int Nvislm=0;
+int* viscam;         // Keyframes on screen
+int Nviscam=0;
+int bake=1;          // Draw the static scene once per view (-nobake draws it every frame)
+int rebake=1;        // Static scene changed (assets arrived)
+int overlay_dirty=1; // Overlay needs building (map, selection or view changed)
+int occlude=1;       // Skip what the furniture hides (-noocclude only culls to the frustum)
+int occlusion_stale=1; // Occlusion buffer needs drawing (view or occluders changed)
+occluders_t occluders;      // Scene triangles that hide landmarks (SLAM thread)
+float* occluder_tri=NULL;   // The same triangles for the occlusion buffer
+int Noccluder_tri=0;
+int occluders_armadillo=-1; // Armadillos were loaded when the occluders were captured (-1 before)
+int table_cubes;   // Cube lists
+int seat_cubes;
+int stand_cubes;
+int ground_cubes;
+
 /*
- *  Draw a cube
- *     at (x,y,z)
- *     dimentions (dx,dy,dz)
- *     rotated th about the y axis
+ *  Add a seat to the seat cubes
+ *     at (x,y)
  */
-
-
- static void cube(double x,double y,double z,
-                  double dx,double dy,double dz,
-                  double th)
- {
-    //  Set specular color to white
-    //  Save transformation
-    glPushMatrix();
-    //  Offset, scale and rotate
-    glTranslated(x,y,z);
-    glRotated(th,0,1,0);
-    glScaled(dx,dy,dz);
-    //  Enable textures
-    //  Front
-    //glColor4f(.5,.5,.5,1);
-    glBegin(GL_QUADS);
-    glNormal3f( 0, 0, 1);
-    glTexCoord2f(0,0); glVertex3f(-1,-1, 1);
-    glTexCoord2f(1,0); glVertex3f(+1,-1, 1);
-    glTexCoord2f(1,1); glVertex3f(+1,+1, 1);
-    glTexCoord2f(0,1); glVertex3f(-1,+1, 1);
-    glEnd();
-    //  Back
-    glBegin(GL_QUADS);
-    //glColor4f(1,1,1,1);
-    glNormal3f( 0, 0,-1);
-    glTexCoord2f(0,0); glVertex3f(+1,-1,-1);
-    glTexCoord2f(1,0); glVertex3f(-1,-1,-1);
-    glTexCoord2f(1,1); glVertex3f(-1,+1,-1);
-    glTexCoord2f(0,1); glVertex3f(+1,+1,-1);
-    glEnd();
-    //  Right
-    glBegin(GL_QUADS);
-    glNormal3f(+1, 0, 0);
-    glTexCoord2f(0,0); glVertex3f(+1,-1,+1);
-    glTexCoord2f(1,0); glVertex3f(+1,-1,-1);
-    glTexCoord2f(1,1); glVertex3f(+1,+1,-1);
-    glTexCoord2f(0,1); glVertex3f(+1,+1,+1);
-    glEnd();
-    //  Lef
-    glBegin(GL_QUADS);
-    glNormal3f(-1, 0, 0);
-    glTexCoord2f(0,0); glVertex3f(-1,-1,-1);
-    glTexCoord2f(1,0); glVertex3f(-1,-1,+1);
-    glTexCoord2f(1,1); glVertex3f(-1,+1,+1);
-    glTexCoord2f(0,1); glVertex3f(-1,+1,-1);
-    glEnd();
-    //  Top
-    glBegin(GL_QUADS);
-    glNormal3f( 0,+1, 0);
-    glTexCoord2f(0,0); glVertex3f(-1,+1,+1);
-    glTexCoord2f(1,0); glVertex3f(+1,+1,+1);
-    glTexCoord2f(1,1); glVertex3f(+1,+1,-1);
-    glTexCoord2f(0,1); glVertex3f(-1,+1,-1);
-    glEnd();
-    //  Bottom
-    glBegin(GL_QUADS);
-    glNormal3f( 0,-1, 0);
-    glTexCoord2f(0,0); glVertex3f(-1,-1,-1);
-    glTexCoord2f(1,0); glVertex3f(+1,-1,-1);
-    glTexCoord2f(1,1); glVertex3f(+1,-1,+1);
-    glTexCoord2f(0,1); glVertex3f(-1,-1,+1);
-    glEnd();
-    glPopMatrix();
-
+void seat(double x,double y)
+{
+  AddCube(seat_cubes,x,y,.4,.5,.5,.05,0);
+  AddCube(seat_cubes,x+.45,y+.45,.2,.05,.05,.2,0);
+  AddCube(seat_cubes,x-.45,y+.45,.2,.05,.05,.2,0);
+  AddCube(seat_cubes,x+.45,y-.45,.2,.05,.05,.2,0);
+  AddCube(seat_cubes,x-.45,y-.45,.2,.05,.05,.2,0);
 }
 
-void seat()
+/*
+ *  Build the cube lists for the furniture
+ */
+void furniture()
 {
-  cube(0,0,.4,.5,.5,.05,0);
-  cube(.45,.45,.2,.05,.05,.2,0);
-  cube(-.45,.45,.2,.05,.05,.2,0);
-  cube(.45,-.45,.2,.05,.05,.2,0);
-  cube(-.45,-.45,.2,.05,.05,.2,0);
+  table_cubes = NewCubes();
+  AddCube(table_cubes,0,0,.8,2,1,.1,0);
+  AddCube(table_cubes,1.9,.9,.4,.1,.1,.4,0);
+  AddCube(table_cubes,-1.9,.9,.4,.1,.1,.4,0);
+  AddCube(table_cubes,1.9,-.9,.4,.1,.1,.4,0);
+  AddCube(table_cubes,-1.9,-.9,.4,.1,.1,.4,0);
+
+  seat_cubes = NewCubes();
+  seat(-.75,-1);
+  seat(.75,-1);
+  seat(-.75,1);
+  seat(.75,1);
+
+  stand_cubes = NewCubes();
+  AddCube(stand_cubes,0,0,0,2,6,.1,0);
+
+  ground_cubes = NewCubes();
+  AddCube(ground_cubes,0,0,-.1,5,5,.05,0);
 }
 
 void table()
@@ -248,11 +243,7 @@ void table()
   glMaterialfv(GL_FRONT_AND_BACK,GL_SPECULAR,brown);
   glMaterialfv(GL_FRONT_AND_BACK,GL_DIFFUSE,brown);
   glMaterialfv(GL_FRONT_AND_BACK,GL_EMISSION,black);
-  cube(0,0,.8,2,1,.1,0);
-  cube(1.9,.9,.4,.1,.1,.4,0);
-  cube(-1.9,.9,.4,.1,.1,.4,0);
-  cube(1.9,-.9,.4,.1,.1,.4,0);
-  cube(-1.9,-.9,.4,.1,.1,.4,0);
+  DrawCubes(table_cubes);
 
 }
 
@@ -266,7 +257,7 @@ void ground()
   glMaterialfv(GL_FRONT_AND_BACK,GL_SPECULAR,brown);
   glMaterialfv(GL_FRONT_AND_BACK,GL_DIFFUSE,brown);
   glMaterialfv(GL_FRONT_AND_BACK,GL_EMISSION,black);
-  cube(0,0,-.1,5,5,.05,0);
+  DrawCubes(ground_cubes);
 }
 
 void box()
@@ -323,28 +314,7 @@ void box()
  */
 static void pole(double height, double radius)
 {
-  const int d = 5;
-  int theta;
-  double z;
-  for (z=0;z<=height;z+=.1)
-  {
-    glBegin(GL_QUAD_STRIP);
-    //glColor3f(0,1,0);
-
-    for (theta=0;theta<=360;theta+=d)
-    {
-      double x = radius*Cos(theta);
-      double y = radius*Sin(theta);
-      glNormal3f(x,y,0);
-      glTexCoord2f(x,y);
-      glVertex3f(x,y,z);
-      glNormal3f(x,y,0);
-      glTexCoord2f(x,y);
-      glVertex3f(x,y,z+.1);
-
-    }
-    glEnd();
-  }
+  DrawPole(height,radius);
   glPopMatrix();
 }
 
@@ -362,7 +332,7 @@ static void hanoi_stand(double space_between_poles)
   glMaterialfv(GL_FRONT_AND_BACK,GL_SPECULAR,brown);
   glMaterialfv(GL_FRONT_AND_BACK,GL_DIFFUSE,brown);
   glMaterialfv(GL_FRONT_AND_BACK,GL_EMISSION,black);
-  cube(0,0,0,2,6,.1,0);
+  DrawCubes(stand_cubes);
   glPushMatrix();
   glTranslated(0,0,0);
   glRotated(90,0,0,1);
@@ -384,65 +354,122 @@ static void hanoi_stand(double space_between_poles)
 
  static void torus(double a, double c)
  {
-   const int d=5;
-   int theta,phi;
-    for (theta=0;theta<=360;theta+=d)
-    {
-      glBegin(GL_QUAD_STRIP);
-      //glColor3f(red,green,blue);
-      for (phi=0;phi<=360;phi+=d)
-      {
-        double x = (c+a*Cos(theta))*Cos(phi);
-        double y = (c+a*Cos(theta))*Sin(phi);
-        double z = a*Sin(theta);
-        double x1 = (c+a*Cos(theta+d))*Cos(phi+d);
-        double y2 = (c+a*Cos(theta+d))*Sin(phi+d);
-        double z3 = a*Sin(theta+d);
-        glNormal3f(x,y,z);
-        glTexCoord2f(x,y);
-        glVertex3f(x,y,z);
-        glNormal3f(x1,y2,z3);
-        glTexCoord2f(x1,y2);
-        glVertex3f(x1,y2,z3);
-      }
-      glEnd();
+    DrawTorus(a,c);
+    //  Undo transofrmations
+    glPopMatrix();
+ }
 
-    }
-    //glEnd();
 
+//transformation from the model coordinates of the tori stack to the table
+void stack_frame()
+{
+   glTranslated(-.5,-.4,.9);
+   glRotated(80,0,0,1);
+   glScaled(.15,.15,.2);
+}
 
+//transformation from the mesh coordinates of armadillo k to the table
+void armadillo_frame(int k)
+{
+  if (k==0)
+  {
+    glTranslated(1.5,.5,1.05);
+    glRotated(90,1,0,0);
+    glRotated(15,0,1,0);
+  }
+  else
+  {
+    glTranslated(-1.4,-.4,1.05);
+    glRotated(90,1,0,0);
+    glRotated(280,0,1,0);
+  }
+  glScaled(.15,.15,.15);
+}
 
+//draws the stacks of tori on their stands
+void tori()
+{
+   glPushMatrix();
+   stack_frame();
 
-    //  Undo transofrmations
-    glPopMatrix();
- }
+   glPushMatrix();
+   //  Offset
+   glTranslated(0,-4,.25);
+   //glRotated(90,0,1,0);
+   glScaled(1,1,.25);
+   glColor4f(1,0,0,1);
+   glBindTexture(GL_TEXTURE_2D,texture[1]);
+   torus(.5,1);
 
+   glPushMatrix();
+   //  Offset
+   glTranslated(0,-4,.7);
+   //glRotated(90,0,0,1);
+   glScaled(.75,.75,.25);
+   glColor4f(1,1,0,1);
+   glBindTexture(GL_TEXTURE_2D,texture[1]);
+   torus(.5,1);
+
+   glPushMatrix();
+   //  Offset
+   glTranslated(0,-4,.9);
+   //glRotated(90,0,0,1);
+   glScaled(.5,.5,.25);
+   glColor4f(0,1,1,1);
+   glBindTexture(GL_TEXTURE_2D,texture[1]);
+   torus(.5,1);
+
+   glPushMatrix();
+   //  Offset
+   glTranslated(0,-4,1.25);
+   //glRotated(90,0,0,1);
+   glScaled(.25,.25,.25);
+   glColor4f(1,0,1,1);
+   glBindTexture(GL_TEXTURE_2D,texture[1]);
+   torus(.5,1);
+   hanoi_stand(4);
 
+   glPushMatrix();
+   //  Offset
+   glTranslated(0,4,1.6);
+   //glRotated(90,0,0,1);
+   glScaled(1.25,1.25,0.25);
+   glColor4f(0,1,0,1);
+   glBindTexture(GL_TEXTURE_2D,texture[1]);
+   torus(.5,1);
+   hanoi_stand(4);
+
+   glPopMatrix();
+}
+
+//  Overlay colors
+const float green[]   = {0,1,0,1};
+const float red[]     = {1,0,0,1};
+const float blue[]    = {0,0,1,1};
+const float magenta[] = {1,0,1,1};
+const float yellow[]  = {1,1,0,1};
+const float grey[]    = {.5,.5,.5,1};
+
+//adds a line to the overlay colored by its type
 void line(double x, double y, double z, double x1, double y1, double z1, int type)
 {
-  glLineWidth(5);
-  glBegin(GL_LINES);
-  if (type==MATCH) glColor4f(0,1,0,1);
-  else if (type==BAD_MATCH) glColor4f(1,0,0,1);
-  else if (type==LANDMARK_CAMERA_0) glColor4f(0,0,1,1);
-  else if (type==LANDMARK_CAMERA_1) glColor4f(1,0,1,1);
-  else if (type==TRANSFORM) glColor4f(0,1,0,1);
-  else glColor4f(.5,.5,.5,1);
-  glVertex4d(x,y,z,1);
-  glVertex4d(x1,y1,z1,1);
-  glEnd();
+  const float* color;
+  if (type==MATCH) color = green;
+  else if (type==BAD_MATCH) color = red;
+  else if (type==LANDMARK_CAMERA_0) color = blue;
+  else if (type==LANDMARK_CAMERA_1) color = magenta;
+  else if (type==TRANSFORM) color = green;
+  else color = grey;
+  OverlayLine(5,color,x,y,z,x1,y1,z1);
 }
 
-void landmark(struct Landmark loc)
+//adds a landmark point to the overlay
+void landmark(int lm, const float* color)
 {
-  glPointSize(10);
-  glBegin(GL_POINTS);
-  //glColor4f(1,1,0,1);
-  glVertex4d(loc.x,loc.y,loc.z,1);
-  glEnd();
+  OverlayPoint(10,color,snap->map.X[lm],snap->map.Y[lm],snap->map.Z[lm]);
 }
 
-void camera(struct Pose pose)
+void camera(pose_t pose)
 {
   //may redraw as lines instead of polygons
   glPushMatrix();
@@ -481,49 +508,108 @@ void camera(struct Pose pose)
   glPopMatrix();
 }
 
-//finds landmarks visible to camera and adds 10 to its list
+//finds an earlier keyframe seeing the same place as keyframe cam, then adds cam to the places
+//the demo's landmarks are already identified, so each one is its own visual word
+int recognize(int cam)
+{
+  placematch_t match;
+  const int* words = map.lm+map.first[cam];
+  int n = map.first[cam+1]-map.first[cam];
+  int found = QueryPlaces(&places,words,n,cam-LOOP_WINDOW,&match,1);
+  AddPlace(&places,cam,words,n);
+  return (found && match.score>=LOOP_SCORE) ? match.cam : -1;
+}
+
+//draws everything that can hide a landmark (the room is around them so it cannot)
+void occluding()
+{
+  DrawCubes(table_cubes);
+  DrawCubes(seat_cubes);
+  tori();
+  for (int k=0;k<2 && objects[0]>=0;k++)
+  {
+    glPushMatrix();
+    armadillo_frame(k);
+    DrawOBJ(objects[0]);
+    glPopMatrix();
+  }
+}
+
+//captures the occluders, and again once the armadillos arrive
+//the SLAM thread gets a copy to build its BVH from, ahead of any step posted after this
+void capture_occluders()
+{
+  if (occluders_armadillo==(objects[0]>=0)) return;
+  occlusion_stale = 1;
+  free(occluder_tri);
+  Noccluder_tri = CaptureTriangles(occluding,8,&occluder_tri);
+  occluders_t* copy = (occluders_t*)malloc(sizeof(occluders_t));
+  if (!copy) Fatal("Cannot allocate memory for occluders\n");
+  InitOccluders(copy);
+  copy->tri = (float*)malloc(9*(size_t)Noccluder_tri*sizeof(float)+1);
+  if (!copy->tri) Fatal("Cannot allocate memory for occluders\n");
+  memcpy(copy->tri,occluder_tri,9*(size_t)Noccluder_tri*sizeof(float));
+  copy->Ntri = copy->Mtri = Noccluder_tri;
+  PostSLAM(SLAM_OCCLUDERS,copy);
+  occluders_armadillo = (objects[0]>=0);
+}
+
+//finds the landmarks keyframe cam sees and makes them its observations
+//there are no camera images, so it looks from the true pose in loop_closure_array
+void detect(int cam)
+{
+  //the camera frustum has corners at (+-1,1,+-1), so 90 degrees each way, seeing up to 6m
+  intrinsics_t K;
+  CameraIntrinsics(&K,640,640,90);
+  K.zfar = 6;
+  pose_t truth = {loop_closure_array[cam][0],loop_closure_array[cam][1],loop_closure_array[cam][2],loop_closure_array[cam][3]};
+  SeeLandmarks(&map,cam,1,&truth,&K,&occluders,0);
+  //index the keyframe's observations for correspondence search
+  UpdateCovis(&covis,&map);
+}
+
+//finds landmarks visible to camera and adds them to its list
 void calcLandmarks()
 {
-  cameras[iteration].draw_landmarks = true;
-  //will calc additional ones and verify given ones
+  map.flags[iteration] |= CAM_LANDMARKS;
+  detect(iteration);
+  loop = recognize(iteration);
 }
 
 //sets the visibility of the camera-landmark lines
 void setCamLines(int newCamID, int oldCamID)
 {
-  cameras[newCamID].show_new=true;
+  map.flags[newCamID] |= CAM_NEW;
   if (oldCamID>0)
   {
-    cameras[oldCamID].show_old=true;
-    cameras[oldCamID].show_new=false;
-    cameras[oldCamID-1].show_old=false;
+    map.flags[oldCamID] |= CAM_OLD;
+    map.flags[oldCamID] &= ~CAM_NEW;
+    map.flags[oldCamID-1] &= ~CAM_OLD;
   }
   else if (oldCamID==0)
   {
-    cameras[oldCamID].show_old=true;
-    cameras[oldCamID].show_new=false;
+    map.flags[oldCamID] |= CAM_OLD;
+    map.flags[oldCamID] &= ~CAM_NEW;
   }
 }
 
 
+//advances the demo a step (SLAM thread)
 void next_step()
 {
   if (iteration==10)
   {
-    for (int i=0;i<10;i++)
+    //  Loop closure: refine the drifted poses against every observation
+    if (loop>=0)
     {
-      cameras[i].pose.x = loop_closure_array[i][0];
-      cameras[i].pose.y = loop_closure_array[i][1];
-      cameras[i].pose.z = loop_closure_array[i][2];
-      cameras[i].pose.d = loop_closure_array[i][3];
-      /*calc camera camera conrers
-      for (int i=0;i<4;i++)
-      {
-        cameras[i].camera_corners[i].x = .5*camera_corners[i][0]*Cos(cameras[i].pose.d) - camera_corners[i][1]*Sin(cameras[i].pose.d) + cameras[i].pose.x;
-        cameras[i].camera_corners[i].y = camera_corners[i][0]*Sin(cameras[i].pose.d) + .5*camera_corners[i][1]*Cos(cameras[i].pose.d) + cameras[i].pose.y;
-        cameras[i].camera_corners[i].z = .5*camera_corners[i][2] + cameras[i].pose.z;
-      }
-      */
+      baopt_t opt;
+      bareport_t rep;
+      BAOptions(&opt);
+      BundleAdjust(&map,&opt,&rep);
+      printf("Bundle adjustment: %d iterations cost %.4g to %.4g in %.2f ms\n",
+             rep.iterations,rep.cost0,rep.cost,1e3*rep.t_total);
+      //landmarks and keyframes moved
+      moved++;
     }
     iteration++;
 
@@ -532,25 +618,26 @@ void next_step()
 
   else if (iteration==9)
   {
-    cameras[9].visible=true;
-    cameras[9].draw_landmarks=true;
-    cameras[9].show_new=true;
-    cameras[0].show_old=true;
+    map.flags[9] |= CAM_VISIBLE|CAM_LANDMARKS|CAM_NEW;
+    detect(9);
+    loop = recognize(9);
+    if (loop>=0) map.flags[loop] |= CAM_OLD;
     iteration++;
   }
 
   else if (iteration>4)
   {
     step=0;
-    cameras[iteration].visible=true;
-    camera_transforms[iteration]=true;
+    map.flags[iteration] |= CAM_VISIBLE|CAM_TRANSFORM;
+    detect(iteration);
+    loop = recognize(iteration);
     iteration++;
 
   }
 
   else if (step==0) //add a camera
   {
-    cameras[iteration].visible=true;
+    map.flags[iteration] |= CAM_VISIBLE;
     step++;
   }
   else if (step==1) //detect landmarks in frame of camera
@@ -565,53 +652,222 @@ void next_step()
   }
   else if (step==3 && iteration!=0) //show correspondences between the new cameras
   {
-    cameras[iteration].show_camera_points=true;
+    map.flags[iteration] |= CAM_POINTS;
     step++;
   }
   else if (step==4 && iteration!=0) //draw a line showing transform
   {
 
-    camera_transforms[iteration]=true;
-    cameras[iteration].show_camera_points=false;
-    cameras[iteration-1].show_old=false;
-    cameras[iteration].show_new=false;
+    map.flags[iteration] |= CAM_TRANSFORM;
+    map.flags[iteration] &= ~(CAM_POINTS|CAM_NEW);
+    map.flags[iteration-1] &= ~CAM_OLD;
     //increment
     step=0;
     iteration++;
   }
   else
   {
-    cameras[iteration].show_camera_points=false;
-    cameras[iteration].show_old=false;
-    cameras[iteration].show_new=false;
+    map.flags[iteration] &= ~(CAM_POINTS|CAM_OLD|CAM_NEW);
       step=0;
       iteration++;
   }
 }
 
-void display()
+//adds the box (x0,y0,z0)-(x1,y1,z1) under the current modelview to the scene octree
+//call with the modelview set to the object's transformation from world coordinates
+void add_object(int id,double x0,double y0,double z0,double x1,double y1,double z1)
+{
+  double m[16];
+  float lo[3] = {INFINITY,INFINITY,INFINITY};
+  float hi[3] = {-INFINITY,-INFINITY,-INFINITY};
+  glGetDoublev(GL_MODELVIEW_MATRIX,m);
+  for (int k=0;k<8;k++)
+  {
+    double x = (k&1) ? x1 : x0;
+    double y = (k&2) ? y1 : y0;
+    double z = (k&4) ? z1 : z0;
+    for (int i=0;i<3;i++)
+    {
+      float w = m[i]*x + m[4+i]*y + m[8+i]*z + m[12+i];
+      if (w<lo[i]) lo[i] = w;
+      if (w>hi[i]) hi[i] = w;
+    }
+  }
+  OctreeAdd(scene_tree,id,lo,hi);
+  memcpy(object_box[id],lo,sizeof(lo));
+  memcpy(object_box[id]+3,hi,sizeof(hi));
+}
+
+//builds the octrees and adds the static objects with their world boxes
+void index_scene()
+{
+  scene_tree = NewOctree();
+  landmark_tree = NewOctree();
+  keyframe_tree = NewOctree();
+  glMatrixMode(GL_MODELVIEW);
+  glPushMatrix();
+  glLoadIdentity();
+  add_object(OBJ_TABLE,-2,-1,0,2,1,.9);
+  add_object(OBJ_SEATS,-1.3,-1.55,0,1.3,1.55,.45);
+  add_object(OBJ_ROOM,-5,-5,-.15,5,5,5);
+  stack_frame();
+  add_object(OBJ_TORI,-2,-6,-.1,2,6,2.5);
+  glPopMatrix();
+}
+
+//adds new landmarks and keyframes (and the armadillos once loaded) to the octrees
+void index_map()
+{
+  //bundle adjustment moved the landmarks and keyframes, or culling renumbered them
+  if (demo->moved!=moved_indexed)
+  {
+    ClearOctree(landmark_tree);
+    ClearOctree(keyframe_tree);
+    Nlm_indexed = Ncam_indexed = 0;
+    moved_indexed = demo->moved;
+  }
+  for (;Nlm_indexed<snap->map.Nlm;Nlm_indexed++)
+  {
+    int i = Nlm_indexed;
+    float p[3] = {snap->map.X[i],snap->map.Y[i],snap->map.Z[i]};
+    OctreeAdd(landmark_tree,i,p,p);
+  }
+  //keyframes cover their camera and the transform line from the previous one
+  for (;Ncam_indexed<snap->map.Ncam;Ncam_indexed++)
+  {
+    int i = Ncam_indexed;
+    pose_t p = snap->map.pose[i];
+    float lo[3] = {p.x,p.y,p.z};
+    float hi[3] = {p.x,p.y,p.z};
+    for (int k=0;k<5;k++)
+    {
+      //camera corners are drawn at half size
+      double x = k<4 ? .5*camera_corners[k][0] : 0;
+      double y = k<4 ? .5*camera_corners[k][1] : 0;
+      double z = k<4 ? .5*camera_corners[k][2] : 0;
+      float w[3] = {p.x+Cos(p.d)*x-Sin(p.d)*y,p.y+Sin(p.d)*x+Cos(p.d)*y,p.z+z};
+      if (k==4 && i>0)
+      {
+        w[0] = snap->map.pose[i-1].x;
+        w[1] = snap->map.pose[i-1].y;
+        w[2] = snap->map.pose[i-1].z;
+      }
+      for (int j=0;j<3;j++)
+      {
+        if (w[j]<lo[j]) lo[j] = w[j];
+        if (w[j]>hi[j]) hi[j] = w[j];
+      }
+    }
+    OctreeAdd(keyframe_tree,i,lo,hi);
+  }
+  if (objects[0]>=0 && !armadillos_indexed)
+  {
+    float lo[3],hi[3];
+    OBJBounds(objects[0],lo,hi);
+    glPushMatrix();
+    for (int k=0;k<2;k++)
+    {
+      glLoadIdentity();
+      armadillo_frame(k);
+      add_object(OBJ_ARMADILLO+k,lo[0],lo[1],lo[2],hi[0],hi[1],hi[2]);
+    }
+    glPopMatrix();
+    armadillos_indexed = 1;
+  }
+}
+
+int compareInts(const void* a,const void* b)
+{
+  int x = *(const int*)a;
+  int y = *(const int*)b;
+  return (x>y) - (x<y);
+}
+
+//finds the static objects, landmarks and keyframes in the view frustum
+//and not hidden by the furniture
+//call with the modelview set by gluLookAt
+void cull()
+{
+  int n;
+  index_map();
+  const int* vis = CullOctree(scene_tree,&n);
+  for (int k=0;k<OBJECTS;k++)
+    shown[k] = 0;
+  for (int k=0;k<n;k++)
+    shown[vis[k]] = 1;
+  vislm = (view%3!=0) ? CullOctree(landmark_tree,&Nvislm) : NULL;
+  if (!vislm) Nvislm = 0;
+  //then drops what the furniture hides (unless only the room is drawn)
+  if (occlude && view%3!=2)
+  {
+    ZoneBegin("occlusion");
+    int m=0;
+    capture_occluders();
+    if (occlusion_stale)
+    {
+      int vp[4];
+      glGetIntegerv(GL_VIEWPORT,vp);
+      //same shape as the viewport
+      int h = vp[2]>0 ? (OCCLUSION_WIDTH*vp[3]+vp[2]/2)/vp[2] : OCCLUSION_WIDTH;
+      OcclusionBegin(OCCLUSION_WIDTH,h>0 ? h : 1);
+      OcclusionDraw(occluder_tri,Noccluder_tri);
+      occlusion_stale = 0;
+    }
+    for (int k=0;k<OBJECTS;k++)
+      if (shown[k] && !OcclusionVisible(object_box[k],object_box[k]+3,0)) shown[k] = 0;
+    for (int k=0;k<Nvislm;k++)
+    {
+      float p[3] = {snap->map.X[vislm[k]],snap->map.Y[vislm[k]],snap->map.Z[vislm[k]]};
+      if (OcclusionVisible(p,p,LANDMARK_PAD)) vislm[m++] = vislm[k];
+    }
+    Nvislm = m;
+    ZoneEnd();
+  }
+  //keyframes in order so transparent cameras blend the same way every frame
+  viscam = CullOctree(keyframe_tree,&Nviscam);
+  qsort(viscam,Nviscam,sizeof(int),compareInts);
+}
+
+//flags of the keyframes that see landmark lm and show their landmarks
+unsigned int landmark_flags(int lm)
+{
+  unsigned int flags = 0;
+  const covis_t* c = &snap->covis;
+  if (lm>=c->Mlm) return 0;
+  for (int n=c->head[lm];n>=0;n=c->next[n])
+    if (snap->map.flags[c->cam[n]]&CAM_LANDMARKS)
+      flags |= snap->map.flags[c->cam[n]] | (c->cam[n]==selected ? CAM_SELECTED : 0);
+  return flags;
+}
+
+//sets the modelview to look from the eye
+void look()
+{
+   glLoadIdentity();
+   gluLookAt(eye_x,eye_y, eye_z , eye_x + Cos(theta_loc),eye_y + Sin(theta_loc),eye_z , 0,0,1);
+}
+
+//draws the static scene: the room and everything in it
+void scene()
 {
     //float Emission[] = {.1,.1,.1,1};
     float Ambient[]   = {.7,.7,.7,1.0};
     float Diffuse[]   = {.5,.5,.5,1.0};
     float Specular[]  = {1,1,1,1.0};
     float Position[] = {0,0,5,1};
-   //const double len=2.0;  //  Length of axes
    //  Erase the window and the depth buffer
    glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
-   //  Enable Z-buffering in OpenGL
-   glEnable(GL_DEPTH_TEST);
    glEnable(GL_TEXTURE_2D);
    glTexEnvi(GL_TEXTURE_ENV,GL_TEXTURE_ENV_MODE,GL_MODULATE);
-   glEnable(GL_BLEND);
-   glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
    //  Undo previous transformations
    glLoadIdentity();
    if(light){
    glColor3f(1,1,1);
+   static GLUquadric* bulb = NULL;
+   if (!bulb) bulb = gluNewQuadric();
    glPushMatrix();
    glTranslated(0,0,5);
-   glutSolidSphere(0.03,10,10);
+   gluSphere(bulb,0.03,10,10);
    glPopMatrix();
    glEnable(GL_NORMALIZE);
    //  Enable lighting
@@ -631,210 +887,171 @@ void display()
    glLightfv(GL_LIGHT0,GL_POSITION,Position);
  }
 
-   gluLookAt(eye_x,eye_y, eye_z , eye_x + Cos(theta_loc),eye_y + Sin(theta_loc),eye_z , 0,0,1);
+   look();
 
    //  Flat or smooth shading
    glShadeModel(GL_SMOOTH);
 
-   //  Light switch
-   //rescale these to fit on the table
    //  Draw scene
    if(view%3!=2)
    {
 
-   glPushMatrix();
-   glTranslated(-.5,-.4,.9);
-   glRotated(80,0,0,1);
-   glScaled(.15,.15,.2);
-
-   glPushMatrix();
-   //  Offset
-   glTranslated(0,-4,.25);
-   //glRotated(90,0,1,0);
-   glScaled(1,1,.25);
-   glColor4f(1,0,0,1);
-   glBindTexture(GL_TEXTURE_2D,texture[1]);
-   torus(.5,1);
-
-   glPushMatrix();
-   //  Offset
-   glTranslated(0,-4,.7);
-   //glRotated(90,0,0,1);
-   glScaled(.75,.75,.25);
-   glColor4f(1,1,0,1);
-   glBindTexture(GL_TEXTURE_2D,texture[1]);
-   torus(.5,1);
-
-   glPushMatrix();
-   //  Offset
-   glTranslated(0,-4,.9);
-   //glRotated(90,0,0,1);
-   glScaled(.5,.5,.25);
-   glColor4f(0,1,1,1);
-   glBindTexture(GL_TEXTURE_2D,texture[1]);
-   torus(.5,1);
-
-   glPushMatrix();
-   //  Offset
-   glTranslated(0,-4,1.25);
-   //glRotated(90,0,0,1);
-   glScaled(.25,.25,.25);
-   glColor4f(1,0,1,1);
-   glBindTexture(GL_TEXTURE_2D,texture[1]);
-   torus(.5,1);
-   hanoi_stand(4);
-
-   glPushMatrix();
-   //  Offset
-   glTranslated(0,4,1.6);
-   //glRotated(90,0,0,1);
-   glScaled(1.25,1.25,0.25);
-   glColor4f(0,1,0,1);
-   glBindTexture(GL_TEXTURE_2D,texture[1]);
-   torus(.5,1);
-   hanoi_stand(4);
-
-   glPopMatrix();
-   table();
+   ZoneBegin("tori");
+   if (shown[OBJ_TORI]) tori();
+   ZoneEnd();
+   ZoneBegin("furniture");
+   if (shown[OBJ_TABLE]) table();
 
    glColor3f(.5,.3,.3);
-   glPushMatrix();
-    glTranslated(-.75,-1,0);
-    //glScaled()
-     seat();
-     glPopMatrix();
-
-     glPushMatrix();
-      glTranslated(.75,-1,0);
-      //glScaled()
-       seat();
-       glPopMatrix();
-
-    glPushMatrix();
-    glTranslated(-.75,1,0);
-        //glScaled()
-    seat();
-    glPopMatrix();
-    glPushMatrix();
-    glTranslated(.75,1,0);
-          //glScaled()
-    seat();
-    glPopMatrix();
-
-    glPushMatrix();
-    glColor3f(.5,.5,.5);
-    glBindTexture(GL_TEXTURE_2D,texture[2]);
-    glMaterialf(GL_FRONT_AND_BACK,GL_SHININESS,128);
-    glTranslated(1.5,.5,1.05);
-    glRotated(90,1,0,0);
-    glRotated(15,0,1,0);
-    glScaled(.15,.15,.15);
-    glCallList(objects[0]);
-    glPopMatrix();
+   if (shown[OBJ_SEATS]) DrawCubes(seat_cubes);
+   ZoneEnd();
 
-    glPushMatrix();
-    glColor3f(.5,.5,.5);
-    glBindTexture(GL_TEXTURE_2D,texture[2]);
-    glMaterialf(GL_FRONT_AND_BACK,GL_SHININESS,128);
-    glTranslated(-1.4,-.4,1.05);
-    glRotated(90,1,0,0);
-    glRotated(280,0,1,0);
-    glScaled(.15,.15,.15);
-    glCallList(objects[0]);
-    glPopMatrix();
+   ZoneBegin("obj");
+    for (int k=0;k<2;k++)
+    {
+      if (objects[0]<0 || !shown[OBJ_ARMADILLO+k]) continue;
+      glPushMatrix();
+      glColor3f(.5,.5,.5);
+      glBindTexture(GL_TEXTURE_2D,texture[2]);
+      glMaterialf(GL_FRONT_AND_BACK,GL_SHININESS,128);
+      armadillo_frame(k);
+      DrawOBJ(objects[0]);
+      glPopMatrix();
+    }
+   ZoneEnd();
 
    }
+   ZoneBegin("room");
+   if (shown[OBJ_ROOM])
+   {
    ground();
    glColor3f(.5,.5,.5);
    box();
+   }
+   ZoneEnd();
    glDisable(GL_TEXTURE_2D);
    glDisable(GL_LIGHTING);
-   /*
-   for (int i=1;i<num_landmarks;i++)
+}
+
+//true when the view differs from the last frame or the scene has changed
+int view_changed()
+{
+  static double last[12];
+  int vp[4];
+  glGetIntegerv(GL_VIEWPORT,vp);
+  double now[12] = {eye_x,eye_y,eye_z,theta_loc,mode,fov,asp,dim,light,view%3,vp[2],vp[3]};
+  int changed = rebake || memcmp(now,last,sizeof(now));
+  memcpy(last,now,sizeof(now));
+  rebake = 0;
+  return changed;
+}
+
+void display()
+{
+   ZoneBegin("setup");
+   //  Enable Z-buffering in OpenGL
+   glEnable(GL_DEPTH_TEST);
+   glEnable(GL_BLEND);
+   glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+   //  Culling picks what goes in the overlay, so a new view rebuilds it
+   int changed = view_changed();
+   if (changed) overlay_dirty = occlusion_stale = 1;
+   //  Newest map from the SLAM thread, and the overlay again when it is new
+   snap = LatestSnapshot();
+   demo = (const progress_t*)snap->app;
+   if (snap->version!=drawn) overlay_dirty = 1;
+   drawn = snap->version;
+   look();
+   ZoneEnd();
+
+   //  What is on screen
+   if (overlay_dirty)
    {
-     landmark(landmarks[i]);
+     ZoneBegin("cull");
+     cull();
+     ZoneEnd();
    }
-   */
 
-   //draw landmarks that are to be drawn
-   for (int i=0;i<10;i++)
+   //  Static scene, drawn into the bake only when the view changes
+   if (!bake)
+     scene();
+   else
    {
-     //printf("about drawing landmarks for cam%d",i);
-     if (view%3!=0){
-     if(cameras[i].draw_landmarks==true)
+     if (changed)
      {
-       //printf("drawing landmarks for cam%d",i);
-       for (int lm=0; lm<10;lm++)
-       {
-
-         int index = cameras[i].visible_landmarks[lm];
-         //printf("Index is %d\n",index);
-         if(index>0)
-         {
-           if (cameras[i].is_selected) glColor4f(0,1,0,1);
-           else glColor4f(1,1,0,1);
-           landmark(landmarks[index]);
-         }
-       }
-     }}
-
-     if(cameras[i].show_new==true)
+       bake = BakeBegin();
+       scene();
+       if (bake) BakeEnd();
+     }
+     ZoneBegin("bake");
+     if (bake && !BakeDraw())
      {
-       for (int lm=0; lm<10;lm++)
-       {
-         int index = cameras[i].visible_landmarks[lm];
-         if (index>0)
-         {
-           double x = landmarks[index].x;
-           double y = landmarks[index].y;
-           double z = landmarks[index].z;
-           double x1 = cameras[i].pose.x;
-           double y1 = cameras[i].pose.y;
-           double z1 = cameras[i].pose.z;
-           //printf("%d %d %d %d %d %d\n",x,y,z,x1,y1,z1);
-           line(x,y,z,x1,y1,z1,LANDMARK_CAMERA_1);
-          }
-       }
+       //  The bake cannot be copied here, so draw every frame instead
+       bake = 0;
+       scene();
      }
+     ZoneEnd();
+     look();
+   }
+   /*
+   for (int i=0;i<snap->map.Nlm;i++)
+   {
+     landmark(i,yellow);
+   }
+   */
 
-       if(cameras[i].show_old==true)
-       {
-         for (int lm=0; lm<10;lm++)
-         {
-           int index = cameras[i].visible_landmarks[lm];
-           if (index>0)
-           {
-             double x = landmarks[index].x;
-             double y = landmarks[index].y;
-             double z = landmarks[index].z;
-             double x1 = cameras[i].pose.x;
-             double y1 = cameras[i].pose.y;
-             double z1 = cameras[i].pose.z;
-             //printf("%d %d %d %d %d %d\n",x,y,z,x1,y1,z1);
-             line(x,y,z,x1,y1,z1,LANDMARK_CAMERA_0);
-            }
-         }
-       }
+   //  Overlay built again only when the map, a selection or the view changed
+   ZoneBegin("overlay");
+   if (overlay_dirty)
+   {
+   ClearOverlay();
+   //draw landmarks that are to be drawn
+   ZoneBegin("landmarks");
+   //landmarks on screen that a keyframe showing its landmarks sees
+   if (view%3!=0)
+     for (int k=0;k<Nvislm;k++)
+     {
+       unsigned int flags = landmark_flags(vislm[k]);
+       if (flags&CAM_LANDMARKS)
+         landmark(vislm[k],(flags&CAM_SELECTED) ? green : yellow);
+     }
+   //rays to landmarks seen by the new and old frames
+   for (int i=0;i<snap->map.Ncam;i++)
+   {
+     unsigned int flags = snap->map.flags[i];
+     double x1 = snap->map.pose[i].x;
+     double y1 = snap->map.pose[i].y;
+     double z1 = snap->map.pose[i].z;
+     if (!(flags&(CAM_NEW|CAM_OLD))) continue;
+     for (int o=snap->map.first[i]; o<snap->map.first[i+1]; o++)
+     {
+       int index = snap->map.lm[o];
+       if (flags&CAM_NEW)
+         line(snap->map.X[index],snap->map.Y[index],snap->map.Z[index],x1,y1,z1,LANDMARK_CAMERA_1);
+       if (flags&CAM_OLD)
+         line(snap->map.X[index],snap->map.Y[index],snap->map.Z[index],x1,y1,z1,LANDMARK_CAMERA_0);
      }
+   }
+   ZoneEnd();
      //draw camera points and lines
-    if(step==4)
+    ZoneBegin("correspondences");
+    if(demo->step==4)
     {
-        for(int lm0=0;lm0<10;lm0++){ //iterate through the old cam
-          for(int lm1=0;lm1<10;lm1++){ //iterate through the new cam
-            if(cameras[iteration].visible_landmarks[lm0] == cameras[iteration-1].visible_landmarks[lm1] && cameras[iteration].visible_landmarks[lm0]!=0)
-            {
-              double lmx = landmarks[cameras[iteration].visible_landmarks[lm0]].x;
-              double lmy = landmarks[cameras[iteration].visible_landmarks[lm0]].y;
-              double lmz = landmarks[cameras[iteration].visible_landmarks[lm0]].z;
-              double c1x = cameras[iteration].pose.x;
-              double c1y = cameras[iteration].pose.y;
-              double c1z = cameras[iteration].pose.z;
-              double c2x = cameras[iteration-1].pose.x;
-              double c2y = cameras[iteration-1].pose.y;
-              double c2z = cameras[iteration-1].pose.z;
-
-              double d1 = pow(pow(lmx-c1x,2)+pow(lmy-c1y,2)+pow(lmz-c1z,2),0.5);
-              double d2 = pow(pow(lmx-c2x,2)+pow(lmy-c2y,2)+pow(lmz-c2z,2),0.5);
+        int Nshared;
+        const int* shared = Correspondences(&snap->covis,demo->iteration-1,demo->iteration,&Nshared);
+        for(int k=0;k<Nshared;k++){ //landmarks tracked by both cams
+              double lmx = snap->map.X[shared[k]];
+              double lmy = snap->map.Y[shared[k]];
+              double lmz = snap->map.Z[shared[k]];
+              double c1x = snap->map.pose[demo->iteration].x;
+              double c1y = snap->map.pose[demo->iteration].y;
+              double c1z = snap->map.pose[demo->iteration].z;
+              double c2x = snap->map.pose[demo->iteration-1].x;
+              double c2y = snap->map.pose[demo->iteration-1].y;
+              double c2z = snap->map.pose[demo->iteration-1].z;
+
+              double d1 = sqrt((lmx-c1x)*(lmx-c1x)+(lmy-c1y)*(lmy-c1y)+(lmz-c1z)*(lmz-c1z));
+              double d2 = sqrt((lmx-c2x)*(lmx-c2x)+(lmy-c2y)*(lmy-c2y)+(lmz-c2z)*(lmz-c2z));
 
 
               double lm_c1_x = c1x+(.7*((lmx-c1x)/d1));
@@ -845,38 +1062,38 @@ void display()
               double lm_c2_y = c2y+(.7*((lmy-c2y)/d2));
               double lm_c2_z = c2z+(.7*((lmz-c2z)/d2));
 
-              glColor4f(0,0,1,1);
-              glPointSize(10);
-              glBegin(GL_POINTS);
-              glVertex3d(lm_c1_x,lm_c1_y,lm_c1_z);
-              glVertex3d(lm_c2_x,lm_c2_y,lm_c2_z);
-              glEnd();
+              OverlayPoint(10,blue,lm_c1_x,lm_c1_y,lm_c1_z);
+              OverlayPoint(10,blue,lm_c2_x,lm_c2_y,lm_c2_z);
 
               line(lm_c1_x,lm_c1_y,lm_c1_z,lm_c2_x,lm_c2_y,lm_c2_z,MATCH);
-
-
-              break;
-            }
-
-          }
         }
     }
 
+    ZoneEnd();
+
    //draw transform lines
-   for(int i=1;i<10;i++)
+   for(int k=0;k<Nviscam;k++)
    {
-     if (camera_transforms[i]==true)
+     int i = viscam[k];
+     if (i>0 && (snap->map.flags[i]&CAM_TRANSFORM))
      {
-       line(cameras[i-1].pose.x,cameras[i-1].pose.y,cameras[i-1].pose.z,
-              cameras[i].pose.x,cameras[i].pose.y,cameras[i].pose.z, TRANSFORM);
+       line(snap->map.pose[i-1].x,snap->map.pose[i-1].y,snap->map.pose[i-1].z,
+              snap->map.pose[i].x,snap->map.pose[i].y,snap->map.pose[i].z, TRANSFORM);
      }
    }
+   overlay_dirty = 0;
+   }
+   //  Points and lines gathered above in one draw per style
+   DrawOverlay();
+   ZoneEnd();
 
-   for(int i=0;i<10;i++)
+   ZoneBegin("cameras");
+   for(int k=0;k<Nviscam;k++)
    {
-     if (cameras[i].visible==true) camera(cameras[i].pose);
+     if (snap->map.flags[viscam[k]]&CAM_VISIBLE) camera(snap->map.pose[viscam[k]]);
 
    }
+   ZoneEnd();
 
 
    //cube(0,0,0,1,1,1,0);
@@ -887,42 +1104,87 @@ void display()
    //glDisable(GL_LIGHTING);
 
    //  Display parameters
+   ZoneBegin("hud");
    glColor3f(1,1,1);
    glWindowPos2i(5,5);
-   Print("Angle=%d FOV=%d Step=%d Interation=%d\n",
-     theta_loc,fov,step+1,iteration+1);
-  if (iteration==11) Print(" This causes all frames poses to be adjusted though Bundle Adjustment");
-  else if (iteration==10) Print (" Frame 10 Detects the Same features that frame 1 did");
-  else if (iteration>4) Print(" Demonstrating Loop Closure");
-  else if (step==1) Print(" Add a camera frame");
-  else if (step==2) Print(" Detect Features in Camera frame");
-  else if (step==3) Print(" Project Features into the Environment");
-  else if (step==4) Print(" Find features tracked by consecutive frames");
-  else if (step==0 && iteration>1)Print(" Estimate a transform based on tracked features");
+   Print("Angle=%d FOV=%d Step=%d Interation=%d Materials=%d\n",
+     theta_loc,fov,demo->step+1,demo->iteration+1,MaterialSwitches());
+  if (recorded) Print(" Played %ld poses into %d keyframes with %d observations",demo->poses,snap->map.Ncam,snap->map.Nobs);
+  if (recorded && demo->culled.calls) Print(", culled %ld keyframes and %ld landmarks",demo->culled.cams,demo->culled.lms);
+  else if (demo->iteration==11) Print(" This causes all frames poses to be adjusted though Bundle Adjustment");
+  else if (demo->iteration==10 && demo->loop>=0) Print (" Frame 10 Detects the Same features that frame %d did",demo->loop+1);
+  else if (demo->iteration==10) Print (" Frame 10 Does not recognize an earlier frame");
+  else if (demo->iteration>4) Print(" Demonstrating Loop Closure");
+  else if (demo->step==1) Print(" Add a camera frame");
+  else if (demo->step==2) Print(" Detect Features in Camera frame");
+  else if (demo->step==3) Print(" Project Features into the Environment");
+  else if (demo->step==4) Print(" Find features tracked by consecutive frames");
+  else if (demo->step==0 && demo->iteration>1)Print(" Estimate a transform based on tracked features");
+   if (hud) ProfileHUD();
+   ZoneEnd();
 
    //  Render the scene and make it visible
+   ZoneBegin("swap");
    ErrCheck("display");
    glFlush();
-   glutSwapBuffers();
+   if (Offscreen())
+     glFinish();
+   else
+     glutSwapBuffers();
+   ZoneEnd();
+   ProfileFrame();
+
+   //  Report time to first frame
+   if (first_frame<0 && !Offscreen())
+   {
+     first_frame = glutGet(GLUT_ELAPSED_TIME);
+     printf("First frame after %d ms\n",first_frame);
+   }
+}
+
+/*
+ *  GLUT calls this routine every 10ms while assets are loading
+ *    Uploads assets as they finish and redraws when something changed
+ */
+void poll(int loading)
+{
+   int now = PollAssets();
+   if (now!=loading)
+   {
+     rebake = 1;
+     glutPostRedisplay();
+   }
+   if (now)
+     glutTimerFunc(10,poll,now);
+   else
+     printf("Assets loaded after %d ms\n",glutGet(GLUT_ELAPSED_TIME));
 }
 
 
+/*
+ *  GLUT calls this routine every 10ms to draw maps the SLAM thread publishes
+ */
+void watch(int unused)
+{
+   if (SnapshotWaiting()) glutPostRedisplay();
+   glutTimerFunc(10,watch,0);
+}
+
 void clearCameras()
 {
- for (int i=0;i<5;i++)
- {
-   cameras[i].is_selected = false;
- }
+ overlay_dirty = 1;
+ selected = -1;
 }
 void setCameraView(int camId)
 {
-  eye_x = cameras[camId].pose.x;
-  eye_y = cameras[camId].pose.y;
-  eye_z = cameras[camId].pose.z;
-  theta_loc = cameras[camId].pose.d +90;
+  if (camId>=snap->map.Ncam) return;
+  eye_x = snap->map.pose[camId].x;
+  eye_y = snap->map.pose[camId].y;
+  eye_z = snap->map.pose[camId].z;
+  theta_loc = snap->map.pose[camId].d +90;
 
   clearCameras();
-  cameras[camId].is_selected=true;
+  selected = camId;
 }
 
 
@@ -980,9 +1242,20 @@ void special(int key,int x,int y)
 void key(unsigned char ch,int x,int y)
 {
    //  Exit on ESC
-    if (ch == 27) exit(0);
+    if (ch == 27)
+    {
+      ProfileStop();
+      exit(0);
+    }
     else if (ch=='v') view++;
     else if (ch=='l') light = 1-light;
+    else if (ch=='p')
+    {
+      //profile zones on screen, keeping a log started with -profile running
+      hud = 1-hud;
+      if (hud && !Profiling) ProfileStart(NULL);
+      else if (!hud && !logging) ProfileStop();
+    }
     else if (ch=='1') setCameraView(0);
     else if (ch=='2') setCameraView(1);
     else if (ch=='3') setCameraView(2);
@@ -993,8 +1266,12 @@ void key(unsigned char ch,int x,int y)
     else if (ch=='8') setCameraView(7);
     else if (ch=='9') setCameraView(8);
     else if (ch=='0') setCameraView(9);
-    else if (ch==' '){
-      if (iteration<11) next_step();}
+    else if (ch==' ' && !recorded)
+    {
+      //the SLAM thread takes the step and the frame after it publishes shows it
+      capture_occluders();
+      PostSLAM(SLAM_STEP,NULL);
+    }
 
    Project(mode?fov:0,asp,dim);
    //  Animate if requested
@@ -1016,43 +1293,252 @@ void reshape(int width,int height)
    Project(mode?fov:0,asp,dim);
 }
 
-int main(int argc,char* argv[])
+//wall clock time in seconds
+double seconds()
 {
-    for (int i=0;i<10;i++)
+#ifdef _WIN32
+  return (double)clock()/CLOCKS_PER_SEC;
+#else
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC,&t);
+  return t.tv_sec + 1e-9*t.tv_nsec;
+#endif
+}
+
+int compareTimes(const void* a,const void* b)
+{
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x>y) - (x<y);
+}
+
+//renders frames at every demo step from each view and reports frame times and draw calls
+void benchmark(int frames)
+{
+  double* t = (double*)malloc(frames*sizeof(double));
+  double* all = NULL;
+  int Nall=0,steps=0;
+  long draws=0;
+  if (!t) Fatal("Cannot allocate memory for benchmark\n");
+
+  //draw until the assets arrive
+  while (PollAssets())
+  {
+    rebake = 1;
+    display();
+  }
+  rebake = 1;
+  DrawCalls();
+  MaterialSwitches();
+
+  printf("Renderer %s, %d frames per view\n",(const char*)glGetString(GL_RENDERER),frames);
+  printf("%5s %5s %5s %10s %10s %10s %7s\n","iter","step","view","min ms","median ms","p99 ms","draws");
+  while (1)
+  {
+    all = (double*)realloc(all,(Nall+3*frames)*sizeof(double));
+    if (!all) Fatal("Cannot allocate memory for benchmark\n");
+    for (view=0;view<3;view++)
     {
-      cameras[i].pose.x = demo_poses_array[i][0];
-      cameras[i].pose.y = demo_poses_array[i][1];
-      cameras[i].pose.z = demo_poses_array[i][2];
-      cameras[i].pose.d = demo_poses_array[i][3];
-      /*calc camera camera conrers
-      for (int i=0;i<4;i++)
+      int calls=0;
+      for (int k=0;k<frames;k++)
       {
-        cameras[i].camera_corners[i].x = .5*camera_corners[i][0]*Cos(cameras[i].pose.d) - camera_corners[i][1]*Sin(cameras[i].pose.d) + cameras[i].pose.x;
-        cameras[i].camera_corners[i].y = camera_corners[i][0]*Sin(cameras[i].pose.d) + .5*camera_corners[i][1]*Cos(cameras[i].pose.d) + cameras[i].pose.y;
-        cameras[i].camera_corners[i].z = .5*camera_corners[i][2] + cameras[i].pose.z;
+        double t0 = seconds();
+        display();
+        t[k] = 1e3*(seconds()-t0);
+        calls = DrawCalls();
+        MaterialSwitches();
+        all[Nall++] = t[k];
+        draws += calls;
       }
-      */
-      cameras[i].visible=false;
-      for (int k=0;k<10;k++)
-      {
-        cameras[i].visible_landmarks[k] = cam_landmark_array[i][k];
-      }
-      cameras[i].draw_landmarks=false;
-      cameras[i].show_old=false;
-      cameras[i].show_new=false;
-      cameras[i].is_selected=false;
-      cameras[i].show_camera_points=false;
-
+      qsort(t,frames,sizeof(double),compareTimes);
+      printf("%5d %5d %5d %10.3f %10.3f %10.3f %7d\n",demo->iteration+1,demo->step+1,view,t[0],t[frames/2],t[(99*frames-1)/100],calls);
     }
+    //advance the demo, waiting so every step is timed
+    steps++;
+    if (demo->iteration>=11 || recorded) break;
+    capture_occluders();
+    PostSLAM(SLAM_STEP,NULL);
+    WaitSLAM();
+  }
+  qsort(all,Nall,sizeof(double),compareTimes);
+  printf("%17s %10.3f %10.3f %10.3f %7.1f\n","all",all[0],all[Nall/2],all[(99*Nall-1)/100],(double)draws/(steps*3*frames));
+  free(t);
+  free(all);
+}
+
+//sets the odometry of keyframe cam
+//demo_poses_array is the drifted dead reckoning, so this is its step in the previous frame
+void odometry(int cam)
+{
+  double c = Cos(demo_poses_array[cam-1][3]);
+  double s = Sin(demo_poses_array[cam-1][3]);
+  double dx = demo_poses_array[cam][0] - demo_poses_array[cam-1][0];
+  double dy = demo_poses_array[cam][1] - demo_poses_array[cam-1][1];
+  map.odom[cam].x =  c*dx + s*dy;
+  map.odom[cam].y = -s*dx + c*dy;
+  map.odom[cam].z = demo_poses_array[cam][2] - demo_poses_array[cam-1][2];
+  map.odom[cam].d = demo_poses_array[cam][3] - demo_poses_array[cam-1][3];
+}
+
+//publishes the map and the demo state for drawing (SLAM thread)
+void publish()
+{
+  progress_t p = {iteration,step,loop,moved,dataset.poses,culled};
+  PublishSnapshot(&map,&covis,&p,sizeof(p));
+}
+
+//retires keyframes and landmarks while the map is over budget (SLAM thread)
+void retire()
+{
+  static int* cammap=NULL;
+  static int* lmmap=NULL;
+  int Nlm = map.Nlm;
+  if (!budget.maxcam && !budget.maxlm && !budget.maxbytes) return;
+  cammap = (int*)realloc(cammap,(map.Ncam+1)*sizeof(int));
+  lmmap = (int*)realloc(lmmap,(map.Nlm+1)*sizeof(int));
+  if (!cammap || !lmmap) Fatal("Cannot allocate memory for culling\n");
+  if (!CullMap(&map,&budget,&culled,cammap,lmmap)) return;
+  //keep streaming into the renumbered map
+  RenumberDataset(&dataset,cammap,lmmap,Nlm);
+  moved++;
+}
 
-    camera_transforms[0]=true;
+//streams the recorded run into the map as its time comes (SLAM thread)
+//the newest keyframe is drawn with rays to its landmarks over the trajectory so far
+//returns 1 until the run ends
+int play()
+{
+  if (play0==0) play0 = seconds();
+  int newest = map.Ncam-1;
+  int n = StreamDataset(&dataset,&map,dataset.t0+speed*(seconds()-play0),0);
+  if (n>0)
+  {
+    if (newest>=0) map.flags[newest] &= ~(CAM_VISIBLE|CAM_LANDMARKS|CAM_NEW);
+    for (int k=map.Ncam-n;k<map.Ncam;k++)
+      map.flags[k] |= CAM_TRANSFORM;
+    map.flags[map.Ncam-1] |= CAM_VISIBLE|CAM_LANDMARKS|CAM_NEW;
+    retire();
+    UpdateCovis(&covis,&map);
+    publish();
+  }
+  if (!dataset.ahead)
+  {
+    printf("Played %ld poses into %ld keyframes with %ld observations\n",dataset.poses,dataset.keyframes,dataset.observations);
+    if (culled.calls)
+      printf("Culled %ld keyframes, %ld landmarks and %ld observations (%.1f MB) leaving %d keyframes and %d landmarks in %.1f MB\n",
+             culled.cams,culled.lms,culled.obs,culled.bytes/1048576,map.Ncam,map.Nlm,MapMemory(&map)/1048576.0);
+    CloseDataset(&dataset);
+    publish();
+    return 0;
+  }
+  return 1;
+}
 
+//runs a request on the SLAM thread
+//returns 1 to be run again
+int slam(int request,void* data)
+{
+  if (request==SLAM_STEP && iteration<11)
+  {
+    next_step();
+    publish();
+  }
+  else if (request==SLAM_OCCLUDERS)
+  {
+    //the BVH is built here rather than on the render thread
+    occluders_t* copy = (occluders_t*)data;
+    FreeOccluders(&occluders);
+    AddOccluders(&occluders,copy->tri,copy->Ntri);
+    FreeOccluders(copy);
+    free(copy);
+  }
+  else if (request==SLAM_PLAY)
+    return play();
+  return 0;
+}
+
+int main(int argc,char* argv[])
+{
+   //  slam_demo -bench [frames] renders offscreen and reports frame times
+   //  slam_demo -profile file logs zone times as CSV, or a Chrome trace for .json
+   //  slam_demo -nobake draws the static scene every frame instead of once per view
+   //  slam_demo -noocclude draws what the furniture hides instead of skipping it
+   //  slam_demo -trajectory file [-observations file] [-landmarks file] [-speed x]
+   //    plays back a recorded run instead of the demo
+   //  slam_demo -maxkeyframes n -maxlandmarks n -maxmb x
+   //    keeps the map of a recorded run within these budgets
+   int bench=0;
+   const char* profile=NULL;
+   const char* trajectory=NULL;
+   const char* observations=NULL;
+   const char* landmarks=NULL;
+   CullOptions(&budget);
+   for (int i=1;i<argc;i++)
+   {
+     if (!strcmp(argv[i],"-bench"))
+       bench = (i+1<argc && isdigit(argv[i+1][0])) ? atoi(argv[++i]) : 30;
+     else if (!strcmp(argv[i],"-nobake"))
+       bake = 0;
+     else if (!strcmp(argv[i],"-noocclude"))
+       occlude = 0;
+     else if (!strcmp(argv[i],"-profile") && i+1<argc)
+       profile = argv[++i];
+     else if (!strcmp(argv[i],"-trajectory") && i+1<argc)
+       trajectory = argv[++i];
+     else if (!strcmp(argv[i],"-observations") && i+1<argc)
+       observations = argv[++i];
+     else if (!strcmp(argv[i],"-landmarks") && i+1<argc)
+       landmarks = argv[++i];
+     else if (!strcmp(argv[i],"-speed") && i+1<argc)
+       speed = atof(argv[++i]);
+     else if (!strcmp(argv[i],"-maxkeyframes") && i+1<argc)
+       budget.maxcam = atoi(argv[++i]);
+     else if (!strcmp(argv[i],"-maxlandmarks") && i+1<argc)
+       budget.maxlm = atoi(argv[++i]);
+     else if (!strcmp(argv[i],"-maxmb") && i+1<argc)
+       budget.maxbytes = 1048576*atof(argv[++i]);
+   }
+   //  A recording that never advances would play forever
+   if (!(speed>0)) Fatal("Playback speed must be positive\n");
+
+    InitMap(&map);
+    if (trajectory)
+    {
+      //  Recorded run streamed in as it plays
+      if (landmarks) ReadLandmarks(&map,landmarks);
+      OpenDataset(&dataset,trajectory,observations);
+      recorded = 1;
+    }
+    else
+    {
+    //  Demo map (keyframes find their landmarks as the demo reaches them)
     for (int i=0;i<num_landmarks;i++)
+      AddLandmark(&map,init_landmarks_array[i][0],init_landmarks_array[i][1],init_landmarks_array[i][2]);
+    for (int i=0;i<10;i++)
     {
-      landmarks[i].x = init_landmarks_array[i][0];
-      landmarks[i].y = init_landmarks_array[i][1];
-      landmarks[i].z = init_landmarks_array[i][2];
+      pose_t pose = {demo_poses_array[i][0],demo_poses_array[i][1],demo_poses_array[i][2],demo_poses_array[i][3]};
+      AddKeyframe(&map,pose);
+      if (i>0) odometry(i);
     }
+    map.flags[0] |= CAM_TRANSFORM;
+    }
+    InitCovis(&covis);
+    UpdateCovis(&covis,&map);
+    InitPlaces(&places,0);
+    InitOccluders(&occluders);
+    //  The SLAM thread owns the map from here and the renderer draws what it publishes
+    publish();
+    snap = LatestSnapshot();
+    demo = (const progress_t*)snap->app;
+    StartSLAM(slam);
+
+   if (bench>0)
+   {
+     Headless(1000,1000);
+     reshape(1000,1000);
+   }
+   else
+   {
    //  Initialize GLUT
    glutInit(&argc,argv);
    //  Request double buffered, true color window with Z buffering at 1000x1000
@@ -1064,14 +1550,43 @@ int main(int argc,char* argv[])
    glutReshapeFunc(reshape);
    glutSpecialFunc(special);
    glutKeyboardFunc(key);
+   glutTimerFunc(10,watch,0);
+   }
+   if (profile)
+   {
+     ProfileStart(profile);
+     logging = 1;
+   }
 
-   texture[0] = LoadTexBMP("wood.bmp");
-   texture[1] = LoadTexBMP("cleanmetal.bmp");
-   texture[2] = LoadTexBMP("metal.bmp");
+   //  Furniture drawn as batched cubes
+   furniture();
+   //  Octrees for culling
+   index_scene();
+   //  Compressed mipmapped textures when the driver supports them
+   TexCompression(1);
+   //  Load assets in the background (placeholders until they arrive)
+   texture[0] = LoadTexBMPAsync("wood.bmp");
+   texture[1] = LoadTexBMPAsync("cleanmetal.bmp");
+   texture[2] = LoadTexBMPAsync("metal.bmp");
    //texture[2] = LoadTexBMP("metal.bmp");
 
 
-   objects[0] = LoadOBJ("armadillo.obj");
+   LoadOBJAsync("armadillo.obj",&objects[0]);
+   if (Offscreen())
+   {
+     //  Benchmark the whole recorded run
+     if (recorded)
+     {
+       play0 = -INFINITY;
+       PostSLAM(SLAM_PLAY,NULL);
+       WaitSLAM();
+     }
+     benchmark(bench);
+     ProfileStop();
+     return 0;
+   }
+   glutTimerFunc(10,poll,PollAssets());
+   if (recorded) PostSLAM(SLAM_PLAY,NULL);
    //  Pass control to GLUT so it can interact with the user
    ErrCheck("init");
    glutMainLoop();
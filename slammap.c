@@ -0,0 +1,362 @@
+/*
+ *  SLAM map store
+ *
+ *  Growable arrays for landmarks, keyframes and observations (see slam.h).
+ *  Capacities double when full, and ReserveMap() sizes everything up
+ *  front when the final size is known, so memory stays proportional to
+ *  the map and loops over it touch contiguous arrays only.  RemoveFromMap()
+ *  compacts the arrays and gives memory back when they shrink by half, and
+ *  TrimMap() sets the capacities outright to hold the map within a budget.
+ */
+#include "CSCIx229.h"
+#include "slam.h"
+
+//
+//  Grow landmark arrays to hold n landmarks
+//
+static void growlm(slammap_t* map,int n)
+{
+   if (n<=map->Mlm) return;
+   map->Mlm = ArrayCapacity(map->Mlm,n);
+   map->X = (double*)ResizeArray(map->X,map->Mlm,sizeof(double));
+   map->Y = (double*)ResizeArray(map->Y,map->Mlm,sizeof(double));
+   map->Z = (double*)ResizeArray(map->Z,map->Mlm,sizeof(double));
+}
+
+//
+//  Grow keyframe arrays to hold n keyframes
+//
+static void growcam(slammap_t* map,int n)
+{
+   if (n<=map->Mcam) return;
+   map->Mcam  = ArrayCapacity(map->Mcam,n);
+   map->pose  = (pose_t*)ResizeArray(map->pose,map->Mcam,sizeof(pose_t));
+   map->flags = (unsigned int*)ResizeArray(map->flags,map->Mcam,sizeof(unsigned int));
+   map->odom  = (pose_t*)ResizeArray(map->odom,map->Mcam,sizeof(pose_t));
+   map->first = (int*)ResizeArray(map->first,map->Mcam+1,sizeof(int));
+}
+
+//
+//  Grow observation array to hold n observations
+//
+static void growobs(slammap_t* map,int n)
+{
+   if (n<=map->Mobs) return;
+   map->Mobs = ArrayCapacity(map->Mobs,n);
+   map->lm = (int*)ResizeArray(map->lm,map->Mobs,sizeof(int));
+   map->u  = (float*)ResizeArray(map->u,map->Mobs,sizeof(float));
+   map->v  = (float*)ResizeArray(map->v,map->Mobs,sizeof(float));
+}
+
+/*
+ *  Initialize an empty map
+ */
+void InitMap(slammap_t* map)
+{
+   memset(map,0,sizeof(slammap_t));
+   growcam(map,1);
+   map->first[0] = 0;
+}
+
+/*
+ *  Release map memory
+ */
+void FreeMap(slammap_t* map)
+{
+   free(map->X);
+   free(map->Y);
+   free(map->Z);
+   free(map->pose);
+   free(map->flags);
+   free(map->odom);
+   free(map->first);
+   free(map->lm);
+   free(map->u);
+   free(map->v);
+   memset(map,0,sizeof(slammap_t));
+}
+
+/*
+ *  Reserve room for Nlm landmarks, Ncam keyframes and Nobs observations
+ */
+void ReserveMap(slammap_t* map,int Nlm,int Ncam,int Nobs)
+{
+   growlm(map,Nlm);
+   growcam(map,Ncam);
+   growobs(map,Nobs);
+}
+
+//
+//  Capacity for n elements after removing some (max if it would not halve)
+//
+static int shrunk(int max,int n)
+{
+   int m = ArrayCapacity(0,n);
+   return (2*m<=max) ? m : max;
+}
+
+//
+//  Reallocate the arrays whose capacity changes
+//
+static void fit(slammap_t* map,int Mlm,int Mcam,int Mobs)
+{
+   if (Mlm!=map->Mlm)
+   {
+      map->Mlm = Mlm;
+      map->X = (double*)ResizeArray(map->X,Mlm,sizeof(double));
+      map->Y = (double*)ResizeArray(map->Y,Mlm,sizeof(double));
+      map->Z = (double*)ResizeArray(map->Z,Mlm,sizeof(double));
+   }
+   if (Mcam!=map->Mcam)
+   {
+      map->Mcam  = Mcam;
+      map->pose  = (pose_t*)ResizeArray(map->pose,Mcam,sizeof(pose_t));
+      map->flags = (unsigned int*)ResizeArray(map->flags,Mcam,sizeof(unsigned int));
+      map->odom  = (pose_t*)ResizeArray(map->odom,Mcam,sizeof(pose_t));
+      map->first = (int*)ResizeArray(map->first,Mcam+1,sizeof(int));
+   }
+   if (Mobs!=map->Mobs)
+   {
+      map->Mobs = Mobs;
+      map->lm = (int*)ResizeArray(map->lm,Mobs,sizeof(int));
+      map->u  = (float*)ResizeArray(map->u,Mobs,sizeof(float));
+      map->v  = (float*)ResizeArray(map->v,Mobs,sizeof(float));
+   }
+}
+
+//
+//  Odometry a then b (NAN if either is unknown)
+//
+static pose_t compose(pose_t a,pose_t b)
+{
+   pose_t r;
+   double c = Cos(a.d),s = Sin(a.d);
+   r.x = a.x + c*b.x - s*b.y;
+   r.y = a.y + s*b.x + c*b.y;
+   r.z = a.z + b.z;
+   r.d = a.d + b.d;
+   if (isnan(a.x) || isnan(b.x)) r.x = r.y = r.z = r.d = NAN;
+   return r;
+}
+
+/*
+ *  Remove keyframes and landmarks from the map
+ *    Keyframe k goes when dropcam[k] is set and landmark l when droplm[l]
+ *    is set (either may be NULL), along with their observations.  The rest
+ *    keep their order and are renumbered from 0.  The odometry of a kept
+ *    keyframe becomes its motion from the kept keyframe before it.
+ *    Sets cammap[k] and lmmap[l] (if not NULL) to the new index of each
+ *    old keyframe and landmark, or -1 if it was removed
+ */
+void RemoveFromMap(slammap_t* map,const unsigned char* dropcam,const unsigned char* droplm,int* cammap,int* lmmap)
+{
+   int k,l,o,Ncam=0,Nlm=0,Nobs=0;
+   int* lmnew = (int*)malloc((map->Nlm+1)*sizeof(int));
+   pose_t step = {0,0,0,0};
+   int dropped = 0;
+   if (!lmnew) Fatal("Cannot allocate memory for map\n");
+   //  Landmarks
+   for (l=0;l<map->Nlm;l++)
+      if (droplm && droplm[l])
+         lmnew[l] = -1;
+      else
+      {
+         map->X[Nlm] = map->X[l];
+         map->Y[Nlm] = map->Y[l];
+         map->Z[Nlm] = map->Z[l];
+         lmnew[l] = Nlm++;
+      }
+   //  Keyframes and their observations of the kept landmarks
+   for (k=0;k<map->Ncam;k++)
+   {
+      int o0 = map->first[k],o1 = map->first[k+1];
+      if (dropcam && dropcam[k])
+      {
+         //  Motion so far from the last kept keyframe
+         step = dropped ? compose(step,map->odom[k]) : map->odom[k];
+         dropped = 1;
+         if (cammap) cammap[k] = -1;
+         continue;
+      }
+      map->pose[Ncam]  = map->pose[k];
+      map->flags[Ncam] = map->flags[k];
+      map->odom[Ncam]  = dropped ? compose(step,map->odom[k]) : map->odom[k];
+      dropped = 0;
+      map->first[Ncam] = Nobs;
+      for (o=o0;o<o1;o++)
+         if (lmnew[map->lm[o]]>=0)
+         {
+            map->lm[Nobs] = lmnew[map->lm[o]];
+            map->u[Nobs] = map->u[o];
+            map->v[Nobs] = map->v[o];
+            Nobs++;
+         }
+      if (cammap) cammap[k] = Ncam;
+      Ncam++;
+   }
+   map->first[Ncam] = Nobs;
+   if (lmmap) memcpy(lmmap,lmnew,map->Nlm*sizeof(int));
+   free(lmnew);
+   map->Nlm = Nlm;
+   map->Ncam = Ncam;
+   map->Nobs = Nobs;
+   map->edited = 0;
+   map->reshaped++;
+
+   //  Give back memory once the arrays are at most half full
+   fit(map,shrunk(map->Mlm,Nlm),shrunk(map->Mcam,Ncam),shrunk(map->Mobs,Nobs));
+}
+
+/*
+ *  Set the capacities to Mlm landmarks, Mcam keyframes and Mobs observations
+ *    Capacities are never set below what the map holds
+ */
+void TrimMap(slammap_t* map,int Mlm,int Mcam,int Mobs)
+{
+   if (Mlm<map->Nlm) Mlm = map->Nlm;
+   if (Mcam<map->Ncam) Mcam = map->Ncam;
+   if (Mobs<map->Nobs) Mobs = map->Nobs;
+   fit(map,Mlm>0?Mlm:1,Mcam>0?Mcam:1,Mobs>0?Mobs:1);
+}
+
+/*
+ *  Make dst a copy of map src
+ *    dst must be initialized and keeps its arrays when they are big enough,
+ *    so copying into the same map again allocates nothing.  When dst was
+ *    last copied from src, only what src has appended since is copied,
+ *    along with every pose and landmark if they were adjusted and the flags
+ *    the application sets directly.  Removing entries or replacing
+ *    observations makes the next copy start over.
+ */
+void CopyMap(slammap_t* dst,const slammap_t* src)
+{
+   int lm=0,cam=0,obs=0;
+   if (dst->reshaped==src->reshaped && dst->Nlm<=src->Nlm && dst->Ncam<=src->Ncam && dst->Nobs<=src->Nobs)
+   {
+      lm  = (dst->adjusted==src->adjusted) ? dst->Nlm : 0;
+      cam = dst->Ncam;
+      obs = dst->Nobs;
+   }
+   growlm(dst,src->Nlm);
+   growcam(dst,src->Ncam);
+   growobs(dst,src->Nobs);
+   memcpy(dst->X+lm,src->X+lm,(src->Nlm-lm)*sizeof(double));
+   memcpy(dst->Y+lm,src->Y+lm,(src->Nlm-lm)*sizeof(double));
+   memcpy(dst->Z+lm,src->Z+lm,(src->Nlm-lm)*sizeof(double));
+   if (dst->adjusted==src->adjusted)
+      memcpy(dst->pose+cam,src->pose+cam,(src->Ncam-cam)*sizeof(pose_t));
+   else
+      memcpy(dst->pose,src->pose,src->Ncam*sizeof(pose_t));
+   memcpy(dst->flags,src->flags,src->Ncam*sizeof(unsigned int));
+   memcpy(dst->odom+cam,src->odom+cam,(src->Ncam-cam)*sizeof(pose_t));
+   memcpy(dst->first+cam,src->first+cam,(src->Ncam+1-cam)*sizeof(int));
+   memcpy(dst->lm+obs,src->lm+obs,(src->Nobs-obs)*sizeof(int));
+   memcpy(dst->u+obs,src->u+obs,(src->Nobs-obs)*sizeof(float));
+   memcpy(dst->v+obs,src->v+obs,(src->Nobs-obs)*sizeof(float));
+   dst->Nlm = src->Nlm;
+   dst->Ncam = src->Ncam;
+   dst->Nobs = src->Nobs;
+   dst->edited = src->edited;
+   dst->reshaped = src->reshaped;
+   dst->adjusted = src->adjusted;
+}
+
+/*
+ *  Bytes allocated by the map
+ */
+size_t MapMemory(const slammap_t* map)
+{
+   return 3*sizeof(double)*(size_t)map->Mlm +
+          (2*sizeof(pose_t)+sizeof(unsigned int)+sizeof(int))*(size_t)map->Mcam + sizeof(int) +
+          (sizeof(int)+2*sizeof(float))*(size_t)map->Mobs;
+}
+
+/*
+ *  Add a landmark
+ *    Returns its index
+ */
+int AddLandmark(slammap_t* map,double x,double y,double z)
+{
+   int k = map->Nlm;
+   growlm(map,k+1);
+   map->X[k] = x;
+   map->Y[k] = y;
+   map->Z[k] = z;
+   map->Nlm++;
+   return k;
+}
+
+/*
+ *  Add a keyframe with no observations, odometry or flags
+ *    Returns its index
+ */
+int AddKeyframe(slammap_t* map,pose_t pose)
+{
+   int k = map->Ncam;
+   growcam(map,k+1);
+   map->pose[k]  = pose;
+   map->flags[k] = 0;
+   map->odom[k].x = map->odom[k].y = map->odom[k].z = map->odom[k].d = NAN;
+   map->first[k+1] = map->Nobs;
+   map->Ncam++;
+   if (k<map->edited) map->edited = k;
+   return k;
+}
+
+/*
+ *  Add an observation of landmark lm at image coordinates (u,v) to the
+ *  last keyframe (NAN if not measured)
+ */
+void AddObservation(slammap_t* map,int lm,double u,double v)
+{
+   if (map->Ncam<1) Fatal("Observation without keyframe\n");
+   if (lm<0 || lm>=map->Nlm) Fatal("Invalid landmark %d\n",lm);
+   growobs(map,map->Nobs+1);
+   map->u[map->Nobs] = u;
+   map->v[map->Nobs] = v;
+   map->lm[map->Nobs++] = lm;
+   map->first[map->Ncam] = map->Nobs;
+   if (map->Ncam-1<map->edited) map->edited = map->Ncam-1;
+}
+
+//
+//  Move observations from o to the end by delta
+//
+static void shift(slammap_t* map,int o,int delta)
+{
+   int n = map->Nobs-o;
+   memmove(map->lm+o+delta,map->lm+o,n*sizeof(int));
+   memmove(map->u+o+delta,map->u+o,n*sizeof(float));
+   memmove(map->v+o+delta,map->v+o,n*sizeof(float));
+}
+
+/*
+ *  Replace the observations of keyframe cam
+ *    u and v may be NULL if the observations are not measured
+ *    Rows after cam are moved when the count changes, so this is cheap
+ *    for the newest keyframe and linear in the map size otherwise
+ */
+void SetObservations(slammap_t* map,int cam,const int* lm,const float* u,const float* v,int n)
+{
+   int k,delta;
+   if (cam<0 || cam>=map->Ncam) Fatal("Invalid keyframe %d\n",cam);
+   for (k=0;k<n;k++)
+      if (lm[k]<0 || lm[k]>=map->Nlm) Fatal("Invalid landmark %d\n",lm[k]);
+   delta = n - (map->first[cam+1]-map->first[cam]);
+   growobs(map,map->Nobs+delta);
+   if (delta)
+   {
+      shift(map,map->first[cam+1],delta);
+      for (k=cam+1;k<=map->Ncam;k++)
+         map->first[k] += delta;
+      map->Nobs += delta;
+   }
+   memcpy(map->lm+map->first[cam],lm,n*sizeof(int));
+   for (k=0;k<n;k++)
+   {
+      map->u[map->first[cam]+k] = u ? u[k] : NAN;
+      map->v[map->first[cam]+k] = v ? v[k] : NAN;
+   }
+   if (cam<map->edited) map->edited = cam;
+   map->reshaped++;
+}
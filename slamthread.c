@@ -0,0 +1,206 @@
+/*
+ *  SLAM thread and map snapshots
+ *
+ *  StartSLAM() starts a thread that owns the map and runs the requests
+ *  PostSLAM() queues for it in order, so tracking and optimization never
+ *  hold up drawing.  The thread publishes its map with PublishSnapshot()
+ *  and the renderer draws LatestSnapshot().
+ *
+ *  Snapshots are triple buffered: the SLAM thread fills its back buffer
+ *  while the renderer reads its front buffer, and the third holds the
+ *  newest complete snapshot.  Publishing and taking the newest each swap
+ *  a buffer with it in one atomic exchange, so neither side ever waits for
+ *  the other, the renderer never sees a snapshot being filled and the
+ *  buffers are reused without allocating once they are big enough.  Each
+ *  buffer is brought up to date with only what the map appended since it
+ *  was last filled (see CopyMap and CopyCovis), so publishing costs about
+ *  the work done since the last snapshot rather than the size of the map.
+ *
+ *  Without threads requests run when they are posted.
+ */
+#include "CSCIx229.h"
+#include "slam.h"
+#ifndef _WIN32
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#define SLAM_PAUSE 10  //  Milliseconds between runs of a request that repeats
+#define SLAM_FRESH 4   //  Flag on the newest buffer that the renderer has not taken
+
+//  Request waiting for the SLAM thread
+typedef struct request_s
+{
+   int               request;  //  Request
+   void*             data;     //  Request data
+   struct request_s* next;     //  Next request in list
+} request_t;
+
+static int (*work)(int request,void* data)=NULL;  //  Runs a request
+static snapshot_t snap[3];       //  Snapshot buffers
+static int back=0;               //  Buffer being filled (SLAM thread only)
+static int front=1;              //  Buffer being drawn (renderer only)
+static int newest=2;             //  Newest complete buffer (atomic, with SLAM_FRESH until taken)
+static long published=0;         //  Snapshots published (SLAM thread only)
+#ifndef _WIN32
+static request_t*  todo=NULL;    //  Requests waiting (oldest first)
+static request_t** last=&todo;   //  End of todo list
+static int         running=0;    //  A request is being run
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  idle = PTHREAD_COND_INITIALIZER;
+
+//
+//  Append a request to the todo list (call with the lock held)
+//
+static void append(request_t* r)
+{
+   r->next = NULL;
+   *last = r;
+   last = &r->next;
+}
+
+//
+//  SLAM thread
+//    Runs requests in order, and a request that asks to run again goes to
+//    the back of the list (after a pause when nothing else is waiting)
+//
+static void* worker(void* arg)
+{
+   pthread_mutex_lock(&lock);
+   for (;;)
+   {
+      request_t* r;
+      int again;
+      while (!todo)
+      {
+         running = 0;
+         pthread_cond_broadcast(&idle);
+         pthread_cond_wait(&wake,&lock);
+      }
+      r = todo;
+      todo = r->next;
+      if (!todo) last = &todo;
+      running = 1;
+      pthread_mutex_unlock(&lock);
+
+      again = work(r->request,r->data);
+
+      pthread_mutex_lock(&lock);
+      if (!again)
+         free(r);
+      else
+      {
+         if (!todo)
+         {
+            struct timespec t;
+            clock_gettime(CLOCK_REALTIME,&t);
+            t.tv_nsec += SLAM_PAUSE*1000000L;
+            t.tv_sec += t.tv_nsec/1000000000L;
+            t.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&wake,&lock,&t);
+         }
+         append(r);
+      }
+   }
+   return NULL;
+}
+#endif
+
+/*
+ *  Start the SLAM thread
+ *    func(request,data) runs each posted request and returns 1 to be run
+ *    again later (e.g. to keep streaming a recording) or 0 when done
+ */
+void StartSLAM(int (*func)(int request,void* data))
+{
+   if (work) Fatal("SLAM thread already started\n");
+   work = func;
+#ifndef _WIN32
+   pthread_t tid;
+   if (pthread_create(&tid,NULL,worker,NULL)) Fatal("Cannot create SLAM thread\n");
+   pthread_detach(tid);
+#endif
+}
+
+/*
+ *  Queue a request for the SLAM thread
+ *    Requests run in the order they are posted
+ */
+void PostSLAM(int request,void* data)
+{
+   if (!work) Fatal("SLAM thread not started\n");
+#ifdef _WIN32
+   while (work(request,data));
+#else
+   request_t* r = (request_t*)malloc(sizeof(request_t));
+   if (!r) Fatal("Cannot allocate memory for SLAM request\n");
+   r->request = request;
+   r->data = data;
+   pthread_mutex_lock(&lock);
+   append(r);
+   pthread_cond_signal(&wake);
+   pthread_mutex_unlock(&lock);
+#endif
+}
+
+/*
+ *  Wait until the SLAM thread has run every request
+ *    A request that keeps asking to run again is waited for until it stops
+ */
+void WaitSLAM(void)
+{
+#ifndef _WIN32
+   pthread_mutex_lock(&lock);
+   while (todo || running)
+      pthread_cond_wait(&idle,&lock);
+   pthread_mutex_unlock(&lock);
+#endif
+}
+
+/*
+ *  Publish a copy of the map, its covisibility graph and size bytes of
+ *  application state
+ *    Call from the SLAM thread (or before it starts) with the same map and
+ *    graph each time
+ */
+void PublishSnapshot(const slammap_t* map,const covis_t* covis,const void* app,size_t size)
+{
+   snapshot_t* s = snap+back;
+   if (!s->map.first) InitMap(&s->map);
+   if (!s->covis.back) InitCovis(&s->covis);
+   CopyMap(&s->map,map);
+   CopyCovis(&s->covis,covis,map);
+   if (size>s->Mapp)
+   {
+      s->app = realloc(s->app,size);
+      if (!s->app) Fatal("Cannot allocate memory for snapshot\n");
+      s->Mapp = size;
+   }
+   if (size) memcpy(s->app,app,size);
+   s->size = size;
+   s->version = ++published;
+   //  Make it the newest and fill the one it replaces next time
+   back = __atomic_exchange_n(&newest,back|SLAM_FRESH,__ATOMIC_ACQ_REL) & ~SLAM_FRESH;
+}
+
+/*
+ *  Is there a snapshot newer than the one the renderer has
+ */
+int SnapshotWaiting(void)
+{
+   return (__atomic_load_n(&newest,__ATOMIC_ACQUIRE)&SLAM_FRESH) != 0;
+}
+
+/*
+ *  Newest snapshot
+ *    Call from the renderer.  The snapshot stays unchanged until the next
+ *    call, which may return the same one.  Returns NULL before the first
+ *    is published.
+ */
+const snapshot_t* LatestSnapshot(void)
+{
+   if (SnapshotWaiting())
+      front = __atomic_exchange_n(&newest,front,__ATOMIC_ACQ_REL) & ~SLAM_FRESH;
+   return snap[front].version ? snap+front : NULL;
+}
@@ -0,0 +1,162 @@
+/*
+ *  Texture loader benchmark
+ *
+ *  Compares loading a BMP straight into a single level texture against
+ *  the mipmapped texture cache, uncompressed and BC1 compressed.  Reports
+ *  the time to build and to load each cache, the texture memory each
+ *  takes and the time to draw a floor viewed at a grazing angle, which is
+ *  where mipmaps and compression matter most.
+ *
+ *  Usage:
+ *    texbench file.bmp [repeat]
+ */
+#include "CSCIx229.h"
+#include "texture.h"
+#include <time.h>
+
+//
+//  Wall clock time in seconds
+//
+static double now()
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC,&t);
+   return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+//
+//  Bytes in all levels of a texture
+//
+static long texbytes(const texdata_t* tex)
+{
+   int k;
+   long n=0;
+   for (k=0;k<tex->levels;k++)
+      n += tex->size[k];
+   return n;
+}
+
+//
+//  Load from BMP without the cache
+//
+static unsigned int loadbmp(const char* file,int repeat,long* bytes)
+{
+   int k,dx=0,dy=0;
+   unsigned int texture=0;
+   double t0 = now();
+   for (k=0;k<repeat;k++)
+   {
+      unsigned char* img = ReadBMP(file,&dx,&dy);
+      if (texture) glDeleteTextures(1,&texture);
+      texture = UploadTexBMP(0,img,dx,dy,file);
+      free(img);
+   }
+   glFinish();
+   printf("bmp     load  %8.3f ms\n",1e3*(now()-t0)/repeat);
+   *bytes = 3L*dx*dy;
+   return texture;
+}
+
+//
+//  Build then load from the cache
+//
+static unsigned int loadcache(const char* file,const char* label,int repeat,long* bytes)
+{
+   int k;
+   unsigned int texture=0;
+   char* name = (char*)malloc(strlen(file)+5);
+   double t0;
+   if (!name) Fatal("Cannot allocate memory for cache name\n");
+   sprintf(name,"%s.tex",file);
+
+   //  Cold: build the pyramid and write the cache
+   remove(name);
+   t0 = now();
+   FreeTexture(ReadTexture(file));
+   printf("%-7s build %8.3f ms\n",label,1e3*(now()-t0));
+
+   //  Warm: map the cache and upload
+   t0 = now();
+   for (k=0;k<repeat;k++)
+   {
+      texdata_t* tex = ReadTexture(file);
+      *bytes = texbytes(tex);
+      if (texture) glDeleteTextures(1,&texture);
+      texture = UploadTexture(0,tex,file);
+   }
+   glFinish();
+   printf("%-7s load  %8.3f ms\n",label,1e3*(now()-t0)/repeat);
+   free(name);
+   return texture;
+}
+
+//
+//  Time drawing a textured floor seen at a grazing angle
+//
+static double grazing(unsigned int texture,int frames)
+{
+   int k;
+   double t0;
+   glMatrixMode(GL_PROJECTION);
+   glLoadIdentity();
+   gluPerspective(60,1,0.1,1000);
+   glMatrixMode(GL_MODELVIEW);
+   glLoadIdentity();
+   gluLookAt(0,1,0 , 0,0.9,-10 , 0,1,0);
+   glEnable(GL_TEXTURE_2D);
+   glBindTexture(GL_TEXTURE_2D,texture);
+   glFinish();
+   t0 = now();
+   for (k=0;k<frames;k++)
+   {
+      glClear(GL_COLOR_BUFFER_BIT);
+      glBegin(GL_QUADS);
+      glTexCoord2f(  0,  0); glVertex3f(-500,0,   0);
+      glTexCoord2f(100,  0); glVertex3f(+500,0,   0);
+      glTexCoord2f(100,100); glVertex3f(+500,0,-500);
+      glTexCoord2f(  0,100); glVertex3f(-500,0,-500);
+      glEnd();
+   }
+   glFinish();
+   glDisable(GL_TEXTURE_2D);
+   return 1e3*(now()-t0)/frames;
+}
+
+//
+//  Main program
+//
+int main(int argc,char* argv[])
+{
+   int k,repeat=10,frames=100;
+   const char* label[3] = {"bmp","mipmap","bc1"};
+   unsigned int texture[3];
+   long bytes[3];
+
+   glutInit(&argc,argv);
+   if (argc<2 || argc>3)
+   {
+      fprintf(stderr,"Usage: texbench file.bmp [repeat]\n");
+      return 1;
+   }
+   if (argc>2) repeat = atoi(argv[2]);
+   if (repeat<1) repeat = 1;
+   glutInitDisplayMode(GLUT_RGB | GLUT_DEPTH | GLUT_DOUBLE);
+   glutInitWindowSize(600,600);
+   glutCreateWindow("Texture Benchmark");
+
+   //  Load each way
+   texture[0] = loadbmp(argv[1],repeat,bytes+0);
+   TexCompression(0);
+   texture[1] = loadcache(argv[1],"mipmap",repeat,bytes+1);
+   TexCompression(1);
+   texture[2] = loadcache(argv[1],"bc1",repeat,bytes+2);
+   TexCompression(0);
+   ErrCheck("texbench");
+
+   //  Memory and sampling cost
+   printf("\n%-7s %10s %10s\n","","bytes","draw ms");
+   for (k=0;k<3;k++)
+      printf("%-7s %10ld %10.3f\n",label[k],bytes[k],grazing(texture[k],frames));
+   ErrCheck("texbench draw");
+   return 0;
+}
@@ -0,0 +1,460 @@
+/*
+ *  Mipmapped texture cache
+ *
+ *  ReadTexture() turns a BMP into a full mipmap pyramid, block compressed
+ *  to S3TC/BC1 on the CPU when TexCompression() enabled it, and saves it
+ *  as file.tex next to the BMP.  Later loads map the cache and hand each
+ *  level straight to glCompressedTexImage2D (or glTexImage2D).  The file
+ *  is laid out as
+ *
+ *    header  format, size, level offsets and a stamp of the source BMP
+ *    levels  one blob per mipmap level, each 16 byte aligned
+ *
+ *  The cache is rebuilt when the BMP modification time, size or content
+ *  hash changes, or when a different format is requested.
+ */
+#include "CSCIx229.h"
+#include "texture.h"
+
+#define TEXC_MAGIC   0x43584554  //  "TEXC" in little endian
+#define TEXC_VERSION 1
+#define TEXC_ALIGN   16          //  Alignment of each level
+
+//  Cache header
+typedef struct
+{
+   unsigned int magic;           //  TEXC_MAGIC
+   unsigned int version;         //  TEXC_VERSION
+   int format;                   //  TEX_RGB or TEX_BC1
+   int dx,dy;                    //  Size of level 0
+   int levels;                   //  Number of levels
+   long long off[TEX_MAXLEVEL];  //  Offset of each level
+   int size[TEX_MAXLEVEL];       //  Bytes in each level
+   long long mtime;              //  Source modification time
+   long long srcsize;            //  Source size
+   unsigned long long hash;      //  Source content hash
+   long long total;              //  Total size of the cache
+} texhdr_t;
+
+//  Format used for new caches (set on the OpenGL thread)
+static int format=TEX_RGB;
+
+/*
+ *  Select block compression for textures loaded from now on
+ *    Compression is only used if the OpenGL driver supports S3TC
+ *    Call from the OpenGL thread before loading textures
+ */
+void TexCompression(int on)
+{
+   const char* ext = (const char*)glGetString(GL_EXTENSIONS);
+   format = (on && ext && strstr(ext,"GL_EXT_texture_compression_s3tc")) ? TEX_BC1 : TEX_RGB;
+}
+
+//
+//  Size of level n
+//
+static int levelsize(int d,int n)
+{
+   d >>= n;
+   return d>0 ? d : 1;
+}
+
+//
+//  Bytes needed for a dx by dy level
+//
+static int bytes(int fmt,int dx,int dy)
+{
+   return (fmt==TEX_BC1) ? 8*((dx+3)/4)*((dy+3)/4) : 3*dx*dy;
+}
+
+//
+//  Halve an RGB image with a box filter
+//    Odd rows and columns are clamped at the edge
+//
+static void halve(const unsigned char* src,int dx,int dy,unsigned char* dst)
+{
+   int i,j,k;
+   int nx = dx>1 ? dx/2 : 1;
+   int ny = dy>1 ? dy/2 : 1;
+   for (j=0;j<ny;j++)
+   {
+      int j0 = 2*j<dy ? 2*j : dy-1;
+      int j1 = 2*j+1<dy ? 2*j+1 : dy-1;
+      for (i=0;i<nx;i++)
+      {
+         int i0 = 2*i<dx ? 2*i : dx-1;
+         int i1 = 2*i+1<dx ? 2*i+1 : dx-1;
+         for (k=0;k<3;k++)
+            dst[3*(j*nx+i)+k] = (src[3*(j0*dx+i0)+k] + src[3*(j0*dx+i1)+k] +
+                                 src[3*(j1*dx+i0)+k] + src[3*(j1*dx+i1)+k] + 2) / 4;
+      }
+   }
+}
+
+//
+//  Pack RGB into 5:6:5
+//
+static unsigned int rgb565(const unsigned char* c)
+{
+   return ((c[0]*31+127)/255)<<11 | ((c[1]*63+127)/255)<<5 | ((c[2]*31+127)/255);
+}
+
+//
+//  Unpack 5:6:5 into RGB
+//
+static void unpack565(unsigned int c,int* rgb)
+{
+   rgb[0] = ((c>>11)&31)*255/31;
+   rgb[1] = ((c>>5)&63)*255/63;
+   rgb[2] = (c&31)*255/31;
+}
+
+//
+//  Compress a 4x4 block of RGB pixels to BC1
+//    Endpoints are the pixels furthest apart along the bounding box
+//    diagonal (flipped for channels that vary against red)
+//
+static void bc1block(unsigned char px[16][3],unsigned char* out)
+{
+   int k,i;
+   int mn[3]={255,255,255},mx[3]={0,0,0},axis[3];
+   int lo=0,hi=0,tlo=1<<30,thi=-(1<<30);
+   int cov[3]={0,0,0},mean[3]={0,0,0};
+   unsigned int c0,c1,bits=0;
+   int pal[4][3];
+
+   //  Bounding box and covariance with red
+   for (k=0;k<16;k++)
+      for (i=0;i<3;i++)
+      {
+         if (px[k][i]<mn[i]) mn[i] = px[k][i];
+         if (px[k][i]>mx[i]) mx[i] = px[k][i];
+         mean[i] += px[k][i];
+      }
+   for (k=0;k<16;k++)
+      for (i=1;i<3;i++)
+         cov[i] += (16*px[k][0]-mean[0])*(16*px[k][i]-mean[i]);
+   for (i=0;i<3;i++)
+      axis[i] = (cov[i]<0) ? mn[i]-mx[i] : mx[i]-mn[i];
+
+   //  Extreme pixels along the axis
+   for (k=0;k<16;k++)
+   {
+      int t = axis[0]*px[k][0] + axis[1]*px[k][1] + axis[2]*px[k][2];
+      if (t<tlo) {tlo = t; lo = k;}
+      if (t>thi) {thi = t; hi = k;}
+   }
+   c0 = rgb565(px[hi]);
+   c1 = rgb565(px[lo]);
+   //  Four color mode needs c0>c1
+   if (c0<c1)
+   {
+      unsigned int t = c0;
+      c0 = c1;
+      c1 = t;
+   }
+   out[0] = c0;  out[1] = c0>>8;
+   out[2] = c1;  out[3] = c1>>8;
+
+   //  Palette and nearest entry for each pixel
+   unpack565(c0,pal[0]);
+   unpack565(c1,pal[1]);
+   for (i=0;i<3;i++)
+   {
+      pal[2][i] = (2*pal[0][i]+pal[1][i])/3;
+      pal[3][i] = (pal[0][i]+2*pal[1][i])/3;
+   }
+   if (c0!=c1)
+      for (k=0;k<16;k++)
+      {
+         int j,best=0,dbest=1<<30;
+         for (j=0;j<4;j++)
+         {
+            int dr = px[k][0]-pal[j][0];
+            int dg = px[k][1]-pal[j][1];
+            int db = px[k][2]-pal[j][2];
+            int d = dr*dr + dg*dg + db*db;
+            if (d<dbest) {dbest = d; best = j;}
+         }
+         bits |= (unsigned int)best << (2*k);
+      }
+   out[4] = bits;  out[5] = bits>>8;  out[6] = bits>>16;  out[7] = bits>>24;
+}
+
+//
+//  Compress an RGB image to BC1
+//    Partial blocks at the edges repeat the last row or column
+//
+static void bc1(const unsigned char* img,int dx,int dy,unsigned char* out)
+{
+   int bx,by,i,j;
+   for (by=0;by<dy;by+=4)
+      for (bx=0;bx<dx;bx+=4)
+      {
+         unsigned char px[16][3];
+         for (j=0;j<4;j++)
+            for (i=0;i<4;i++)
+            {
+               int x = bx+i<dx ? bx+i : dx-1;
+               int y = by+j<dy ? by+j : dy-1;
+               memcpy(px[4*j+i],img+3*(y*dx+x),3);
+            }
+         bc1block(px,out);
+         out += 8;
+      }
+}
+
+//
+//  Build mipmap pyramid from BMP
+//
+static texdata_t* build(const char* file,int fmt)
+{
+   int k,dx,dy,total=0;
+   unsigned char *img,*cur,*next=NULL;
+   texdata_t* tex = (texdata_t*)calloc(1,sizeof(texdata_t));
+   if (!tex) Fatal("Cannot allocate memory for texture %s\n",file);
+
+   //  Read image and size the pyramid
+   img = ReadBMP(file,&dx,&dy);
+   tex->format = fmt;
+   tex->dx = dx;
+   tex->dy = dy;
+   while (tex->levels<TEX_MAXLEVEL)
+   {
+      int n = tex->levels++;
+      tex->size[n] = bytes(fmt,levelsize(dx,n),levelsize(dy,n));
+      total += (tex->size[n]+TEXC_ALIGN-1) & ~(TEXC_ALIGN-1);
+      if (levelsize(dx,n)==1 && levelsize(dy,n)==1) break;
+   }
+   tex->data = (unsigned char*)malloc(total);
+   if (fmt==TEX_BC1) next = (unsigned char*)malloc(3*dx*dy);
+   if (!tex->data || (fmt==TEX_BC1 && !next)) Fatal("Cannot allocate memory for texture %s\n",file);
+
+   //  Each level is half the previous one
+   cur = img;
+   total = 0;
+   for (k=0;k<tex->levels;k++)
+   {
+      int lx = levelsize(dx,k);
+      int ly = levelsize(dy,k);
+      unsigned char* dst = tex->data+total;
+      tex->level[k] = dst;
+      total += (tex->size[k]+TEXC_ALIGN-1) & ~(TEXC_ALIGN-1);
+      //  RGB levels are built in place and halved from the previous level
+      if (fmt==TEX_RGB)
+      {
+         if (k==0)
+            memcpy(dst,img,3*lx*ly);
+         else
+            halve(tex->level[k-1],levelsize(dx,k-1),levelsize(dy,k-1),dst);
+      }
+      //  BC1 levels are compressed from an RGB working copy
+      else
+      {
+         //  Halving in place is safe since each output pixel only reads
+         //  pixels at or after its own position
+         if (k>0)
+         {
+            halve(cur,levelsize(dx,k-1),levelsize(dy,k-1),next);
+            cur = next;
+         }
+         bc1(cur,lx,ly,dst);
+      }
+   }
+   free(img);
+   free(next);
+   return tex;
+}
+
+//
+//  Name of cache file for a BMP file
+//
+static char* cachename(const char* file)
+{
+   char* name = (char*)malloc(strlen(file)+5);
+   if (!name) Fatal("Cannot allocate memory for cache name\n");
+   strcpy(name,file);
+   strcat(name,".tex");
+   return name;
+}
+
+//
+//  Write texture to cache next to file
+//    Failure only produces a warning since the cache is optional
+//
+static void writecache(const char* file,const texdata_t* tex)
+{
+   int k;
+   FILE* f;
+   texhdr_t hdr;
+   long long off;
+   char* name = cachename(file);
+   char* tmp  = (char*)malloc(strlen(name)+5);
+   if (!tmp) Fatal("Cannot allocate memory for cache name\n");
+   sprintf(tmp,"%s.tmp",name);
+
+   //  Header
+   memset(&hdr,0,sizeof(hdr));
+   hdr.magic   = TEXC_MAGIC;
+   hdr.version = TEXC_VERSION;
+   hdr.format  = tex->format;
+   hdr.dx      = tex->dx;
+   hdr.dy      = tex->dy;
+   hdr.levels  = tex->levels;
+   FileStamp(file,&hdr.mtime,&hdr.srcsize);
+   hdr.hash    = HashFile(file);
+   off = (sizeof(hdr)+TEXC_ALIGN-1) & ~(TEXC_ALIGN-1);
+   for (k=0;k<tex->levels;k++)
+   {
+      hdr.off[k]  = off;
+      hdr.size[k] = tex->size[k];
+      off = (off+tex->size[k]+TEXC_ALIGN-1) & ~(TEXC_ALIGN-1);
+   }
+   hdr.total = hdr.off[tex->levels-1] + tex->size[tex->levels-1];
+
+   //  Write to a temporary file and rename so readers never see a partial cache
+   f = fopen(tmp,"wb");
+   if (!f)
+      fprintf(stderr,"Cannot write texture cache %s\n",tmp);
+   else
+   {
+      static const char zero[TEXC_ALIGN] = {0};
+      int err;
+      fwrite(&hdr,sizeof(hdr),1,f);
+      for (k=0;k<tex->levels;k++)
+      {
+         long long pad = hdr.off[k]-ftell(f);
+         if (pad>0) fwrite(zero,1,pad,f);
+         fwrite(tex->level[k],tex->size[k],1,f);
+      }
+      err = ferror(f);
+      if (fclose(f) || err)
+         fprintf(stderr,"Error writing texture cache %s\n",tmp);
+      else
+      {
+         remove(name);
+         if (rename(tmp,name)) fprintf(stderr,"Cannot rename %s to %s\n",tmp,name);
+      }
+   }
+   free(name);
+   free(tmp);
+}
+
+//
+//  Read texture from cache next to file
+//    Returns NULL if the cache is missing, out of date or in another format
+//
+static texdata_t* readcache(const char* file,int fmt)
+{
+   int k;
+   size_t size;
+   long long mtime,srcsize;
+   const texhdr_t* hdr;
+   texdata_t* tex;
+   char* name = cachename(file);
+   char* buf  = (char*)MapFile(name,&size);
+   free(name);
+   if (!buf) return NULL;
+
+   //  Check header, layout and source
+   hdr = (const texhdr_t*)buf;
+   FileStamp(file,&mtime,&srcsize);
+   if (size<sizeof(texhdr_t) || hdr->magic!=TEXC_MAGIC || hdr->version!=TEXC_VERSION ||
+       hdr->format!=fmt || hdr->total!=(long long)size || hdr->levels<1 || hdr->levels>TEX_MAXLEVEL ||
+       hdr->mtime!=mtime || hdr->srcsize!=srcsize)
+      goto stale;
+   for (k=0;k<hdr->levels;k++)
+      if (hdr->off[k]<(long long)sizeof(texhdr_t) || hdr->off[k]+hdr->size[k]>hdr->total ||
+          hdr->size[k]!=bytes(fmt,levelsize(hdr->dx,k),levelsize(hdr->dy,k)))
+         goto stale;
+   if (hdr->hash!=HashFile(file)) goto stale;
+
+   //  Point at mapped levels
+   tex = (texdata_t*)calloc(1,sizeof(texdata_t));
+   if (!tex) Fatal("Cannot allocate memory for texture %s\n",file);
+   tex->format  = hdr->format;
+   tex->dx      = hdr->dx;
+   tex->dy      = hdr->dy;
+   tex->levels  = hdr->levels;
+   tex->map     = buf;
+   tex->mapsize = size;
+   for (k=0;k<hdr->levels;k++)
+   {
+      tex->level[k] = (const unsigned char*)buf+hdr->off[k];
+      tex->size[k]  = hdr->size[k];
+   }
+   return tex;
+
+stale:
+   UnmapFile(buf,size);
+   return NULL;
+}
+
+/*
+ *  Read mipmapped texture for a BMP file
+ *    Uses the cache if it is up to date, otherwise builds and saves it
+ *    Makes no OpenGL calls so it may be used from any thread
+ */
+texdata_t* ReadTexture(const char* file)
+{
+   int fmt = format;
+   texdata_t* tex = readcache(file,fmt);
+   if (!tex)
+   {
+      tex = build(file,fmt);
+      writecache(file,tex);
+   }
+   return tex;
+}
+
+/*
+ *  Release texture returned by ReadTexture
+ */
+void FreeTexture(texdata_t* tex)
+{
+   if (!tex) return;
+   if (tex->map) UnmapFile(tex->map,tex->mapsize);
+   free(tex->data);
+   free(tex);
+}
+
+/*
+ *  Copy mipmapped texture to OpenGL
+ *    Creates a new texture if texture is zero
+ *    Releases tex and returns the texture name
+ */
+unsigned int UploadTexture(unsigned int texture,texdata_t* tex,const char* file)
+{
+   int k,max;
+
+   //  Check image size
+   glGetIntegerv(GL_MAX_TEXTURE_SIZE,&max);
+   if (tex->dx>max || tex->dy>max) Fatal("%s image %dx%d larger than %d\n",file,tex->dx,tex->dy,max);
+
+   //  Sanity check
+   ErrCheck("UploadTexture");
+   if (!texture) glGenTextures(1,&texture);
+   glBindTexture(GL_TEXTURE_2D,texture);
+   //  Small levels have rows that are not 4 byte aligned
+   glPixelStorei(GL_UNPACK_ALIGNMENT,1);
+   for (k=0;k<tex->levels;k++)
+   {
+      int dx = levelsize(tex->dx,k);
+      int dy = levelsize(tex->dy,k);
+#ifdef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+      if (tex->format==TEX_BC1)
+         glCompressedTexImage2D(GL_TEXTURE_2D,k,GL_COMPRESSED_RGB_S3TC_DXT1_EXT,dx,dy,0,tex->size[k],tex->level[k]);
+      else
+#endif
+         glTexImage2D(GL_TEXTURE_2D,k,GL_RGB,dx,dy,0,GL_RGB,GL_UNSIGNED_BYTE,tex->level[k]);
+   }
+   glPixelStorei(GL_UNPACK_ALIGNMENT,4);
+   if (glGetError()) Fatal("Error uploading texture %s %dx%d\n",file,tex->dx,tex->dy);
+   //  Trilinear filtering across the pyramid
+   glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAX_LEVEL,tex->levels-1);
+   glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
+   glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR_MIPMAP_LINEAR);
+
+   FreeTexture(tex);
+   return texture;
+}
@@ -0,0 +1,37 @@
+/*
+ *  Texture cache internals
+ *    Shared by the texture, OBJ and asynchronous loaders
+ */
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TEX_RGB      0   //  Uncompressed RGB
+#define TEX_BC1      1   //  S3TC/BC1 (DXT1) blocks
+#define TEX_MAXLEVEL 16  //  Maximum number of mipmap levels
+
+//  Mipmapped texture ready for upload
+typedef struct
+{
+   int format;                                //  TEX_RGB or TEX_BC1
+   int dx,dy;                                 //  Size of level 0
+   int levels;                                //  Number of mipmap levels
+   const unsigned char* level[TEX_MAXLEVEL];  //  Data for each level
+   int size[TEX_MAXLEVEL];                    //  Bytes in each level
+   void* map;                                 //  Mapped cache (NULL if data is allocated)
+   size_t mapsize;                            //  Size of mapped cache
+   unsigned char* data;                       //  Allocated levels
+} texdata_t;
+
+texdata_t* ReadTexture(const char* file);
+unsigned int UploadTexture(unsigned int texture,texdata_t* tex,const char* file);
+void FreeTexture(texdata_t* tex);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,51 @@
+/*
+ *  Worker threads for splitting work into chunks
+ */
+#include "CSCIx229.h"
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/*
+ *  Number of processors
+ */
+int Processors(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+   int n = sysconf(_SC_NPROCESSORS_ONLN);
+   return n>0 ? n : 1;
+#else
+   return 1;
+#endif
+}
+
+/*
+ *  Run func on each of n chunks of size bytes starting at chunk
+ *    Chunk 0 runs on the calling thread and the others on a thread each.
+ *    Returns when all are done.  Without threads they run in turn.
+ */
+void RunThreads(void* (*func)(void*),void* chunk,size_t size,int n)
+{
+   int k;
+#ifdef _WIN32
+   for (k=0;k<n;k++)
+      func((char*)chunk+k*size);
+#else
+   pthread_t* tid;
+   if (n<1) return;
+   if (n==1)
+   {
+      func(chunk);
+      return;
+   }
+   tid = (pthread_t*)malloc(n*sizeof(pthread_t));
+   if (!tid) Fatal("Cannot allocate memory for threads\n");
+   for (k=1;k<n;k++)
+      if (pthread_create(tid+k,NULL,func,(char*)chunk+k*size)) Fatal("Cannot create thread\n");
+   func(chunk);
+   for (k=1;k<n;k++)
+      pthread_join(tid[k],NULL);
+   free(tid);
+#endif
+}
@@ -0,0 +1,257 @@
+/*
+ *  Landmark visibility
+ *
+ *  SeeLandmarks() works out which landmarks a keyframe sees and makes
+ *  them its observations.  A landmark is seen when it projects into the
+ *  image within the depth range of the camera model (ProjectLandmarks)
+ *  and the segment from the camera center to it does not pass through
+ *  any occluding triangle.  The landmarks of each keyframe are split into
+ *  chunks and the chunks of all keyframes are shared between threads.
+ *
+ *  Occluders are kept in a BVH that is rebuilt when triangles are added,
+ *  so add them in as few batches as possible.  SyntheticDepth() uses the
+ *  same BVH to make the depth image a keyframe would see.
+ */
+#include "CSCIx229.h"
+#include "slam.h"
+
+#define VIS_CHUNK    4096     //  Landmarks in a share of work
+#define VIS_BATCH    (1<<20)  //  Landmark projections held at once
+#define VIS_MARGIN   0.01     //  Distance from a landmark that hits are ignored (so it does not hide itself)
+
+//  Share of the landmarks of a batch of keyframes
+typedef struct
+{
+   const slammap_t* map;     //  Map
+   const pose_t* pose;       //  Poses of the batch
+   const intrinsics_t* K;    //  Camera model
+   const occluders_t* occ;   //  Occluders (NULL for none)
+   int Nchunk;               //  Chunks per keyframe
+   int k0,k1;                //  Chunks to do (keyframe*Nchunk+chunk)
+   float *u,*v,*depth;       //  Projections (Nlm per keyframe)
+   unsigned char* in;        //  Landmark seen
+} vischunk_t;
+
+/*
+ *  Initialize empty occluders
+ */
+void InitOccluders(occluders_t* occ)
+{
+   memset(occ,0,sizeof(occluders_t));
+   occ->bvh = -1;
+}
+
+/*
+ *  Free occluders
+ *    The BVH handle is kept for the next triangles added
+ */
+void FreeOccluders(occluders_t* occ)
+{
+   int bvh = occ->bvh;
+   free(occ->tri);
+   if (bvh>=0) BuildBVH(bvh,NULL,0);
+   InitOccluders(occ);
+   occ->bvh = bvh;
+}
+
+/*
+ *  Add n triangles (9 floats each) to the occluders
+ */
+void AddOccluders(occluders_t* occ,const float* tri,int n)
+{
+   if (n<=0) return;
+   if (occ->Ntri+n>occ->Mtri)
+   {
+      occ->Mtri = occ->Mtri ? 2*occ->Mtri : 1024;
+      if (occ->Mtri<occ->Ntri+n) occ->Mtri = occ->Ntri+n;
+      occ->tri = (float*)realloc(occ->tri,9*(size_t)occ->Mtri*sizeof(float));
+      if (!occ->tri) Fatal("Cannot allocate memory for occluders\n");
+   }
+   memcpy(occ->tri+9*(size_t)occ->Ntri,tri,9*(size_t)n*sizeof(float));
+   occ->Ntri += n;
+   if (occ->bvh<0) occ->bvh = NewBVH();
+   BuildBVH(occ->bvh,occ->tri,occ->Ntri);
+}
+
+/*
+ *  Is the segment from a to b blocked by an occluder
+ */
+int Occluded(const occluders_t* occ,const double a[3],const double b[3])
+{
+   float o[3] = {a[0],a[1],a[2]};
+   float d[3] = {b[0]-a[0],b[1]-a[1],b[2]-a[2]};
+   if (!occ->Ntri) return 0;
+   return RayBVH(occ->bvh,o,d,1,1,NULL)>=0;
+}
+
+//
+//  Project chunks of landmarks and drop those that are hidden
+//
+static void* seechunk(void* arg)
+{
+   vischunk_t* c = (vischunk_t*)arg;
+   int Nlm = c->map->Nlm;
+   int k,i;
+   for (k=c->k0;k<c->k1;k++)
+   {
+      int cam = k/c->Nchunk;
+      int l0 = (k%c->Nchunk)*VIS_CHUNK;
+      int n = (l0+VIS_CHUNK<Nlm) ? VIS_CHUNK : Nlm-l0;
+      size_t o = (size_t)cam*Nlm+l0;
+      const pose_t* p = c->pose+cam;
+      //  Map starting at this chunk's landmarks
+      slammap_t sub = *c->map;
+      sub.X += l0;
+      sub.Y += l0;
+      sub.Z += l0;
+      ProjectLandmarks(&sub,NULL,n,p,1,c->K,c->u+o,c->v+o,c->depth+o,c->in+o);
+      if (!c->occ || !c->occ->Ntri) continue;
+      //  Cast a ray to each landmark in view, stopping short of it
+      for (i=0;i<n;i++)
+         if (c->in[o+i])
+         {
+            int l = l0+i;
+            double a[3] = {p->x,p->y,p->z};
+            double b[3] = {c->map->X[l],c->map->Y[l],c->map->Z[l]};
+            double dx=b[0]-a[0],dy=b[1]-a[1],dz=b[2]-a[2];
+            double f = 1 - VIS_MARGIN/sqrt(dx*dx+dy*dy+dz*dz);
+            if (f<=0) continue;
+            b[0] = a[0]+f*dx;
+            b[1] = a[1]+f*dy;
+            b[2] = a[2]+f*dz;
+            if (Occluded(c->occ,a,b)) c->in[o+i] = 0;
+         }
+   }
+   return NULL;
+}
+
+/*
+ *  Replace the observations of keyframes cam .. cam+n-1 with the landmarks
+ *  they see
+ *    Keyframe cam+k looks from pose from[k] (its map pose if from is NULL)
+ *    with camera model K, and occluders hide landmarks (none if NULL)
+ *    Observations are exact image coordinates as in slam.h
+ *    Uses up to threads threads (0 for every processor)
+ *    Returns the number of observations added
+ */
+int SeeLandmarks(slammap_t* map,int cam,int n,const pose_t* from,const intrinsics_t* K,const occluders_t* occ,int threads)
+{
+   int Nlm = map->Nlm;
+   int Nchunk = (Nlm+VIS_CHUNK-1)/VIS_CHUNK;
+   int batch = Nlm>0 ? VIS_BATCH/Nlm : n;
+   int k,j,added=0;
+   float *u,*v,*depth,*ou,*ov;
+   unsigned char* in;
+   int* lm;
+   vischunk_t* c;
+   if (cam<0 || n<0 || cam+n>map->Ncam) Fatal("Invalid keyframes %d to %d\n",cam,cam+n-1);
+   if (batch<1) batch = 1;
+   if (batch>n) batch = n;
+   if (threads<=0) threads = Processors();
+   //  Choose the kernel before threads use it
+   ProjectionKernel(-1);
+   u = (float*)malloc(3*(size_t)batch*Nlm*sizeof(float)+1);
+   in = (unsigned char*)malloc((size_t)batch*Nlm+1);
+   lm = (int*)malloc((Nlm+1)*sizeof(int));
+   ou = (float*)malloc(2*(Nlm+1)*sizeof(float));
+   c = (vischunk_t*)malloc(threads*sizeof(vischunk_t));
+   if (!u || !in || !lm || !ou || !c) Fatal("Cannot allocate memory for visibility\n");
+   v = u+(size_t)batch*Nlm;
+   depth = v+(size_t)batch*Nlm;
+   ov = ou+Nlm+1;
+
+   for (k=0;k<n;k+=batch)
+   {
+      int m = (n-k<batch) ? n-k : batch;
+      int work = m*Nchunk;
+      int t = (threads<work) ? threads : work;
+      const pose_t* p = from ? from+k : map->pose+cam+k;
+      //  Share the chunks between threads
+      for (j=0;j<t;j++)
+      {
+         c[j].map = map;
+         c[j].pose = p;
+         c[j].K = K;
+         c[j].occ = occ;
+         c[j].Nchunk = Nchunk;
+         c[j].k0 = (int)((long long)work*j/t);
+         c[j].k1 = (int)((long long)work*(j+1)/t);
+         c[j].u = u;
+         c[j].v = v;
+         c[j].depth = depth;
+         c[j].in = in;
+      }
+      RunThreads(seechunk,c,sizeof(vischunk_t),t);
+      //  Observations in landmark order
+      for (j=0;j<m;j++)
+      {
+         int l,N=0;
+         size_t o = (size_t)j*Nlm;
+         for (l=0;l<Nlm;l++)
+            if (in[o+l])
+            {
+               lm[N] = l;
+               ou[N] = (u[o+l]-K->cu)/K->f;
+               ov[N] = (v[o+l]-K->cv)/K->f;
+               N++;
+            }
+         SetObservations(map,cam+k+j,lm,ou,ov,N);
+         added += N;
+      }
+   }
+   free(u);
+   free(in);
+   free(lm);
+   free(ou);
+   free(c);
+   return added;
+}
+
+/*
+ *  Depth image seen from pose with camera model K
+ *    Sets depth[v*K->w+u] to the depth of the nearest occluder through
+ *    pixel u,v (row 0 at the bottom as glReadPixels) or INFINITY if there
+ *    is none within the depth range
+ */
+void SyntheticDepth(const occluders_t* occ,const pose_t* pose,const intrinsics_t* K,float* depth)
+{
+   int u,v,i,w=K->w;
+   double c = Cos(pose->d),s = Sin(pose->d);
+   float *o,*d,*t,*tmax;
+   int* hit;
+   o = (float*)malloc(9*(size_t)w*sizeof(float));
+   hit = (int*)malloc(w*sizeof(int));
+   if (!o || !hit) Fatal("Cannot allocate memory for depth image\n");
+   d = o+3*w;
+   t = d+3*w;
+   tmax = t+w;
+   for (u=0;u<w;u++)
+   {
+      o[3*u] = pose->x;
+      o[3*u+1] = pose->y;
+      o[3*u+2] = pose->z;
+      tmax[u] = K->zfar;
+   }
+   //  A row at a time so neighbouring rays go through neighbouring pixels
+   for (v=0;v<K->h;v++)
+   {
+      float* row = depth+(size_t)v*w;
+      for (u=0;u<w;u++)
+      {
+         //  One unit forward so the distance along the ray is the depth
+         double px = (u+0.5-K->cu)/K->f;
+         d[3*u]   = c*px - s;
+         d[3*u+1] = s*px + c;
+         d[3*u+2] = (v+0.5-K->cv)/K->f;
+      }
+      if (occ->Ntri)
+         RaysBVH(occ->bvh,w,o,d,tmax,0,t,hit);
+      else
+         for (u=0;u<w;u++)
+            hit[u] = -1;
+      for (i=0;i<w;i++)
+         row[i] = (hit[i]>=0 && t[i]>=K->znear) ? t[i] : INFINITY;
+   }
+   free(o);
+   free(hit);
+}